@@ -0,0 +1,85 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+
+void *arena_alloc(arena_s *arena, size_t size, size_t align)
+{
+    arena_chunk_s *chunk = arena->chunks;
+    uintptr_t start = 0;
+
+    if(chunk) {
+        start = ((uintptr_t)(chunk->data + chunk->used) + (align - 1)) & ~((uintptr_t)align - 1);
+    }
+
+    if(!chunk || start + size > (uintptr_t)(chunk->data + chunk->size)) {
+        /* big allocations get a chunk of their own. */
+        size_t chunk_size = (size + align > ARENA_CHUNK_SIZE ? size + align : ARENA_CHUNK_SIZE);
+
+        chunk = calloc(1, sizeof(*chunk) + chunk_size);
+        if(!chunk) {
+            return NULL;
+        }
+
+        chunk->size = chunk_size;
+
+        /* keep filling the current chunk if the new one is just for this allocation. */
+        if(arena->chunks && chunk_size > ARENA_CHUNK_SIZE) {
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+        } else {
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+
+        start = ((uintptr_t)chunk->data + (align - 1)) & ~((uintptr_t)align - 1);
+    }
+
+    chunk->used = (size_t)(start + size - (uintptr_t)chunk->data);
+
+    return (void *)start;
+}
+
+
+char *arena_strndup(arena_s *arena, const char *str, size_t len)
+{
+    char *copy = arena_alloc(arena, len + 1, 1);
+
+    if(copy) {
+        memcpy(copy, str, len);
+        copy[len] = 0;
+    }
+
+    return copy;
+}
+
+
+void arena_free(arena_s *arena)
+{
+    while(arena->chunks) {
+        arena_chunk_s *chunk = arena->chunks;
+
+        arena->chunks = chunk->next;
+        free(chunk);
+    }
+}
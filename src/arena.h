@@ -0,0 +1,48 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bump allocator for things that live as long as the server, like tags
+ * loaded in bulk.  Memory comes from a few large zeroed chunks and is
+ * only released all at once by arena_free().
+ */
+
+#define ARENA_CHUNK_SIZE (1024 * 1024)
+
+typedef struct arena_chunk_s {
+    struct arena_chunk_s *next;
+    size_t size;
+    size_t used;
+    uint8_t data[];
+} arena_chunk_s;
+
+typedef struct {
+    arena_chunk_s *chunks;  /* the current chunk is first. */
+} arena_s;
+
+/* returns zeroed memory aligned to align, which must be a power of two, or NULL. */
+extern void *arena_alloc(arena_s *arena, size_t size, size_t align);
+extern char *arena_strndup(arena_s *arena, const char *str, size_t len);
+extern void arena_free(arena_s *arena);
@@ -0,0 +1,946 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+/*
+ * ab_bench - load generator for ab_server.
+ *
+ * Each session is a thread with its own TCP connection and EIP session.
+ * The threads run a weighted random mix of requests against one tag until
+ * the time is up.  Every request is timed from the first byte sent to the
+ * last byte received, and the latencies are merged at the end to report
+ * throughput and percentiles for each kind of request.
+ */
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cpf.h"
+#include "eip.h"
+#include "slice.h"
+#include "socket.h"
+#include "utils.h"
+
+
+typedef enum {
+    OP_UREAD,       /* unconnected read. */
+    OP_CREAD,       /* connected read. */
+    OP_UWRITE,      /* unconnected write. */
+    OP_CWRITE,      /* connected write. */
+    OP_FRAG,        /* fragmented read of a large range, all fragments count as one op. */
+    OP_MULTI,       /* connected Multiple Service Packet of reads. */
+    OP_COUNT
+} op_t;
+
+static const char *op_names[OP_COUNT] = { "uread", "cread", "uwrite", "cwrite", "frag", "multi" };
+
+typedef struct {
+    const char *host;
+    const char *port;
+    uint8_t path[2];
+    bool has_path;
+    int num_sessions;
+    int duration;
+    const char *tag_name;
+    int elem_count;         /* elements per read and write. */
+    int frag_count;         /* elements per fragmented read. */
+    int multi_count;        /* reads per Multiple Service Packet. */
+    uint32_t conn_size;     /* Forward Open connection size. */
+    int weights[OP_COUNT];
+    int total_weight;
+} bench_config_s;
+
+typedef struct {
+    uint64_t *samples;
+    size_t num_samples;
+    size_t capacity;
+} latency_list_s;
+
+typedef struct {
+    bench_config_s *config;
+    pthread_t thread;
+    unsigned int rand_state;
+    int sock;
+    uint32_t session_handle;
+    uint32_t conn_id;           /* the server's connection ID, sent with connected data. */
+    uint16_t conn_serial;
+    uint16_t conn_seq;
+    uint16_t tag_type;
+    size_t elem_size;
+    uint8_t *out_buf;
+    uint8_t *in_buf;
+    latency_list_s latencies[OP_COUNT];
+    uint64_t errors;
+    bool failed;
+} bench_session_s;
+
+#define BENCH_BUFFER_SIZE (65535 + EIP_HEADER_SIZE)
+#define BENCH_UCONN_MAX_PACKET (508)
+
+#define CIP_READ ((uint8_t)0x4C)
+#define CIP_WRITE ((uint8_t)0x4D)
+#define CIP_READ_FRAG ((uint8_t)0x52)
+#define CIP_MULTI ((uint8_t)0x0A)
+#define CIP_FORWARD_OPEN ((uint8_t)0x54)
+#define CIP_FORWARD_OPEN_EX ((uint8_t)0x5B)
+#define CIP_FORWARD_CLOSE ((uint8_t)0x4E)
+#define CIP_OK ((uint8_t)0x00)
+#define CIP_ERR_FRAG ((uint8_t)0x06)
+
+static void usage(void);
+static void process_args(int argc, const char **argv, bench_config_s *config);
+static bool parse_mix(const char *mix, bench_config_s *config);
+static void *session_thread(void *arg);
+static bool session_setup(bench_session_s *bs);
+static void session_teardown(bench_session_s *bs);
+static op_t pick_op(bench_session_s *bs);
+static bool run_op(bench_session_s *bs, op_t op, uint8_t *status);
+static slice_s send_unconnected(bench_session_s *bs, size_t cip_len);
+static slice_s send_connected(bench_session_s *bs, size_t cip_len);
+static slice_s transact(bench_session_s *bs, uint16_t command, size_t payload_len);
+static bool read_fully(int sock, uint8_t *buf, size_t len);
+static size_t encode_tag_path(slice_s cip, size_t offset, const char *name, uint32_t index);
+static size_t encode_read(slice_s cip, uint8_t service, const char *name, uint32_t index, uint16_t count);
+static uint64_t now_ns(void);
+static bool record_latency(latency_list_s *list, uint64_t ns);
+static int compare_uint64(const void *a, const void *b);
+static void report(bench_config_s *config, bench_session_s *sessions, double elapsed);
+static void report_line(const char *name, uint64_t *samples, size_t count, double elapsed);
+
+static pthread_barrier_t start_barrier;
+static volatile uint64_t stop_time_ns = 0;
+
+
+int main(int argc, const char **argv)
+{
+    bench_config_s config;
+    bench_session_s *sessions = NULL;
+    uint64_t start_ns = 0;
+    double elapsed = 0.0;
+    int failed = 0;
+
+    debug_off();
+
+    memset(&config, 0, sizeof(config));
+
+    process_args(argc, argv, &config);
+
+    sessions = calloc((size_t)config.num_sessions, sizeof(*sessions));
+    if(!sessions) {
+        fprintf(stderr, "Unable to allocate session state!\n");
+        return 1;
+    }
+
+    /* the main thread releases the workers once all of them are set up. */
+    pthread_barrier_init(&start_barrier, NULL, (unsigned)config.num_sessions + 1);
+
+    for(int i=0; i < config.num_sessions; i++) {
+        sessions[i].config = &config;
+        sessions[i].rand_state = (unsigned)time(NULL) ^ (unsigned)(i * 7919);
+
+        if(pthread_create(&sessions[i].thread, NULL, session_thread, &sessions[i])) {
+            fprintf(stderr, "Unable to start session thread %d!\n", i);
+            return 1;
+        }
+    }
+
+    start_ns = now_ns();
+    stop_time_ns = start_ns + (uint64_t)config.duration * 1000000000ull;
+
+    pthread_barrier_wait(&start_barrier);
+
+    for(int i=0; i < config.num_sessions; i++) {
+        pthread_join(sessions[i].thread, NULL);
+        failed += (sessions[i].failed ? 1 : 0);
+    }
+
+    elapsed = (double)(now_ns() - start_ns) / 1e9;
+
+    if(failed) {
+        fprintf(stderr, "%d of %d sessions failed.\n", failed, config.num_sessions);
+    }
+
+    report(&config, sessions, elapsed);
+
+    for(int i=0; i < config.num_sessions; i++) {
+        for(int op=0; op < OP_COUNT; op++) {
+            free(sessions[i].latencies[op].samples);
+        }
+    }
+
+    free(sessions);
+
+    pthread_barrier_destroy(&start_barrier);
+
+    return (failed == config.num_sessions ? 1 : 0);
+}
+
+
+void usage(void)
+{
+    fprintf(stderr, "Usage: ab_bench --tag=<name> [--host=<host>] [--port=<port>] [--path=<path>] [--sessions=<n>]\n"
+                    "                [--duration=<secs>] [--count=<n>] [--frag-count=<n>] [--multi=<n>]\n"
+                    "                [--conn-size=<bytes>] [--mix=<op>:<weight>,...] [--debug]\n"
+                    "   <name> = a tag of an integer or floating point type served by ab_server.\n"
+                    "   <path> = internal path to the CPU for ControlLogix, e.g. \"1,0\".  Leave out for Micro800.\n"
+                    "   --sessions is the number of concurrent clients, default 1.\n"
+                    "   --duration is the length of the run in seconds, default 10.\n"
+                    "   --count is the number of elements per read or write, default 1.\n"
+                    "   --frag-count is the number of elements per fragmented read, default 1000.\n"
+                    "   --multi is the number of reads per Multiple Service Packet, default 10.\n"
+                    "   --conn-size is the Forward Open connection size, default 4002.\n"
+                    "   <op> is one of uread, cread, uwrite, cwrite, frag or multi.  The default mix is cread:1.\n"
+                    "\n"
+                    "Example: ab_bench --tag=TestDINTArray --path=1,0 --sessions=8 --mix=cread:6,cwrite:2,multi:1,frag:1\n");
+
+    exit(1);
+}
+
+
+void process_args(int argc, const char **argv, bench_config_s *config)
+{
+    bool has_mix = false;
+
+    config->host = "127.0.0.1";
+    config->port = "44818";
+    config->num_sessions = 1;
+    config->duration = 10;
+    config->elem_count = 1;
+    config->frag_count = 1000;
+    config->multi_count = 10;
+    config->conn_size = 4002;
+
+    for(int i=1; i < argc; i++) {
+        if(strncmp(argv[i], "--host=", 7) == 0) {
+            config->host = &(argv[i][7]);
+        } else if(strncmp(argv[i], "--port=", 7) == 0) {
+            config->port = &(argv[i][7]);
+        } else if(strncmp(argv[i], "--path=", 7) == 0) {
+            int tmp_path[2];
+
+            if(sscanf(&(argv[i][7]), "%d,%d", &tmp_path[0], &tmp_path[1]) != 2) {
+                fprintf(stderr, "Path must be two numbers separated by a comma!\n");
+                usage();
+            }
+
+            config->path[0] = (uint8_t)tmp_path[0];
+            config->path[1] = (uint8_t)tmp_path[1];
+            config->has_path = true;
+        } else if(strncmp(argv[i], "--tag=", 6) == 0) {
+            config->tag_name = &(argv[i][6]);
+        } else if(strncmp(argv[i], "--sessions=", 11) == 0) {
+            config->num_sessions = atoi(&(argv[i][11]));
+        } else if(strncmp(argv[i], "--duration=", 11) == 0) {
+            config->duration = atoi(&(argv[i][11]));
+        } else if(strncmp(argv[i], "--count=", 8) == 0) {
+            config->elem_count = atoi(&(argv[i][8]));
+        } else if(strncmp(argv[i], "--frag-count=", 13) == 0) {
+            config->frag_count = atoi(&(argv[i][13]));
+        } else if(strncmp(argv[i], "--multi=", 8) == 0) {
+            config->multi_count = atoi(&(argv[i][8]));
+        } else if(strncmp(argv[i], "--conn-size=", 12) == 0) {
+            config->conn_size = (uint32_t)atoi(&(argv[i][12]));
+        } else if(strncmp(argv[i], "--mix=", 6) == 0) {
+            if(!parse_mix(&(argv[i][6]), config)) {
+                usage();
+            }
+            has_mix = true;
+        } else if(strcmp(argv[i], "--debug") == 0) {
+            debug_on();
+        } else {
+            fprintf(stderr, "Unknown argument \"%s\"!\n", argv[i]);
+            usage();
+        }
+    }
+
+    if(!config->tag_name || strlen(config->tag_name) == 0 || strlen(config->tag_name) > 255) {
+        fprintf(stderr, "You must pass a --tag= argument!\n");
+        usage();
+    }
+
+    if(config->num_sessions < 1 || config->duration < 1 || config->elem_count < 1 || config->elem_count > 0xFFFF
+       || config->frag_count < 1 || config->frag_count > 0xFFFF || config->multi_count < 1 || config->multi_count > 200) {
+        fprintf(stderr, "Counts and durations must be positive and element counts must fit in 16 bits!\n");
+        usage();
+    }
+
+    if(config->conn_size < 100 || config->conn_size > 65535) {
+        fprintf(stderr, "The connection size must be between 100 and 65535 bytes!\n");
+        usage();
+    }
+
+    if(!has_mix) {
+        config->weights[OP_CREAD] = 1;
+        config->total_weight = 1;
+    }
+}
+
+
+/* the mix is a comma separated list of op:weight pairs. */
+bool parse_mix(const char *mix, bench_config_s *config)
+{
+    const char *p = mix;
+
+    memset(config->weights, 0, sizeof(config->weights));
+    config->total_weight = 0;
+
+    while(*p) {
+        char name[16];
+        int weight = 0;
+        int consumed = 0;
+        int op = 0;
+
+        if(sscanf(p, "%15[a-z]:%d%n", name, &weight, &consumed) != 2 || weight < 0) {
+            fprintf(stderr, "Mix entries must be <op>:<weight>, got \"%s\"!\n", p);
+            return false;
+        }
+
+        for(op=0; op < OP_COUNT; op++) {
+            if(strcmp(name, op_names[op]) == 0) {
+                break;
+            }
+        }
+
+        if(op == OP_COUNT) {
+            fprintf(stderr, "Unknown op \"%s\" in mix!\n", name);
+            return false;
+        }
+
+        config->weights[op] += weight;
+        config->total_weight += weight;
+
+        p += consumed;
+        if(*p == ',') {
+            p++;
+        }
+    }
+
+    if(config->total_weight <= 0) {
+        fprintf(stderr, "The mix must have at least one op with a positive weight!\n");
+        return false;
+    }
+
+    return true;
+}
+
+
+void *session_thread(void *arg)
+{
+    bench_session_s *bs = (bench_session_s *)arg;
+    bool ready = session_setup(bs);
+
+    /* wait even if the setup failed so that the other sessions are not stuck. */
+    pthread_barrier_wait(&start_barrier);
+
+    if(!ready) {
+        bs->failed = true;
+        session_teardown(bs);
+        return NULL;
+    }
+
+    while(now_ns() < stop_time_ns) {
+        op_t op = pick_op(bs);
+        uint8_t status = 0;
+        uint64_t start = now_ns();
+
+        if(!run_op(bs, op, &status)) {
+            error("Session %" PRIu32 " lost its connection to the server!", bs->session_handle);
+            bs->failed = true;
+            break;
+        }
+
+        if(status != CIP_OK) {
+            info("%s request failed with CIP status %x.", op_names[op], status);
+            bs->errors++;
+        } else if(!record_latency(&bs->latencies[op], now_ns() - start)) {
+            bs->failed = true;
+            break;
+        }
+    }
+
+    session_teardown(bs);
+
+    return NULL;
+}
+
+
+/*
+ * Connect, register a session, find the tag type with a one element read
+ * and open a connection if the mix uses connected messaging.
+ */
+bool session_setup(bench_session_s *bs)
+{
+    bench_config_s *config = bs->config;
+    slice_s out;
+    slice_s resp;
+    size_t offset = 0;
+    bool large = (config->conn_size > 511);
+
+    bs->sock = -1;
+    bs->out_buf = malloc(BENCH_BUFFER_SIZE);
+    bs->in_buf = malloc(BENCH_BUFFER_SIZE);
+
+    if(!bs->out_buf || !bs->in_buf) {
+        fprintf(stderr, "Unable to allocate buffers!\n");
+        return false;
+    }
+
+    bs->sock = socket_open(config->host, config->port);
+    if(bs->sock < 0) {
+        fprintf(stderr, "Unable to connect to %s:%s, error %d!\n", config->host, config->port, bs->sock);
+        return false;
+    }
+
+    /* Register Session, protocol version 1 and no options. */
+    out = slice_make(bs->out_buf + EIP_HEADER_SIZE, 4);
+    slice_set_uint16_le(out, 0, 1);
+    slice_set_uint16_le(out, 2, 0);
+
+    resp = transact(bs, 0x65, 4);
+    if(slice_has_err(resp)) {
+        fprintf(stderr, "Unable to register a session!\n");
+        return false;
+    }
+
+    bs->session_handle = slice_get_uint32_le(slice_make(bs->in_buf, EIP_HEADER_SIZE), 4);
+
+    /* find out the tag type. */
+    out = slice_make(bs->out_buf + EIP_HEADER_SIZE + CPF_UCONN_HEADER_SIZE, BENCH_UCONN_MAX_PACKET);
+    resp = send_unconnected(bs, encode_read(out, CIP_READ, config->tag_name, 0, 1));
+    if(slice_has_err(resp) || slice_len(resp) < 6 || slice_get_uint8(resp, 2) != CIP_OK) {
+        fprintf(stderr, "Unable to read tag \"%s\"!\n", config->tag_name);
+        return false;
+    }
+
+    bs->tag_type = slice_get_uint16_le(resp, 4);
+    bs->elem_size = (size_t)slice_len(resp) - 6;
+
+    if(!config->weights[OP_CREAD] && !config->weights[OP_CWRITE] && !config->weights[OP_MULTI]) {
+        return true;
+    }
+
+    /* Forward Open, or Forward Open Ex for connections larger than 511 bytes. */
+    bs->conn_serial = (uint16_t)rand_r(&bs->rand_state);
+
+    out = slice_make(bs->out_buf + EIP_HEADER_SIZE + CPF_UCONN_HEADER_SIZE, BENCH_UCONN_MAX_PACKET);
+    slice_set_uint8(out, offset, (large ? CIP_FORWARD_OPEN_EX : CIP_FORWARD_OPEN)); offset++;
+    slice_set_uint8(out, offset, 2); offset++;
+    slice_set_uint8(out, offset, 0x20); offset++;
+    slice_set_uint8(out, offset, 0x06); offset++;
+    slice_set_uint8(out, offset, 0x24); offset++;
+    slice_set_uint8(out, offset, 0x01); offset++;
+    slice_set_uint8(out, offset, 10); offset++; /* secs per tick. */
+    slice_set_uint8(out, offset, 5); offset++; /* timeout ticks. */
+    slice_set_uint32_le(out, offset, 0); offset += 4; /* server picks its connection ID. */
+    slice_set_uint32_le(out, offset, (uint32_t)rand_r(&bs->rand_state)); offset += 4;
+    slice_set_uint16_le(out, offset, bs->conn_serial); offset += 2;
+    slice_set_uint16_le(out, offset, 0xF33D); offset += 2; /* vendor ID. */
+    slice_set_uint32_le(out, offset, 0x42); offset += 4; /* originator serial number. */
+    slice_set_uint32_le(out, offset, 1); offset += 4; /* timeout multiplier and padding. */
+
+    for(int dir=0; dir < 2; dir++) {
+        slice_set_uint32_le(out, offset, 2000000); offset += 4; /* RPI */
+
+        if(large) {
+            slice_set_uint32_le(out, offset, 0x42000000 | config->conn_size); offset += 4;
+        } else {
+            slice_set_uint16_le(out, offset, (uint16_t)(0x4200 | config->conn_size)); offset += 2;
+        }
+    }
+
+    slice_set_uint8(out, offset, 0xA3); offset++; /* class 3, server transport. */
+
+    if(config->has_path) {
+        slice_set_uint8(out, offset, 3); offset++;
+        slice_set_uint8(out, offset, config->path[0]); offset++;
+        slice_set_uint8(out, offset, config->path[1]); offset++;
+    } else {
+        slice_set_uint8(out, offset, 2); offset++;
+    }
+
+    slice_set_uint8(out, offset, 0x20); offset++;
+    slice_set_uint8(out, offset, 0x02); offset++;
+    slice_set_uint8(out, offset, 0x24); offset++;
+    slice_set_uint8(out, offset, 0x01); offset++;
+
+    resp = send_unconnected(bs, offset);
+    if(slice_has_err(resp) || slice_len(resp) < 8 || slice_get_uint8(resp, 2) != CIP_OK) {
+        fprintf(stderr, "Forward Open failed with status %x!\n", (slice_has_err(resp) ? 0xFF : slice_get_uint8(resp, 2)));
+        return false;
+    }
+
+    bs->conn_id = slice_get_uint32_le(resp, 4);
+
+    return true;
+}
+
+
+/* close the connection politely if we have one, then drop the socket. */
+void session_teardown(bench_session_s *bs)
+{
+    bench_config_s *config = bs->config;
+
+    if(bs->conn_id && !bs->failed) {
+        slice_s out = slice_make(bs->out_buf + EIP_HEADER_SIZE + CPF_UCONN_HEADER_SIZE, BENCH_UCONN_MAX_PACKET);
+        size_t offset = 0;
+
+        slice_set_uint8(out, offset, CIP_FORWARD_CLOSE); offset++;
+        slice_set_uint8(out, offset, 2); offset++;
+        slice_set_uint8(out, offset, 0x20); offset++;
+        slice_set_uint8(out, offset, 0x06); offset++;
+        slice_set_uint8(out, offset, 0x24); offset++;
+        slice_set_uint8(out, offset, 0x01); offset++;
+        slice_set_uint8(out, offset, 10); offset++;
+        slice_set_uint8(out, offset, 5); offset++;
+        slice_set_uint16_le(out, offset, bs->conn_serial); offset += 2;
+        slice_set_uint16_le(out, offset, 0xF33D); offset += 2;
+        slice_set_uint32_le(out, offset, 0x42); offset += 4;
+
+        /* the close path is padded after the size byte. */
+        slice_set_uint8(out, offset, (config->has_path ? 3 : 2)); offset++;
+        slice_set_uint8(out, offset, 0); offset++;
+
+        if(config->has_path) {
+            slice_set_uint8(out, offset, config->path[0]); offset++;
+            slice_set_uint8(out, offset, config->path[1]); offset++;
+        }
+
+        slice_set_uint8(out, offset, 0x20); offset++;
+        slice_set_uint8(out, offset, 0x02); offset++;
+        slice_set_uint8(out, offset, 0x24); offset++;
+        slice_set_uint8(out, offset, 0x01); offset++;
+
+        send_unconnected(bs, offset);
+    }
+
+    socket_close(bs->sock);
+    bs->sock = -1;
+
+    free(bs->out_buf);
+    free(bs->in_buf);
+    bs->out_buf = NULL;
+    bs->in_buf = NULL;
+}
+
+
+op_t pick_op(bench_session_s *bs)
+{
+    int pick = (int)(rand_r(&bs->rand_state) % (unsigned)bs->config->total_weight);
+
+    for(int op=0; op < OP_COUNT; op++) {
+        if(pick < bs->config->weights[op]) {
+            return (op_t)op;
+        }
+
+        pick -= bs->config->weights[op];
+    }
+
+    return OP_CREAD;
+}
+
+
+/*
+ * Run one request.  Returns false if the connection broke, otherwise
+ * sets the status to the CIP general status of the response.
+ */
+bool run_op(bench_session_s *bs, op_t op, uint8_t *status)
+{
+    bench_config_s *config = bs->config;
+    bool connected = (op == OP_CREAD || op == OP_CWRITE || op == OP_MULTI);
+    size_t header_size = EIP_HEADER_SIZE + (connected ? CPF_CONN_HEADER_SIZE : CPF_UCONN_HEADER_SIZE);
+    size_t max_packet = (connected ? config->conn_size - 2 : BENCH_UCONN_MAX_PACKET);
+    slice_s out = slice_make(bs->out_buf + header_size, (ssize_t)max_packet);
+    slice_s resp;
+    size_t len = 0;
+
+    switch(op) {
+        case OP_UREAD:
+        case OP_CREAD:
+            len = encode_read(out, CIP_READ, config->tag_name, 0, (uint16_t)config->elem_count);
+            break;
+
+        case OP_UWRITE:
+        case OP_CWRITE:
+            len = encode_read(out, CIP_WRITE, config->tag_name, 0, 0) - 2;
+            slice_set_uint16_le(out, len, bs->tag_type); len += 2;
+            slice_set_uint16_le(out, len, (uint16_t)config->elem_count); len += 2;
+
+            for(size_t i=0; i < (size_t)config->elem_count * bs->elem_size; i++) {
+                slice_set_uint8(out, len, (uint8_t)(i + bs->conn_seq)); len++;
+            }
+
+            if(len > max_packet) {
+                *status = 0xFF;
+                return true;
+            }
+            break;
+
+        case OP_FRAG: {
+                uint32_t byte_offset = 0;
+                uint32_t total = (uint32_t)config->frag_count * (uint32_t)bs->elem_size;
+
+                /* keep asking for the next fragment until the server says it is done. */
+                do {
+                    len = encode_read(out, CIP_READ_FRAG, config->tag_name, 0, (uint16_t)config->frag_count);
+                    slice_set_uint32_le(out, len, byte_offset); len += 4;
+
+                    resp = send_unconnected(bs, len);
+                    if(slice_has_err(resp)) {
+                        return false;
+                    }
+
+                    *status = (uint8_t)slice_get_uint8(resp, 2);
+                    if(slice_len(resp) <= 6 || (*status != CIP_OK && *status != CIP_ERR_FRAG)) {
+                        *status = (*status == CIP_OK ? 0xFF : *status);
+                        return true;
+                    }
+
+                    byte_offset += (uint32_t)slice_len(resp) - 6;
+                } while(*status == CIP_ERR_FRAG && byte_offset < total);
+
+                return true;
+            }
+
+        case OP_MULTI: {
+                size_t count = (size_t)config->multi_count;
+                size_t table_size = 2 + (2 * count);
+                size_t data_offset = 0;
+
+                len = 0;
+                slice_set_uint8(out, len, CIP_MULTI); len++;
+                slice_set_uint8(out, len, 2); len++;
+                slice_set_uint8(out, len, 0x20); len++;
+                slice_set_uint8(out, len, 0x02); len++;
+                slice_set_uint8(out, len, 0x24); len++;
+                slice_set_uint8(out, len, 0x01); len++;
+                slice_set_uint16_le(out, len, (uint16_t)count);
+
+                data_offset = table_size;
+                for(size_t i=0; i < count; i++) {
+                    size_t embedded_len = 0;
+
+                    slice_set_uint16_le(out, len + 2 + (2 * i), (uint16_t)data_offset);
+
+                    embedded_len = encode_read(slice_from_slice(out, len + data_offset, max_packet - len - data_offset), CIP_READ, config->tag_name, 0, (uint16_t)config->elem_count);
+                    if(embedded_len == 0) {
+                        *status = 0xFF;
+                        return true;
+                    }
+
+                    data_offset += embedded_len;
+                }
+
+                len += data_offset;
+            }
+            break;
+
+        default:
+            *status = 0xFF;
+            return true;
+    }
+
+    if(len == 0) {
+        *status = 0xFF;
+        return true;
+    }
+
+    resp = (connected ? send_connected(bs, len) : send_unconnected(bs, len));
+    if(slice_has_err(resp)) {
+        return false;
+    }
+
+    *status = (slice_len(resp) >= 4 ? (uint8_t)slice_get_uint8(resp, 2) : 0xFF);
+
+    return true;
+}
+
+
+/* wrap the CIP request already in the output buffer in an unconnected CPF and EIP header. */
+slice_s send_unconnected(bench_session_s *bs, size_t cip_len)
+{
+    slice_s cpf = slice_make(bs->out_buf + EIP_HEADER_SIZE, CPF_UCONN_HEADER_SIZE);
+    slice_s resp;
+
+    slice_set_uint32_le(cpf, 0, 0); /* interface handle. */
+    slice_set_uint16_le(cpf, 4, 5); /* timeout. */
+    slice_set_uint16_le(cpf, 6, 2); /* item count. */
+    slice_set_uint16_le(cpf, 8, 0); /* null address item. */
+    slice_set_uint16_le(cpf, 10, 0);
+    slice_set_uint16_le(cpf, 12, 0xB2); /* unconnected data item. */
+    slice_set_uint16_le(cpf, 14, (uint16_t)cip_len);
+
+    resp = transact(bs, 0x6F, CPF_UCONN_HEADER_SIZE + cip_len);
+    if(slice_has_err(resp) || slice_len(resp) < CPF_UCONN_HEADER_SIZE) {
+        return slice_make_err(SOCKET_ERR_READ);
+    }
+
+    return slice_from_slice(resp, CPF_UCONN_HEADER_SIZE, (size_t)slice_len(resp) - CPF_UCONN_HEADER_SIZE);
+}
+
+
+/* wrap the CIP request already in the output buffer in a connected CPF and EIP header. */
+slice_s send_connected(bench_session_s *bs, size_t cip_len)
+{
+    slice_s cpf = slice_make(bs->out_buf + EIP_HEADER_SIZE, CPF_CONN_HEADER_SIZE);
+    slice_s resp;
+
+    bs->conn_seq++;
+
+    slice_set_uint32_le(cpf, 0, 0); /* interface handle. */
+    slice_set_uint16_le(cpf, 4, 0); /* timeout. */
+    slice_set_uint16_le(cpf, 6, 2); /* item count. */
+    slice_set_uint16_le(cpf, 8, 0xA1); /* connected address item. */
+    slice_set_uint16_le(cpf, 10, 4);
+    slice_set_uint32_le(cpf, 12, bs->conn_id);
+    slice_set_uint16_le(cpf, 16, 0xB1); /* connected data item. */
+    slice_set_uint16_le(cpf, 18, (uint16_t)(cip_len + 2));
+    slice_set_uint16_le(cpf, 20, bs->conn_seq);
+
+    resp = transact(bs, 0x70, CPF_CONN_HEADER_SIZE + cip_len);
+    if(slice_has_err(resp) || slice_len(resp) < CPF_CONN_HEADER_SIZE) {
+        return slice_make_err(SOCKET_ERR_READ);
+    }
+
+    return slice_from_slice(resp, CPF_CONN_HEADER_SIZE, (size_t)slice_len(resp) - CPF_CONN_HEADER_SIZE);
+}
+
+
+/* send one EIP packet and wait for the whole response.  Returns the response payload. */
+slice_s transact(bench_session_s *bs, uint16_t command, size_t payload_len)
+{
+    slice_s header = slice_make(bs->out_buf, EIP_HEADER_SIZE);
+    slice_s in_header = slice_make(bs->in_buf, EIP_HEADER_SIZE);
+    size_t in_len = 0;
+    int rc = 0;
+
+    slice_set_uint16_le(header, 0, command);
+    slice_set_uint16_le(header, 2, (uint16_t)payload_len);
+    slice_set_uint32_le(header, 4, bs->session_handle);
+    slice_set_uint32_le(header, 8, 0); /* status */
+    slice_set_uint64_le(header, 12, 0); /* sender context */
+    slice_set_uint32_le(header, 20, 0); /* options */
+
+    rc = socket_write(bs->sock, slice_make(bs->out_buf, (ssize_t)(EIP_HEADER_SIZE + payload_len)));
+    if(rc != (int)(EIP_HEADER_SIZE + payload_len)) {
+        return slice_make_err(SOCKET_ERR_WRITE);
+    }
+
+    if(!read_fully(bs->sock, bs->in_buf, EIP_HEADER_SIZE)) {
+        return slice_make_err(SOCKET_ERR_READ);
+    }
+
+    in_len = slice_get_uint16_le(in_header, 2);
+
+    if(!read_fully(bs->sock, bs->in_buf + EIP_HEADER_SIZE, in_len)) {
+        return slice_make_err(SOCKET_ERR_READ);
+    }
+
+    if(slice_get_uint32_le(in_header, 8) != 0) {
+        info("EIP command %x failed with status %x.", command, slice_get_uint32_le(in_header, 8));
+        return slice_make_err(SOCKET_ERR_READ);
+    }
+
+    return slice_make(bs->in_buf + EIP_HEADER_SIZE, (ssize_t)in_len);
+}
+
+
+bool read_fully(int sock, uint8_t *buf, size_t len)
+{
+    size_t total = 0;
+
+    while(total < len) {
+        slice_s got = socket_read(sock, slice_make(buf + total, (ssize_t)(len - total)));
+
+        if(slice_has_err(got)) {
+            return false;
+        }
+
+        total += (size_t)slice_len(got);
+    }
+
+    return true;
+}
+
+
+/* symbolic segment for the name and an element segment for the index.  Returns the end offset or 0. */
+size_t encode_tag_path(slice_s cip, size_t offset, const char *name, uint32_t index)
+{
+    size_t name_len = strlen(name);
+
+    if(!slice_range_in_bounds(cip, offset, 2 + name_len + 1 + 6)) {
+        return 0;
+    }
+
+    slice_set_uint8(cip, offset, 0x91); offset++;
+    slice_set_uint8(cip, offset, (uint8_t)name_len); offset++;
+    slice_set_bytes(cip, offset, (const uint8_t *)name, name_len); offset += name_len;
+
+    if(name_len & 0x01) {
+        slice_set_uint8(cip, offset, 0); offset++;
+    }
+
+    if(index > 0xFFFF) {
+        slice_set_uint8(cip, offset, 0x2A); offset++;
+        slice_set_uint8(cip, offset, 0); offset++;
+        slice_set_uint32_le(cip, offset, index); offset += 4;
+    } else if(index > 0xFF) {
+        slice_set_uint8(cip, offset, 0x29); offset++;
+        slice_set_uint8(cip, offset, 0); offset++;
+        slice_set_uint16_le(cip, offset, (uint16_t)index); offset += 2;
+    } else if(index > 0) {
+        slice_set_uint8(cip, offset, 0x28); offset++;
+        slice_set_uint8(cip, offset, (uint8_t)index); offset++;
+    }
+
+    return offset;
+}
+
+
+/* service, path size, path and element count.  Returns the length or 0 if it does not fit. */
+size_t encode_read(slice_s cip, uint8_t service, const char *name, uint32_t index, uint16_t count)
+{
+    size_t offset = encode_tag_path(cip, 2, name, index);
+
+    if(offset == 0 || !slice_range_in_bounds(cip, offset, 2)) {
+        return 0;
+    }
+
+    slice_set_uint8(cip, 0, service);
+    slice_set_uint8(cip, 1, (uint8_t)((offset - 2) / 2));
+    slice_set_uint16_le(cip, offset, count); offset += 2;
+
+    return offset;
+}
+
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+}
+
+
+bool record_latency(latency_list_s *list, uint64_t ns)
+{
+    if(list->num_samples == list->capacity) {
+        size_t new_capacity = (list->capacity ? list->capacity * 2 : 4096);
+        uint64_t *new_samples = realloc(list->samples, new_capacity * sizeof(*new_samples));
+
+        if(!new_samples) {
+            error("Unable to allocate memory for latency samples!");
+            return false;
+        }
+
+        list->samples = new_samples;
+        list->capacity = new_capacity;
+    }
+
+    list->samples[list->num_samples] = ns;
+    list->num_samples++;
+
+    return true;
+}
+
+
+int compare_uint64(const void *a, const void *b)
+{
+    uint64_t left = *(const uint64_t *)a;
+    uint64_t right = *(const uint64_t *)b;
+
+    return (left > right) - (left < right);
+}
+
+
+/* merge the samples from all sessions and print one line per op and one for everything. */
+void report(bench_config_s *config, bench_session_s *sessions, double elapsed)
+{
+    size_t total_count = 0;
+    size_t total_offset = 0;
+    uint64_t *all = NULL;
+    uint64_t errors = 0;
+
+    for(int i=0; i < config->num_sessions; i++) {
+        errors += sessions[i].errors;
+
+        for(int op=0; op < OP_COUNT; op++) {
+            total_count += sessions[i].latencies[op].num_samples;
+        }
+    }
+
+    printf("%d sessions, %.2f seconds, %" PRIu64 " errors.\n", config->num_sessions, elapsed, errors);
+    printf("%-8s %12s %12s %10s %10s %10s %10s\n", "op", "count", "ops/sec", "p50 us", "p99 us", "p99.9 us", "max us");
+
+    all = malloc((total_count ? total_count : 1) * sizeof(*all));
+    if(!all) {
+        fprintf(stderr, "Unable to allocate memory for the report!\n");
+        return;
+    }
+
+    for(int op=0; op < OP_COUNT; op++) {
+        size_t op_start = total_offset;
+
+        if(!config->weights[op]) {
+            continue;
+        }
+
+        for(int i=0; i < config->num_sessions; i++) {
+            latency_list_s *list = &sessions[i].latencies[op];
+
+            if(list->num_samples) {
+                memcpy(all + total_offset, list->samples, list->num_samples * sizeof(*all));
+                total_offset += list->num_samples;
+            }
+        }
+
+        report_line(op_names[op], all + op_start, total_offset - op_start, elapsed);
+    }
+
+    report_line("all", all, total_offset, elapsed);
+
+    free(all);
+}
+
+
+void report_line(const char *name, uint64_t *samples, size_t count, double elapsed)
+{
+    if(count == 0) {
+        printf("%-8s %12d\n", name, 0);
+        return;
+    }
+
+    qsort(samples, count, sizeof(*samples), compare_uint64);
+
+    printf("%-8s %12zu %12.0f %10.1f %10.1f %10.1f %10.1f\n",
+           name,
+           count,
+           (double)count / elapsed,
+           (double)samples[(size_t)(0.5 * (double)(count - 1))] / 1000.0,
+           (double)samples[(size_t)(0.99 * (double)(count - 1))] / 1000.0,
+           (double)samples[(size_t)(0.999 * (double)(count - 1))] / 1000.0,
+           (double)samples[count - 1] / 1000.0);
+}
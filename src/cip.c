@@ -22,9 +22,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include "cip.h"
+#include "cpf.h"
 #include "eip.h"
+#include "io_conn.h"
 #include "plc.h"
 #include "slice.h"
+#include "tag.h"
+#include "udt.h"
 #include "utils.h"
 
 
@@ -32,7 +36,7 @@
 const uint8_t CIP_MULTI[] = { 0x0A, 0x02, 0x20, 0x02, 0x24, 0x01 }; 
 const uint8_t CIP_READ[] = { 0x4C };
 const uint8_t CIP_WRITE[] = { 0x4D };
-const uint8_t CIP_RMW[] = { 0x4E, 0x02, 0x20, 0x02, 0x24, 0x01 };
+const uint8_t CIP_RMW[] = { 0x4E };
 const uint8_t CIP_READ_FRAG[] = { 0x52 };
 const uint8_t CIP_WRITE_FRAG[] = { 0x53 };
 
@@ -41,7 +45,7 @@ const uint8_t CIP_WRITE_FRAG[] = { 0x53 };
 const uint8_t CIP_PCCC_EXECUTE[] = { 0x4B, 0x02, 0x20, 0x02, 0x24, 0x01 };
 const uint8_t CIP_FORWARD_CLOSE[] = { 0x4E, 0x02, 0x20, 0x06, 0x24, 0x01 };
 const uint8_t CIP_FORWARD_OPEN[] = { 0x54, 0x02, 0x20, 0x06, 0x24, 0x01 };
-const uint8_t CIP_LIST_TAGS[] = { 0x55, 0x02, 0x20, 0x02, 0x24, 0x01 };
+const uint8_t CIP_LIST_TAGS[] = { 0x55 };
 const uint8_t CIP_FORWARD_OPEN_EX[] = { 0x5B, 0x02, 0x20, 0x06, 0x24, 0x01 };
 
 /* path to match. */
@@ -56,10 +60,23 @@ const uint8_t CIP_FORWARD_OPEN_EX[] = { 0x5B, 0x02, 0x20, 0x06, 0x24, 0x01 };
 
 #define CIP_OK                  ((uint8_t)0x00)
 #define CIP_ERR_FRAG            ((uint8_t)0x06)
+#define CIP_ERR_PATH_DEST_UNKNOWN ((uint8_t)0x05)
 #define CIP_ERR_UNSUPPORTED     ((uint8_t)0x08)
+#define CIP_ERR_REPLY_TOO_LARGE ((uint8_t)0x11)
+#define CIP_ERR_ATTR_UNSUPPORTED ((uint8_t)0x14)
+#define CIP_ERR_EMBEDDED        ((uint8_t)0x1E)
 #define CIP_ERR_EXTENDED        ((uint8_t)0xff)
 
+#define CIP_ERR_CONN_FAILURE    ((uint8_t)0x01)
+
 #define CIP_ERR_EX_TOO_LONG     ((uint16_t)0x2105)
+#define CIP_ERR_EX_CONN_NOT_FOUND ((uint16_t)0x0107)
+#define CIP_ERR_EX_BAD_CONN_SIZE ((uint16_t)0x0109)
+#define CIP_ERR_EX_OUT_OF_CONNS ((uint16_t)0x0113)
+#define CIP_ERR_EX_BAD_TRANSPORT ((uint16_t)0x0103)
+#define CIP_ERR_EX_BAD_CONN_TYPE ((uint16_t)0x0108)
+#define CIP_ERR_EX_BAD_RPI      ((uint16_t)0x0111)
+#define CIP_ERR_EX_BAD_APP_PATH ((uint16_t)0x0117)
 
 typedef struct {
     uint8_t service_code;   /* why is the operation code _before_ the path? */
@@ -67,37 +84,55 @@ typedef struct {
     slice_s path;           /* store this in a slice to avoid copying */
 } cip_header_s;
 
-static slice_s handle_forward_open(slice_s input, slice_s output, plc_s *plc);
-static slice_s handle_forward_close(slice_s input, slice_s output, plc_s *plc);
-static slice_s handle_read_request(slice_s input, slice_s output, plc_s *plc);
-static slice_s handle_write_request(slice_s input, slice_s output, plc_s *plc);
-
-static bool process_tag_segment(plc_s *plc, slice_s input, tag_def_s **tag, size_t *start_read_offset);
+static slice_s handle_forward_open(slice_s input, slice_s output, session_s *session);
+static slice_s handle_forward_close(slice_s input, slice_s output, session_s *session);
+static slice_s handle_read_request(slice_s input, slice_s output, session_s *session, bool zero_copy);
+static slice_s handle_write_request(slice_s input, slice_s output, session_s *session);
+static slice_s handle_rmw_request(slice_s input, slice_s output, session_s *session);
+static slice_s handle_multi_request(slice_s input, slice_s output, session_s *session);
+static slice_s handle_list_tags_request(slice_s input, slice_s output, session_s *session);
+static bool is_template_request(slice_s input);
+static slice_s handle_template_request(slice_s input, slice_s output, session_s *session);
+static bool stage_write_fragment(session_s *session, tag_def_s *tag, size_t start_offset, size_t total_size, size_t byte_offset, const uint8_t *data, size_t len);
+
+static bool process_tag_segment(plc_s *plc, slice_s input, tag_ref_s *ref);
+static bool get_numeric_segment(slice_s *segments, int *value);
+static bool get_instance_segment(slice_s path, uint32_t *instance);
 static slice_s make_cip_error(slice_s output, uint8_t cip_cmd, uint8_t cip_err, bool extend, uint16_t extended_error);
 static bool match_path(slice_s input, bool need_pad, uint8_t *path, uint8_t path_len);
+static bool match_port_path(plc_s *plc, slice_s input, bool need_pad);
 
-slice_s cip_dispatch_request(slice_s input, slice_s output, plc_s *plc)
+slice_s cip_dispatch_request(slice_s input, slice_s output, session_s *session)
 {
     cip_header_s header;
 
     info("Got packet:");
     slice_dump(input);
 
-    /* match the prefix and dispatch. */
-    if(slice_match_bytes(input, CIP_READ, sizeof(CIP_READ))) {
-        return handle_read_request(input, output, plc);
+    /* match the prefix and dispatch.  Template reads look like tag reads until the path. */
+    if(is_template_request(input)) {
+        return handle_template_request(input, output, session);
+    } else if(slice_match_bytes(input, CIP_MULTI, sizeof(CIP_MULTI))) {
+        return handle_multi_request(input, output, session);
+    } else if(slice_match_bytes(input, CIP_READ, sizeof(CIP_READ))) {
+        return handle_read_request(input, output, session, true);
     } else if(slice_match_bytes(input, CIP_READ_FRAG, sizeof(CIP_READ_FRAG))) {
-        return handle_read_request(input, output, plc);
+        return handle_read_request(input, output, session, true);
     } else if(slice_match_bytes(input, CIP_WRITE, sizeof(CIP_WRITE))) {
-        return handle_write_request(input, output, plc);
+        return handle_write_request(input, output, session);
     } else if(slice_match_bytes(input, CIP_WRITE_FRAG, sizeof(CIP_WRITE_FRAG))) {
-        return handle_write_request(input, output, plc);
+        return handle_write_request(input, output, session);
     } else if(slice_match_bytes(input, CIP_FORWARD_OPEN, sizeof(CIP_FORWARD_OPEN))) {
-        return handle_forward_open(input, output, plc);
+        return handle_forward_open(input, output, session);
     } else if(slice_match_bytes(input, CIP_FORWARD_OPEN_EX, sizeof(CIP_FORWARD_OPEN_EX))) {
-        return handle_forward_open(input, output, plc);
+        return handle_forward_open(input, output, session);
     } else if(slice_match_bytes(input, CIP_FORWARD_CLOSE, sizeof(CIP_FORWARD_CLOSE))) {
-        return handle_forward_close(input, output, plc);
+        return handle_forward_close(input, output, session);
+    } else if(slice_match_bytes(input, CIP_LIST_TAGS, sizeof(CIP_LIST_TAGS))) {
+        return handle_list_tags_request(input, output, session);
+    } else if(slice_match_bytes(input, CIP_RMW, sizeof(CIP_RMW))) {
+        /* same service code as Forward Close, so this must come after it. */
+        return handle_rmw_request(input, output, session);
     } else {
             return make_cip_error(output, slice_get_uint8(input, 0) | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
     }
@@ -126,13 +161,40 @@ typedef struct {
 /* the minimal Forward Open with no path */
 #define CIP_FORWARD_OPEN_MIN_SIZE   (48)
 
+/* a connection must at least hold the sequence number and a CIP error response. */
+#define CIP_MIN_CONN_SIZE   (16)
+
+/* transport class and trigger byte.  Class 1 I/O is only produced cyclically. */
+#define CIP_TRANSPORT_CLASS_MASK    ((uint8_t)0x0F)
+#define CIP_TRANSPORT_TRIGGER_MASK  ((uint8_t)0x70)
+#define CIP_TRANSPORT_CLASS_1       ((uint8_t)0x01)
+
+/* connection type in the connection parameters of Forward Open and Forward Open Ex. */
+#define CIP_CONN_TYPE(fo_cmd, params)   ((((fo_cmd) == CIP_FORWARD_OPEN[0]) ? ((params) >> 13) : ((params) >> 29)) & 0x03)
+#define CIP_CONN_TYPE_NULL          (0)
+#define CIP_CONN_TYPE_POINT         (2)
 
-slice_s handle_forward_open(slice_s input, slice_s output, plc_s *plc)
+static slice_s make_forward_open_error(slice_s output, uint8_t fo_cmd, uint16_t extended_error, bool has_size, uint16_t max_size, forward_open_s *fo_req);
+static uint16_t check_io_forward_open(plc_s *plc, uint8_t fo_cmd, forward_open_s *fo_req, slice_s conn_path, bool need_pad,
+                                      uint32_t client_to_server_max_packet, uint32_t server_to_client_max_packet,
+                                      tag_def_s **o_to_t_tag, tag_def_s **t_to_o_tag, uint16_t *max_size);
+static bool get_io_path(plc_s *plc, slice_s conn_path, bool need_pad, tag_def_s **o_to_t_tag, tag_def_s **t_to_o_tag);
+
+
+slice_s handle_forward_open(slice_s input, slice_s output, session_s *session)
 {
+    plc_s *plc = session->plc;
+    conn_s *conn = NULL;
     slice_s conn_path;
     size_t offset = 0;
     uint8_t fo_cmd = slice_get_uint8(input, 0);
     forward_open_s fo_req = {0};
+    uint32_t client_to_server_max_packet = 0;
+    uint32_t server_to_client_max_packet = 0;
+    uint32_t max_conn_size = 0;
+    bool is_io = false;
+    tag_def_s *o_to_t_tag = NULL;
+    tag_def_s *t_to_o_tag = NULL;
 
     info("Checking Forward Open request:");
     slice_dump(input);
@@ -184,29 +246,78 @@ slice_s handle_forward_open(slice_s input, slice_s output, plc_s *plc)
     info("path slice:");
     slice_dump(conn_path);
 
-    if(!match_path(conn_path, ((offset & 0x01) ? false : true), &plc->path[0], plc->path_len)) {
+    /* get the requested packet sizes.  Forward Open Ex has a 16-bit size field. */
+    client_to_server_max_packet = fo_req.client_to_server_conn_params & ((fo_cmd == CIP_FORWARD_OPEN[0]) ? 0x1FF : 0xFFFF);
+    server_to_client_max_packet = fo_req.server_to_client_conn_params & ((fo_cmd == CIP_FORWARD_OPEN[0]) ? 0x1FF : 0xFFFF);
+
+    /* class 1 connections name their data in the path and have their own size rules. */
+    is_io = ((fo_req.transport_class & CIP_TRANSPORT_CLASS_MASK) == CIP_TRANSPORT_CLASS_1);
+    if(is_io) {
+        uint16_t max_size = 0;
+        uint16_t extended_error = check_io_forward_open(plc, fo_cmd, &fo_req, conn_path, ((offset & 0x01) ? false : true),
+                                                        client_to_server_max_packet, server_to_client_max_packet,
+                                                        &o_to_t_tag, &t_to_o_tag, &max_size);
+
+        if(extended_error) {
+            return make_forward_open_error(output, fo_cmd, extended_error, (extended_error == CIP_ERR_EX_BAD_CONN_SIZE), max_size, &fo_req);
+        }
+    } else if(!match_path(conn_path, ((offset & 0x01) ? false : true), &plc->path[0], plc->path_len)) {
         /* FIXME - send back the right error. */
         info("Forward open request path did not match the path for this PLC!");
         return make_cip_error(output, slice_get_uint8(input, 0) | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
     }
 
+    /* check that the packet sizes are ones this PLC supports.  The error tells the client the largest we allow. */
+    max_conn_size = (plc->conn_max_packet < CPF_MAX_CONN_SIZE ? plc->conn_max_packet : CPF_MAX_CONN_SIZE);
+    if(!is_io && (client_to_server_max_packet < CIP_MIN_CONN_SIZE || client_to_server_max_packet > max_conn_size ||
+       server_to_client_max_packet < CIP_MIN_CONN_SIZE || server_to_client_max_packet > max_conn_size)) {
+        info("Forward open requested unsupported connection sizes %u and %u, must be between %u and %u!", client_to_server_max_packet, server_to_client_max_packet, CIP_MIN_CONN_SIZE, max_conn_size);
+        return make_forward_open_error(output, fo_cmd, CIP_ERR_EX_BAD_CONN_SIZE, true, (uint16_t)max_conn_size, &fo_req);
+    }
+
     /* all good if we got here. */
-    plc->client_connection_id = fo_req.client_conn_id;
-    plc->client_connection_serial_number = fo_req.conn_serial_number;
-    plc->client_vendor_id = fo_req.orig_vendor_id;
-    plc->client_serial_number = fo_req.orig_serial_number;
-    plc->client_to_server_rpi = fo_req.client_to_server_rpi;
-    plc->server_to_client_rpi = fo_req.server_to_client_rpi;
-    plc->server_connection_id = rand();
-    plc->server_connection_seq = (uint16_t)rand();
-
-    /* store the allowed packet sizes. */
-    plc->client_to_server_max_packet = fo_req.client_to_server_conn_params & 
-                               ((fo_cmd == CIP_FORWARD_OPEN[0]) ? 0x1FF : 0x0FFF);
-    plc->server_to_client_max_packet = fo_req.server_to_client_conn_params & 
-                               ((fo_cmd == CIP_FORWARD_OPEN[0]) ? 0x1FF : 0x0FFF);
-
-    /* FIXME - check that the packet sizes are valid 508 or 4002 */
+    conn = session_add_conn(session);
+    if(!conn) {
+        return make_forward_open_error(output, fo_cmd, CIP_ERR_EX_OUT_OF_CONNS, false, 0, &fo_req);
+    }
+
+    conn->client_connection_id = fo_req.client_conn_id;
+    conn->client_connection_serial_number = fo_req.conn_serial_number;
+    conn->client_vendor_id = fo_req.orig_vendor_id;
+    conn->client_serial_number = fo_req.orig_serial_number;
+    conn->client_to_server_rpi = fo_req.client_to_server_rpi;
+    conn->server_to_client_rpi = fo_req.server_to_client_rpi;
+    conn->server_connection_seq = (uint16_t)rand();
+
+    /* store the allowed packet sizes and make room for them. */
+    conn->client_to_server_max_packet = client_to_server_max_packet;
+    conn->server_to_client_max_packet = server_to_client_max_packet;
+
+    if(is_io) {
+        /* I/O goes to the originator's port 2222, the TCP buffers do not carry it. */
+        struct sockaddr_in dest;
+        struct sockaddr_in src;
+
+        if(tcp_conn_get_peer(session->tcp_conn, &dest)) {
+            dest.sin_port = htons(2222);
+            conn->io = io_conn_open(plc, conn->server_connection_id, conn->client_connection_id, &dest,
+                                    (tcp_conn_get_local(session->tcp_conn, &src) ? &src : NULL),
+                                    o_to_t_tag, client_to_server_max_packet, conn->client_to_server_rpi,
+                                    t_to_o_tag, server_to_client_max_packet, conn->server_to_client_rpi);
+        }
+
+        if(!conn->io) {
+            session_remove_conn(session, conn);
+            return make_forward_open_error(output, fo_cmd, CIP_ERR_EX_OUT_OF_CONNS, false, 0, &fo_req);
+        }
+    } else {
+        session_fit_buffers(session, (client_to_server_max_packet > server_to_client_max_packet ? client_to_server_max_packet : server_to_client_max_packet));
+    }
+
+    /* a class 1 connection without O->T data has nothing to time out on, its owner's connection does that. */
+    if(!is_io || CIP_CONN_TYPE(fo_cmd, fo_req.client_to_server_conn_params) != CIP_CONN_TYPE_NULL) {
+        session_set_conn_timeout(session, conn, conn->client_to_server_rpi, fo_req.conn_timeout_multiplier);
+    }
 
     /* now process the FO and respond. */
     offset = 0;
@@ -215,13 +326,13 @@ slice_s handle_forward_open(slice_s input, slice_s output, plc_s *plc)
     slice_set_uint8(output, offset, 0); offset++; /* no error. */
     slice_set_uint8(output, offset, 0); offset++; /* no extra error fields. */
 
-    slice_set_uint32_le(output, offset, plc->server_connection_id); offset += 4;
-    slice_set_uint32_le(output, offset, plc->client_connection_id); offset += 4;
-    slice_set_uint16_le(output, offset, plc->client_connection_serial_number); offset += 2;
-    slice_set_uint16_le(output, offset, plc->client_vendor_id); offset += 2;
-    slice_set_uint32_le(output, offset, plc->client_serial_number); offset += 4;
-    slice_set_uint32_le(output, offset, plc->client_to_server_rpi); offset += 4;
-    slice_set_uint32_le(output, offset, plc->server_to_client_rpi); offset += 4;
+    slice_set_uint32_le(output, offset, conn->server_connection_id); offset += 4;
+    slice_set_uint32_le(output, offset, conn->client_connection_id); offset += 4;
+    slice_set_uint16_le(output, offset, conn->client_connection_serial_number); offset += 2;
+    slice_set_uint16_le(output, offset, conn->client_vendor_id); offset += 2;
+    slice_set_uint32_le(output, offset, conn->client_serial_number); offset += 4;
+    slice_set_uint32_le(output, offset, conn->client_to_server_rpi); offset += 4;
+    slice_set_uint32_le(output, offset, conn->server_to_client_rpi); offset += 4;
 
     /* not sure what these do... */
     slice_set_uint8(output, offset, 0); offset++;
@@ -231,6 +342,214 @@ slice_s handle_forward_open(slice_s input, slice_s output, plc_s *plc)
 }
 
 
+/*
+ * A failed Forward Open has its own response format.  After the status
+ * comes the connection triad and the remaining path size.  For size
+ * errors the extended status includes the largest supported size.
+ */
+slice_s make_forward_open_error(slice_s output, uint8_t fo_cmd, uint16_t extended_error, bool has_size, uint16_t max_size, forward_open_s *fo_req)
+{
+    size_t offset = 0;
+
+    slice_set_uint8(output, offset, fo_cmd | CIP_DONE); offset++;
+    slice_set_uint8(output, offset, 0); offset++; /* padding/reserved. */
+    slice_set_uint8(output, offset, CIP_ERR_CONN_FAILURE); offset++;
+    slice_set_uint8(output, offset, (has_size ? 2 : 1)); offset++; /* words of extended status. */
+    slice_set_uint16_le(output, offset, extended_error); offset += 2;
+
+    if(has_size) {
+        slice_set_uint16_le(output, offset, max_size); offset += 2;
+    }
+
+    slice_set_uint16_le(output, offset, fo_req->conn_serial_number); offset += 2;
+    slice_set_uint16_le(output, offset, fo_req->orig_vendor_id); offset += 2;
+    slice_set_uint32_le(output, offset, fo_req->orig_serial_number); offset += 4;
+    slice_set_uint8(output, offset, 0); offset++; /* remaining path size. */
+    slice_set_uint8(output, offset, 0); offset++; /* reserved. */
+
+    return slice_from_slice(output, 0, offset);
+}
+
+
+/*
+ * Check a class 1 Forward Open.  Returns 0 if it is good or the
+ * extended status to fail it with, and for size errors the largest size
+ * we would accept.
+ */
+uint16_t check_io_forward_open(plc_s *plc, uint8_t fo_cmd, forward_open_s *fo_req, slice_s conn_path, bool need_pad,
+                               uint32_t client_to_server_max_packet, uint32_t server_to_client_max_packet,
+                               tag_def_s **o_to_t_tag, tag_def_s **t_to_o_tag, uint16_t *max_size)
+{
+    uint32_t o_to_t_type = CIP_CONN_TYPE(fo_cmd, fo_req->client_to_server_conn_params);
+    uint32_t t_to_o_type = CIP_CONN_TYPE(fo_cmd, fo_req->server_to_client_conn_params);
+    uint32_t o_to_t_data_size = (client_to_server_max_packet > IO_O_TO_T_HEADER_SIZE ? client_to_server_max_packet - IO_O_TO_T_HEADER_SIZE : 0);
+    uint32_t t_to_o_data_size = (server_to_client_max_packet > IO_T_TO_O_HEADER_SIZE ? server_to_client_max_packet - IO_T_TO_O_HEADER_SIZE : 0);
+
+    if(!plc->io_engine) {
+        info("Class 1 I/O is not running!");
+        return CIP_ERR_EX_OUT_OF_CONNS;
+    }
+
+    if((fo_req->transport_class & CIP_TRANSPORT_TRIGGER_MASK) != 0) {
+        info("Only cyclic class 1 connections are supported, got transport %x!", fo_req->transport_class);
+        return CIP_ERR_EX_BAD_TRANSPORT;
+    }
+
+    /* we produce to the originator only, there is no multicast group to join. */
+    if(t_to_o_type != CIP_CONN_TYPE_POINT || (o_to_t_type != CIP_CONN_TYPE_POINT && o_to_t_type != CIP_CONN_TYPE_NULL)) {
+        info("Class 1 connections must be point to point, got types %u and %u!", o_to_t_type, t_to_o_type);
+        return CIP_ERR_EX_BAD_CONN_TYPE;
+    }
+
+    if(fo_req->server_to_client_rpi < IO_MIN_RPI_US || (o_to_t_type != CIP_CONN_TYPE_NULL && fo_req->client_to_server_rpi < IO_MIN_RPI_US)) {
+        info("Class 1 RPIs must be at least %d us, got %u and %u!", IO_MIN_RPI_US, fo_req->client_to_server_rpi, fo_req->server_to_client_rpi);
+        return CIP_ERR_EX_BAD_RPI;
+    }
+
+    if(!get_io_path(plc, conn_path, need_pad, o_to_t_tag, t_to_o_tag)) {
+        return CIP_ERR_EX_BAD_APP_PATH;
+    }
+
+    /* a connection point that is not a tag can only carry a heartbeat. */
+    if((o_to_t_data_size > 0 && !*o_to_t_tag) || (t_to_o_data_size > 0 && !*t_to_o_tag)) {
+        info("Class 1 connection points must be tags to carry data!");
+        return CIP_ERR_EX_BAD_APP_PATH;
+    }
+
+    if(o_to_t_type == CIP_CONN_TYPE_NULL) {
+        o_to_t_data_size = 0;
+        *o_to_t_tag = NULL;
+    }
+
+    if(server_to_client_max_packet < IO_T_TO_O_HEADER_SIZE || server_to_client_max_packet > plc->conn_max_packet ||
+       (*t_to_o_tag && t_to_o_data_size > (uint32_t)((*t_to_o_tag)->elem_count * (*t_to_o_tag)->elem_size))) {
+        *max_size = (uint16_t)(*t_to_o_tag ? IO_T_TO_O_HEADER_SIZE + (*t_to_o_tag)->elem_count * (*t_to_o_tag)->elem_size : IO_T_TO_O_HEADER_SIZE);
+        info("Class 1 T->O size %u is not supported!", server_to_client_max_packet);
+        return CIP_ERR_EX_BAD_CONN_SIZE;
+    }
+
+    if(client_to_server_max_packet > plc->conn_max_packet ||
+       (*o_to_t_tag && o_to_t_data_size > (uint32_t)((*o_to_t_tag)->elem_count * (*o_to_t_tag)->elem_size))) {
+        *max_size = (uint16_t)(*o_to_t_tag ? IO_O_TO_T_HEADER_SIZE + (*o_to_t_tag)->elem_count * (*o_to_t_tag)->elem_size : IO_O_TO_T_HEADER_SIZE);
+        info("Class 1 O->T size %u is not supported!", client_to_server_max_packet);
+        return CIP_ERR_EX_BAD_CONN_SIZE;
+    }
+
+    return 0;
+}
+
+
+/*
+ * The path of a class 1 connection is our port segment followed by an
+ * application path, such as an assembly with a configuration instance
+ * and two connection points, or the symbolic name of a tag to consume.
+ * Connection points are tags, by symbol instance ID or by name.  With
+ * two, the first is O->T and the second T->O.  With one, it is T->O.
+ * Electronic keys and configuration data are accepted and ignored.
+ */
+bool get_io_path(plc_s *plc, slice_s conn_path, bool need_pad, tag_def_s **o_to_t_tag, tag_def_s **t_to_o_tag)
+{
+    size_t path_start = (need_pad ? 2 : 1);
+    size_t pos = path_start + (size_t)plc->path_len - 4;
+    size_t end = path_start + ((size_t)slice_get_uint8(conn_path, 0) * 2);
+    tag_def_s *points[2] = { NULL, NULL };
+    int num_points = 0;
+
+    if(!match_port_path(plc, conn_path, need_pad)) {
+        info("Class 1 connection path does not start with the path for this PLC!");
+        return false;
+    }
+
+    while(pos < end) {
+        uint8_t segment = (uint8_t)slice_get_uint8(conn_path, pos);
+        uint32_t point = 0;
+        tag_def_s *tag = NULL;
+        bool is_point = false;
+
+        switch(segment) {
+            case 0x20: /* class, must be the assembly. */
+                if(slice_get_uint8(conn_path, pos + 1) != 0x04) {
+                    info("Class 1 connections only support the assembly class!");
+                    return false;
+                }
+                pos += 2;
+                break;
+
+            case 0x24: /* configuration instance. */
+                pos += 2;
+                break;
+
+            case 0x25:
+                pos += 4;
+                break;
+
+            case 0x2C: /* connection point. */
+                point = slice_get_uint8(conn_path, pos + 1);
+                is_point = true;
+                pos += 2;
+                break;
+
+            case 0x2D:
+                point = slice_get_uint16_le(conn_path, (int)(pos + 2));
+                is_point = true;
+                pos += 4;
+                break;
+
+            case 0x34: /* electronic key. */
+                pos += 10;
+                break;
+
+            case 0x80: /* configuration data. */
+                pos += 2 + ((size_t)slice_get_uint8(conn_path, pos + 1) * 2);
+                break;
+
+            case CIP_SYMBOLIC_SEGMENT_MARKER: {
+                    size_t name_len = slice_get_uint8(conn_path, pos + 1);
+
+                    tag = tag_find(plc, slice_from_slice(conn_path, pos + 2, name_len));
+                    if(!tag) {
+                        info("Class 1 connection point %.*s is not a tag!", (int)name_len, (const char *)slice_get_bytes(conn_path, pos + 2));
+                        return false;
+                    }
+
+                    is_point = true;
+                    pos += 2 + name_len + (name_len & 0x01);
+                }
+                break;
+
+            default:
+                info("Unsupported segment %x in class 1 connection path!", segment);
+                return false;
+        }
+
+        if(is_point) {
+            if(num_points == 2) {
+                info("Class 1 connection paths have at most two connection points!");
+                return false;
+            }
+
+            /* numbered points that are not tags are heartbeats. */
+            if(!tag && point >= 1 && point <= plc->num_tags) {
+                tag = &plc->tag_defs[point - 1];
+            }
+
+            points[num_points] = tag;
+            num_points++;
+        }
+    }
+
+    if(pos != end || num_points == 0) {
+        info("Class 1 connection path has no connection point or runs past its end!");
+        return false;
+    }
+
+    *o_to_t_tag = (num_points == 2 ? points[0] : NULL);
+    *t_to_o_tag = points[num_points - 1];
+
+    return true;
+}
+
+
 /* Forward Close request. */
 typedef struct {
     uint8_t secs_per_tick;          /* seconds per tick */
@@ -245,8 +564,10 @@ typedef struct {
 #define CIP_FORWARD_CLOSE_MIN_SIZE   (16)
 
 
-slice_s handle_forward_close(slice_s input, slice_s output, plc_s *plc)
+slice_s handle_forward_close(slice_s input, slice_s output, session_s *session)
 {
+    plc_s *plc = session->plc;
+    conn_s *conn = NULL;
     slice_s conn_path;
     size_t offset = 0;
     uint8_t fc_cmd = slice_get_uint8(input, 0);
@@ -285,28 +606,23 @@ slice_s handle_forward_close(slice_s input, slice_s output, plc_s *plc)
     /* build the path to match. */
     conn_path = slice_from_slice(input, offset, slice_len(input));
 
-    if(!match_path(conn_path, ((offset & 0x01) ? false : true), plc->path, plc->path_len)) {
+    /* find the connection by the triad the client opened it with. */
+    conn = session_find_conn_by_serial(session, fc_req.client_connection_serial_number, fc_req.client_vendor_id, fc_req.client_serial_number);
+
+    /* class 1 connections are closed with their own path, only our port has to match. */
+    if(conn && conn->io ? !match_port_path(plc, conn_path, ((offset & 0x01) ? false : true))
+                        : !match_path(conn_path, ((offset & 0x01) ? false : true), plc->path, plc->path_len)) {
         info("path does not match stored path!");
         return make_cip_error(output, slice_get_uint8(input, 0) | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
     }
 
-    /* Check the values we got. */
-    if(plc->client_connection_serial_number != fc_req.client_connection_serial_number) {
-        /* FIXME - send back the right error. */
-        info("Forward close connection serial number, %x, did not match the connection serial number originally passed, %x!", fc_req.client_connection_serial_number, plc->client_connection_serial_number);
-        return make_cip_error(output, slice_get_uint8(input, 0) | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
-    }
-    if(plc->client_vendor_id != fc_req.client_vendor_id) {
-        /* FIXME - send back the right error. */
-        info("Forward close client vendor ID, %x, did not match the client vendor ID originally passed, %x!", fc_req.client_vendor_id, plc->client_vendor_id);
-        return make_cip_error(output, slice_get_uint8(input, 0) | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
-    }
-    if(plc->client_serial_number != fc_req.client_serial_number) {
-        /* FIXME - send back the right error. */
-        info("Forward close client serial number, %x, did not match the client serial number originally passed, %x!", fc_req.client_serial_number, plc->client_serial_number);
-        return make_cip_error(output, slice_get_uint8(input, 0) | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+    if(!conn) {
+        info("No connection found for connection serial number %x, vendor ID %x and client serial number %x!", fc_req.client_connection_serial_number, fc_req.client_vendor_id, fc_req.client_serial_number);
+        return make_cip_error(output, slice_get_uint8(input, 0) | CIP_DONE, CIP_ERR_CONN_FAILURE, true, CIP_ERR_EX_CONN_NOT_FOUND);
     }
 
+    session_remove_conn(session, conn);
+
     /* now process the FClose and respond. */
     offset = 0;
     slice_set_uint8(output, offset, slice_get_uint8(input, 0) | CIP_DONE); offset++;
@@ -314,9 +630,9 @@ slice_s handle_forward_close(slice_s input, slice_s output, plc_s *plc)
     slice_set_uint8(output, offset, 0); offset++; /* no error. */
     slice_set_uint8(output, offset, 0); offset++; /* no extra error fields. */
 
-    slice_set_uint16_le(output, offset, plc->client_connection_serial_number); offset += 2;
-    slice_set_uint16_le(output, offset, plc->client_vendor_id); offset += 2;
-    slice_set_uint32_le(output, offset, plc->client_serial_number); offset += 4;
+    slice_set_uint16_le(output, offset, fc_req.client_connection_serial_number); offset += 2;
+    slice_set_uint16_le(output, offset, fc_req.client_vendor_id); offset += 2;
+    slice_set_uint32_le(output, offset, fc_req.client_serial_number); offset += 4;
 
     /* not sure what these do... */
     slice_set_uint8(output, offset, 0); offset++;
@@ -328,25 +644,32 @@ slice_s handle_forward_close(slice_s input, slice_s output, plc_s *plc)
 
 /*
  * A read request comes in with a symbolic segment first, then zero to three numeric segments. 
+ *
+ * When zero_copy is set, the response ends with the tag data and large
+ * amounts are not copied into the output.  The tag is pinned and the data
+ * is sent from where it is, see session_send_tail().  Responses embedded
+ * in a Multiple Service Packet are always copied.
  */
 
 #define CIP_READ_MIN_SIZE (6)
 #define CIP_READ_FRAG_MIN_SIZE (10)
+#define CIP_READ_ZERO_COPY_MIN (256)
 
-slice_s handle_read_request(slice_s input, slice_s output, plc_s *plc)
+slice_s handle_read_request(slice_s input, slice_s output, session_s *session, bool zero_copy)
 {
+    plc_s *plc = session->plc;
     uint8_t read_cmd = slice_get_uint8(input, 0);  /*get the type. */
     uint8_t tag_segment_size = 0;
     uint8_t symbolic_marker = 0;
     uint8_t tag_name_size = 0;
     uint16_t element_count = 0;
     uint32_t byte_offset = 0;
-    size_t read_start_offset = 0;
     size_t offset = 0;
+    tag_ref_s ref;
     tag_def_s *tag = NULL;
-    size_t tag_data_length = 0;
     size_t total_request_size = 0;
     size_t remaining_size = 0;
+    size_t header_size = 0;
     size_t packet_capacity = 0;
     bool need_frag = false;
     size_t amount_to_copy = 0;
@@ -365,10 +688,12 @@ slice_s handle_read_request(slice_s input, slice_s output, plc_s *plc)
         return make_cip_error(output, read_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
     }
 
-    if(!process_tag_segment(plc, slice_from_slice(input, offset, tag_segment_size * 2), &tag, &read_start_offset)) {
+    if(!process_tag_segment(plc, slice_from_slice(input, offset, tag_segment_size * 2), &ref)) {
         return make_cip_error(output, read_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
     }
 
+    tag = ref.tag;
+
     /* step past the tag segment. */
     offset += (tag_segment_size * 2);
 
@@ -384,31 +709,36 @@ slice_s handle_read_request(slice_s input, slice_s output, plc_s *plc)
         return make_cip_error(output, read_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
     }
 
-    /* check the offset bounds. */
-    tag_data_length = tag->elem_count * tag->elem_size;
-
-    info("tag_data_length = %d", tag_data_length);
+    info("ref.length = %d", ref.length);
 
     /* get the amount requested. */
-    total_request_size = element_count * tag->elem_size;
+    total_request_size = element_count * (size_t)ref.elem_size;
 
     info("total_request_size = %d", total_request_size);
 
     /* check the amount */
-    if(read_start_offset + total_request_size > tag_data_length) {
+    if(total_request_size > ref.length) {
         info("request asks for too much data!");
         return make_cip_error(output, read_cmd | CIP_DONE, CIP_ERR_EXTENDED, true, CIP_ERR_EX_TOO_LONG);
     }
 
     /* check to make sure that the offset passed is within the bounds. */
-    if(read_start_offset + byte_offset > tag_data_length) {
+    if(byte_offset > total_request_size) {
         info("request offset is past the end of the tag!");
         return make_cip_error(output, read_cmd | CIP_DONE, CIP_ERR_EXTENDED, true, CIP_ERR_EX_TOO_LONG);
     }
 
+    /* CIP header plus the data type, which for a structure includes its handle. */
+    header_size = 4 + (ref.udt ? 4 : 2);
+
     /* do we need to fragment the result? */
+    if((size_t)slice_len(output) < header_size) {
+        info("No space left in the response for any data!");
+        return make_cip_error(output, read_cmd | CIP_DONE, CIP_ERR_REPLY_TOO_LARGE, false, 0);
+    }
+
     remaining_size = total_request_size - byte_offset;
-    packet_capacity = slice_len(output) - 6; /* MAGIC - CIP header plus data type bytes is 6 bytes. */
+    packet_capacity = (size_t)slice_len(output) - header_size;
 
     info("packet_capacity = %d", packet_capacity);
 
@@ -427,23 +757,53 @@ slice_s handle_read_request(slice_s input, slice_s output, plc_s *plc)
     slice_set_uint8(output, offset, (need_frag ? CIP_ERR_FRAG : CIP_OK)); offset++; /* no error. */
     slice_set_uint8(output, offset, 0); offset++; /* no extra error fields. */
 
-    /* copy the data type. */
-    slice_set_uint16_le(output, offset, tag->tag_type); offset += 2;
+    /* copy the data type.  A structure is sent with its handle. */
+    slice_set_uint16_le(output, offset, ref.tag_type); offset += 2;
+    if(ref.udt) {
+        slice_set_uint16_le(output, offset, ref.udt->handle); offset += 2;
+    }
 
-    /* how much data to copy? */
-    amount_to_copy = (remaining_size < packet_capacity ? remaining_size : packet_capacity);
-    if(amount_to_copy > 8) {
-        /* align to 8-byte chunks */
-        amount_to_copy &= 0xFFFFC;
+    /*
+     * how much data to copy?  Everything left if it fits, otherwise whole
+     * elements so that none is split across fragments.  An element bigger
+     * than the packet is sent in 4-byte chunks.
+     */
+    if(need_frag) {
+        amount_to_copy = packet_capacity;
+
+        if(ref.elem_size > 0 && amount_to_copy >= (size_t)ref.elem_size) {
+            amount_to_copy -= amount_to_copy % (size_t)ref.elem_size;
+        } else {
+            amount_to_copy &= ~(size_t)3;
+        }
+    } else {
+        amount_to_copy = remaining_size;
     }
 
     info("amount_to_copy = %d", amount_to_copy);
     info("copy start location = %d", offset);
     info("output space = %d", slice_len(output) - offset);
 
-    /* FIXME - use memcpy */
-    for(size_t i=0; i < amount_to_copy; i++) {
-        slice_set_uint8(output, offset + i, tag->data[byte_offset + i]);
+    if(!slice_range_in_bounds(output, offset, amount_to_copy)) {
+        info("Response does not have room for %d bytes of data!", (int)amount_to_copy);
+        return make_cip_error(output, read_cmd | CIP_DONE, CIP_ERR_REPLY_TOO_LARGE, false, 0);
+    }
+
+    if(zero_copy && amount_to_copy >= CIP_READ_ZERO_COPY_MIN) {
+        tag_pin_data(tag);
+
+        session->tail.tag = tag;
+        session->tail.offset = ref.offset + byte_offset;
+        session->tail.len = amount_to_copy;
+
+        return slice_from_slice(output, 0, offset);
+    }
+
+    tag_read_data(tag, ref.offset + byte_offset, output.data + offset, amount_to_copy);
+
+    /* a BOOL member is one bit of the byte we just copied. */
+    if(ref.bit >= 0 && amount_to_copy == 1) {
+        output.data[offset] = (uint8_t)((output.data[offset] >> ref.bit) & 0x01);
     }
 
     offset += amount_to_copy;
@@ -457,18 +817,18 @@ slice_s handle_read_request(slice_s input, slice_s output, plc_s *plc)
 #define CIP_WRITE_MIN_SIZE (6)
 #define CIP_WRITE_FRAG_MIN_SIZE (10)
 
-slice_s handle_write_request(slice_s input, slice_s output, plc_s *plc)
+slice_s handle_write_request(slice_s input, slice_s output, session_s *session)
 {
+    plc_s *plc = session->plc;
     uint8_t write_cmd = slice_get_uint8(input, 0);  /*get the type. */
     uint8_t tag_segment_size = 0;
     uint8_t symbolic_marker = 0;
     uint8_t tag_name_size = 0;
     uint16_t element_count = 0;
     uint32_t byte_offset = 0;
-    size_t write_start_offset = 0;
     size_t offset = 0;
+    tag_ref_s ref;
     tag_def_s *tag = NULL;
-    size_t tag_data_length = 0;
     size_t total_request_size = 0;
     size_t remaining_size = 0;
     size_t packet_capacity = 0;
@@ -491,27 +851,38 @@ slice_s handle_write_request(slice_s input, slice_s output, plc_s *plc)
         return make_cip_error(output, write_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
     }
 
-    if(!process_tag_segment(plc, slice_from_slice(input, offset, tag_segment_size * 2), &tag, &write_start_offset)) {
+    if(!process_tag_segment(plc, slice_from_slice(input, offset, tag_segment_size * 2), &ref)) {
         return make_cip_error(output, write_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
     }
 
+    tag = ref.tag;
+
     /* step past the tag segment. */
     offset += (tag_segment_size * 2);
 
     /* get the tag data type and compare. */
     write_data_type = slice_get_uint16_le(input, offset); offset += 2;
 
-    /* check that the data types match. */
-    if(tag->tag_type != write_data_type) {
-        info("tag data type %02x does not match the data type in the write request %02x", tag->tag_type, write_data_type);
+    /* check that the data types match.  Structures must also have the same handle. */
+    if(ref.tag_type != write_data_type) {
+        info("tag data type %02x does not match the data type in the write request %02x", ref.tag_type, write_data_type);
         return make_cip_error(output, write_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
     }
 
+    if(ref.udt) {
+        uint16_t handle = slice_get_uint16_le(input, offset); offset += 2;
+
+        if(handle != ref.udt->handle) {
+            info("structure handle %04x does not match the handle in the write request %04x", ref.udt->handle, handle);
+            return make_cip_error(output, write_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+        }
+    }
+
     /* get the number of elements to write. */
     write_element_count = slice_get_uint16_le(input, offset); offset += 2;
 
     /* check the number of elements */
-    if(write_element_count > tag->elem_count) {
+    if((size_t)write_element_count * (size_t)ref.elem_size > ref.length) {
         info("request tries to write too many elements!");
         return make_cip_error(output, write_cmd | CIP_DONE, CIP_ERR_EXTENDED, true, CIP_ERR_EX_TOO_LONG);
     }
@@ -522,10 +893,7 @@ slice_s handle_write_request(slice_s input, slice_s output, plc_s *plc)
 
     info("byte_offset = %d", byte_offset);
 
-    /* check the offset bounds. */
-    tag_data_length = tag->elem_count * tag->elem_size;
-
-    info("tag_data_length = %d", tag_data_length);
+    info("ref.length = %d", ref.length);
 
     /* get the write amount requested. */
     total_request_size = slice_len(input) - offset;
@@ -533,7 +901,7 @@ slice_s handle_write_request(slice_s input, slice_s output, plc_s *plc)
     info("total_request_size = %d", total_request_size);
 
     /* check the amount */
-    if(byte_offset + total_request_size > tag_data_length) {
+    if(byte_offset + total_request_size > ref.length) {
         info("request tries to write too much data!");
         return make_cip_error(output, write_cmd | CIP_DONE, CIP_ERR_EXTENDED, true, CIP_ERR_EX_TOO_LONG);
     }
@@ -542,7 +910,39 @@ slice_s handle_write_request(slice_s input, slice_s output, plc_s *plc)
     info("byte_offset = %d", byte_offset);
     info("offset = %d", offset);
     info("total_request_size = %d", total_request_size);
-    memcpy(&tag->data[byte_offset], slice_get_bytes(input, offset), total_request_size);
+    if(!slice_range_in_bounds(input, offset, total_request_size)) {
+        info("Request does not contain %d bytes of data!", (int)total_request_size);
+        return make_cip_error(output, write_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+    }
+
+    if(ref.bit >= 0) {
+        /* a BOOL member shares its byte with others, so only its bit changes. */
+        uint8_t data = 0;
+
+        if(write_element_count != 1 || total_request_size != 1) {
+            info("BOOL members are written one at a time!");
+            return make_cip_error(output, write_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+        }
+
+        tag_write_begin(tag);
+
+        data = tag->data[ref.offset];
+        if(input.data[offset]) {
+            data = (uint8_t)(data | (1 << ref.bit));
+        } else {
+            data = (uint8_t)(data & ~(1 << ref.bit));
+        }
+        tag_store_data(tag, ref.offset, &data, 1);
+
+        tag_write_end(tag);
+    } else if(write_cmd == CIP_WRITE_FRAG[0]) {
+        if(!stage_write_fragment(session, tag, ref.offset, (size_t)write_element_count * (size_t)ref.elem_size,
+                                 byte_offset, input.data + offset, total_request_size)) {
+            return make_cip_error(output, write_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+        }
+    } else {
+        tag_write_data(tag, ref.offset, input.data + offset, total_request_size);
+    }
 
     /* start making the response. */
     offset = 0;
@@ -558,22 +958,511 @@ slice_s handle_write_request(slice_s input, slice_s output, plc_s *plc)
 
 
 
+/*
+ * Gather one fragment of a fragmented write.  The fragments must come in
+ * order.  The whole range is written to the tag when the last one arrives
+ * so that readers see either the old values or all of the new ones.
+ */
+bool stage_write_fragment(session_s *session, tag_def_s *tag, size_t start_offset, size_t total_size, size_t byte_offset, const uint8_t *data, size_t len)
+{
+    frag_write_s *frag = &session->frag_write;
+
+    if(start_offset + total_size > (size_t)tag->elem_count * (size_t)tag->elem_size || byte_offset + len > total_size) {
+        info("Write fragment at offset %d does not fit in the %d bytes of the write!", (int)byte_offset, (int)total_size);
+        frag->tag = NULL;
+        return false;
+    }
+
+    /* the first fragment starts a new write and drops any unfinished one. */
+    if(byte_offset == 0) {
+        if(len == total_size) {
+            tag_write_data(tag, start_offset, data, len);
+            frag->tag = NULL;
+            return true;
+        }
+
+        if(frag->capacity < total_size) {
+            uint8_t *new_data = realloc(frag->data, total_size);
+
+            if(!new_data) {
+                warning("Unable to allocate %d bytes for a fragmented write!", (int)total_size);
+                frag->tag = NULL;
+                return false;
+            }
+
+            frag->data = new_data;
+            frag->capacity = total_size;
+        }
+
+        frag->tag = tag;
+        frag->start_offset = start_offset;
+        frag->total_size = total_size;
+        frag->received = 0;
+    } else if(frag->tag != tag || frag->start_offset != start_offset || frag->total_size != total_size || frag->received != byte_offset) {
+        info("Write fragment at offset %d does not continue the write in progress!", (int)byte_offset);
+        frag->tag = NULL;
+        return false;
+    }
+
+    memcpy(frag->data + byte_offset, data, len);
+    frag->received += len;
+
+    if(frag->received == frag->total_size) {
+        tag_write_data(tag, frag->start_offset, frag->data, frag->total_size);
+        frag->tag = NULL;
+    }
+
+    return true;
+}
+
+
+
+
+/*
+ * Read-Modify-Write sets and clears bits in one element of an integer tag.
+ * The request has the tag path, the mask size in bytes and then the OR
+ * mask and the AND mask.  The new value is (old | OR) & AND.  The tag's
+ * write lock is held across the read and the write, so no other client
+ * can see or change the element in between.
+ */
+
+#define CIP_RMW_MIN_SIZE (6)
+
+slice_s handle_rmw_request(slice_s input, slice_s output, session_s *session)
+{
+    plc_s *plc = session->plc;
+    uint8_t rmw_cmd = slice_get_uint8(input, 0);
+    uint8_t tag_segment_size = 0;
+    size_t offset = 0;
+    tag_ref_s ref;
+    tag_def_s *tag = NULL;
+    uint16_t mask_size = 0;
+    slice_s or_mask;
+    slice_s and_mask;
+
+    if(slice_len(input) < CIP_RMW_MIN_SIZE) {
+        info("Insufficient data in the CIP read-modify-write request!");
+        return make_cip_error(output, rmw_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+    }
+
+    offset = 1;
+    tag_segment_size = slice_get_uint8(input, offset); offset++;
+
+    if(!process_tag_segment(plc, slice_from_slice(input, offset, tag_segment_size * 2), &ref)) {
+        return make_cip_error(output, rmw_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+    }
+
+    tag = ref.tag;
+
+    /* step past the tag segment. */
+    offset += (tag_segment_size * 2);
+
+    /* only integer types, and the words of BOOL arrays, have bits to twiddle. */
+    if((ref.tag_type < TAG_TYPE_SINT || ref.tag_type > TAG_TYPE_ULINT) && ref.tag_type != TAG_TYPE_BOOL_ARRAY) {
+        info("Tag %s with type %x does not support read-modify-write!", tag->name, ref.tag_type);
+        return make_cip_error(output, rmw_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+    }
+
+    mask_size = slice_get_uint16_le(input, offset); offset += 2;
+
+    if(mask_size == 0 || mask_size > (uint16_t)ref.elem_size) {
+        info("Mask size %u is not valid for tag %s with element size %d!", mask_size, tag->name, ref.elem_size);
+        return make_cip_error(output, rmw_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+    }
+
+    /* double check the size of the request. */
+    if(offset + (2 * (size_t)mask_size) != (size_t)slice_len(input)) {
+        info("Request size does not match CIP read-modify-write request size!");
+        return make_cip_error(output, rmw_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+    }
+
+    or_mask = slice_from_slice(input, offset, mask_size);
+    and_mask = slice_from_slice(input, offset + mask_size, mask_size);
+
+    /* masks are little endian, like the data, so this works a byte at a time for every width. */
+    tag_write_begin(tag);
+
+    for(size_t i=0; i < mask_size; i++) {
+        uint8_t data = tag->data[ref.offset + i];
+
+        data = (uint8_t)((data | or_mask.data[i]) & and_mask.data[i]);
+        tag_store_data(tag, ref.offset + i, &data, 1);
+    }
+
+    tag_write_end(tag);
+
+    /* start making the response. */
+    offset = 0;
+    slice_set_uint8(output, offset, rmw_cmd | CIP_DONE); offset++;
+    slice_set_uint8(output, offset, 0); offset++; /* padding/reserved. */
+    slice_set_uint8(output, offset, CIP_OK); offset++; /* no error. */
+    slice_set_uint8(output, offset, 0); offset++; /* no extra error fields. */
+
+    return slice_from_slice(output, 0, offset);
+}
+
+
+
+
+/*
+ * Get Instance Attribute List on the symbol object lists the tags.  The
+ * path is the symbol class, 0x6B, and the instance to start from.  Then
+ * comes the list of attributes wanted for each tag.  The response is as
+ * many whole entries as fit, with status 0x06 if there are more.  The
+ * client asks again starting after the last instance it got.
+ */
+
+#define CIP_SYMBOL_CLASS ((uint8_t)0x6B)
+#define CIP_LIST_TAGS_MIN_SIZE (8)
+
+slice_s handle_list_tags_request(slice_s input, slice_s output, session_s *session)
+{
+    plc_s *plc = session->plc;
+    uint8_t list_cmd = slice_get_uint8(input, 0);
+    uint8_t path_size = 0;
+    slice_s path;
+    uint32_t start_instance = 0;
+    size_t offset = 0;
+    uint16_t num_attribs = 0;
+    uint16_t attribs[TAG_LIST_MAX_ATTRIBS];
+    tag_list_cache_s *cache = NULL;
+    size_t first = 0;
+    size_t last = 0;
+    size_t capacity = 0;
+    size_t amount = 0;
+
+    if(slice_len(input) < CIP_LIST_TAGS_MIN_SIZE) {
+        info("Insufficient data in the CIP list tags request!");
+        return make_cip_error(output, list_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+    }
+
+    path_size = slice_get_uint8(input, 1);
+    path = slice_from_slice(input, 2, (size_t)path_size * 2);
+    offset = 2 + ((size_t)path_size * 2);
+
+    /* program tags would have a symbolic segment first, we only have controller tags. */
+    if(slice_get_uint8(path, 0) != 0x20 || slice_get_uint8(path, 1) != CIP_SYMBOL_CLASS) {
+        info("List tags request is not for the controller symbol class!");
+        return make_cip_error(output, list_cmd | CIP_DONE, CIP_ERR_PATH_DEST_UNKNOWN, false, 0);
+    }
+
+    if(!get_instance_segment(slice_from_slice(path, 2, slice_len(path)), &start_instance)) {
+        info("Unexpected instance segment type %x in list tags request!", slice_get_uint8(path, 2));
+        return make_cip_error(output, list_cmd | CIP_DONE, CIP_ERR_PATH_DEST_UNKNOWN, false, 0);
+    }
+
+    num_attribs = slice_get_uint16_le(input, offset); offset += 2;
+
+    if(num_attribs == 0 || num_attribs > TAG_LIST_MAX_ATTRIBS || offset + (2 * (size_t)num_attribs) != (size_t)slice_len(input)) {
+        info("List tags request has a bad attribute list!");
+        return make_cip_error(output, list_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+    }
+
+    for(uint16_t i=0; i < num_attribs; i++) {
+        attribs[i] = slice_get_uint16_le(input, offset); offset += 2;
+    }
+
+    cache = tag_list_cache_get(plc, attribs, num_attribs);
+    if(!cache) {
+        return make_cip_error(output, list_cmd | CIP_DONE, CIP_ERR_ATTR_UNSUPPORTED, false, 0);
+    }
+
+    /* instances are numbered from 1 with no gaps. */
+    first = (start_instance > 0 ? (size_t)start_instance - 1 : 0);
+    if(first > plc->num_tags) {
+        first = plc->num_tags;
+    }
+
+    /* take as many whole entries as fit after the 4-byte CIP header. */
+    capacity = (slice_len(output) > 4 ? (size_t)slice_len(output) - 4 : 0);
+    last = first;
+    while(last < plc->num_tags && (cache->entry_offsets[last + 1] - cache->entry_offsets[first]) <= capacity) {
+        last++;
+    }
+
+    if(last == first && first < plc->num_tags) {
+        info("Tag listing entry for instance %d does not fit in the response!", (int)(first + 1));
+        return make_cip_error(output, list_cmd | CIP_DONE, CIP_ERR_REPLY_TOO_LARGE, false, 0);
+    }
+
+    amount = cache->entry_offsets[last] - cache->entry_offsets[first];
+
+    slice_set_uint8(output, 0, list_cmd | CIP_DONE);
+    slice_set_uint8(output, 1, 0); /* padding/reserved. */
+    slice_set_uint8(output, 2, (last < plc->num_tags ? CIP_ERR_FRAG : CIP_OK));
+    slice_set_uint8(output, 3, 0); /* no extra error fields. */
+    slice_set_bytes(output, 4, cache->entries + cache->entry_offsets[first], amount);
+
+    return slice_from_slice(output, 0, 4 + amount);
+}
+
+
+
+
+/*
+ * A Multiple Service Packet has a count of embedded requests followed by
+ * a table of offsets to each one.  The offsets are from the start of the
+ * count field.  The response has the same layout.  Each embedded request
+ * is handled by the normal handler, writing directly into the shared
+ * output buffer, so the embedded responses are limited by whatever space
+ * the earlier ones left in the negotiated packet size.
+ */
+
+#define CIP_MULTI_MIN_SIZE (sizeof(CIP_MULTI) + 2)
+#define CIP_MULTI_MIN_REPLY_SIZE (6)
+
+slice_s handle_multi_request(slice_s input, slice_s output, session_s *session)
+{
+    uint8_t multi_cmd = slice_get_uint8(input, 0);
+    slice_s requests;
+    slice_s responses;
+    uint16_t request_count = 0;
+    size_t table_size = 0;
+    size_t response_offset = 0;
+    bool any_failed = false;
+
+    if(slice_len(input) < (ssize_t)CIP_MULTI_MIN_SIZE) {
+        info("Insufficient data in the CIP multiple service request!");
+        return make_cip_error(output, multi_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+    }
+
+    /* everything after the path is relative to the count field. */
+    requests = slice_from_slice(input, sizeof(CIP_MULTI), slice_len(input) - sizeof(CIP_MULTI));
+    request_count = slice_get_uint16_le(requests, 0);
+    table_size = 2 + (2 * (size_t)request_count);
+
+    if(request_count == 0 || table_size > (size_t)slice_len(requests)) {
+        info("Multiple service request has a bad request count, %u!", request_count);
+        return make_cip_error(output, multi_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+    }
+
+    /* the response count and offset table go right after the 4-byte CIP response header. */
+    responses = slice_from_slice(output, 4, slice_len(output) - 4);
+    if((size_t)slice_len(responses) < table_size) {
+        info("Multiple service response table does not fit in the packet!");
+        return make_cip_error(output, multi_cmd | CIP_DONE, CIP_ERR_REPLY_TOO_LARGE, false, 0);
+    }
+
+    slice_set_uint16_le(responses, 0, request_count);
+    response_offset = table_size;
+
+    for(uint16_t i=0; i < request_count; i++) {
+        size_t req_start = slice_get_uint16_le(requests, 2 + (2 * i));
+        size_t req_end = (i + 1 < request_count) ? slice_get_uint16_le(requests, 2 + (2 * (i + 1))) : (size_t)slice_len(requests);
+        slice_s request;
+        slice_s response_space;
+        slice_s response;
+        uint8_t service;
+
+        if(req_start < table_size || req_end <= req_start || req_end > (size_t)slice_len(requests)) {
+            info("Multiple service request %u has bad offsets %d to %d!", i, (int)req_start, (int)req_end);
+            return make_cip_error(output, multi_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+        }
+
+        /* every embedded response needs room for the largest error reply, the header and two bytes of extended status. */
+        if(response_offset + CIP_MULTI_MIN_REPLY_SIZE > (size_t)slice_len(responses)) {
+            info("Multiple service response is too large for the packet at request %u!", i);
+            return make_cip_error(output, multi_cmd | CIP_DONE, CIP_ERR_REPLY_TOO_LARGE, false, 0);
+        }
+
+        request = slice_from_slice(requests, req_start, req_end - req_start);
+        response_space = slice_from_slice(responses, response_offset, slice_len(responses) - response_offset);
+        service = slice_get_uint8(request, 0);
+
+        /* only tag and template services can be embedded. */
+        if(is_template_request(request)) {
+            response = handle_template_request(request, response_space, session);
+        } else if(service == CIP_READ[0] || service == CIP_READ_FRAG[0]) {
+            response = handle_read_request(request, response_space, session, false);
+        } else if(service == CIP_WRITE[0] || service == CIP_WRITE_FRAG[0]) {
+            response = handle_write_request(request, response_space, session);
+        } else if(service == CIP_RMW[0] && !slice_match_bytes(request, CIP_FORWARD_CLOSE, sizeof(CIP_FORWARD_CLOSE))) {
+            response = handle_rmw_request(request, response_space, session);
+        } else {
+            info("Unsupported service %x in multiple service request!", service);
+            response = make_cip_error(response_space, service | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+        }
+
+        /* a reply that did not fit cannot be embedded at all. */
+        if(slice_get_uint8(response, 2) == CIP_ERR_REPLY_TOO_LARGE) {
+            info("Multiple service response is too large for the packet at request %u!", i);
+            return make_cip_error(output, multi_cmd | CIP_DONE, CIP_ERR_REPLY_TOO_LARGE, false, 0);
+        }
+
+        /* a partial read is not a failure, the client follows up with fragmented reads. */
+        if(slice_get_uint8(response, 2) != CIP_OK && slice_get_uint8(response, 2) != CIP_ERR_FRAG) {
+            any_failed = true;
+        }
+
+        slice_set_uint16_le(responses, 2 + (2 * i), (uint16_t)response_offset);
+        response_offset += (size_t)slice_len(response);
+    }
+
+    slice_set_uint8(output, 0, multi_cmd | CIP_DONE);
+    slice_set_uint8(output, 1, 0); /* padding/reserved. */
+    slice_set_uint8(output, 2, (any_failed ? CIP_ERR_EMBEDDED : CIP_OK));
+    slice_set_uint8(output, 3, 0); /* no extra error fields. */
+
+    return slice_from_slice(output, 0, 4 + response_offset);
+}
+
+
+
+
+/*
+ * The template object, class 0x6C, describes the structure types.  Get
+ * Attribute List returns the sizes a client needs to read a template and
+ * Read Template returns the template itself, with status 0x06 if it does
+ * not all fit.  Templates are encoded once at startup, see udt.h.
+ */
+
+#define CIP_TEMPLATE_CLASS ((uint8_t)0x6C)
+#define CIP_GET_ATTRIBUTE_LIST ((uint8_t)0x03)
+#define CIP_TEMPLATE_MAX_ATTRIBS (16)
+
+/* the service goes first, then the path, which must start with the class. */
+bool is_template_request(slice_s input)
+{
+    return slice_get_uint8(input, 2) == 0x20 && slice_get_uint8(input, 3) == CIP_TEMPLATE_CLASS;
+}
+
+
+slice_s handle_template_request(slice_s input, slice_s output, session_s *session)
+{
+    plc_s *plc = session->plc;
+    uint8_t template_cmd = slice_get_uint8(input, 0);
+    uint8_t path_size = slice_get_uint8(input, 1);
+    slice_s path = slice_from_slice(input, 2, (size_t)path_size * 2);
+    size_t offset = 2 + ((size_t)path_size * 2);
+    uint32_t instance = 0;
+    udt_def_s *udt = NULL;
+
+    if((size_t)slice_len(input) < offset || !get_instance_segment(slice_from_slice(path, 2, slice_len(path)), &instance)) {
+        info("Template request does not have an instance!");
+        return make_cip_error(output, template_cmd | CIP_DONE, CIP_ERR_PATH_DEST_UNKNOWN, false, 0);
+    }
+
+    udt = udt_find_instance(plc, instance);
+    if(!udt) {
+        info("No template instance %u!", instance);
+        return make_cip_error(output, template_cmd | CIP_DONE, CIP_ERR_PATH_DEST_UNKNOWN, false, 0);
+    }
+
+    if(template_cmd == CIP_GET_ATTRIBUTE_LIST) {
+        uint16_t num_attribs = slice_get_uint16_le(input, offset);
+        size_t out_offset = 6;
+
+        offset += 2;
+
+        if(num_attribs == 0 || num_attribs > CIP_TEMPLATE_MAX_ATTRIBS || offset + (2 * (size_t)num_attribs) != (size_t)slice_len(input)) {
+            info("Template attribute request has a bad attribute list!");
+            return make_cip_error(output, template_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+        }
+
+        /* each attribute is at most 8 bytes with its ID and status. */
+        if((size_t)slice_len(output) < out_offset + (8 * (size_t)num_attribs)) {
+            return make_cip_error(output, template_cmd | CIP_DONE, CIP_ERR_REPLY_TOO_LARGE, false, 0);
+        }
+
+        slice_set_uint16_le(output, 4, num_attribs);
+
+        for(uint16_t i=0; i < num_attribs; i++) {
+            uint16_t attrib = slice_get_uint16_le(input, offset + (2 * (size_t)i));
+
+            slice_set_uint16_le(output, out_offset, attrib);
+            slice_set_uint16_le(output, out_offset + 2, CIP_OK);
+            out_offset += 4;
+
+            switch(attrib) {
+                case 1: /* structure handle. */
+                    slice_set_uint16_le(output, out_offset, udt->handle); out_offset += 2;
+                    break;
+
+                case 2: /* member count. */
+                    slice_set_uint16_le(output, out_offset, (uint16_t)udt->num_members); out_offset += 2;
+                    break;
+
+                case 4: /* definition size in 32-bit words. */
+                    slice_set_uint32_le(output, out_offset, udt->template_words); out_offset += 4;
+                    break;
+
+                case 5: /* structure size in bytes. */
+                    slice_set_uint32_le(output, out_offset, udt->size); out_offset += 4;
+                    break;
+
+                default:
+                    slice_set_uint16_le(output, out_offset - 2, CIP_ERR_ATTR_UNSUPPORTED);
+                    break;
+            }
+        }
+
+        slice_set_uint8(output, 0, template_cmd | CIP_DONE);
+        slice_set_uint8(output, 1, 0); /* padding/reserved. */
+        slice_set_uint8(output, 2, CIP_OK);
+        slice_set_uint8(output, 3, 0); /* no extra error fields. */
+
+        return slice_from_slice(output, 0, out_offset);
+    } else if(template_cmd == CIP_READ[0]) {
+        uint32_t start = slice_get_uint32_le(input, offset);
+        uint16_t wanted = slice_get_uint16_le(input, offset + 4);
+        size_t remaining = 0;
+        size_t amount = 0;
+        size_t capacity = (slice_len(output) > 4 ? (size_t)slice_len(output) - 4 : 0);
+
+        if(offset + 6 != (size_t)slice_len(input)) {
+            info("Read template request has the wrong size!");
+            return make_cip_error(output, template_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+        }
+
+        if(start > udt->template_size) {
+            info("Read template request starts past the end of template %s!", udt->name);
+            return make_cip_error(output, template_cmd | CIP_DONE, CIP_ERR_EXTENDED, true, CIP_ERR_EX_TOO_LONG);
+        }
+
+        /* clients ask for the definition size less 23, which may be more than there is. */
+        remaining = udt->template_size - start;
+        amount = (wanted < remaining ? wanted : remaining);
+        if(amount > capacity) {
+            amount = capacity & ~(size_t)0x03;
+        }
+
+        slice_set_uint8(output, 0, template_cmd | CIP_DONE);
+        slice_set_uint8(output, 1, 0); /* padding/reserved. */
+        slice_set_uint8(output, 2, (start + amount < udt->template_size && amount < wanted ? CIP_ERR_FRAG : CIP_OK));
+        slice_set_uint8(output, 3, 0); /* no extra error fields. */
+        slice_set_bytes(output, 4, udt->template_data + start, amount);
+
+        return slice_from_slice(output, 0, 4 + amount);
+    }
+
+    info("Unsupported template service %x!", template_cmd);
+
+    return make_cip_error(output, template_cmd | CIP_DONE, CIP_ERR_UNSUPPORTED, false, 0);
+}
+
+
+
+
 /*
  * we should see:
- *  0x91 <name len> <name bytes> (<numeric segment>){0-3} 
+ *  0x91 <name len> <name bytes> (<numeric segment>){0-3} (0x91 <name len> <name bytes> (<numeric segment>)?)*
  *
  * find the tag name, then check the numeric segments, if any, against the
- * tag dimensions.
+ * tag dimensions.  Any further symbolic segments name members of the
+ * tag's structure type, each with an index if the member is an array.
  */
 
-bool process_tag_segment(plc_s *plc, slice_s input, tag_def_s **tag, size_t *start_read_offset)
+bool process_tag_segment(plc_s *plc, slice_s input, tag_ref_s *ref)
 {
     size_t offset = 0;
     uint8_t symbolic_marker = slice_get_uint8(input, offset); offset++;
     uint8_t name_len = 0;
     slice_s tag_name;
+    slice_s segments;
+    tag_def_s *tag = NULL;
     int dimensions[3] = { 0, 0, 0};
     size_t dimension_index = 0;
+    bool whole_array = false;
 
     if(symbolic_marker != CIP_SYMBOLIC_SEGMENT_MARKER)  {
         info("Expected symbolic segment but found %x!", symbolic_marker);
@@ -592,92 +1481,168 @@ bool process_tag_segment(plc_s *plc, slice_s input, tag_def_s **tag, size_t *sta
 
     /* try to find the tag. */
     tag_name = slice_from_slice(input, 2, name_len);
-    *tag = plc->tags;
+    tag = tag_find(plc, tag_name);
 
-    while(*tag) {
-        if(slice_match_string(tag_name, (*tag)->name)) {
-            info("Found tag %s", (*tag)->name);
-            break;
-        }
-
-        (*tag) = (*tag)->next_tag;
+    if(!tag) {
+        info("Tag %.*s not found!", slice_len(tag_name), (const char *)(tag_name.data));
+        return false;
     }
 
-    if(*tag) {
-        slice_s numeric_segments = slice_from_slice(input, offset, slice_len(input));
+    ref->tag = tag;
+    ref->offset = 0;
+    ref->length = (size_t)tag->elem_count * (size_t)tag->elem_size;
+    ref->tag_type = tag->tag_type;
+    ref->udt = tag->udt;
+    ref->elem_size = tag->elem_size;
+    ref->bit = -1;
+
+    segments = slice_from_slice(input, offset, slice_len(input));
 
-        dimension_index = 0;
+    info("Numeric segment(s):");
+    slice_dump(segments);
 
-        info("Numeric segment(s):");
-        slice_dump(numeric_segments);
+    while(slice_len(segments) > 0 && slice_get_uint8(segments, 0) != CIP_SYMBOLIC_SEGMENT_MARKER) {
+        if(dimension_index >= 3) {
+            info("More numeric segments than expected!   Remaining request:");
+            slice_dump(segments);
+            return false;
+        }
+
+        if(!get_numeric_segment(&segments, &dimensions[dimension_index])) {
+            return false;
+        }
+
+        dimension_index++;
+    }
+
+    /* calculate the element offset. */
+    if(dimension_index > 0) {
+        size_t element_offset = 0;
 
-        while(slice_len(numeric_segments) > 0) {
-            uint8_t segment_type = slice_get_uint8(numeric_segments, 0);
+        if(dimension_index != (size_t)tag->num_dimensions) {
+            info("Required %d numeric segments, but only found %d!", tag->num_dimensions, dimension_index);
+            return false;
+        }
 
-            if(dimension_index >= 3) {
-                info("More numeric segments than expected!   Remaining request:");
-                slice_dump(numeric_segments);
+        /* check in bounds. */
+        for(size_t i=0; i < dimension_index; i++) {
+            if(dimensions[i] < 0 || dimensions[i] >= tag->dimensions[i]) {
+                info("Dimension %d is out of bounds, must be 0 <= %d < %d", (int)i, dimensions[i], tag->dimensions[i]);
                 return false;
             }
+        }
 
-            switch(segment_type) {
-                case 0x28: /* single byte value. */
-                    dimensions[dimension_index] = (int)slice_get_uint8(numeric_segments, 1);
-                    dimension_index++;
-                    numeric_segments = slice_from_slice(numeric_segments, 2, slice_len(numeric_segments));
-                    break;
+        /* calculate the offset.  BOOL arrays are indexed by bit and read by the word. */
+        if(tag->tag_type == TAG_TYPE_BOOL_ARRAY) {
+            element_offset = (size_t)dimensions[0] / 32;
+        } else {
+            element_offset = (size_t)dimensions[0] * (size_t)(tag->dimensions[1] * tag->dimensions[2]) +
+                             (size_t)dimensions[1] * (size_t)tag->dimensions[2] +
+                             (size_t)dimensions[2];
+        }
 
-                case 0x29: /* two byte value */
-                    dimensions[dimension_index] = (int)slice_get_uint16_le(numeric_segments, 2);
-                    dimension_index++;
-                    numeric_segments = slice_from_slice(numeric_segments, 4, slice_len(numeric_segments));
-                    break;
+        ref->offset = (size_t)tag->elem_size * element_offset;
+        ref->length -= ref->offset;
+    } else {
+        whole_array = (tag->num_dimensions > 0);
+    }
 
-                case 0x2A: /* four byte value */
-                    dimensions[dimension_index] = (int)slice_get_uint32_le(numeric_segments, 2);
-                    dimension_index++;
-                    numeric_segments = slice_from_slice(numeric_segments, 6, slice_len(numeric_segments));
-                    break;
+    /* walk down through the members. */
+    while(slice_len(segments) > 0) {
+        udt_member_s *member = NULL;
+        slice_s member_name;
+        int index = 0;
+        size_t index_offset = 0;
 
-                default:
-                    info("Unexpected numeric segment marker %x!", segment_type);
-                    return false;
-                    break;
-            }
+        name_len = (uint8_t)slice_get_uint8(segments, 1);
+
+        if(slice_get_uint8(segments, 0) != CIP_SYMBOLIC_SEGMENT_MARKER || !slice_range_in_bounds(segments, 2, name_len)) {
+            info("Expected a member name after the numeric segments!");
+            return false;
+        }
+
+        member_name = slice_from_slice(segments, 2, name_len);
+        segments = slice_from_slice(segments, 2 + name_len + (name_len & 0x01), slice_len(segments));
+
+        if(!ref->udt || whole_array) {
+            info("Member %.*s must be in a single structure!", slice_len(member_name), (const char *)member_name.data);
+            return false;
+        }
+
+        member = udt_find_member(ref->udt, member_name);
+        if(!member) {
+            info("Type %s has no member %.*s!", ref->udt->name, slice_len(member_name), (const char *)member_name.data);
+            return false;
         }
 
-        /* calculate the element offset. */
-        if(dimension_index > 0) {
-            size_t element_offset = 0;
+        whole_array = (member->array_size > 0);
 
-            if(dimension_index != (*tag)->num_dimensions) {
-                info("Required %d numeric segments, but only found %d!", (*tag)->num_dimensions, dimension_index);
+        if(member->array_size > 0 && slice_len(segments) > 0 && slice_get_uint8(segments, 0) != CIP_SYMBOLIC_SEGMENT_MARKER) {
+            if(!get_numeric_segment(&segments, &index)) {
                 return false;
             }
 
-            /* check in bounds. */
-            for(size_t i=0; i < dimension_index; i++) {
-                if(dimensions[i] < 0 || dimensions[i] >= (*tag)->dimensions[i]) {
-                    info("Dimension %d is out of bounds, must be 0 <= %d < %d", (int)i, dimensions[i], (*tag)->dimensions[i]);
-                    return false;
-                }
+            if(index < 0 || index >= member->array_size) {
+                info("Index %d of member %s is out of bounds, must be 0 <= %d < %d", index, member->name, index, member->array_size);
+                return false;
             }
-            
-            /* calculate the offset. */
-            element_offset = dimensions[0] * ((*tag)->dimensions[1] * (*tag)->dimensions[2]) + 
-                             dimensions[1] * (*tag)->dimensions[2] +
-                             dimensions[2];
 
-            *start_read_offset = (*tag)->elem_size * element_offset;
-        } else {
-            *start_read_offset = 0;
+            index_offset = (size_t)member->elem_size * (size_t)(member->tag_type == TAG_TYPE_BOOL_ARRAY ? index / 32 : index);
+            whole_array = false;
         }
-    } else {
-        info("Tag %.*s not found!", slice_len(tag_name), (const char *)(tag_name.data));
-        return false;
+
+        ref->offset += member->offset + index_offset;
+        ref->length = (member->bit >= 0 ? 1 : (size_t)member->elem_size * (size_t)member->elem_count - index_offset);
+        ref->tag_type = member->tag_type;
+        ref->udt = member->udt;
+        ref->elem_size = member->elem_size;
+        ref->bit = member->bit;
     }
 
+    return true;
+}
+
 
+/* take one numeric segment off the front. */
+bool get_numeric_segment(slice_s *segments, int *value)
+{
+    uint8_t segment_type = (uint8_t)slice_get_uint8(*segments, 0);
+
+    switch(segment_type) {
+        case 0x28: /* single byte value. */
+            *value = (int)slice_get_uint8(*segments, 1);
+            *segments = slice_from_slice(*segments, 2, slice_len(*segments));
+            break;
+
+        case 0x29: /* two byte value */
+            *value = (int)slice_get_uint16_le(*segments, 2);
+            *segments = slice_from_slice(*segments, 4, slice_len(*segments));
+            break;
+
+        case 0x2A: /* four byte value */
+            *value = (int)slice_get_uint32_le(*segments, 2);
+            *segments = slice_from_slice(*segments, 6, slice_len(*segments));
+            break;
+
+        default:
+            info("Unexpected numeric segment marker %x!", segment_type);
+            return false;
+            break;
+    }
+
+    return true;
+}
+
+/* an 8, 16 or 32-bit instance segment at the start of the path. */
+bool get_instance_segment(slice_s path, uint32_t *instance)
+{
+    switch(slice_get_uint8(path, 0)) {
+        case 0x24: *instance = slice_get_uint8(path, 1); break;
+        case 0x25: *instance = slice_get_uint16_le(path, 2); break;
+        case 0x26: *instance = slice_get_uint32_le(path, 2); break;
+        default:
+            return false;
+    }
 
     return true;
 }
@@ -725,6 +1690,23 @@ bool match_path(slice_s input, bool need_pad, uint8_t *path, uint8_t path_len)
 
 
 
+/* the path starts with our port segment.  That is the PLC's path without the message router at the end. */
+bool match_port_path(plc_s *plc, slice_s input, bool need_pad)
+{
+    size_t port_len = (size_t)plc->path_len - 4;
+    size_t path_start = (need_pad ? 2 : 1);
+    size_t input_path_len = (size_t)slice_get_uint8(input, 0) * 2;
+
+    if(input_path_len < port_len || !slice_range_in_bounds(input, path_start, input_path_len)) {
+        info("path is too short to hold the port segment!");
+        return false;
+    }
+
+    return slice_match_bytes(slice_from_slice(input, path_start, port_len), plc->path, port_len);
+}
+
+
+
 slice_s make_cip_error(slice_s output, uint8_t cip_cmd, uint8_t cip_err, bool extend, uint16_t extended_error)
 {
     size_t result_size = 0;
@@ -20,7 +20,7 @@
 
 #pragma once
 
-#include "plc.h"
+#include "session.h"
 #include "slice.h"
 
-extern slice_s cip_dispatch_request(slice_s input, slice_s output, plc_s *context);
+extern slice_s cip_dispatch_request(slice_s input, slice_s output, session_s *session);
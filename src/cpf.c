@@ -40,7 +40,6 @@ typedef struct {
     uint16_t item_data_length;
 } cpf_uc_header_s;
 
-#define CPF_UCONN_HEADER_SIZE (16)
 
 typedef struct {
     uint32_t interface_handle;   
@@ -54,11 +53,10 @@ typedef struct {
     uint16_t conn_seq;
 } cpf_co_header_s;
 
-#define CPF_CONN_HEADER_SIZE (22)
 
 
 
-slice_s handle_cpf_unconnected(slice_s input, slice_s output, plc_s *plc)
+slice_s handle_cpf_unconnected(slice_s input, slice_s output, session_s *session)
 {
     slice_s result;
     cpf_uc_header_s header;
@@ -109,10 +107,10 @@ slice_s handle_cpf_unconnected(slice_s input, slice_s output, plc_s *plc)
         return slice_make_err(EIP_ERR_BAD_REQUEST);
     }
 
-    /* dispatch and handle the result. */
+    /* dispatch and handle the result.  Unconnected responses are limited to the PLC's unconnected packet size. */
     result = cip_dispatch_request(slice_from_slice(input, CPF_UCONN_HEADER_SIZE, slice_len(input) - CPF_UCONN_HEADER_SIZE),
-                                slice_from_slice(output, CPF_UCONN_HEADER_SIZE, slice_len(output) - CPF_UCONN_HEADER_SIZE),
-                                plc);
+                                slice_from_slice(output, CPF_UCONN_HEADER_SIZE, session->plc->server_to_client_max_packet),
+                                session);
 
     if(!slice_has_err(result)) {
         /* build outbound header. */
@@ -122,7 +120,7 @@ slice_s handle_cpf_unconnected(slice_s input, slice_s output, plc_s *plc)
         slice_set_uint16_le(output, 8, CPF_ITEM_NAI); /* connected address type. */
         slice_set_uint16_le(output, 10, 0); /* No connection ID. */
         slice_set_uint16_le(output, 12, CPF_ITEM_UDI); /* connected data type */
-        slice_set_uint16_le(output, 14, slice_len(result)); /* result from CIP processing downstream. */
+        slice_set_uint16_le(output, 14, slice_len(result) + session->tail.len); /* result from CIP processing downstream. */
 
         /* create a new slice with the CPF header and the response packet in it. */
         result = slice_from_slice(output, 0, slice_len(result) + CPF_UCONN_HEADER_SIZE);
@@ -136,10 +134,12 @@ slice_s handle_cpf_unconnected(slice_s input, slice_s output, plc_s *plc)
 
 
 
-slice_s handle_cpf_connected(slice_s input, slice_s output, plc_s *plc)
+slice_s handle_cpf_connected(slice_s input, slice_s output, session_s *session)
 {
     slice_s result;
     cpf_co_header_s header;
+    conn_s *conn = NULL;
+    uint32_t client_conn_id = 0;
 
     /* we must have some sort of payload. */
     if(slice_len(input) <= CPF_UCONN_HEADER_SIZE) {
@@ -176,11 +176,22 @@ slice_s handle_cpf_connected(slice_s input, slice_s output, plc_s *plc)
         return slice_make_err(EIP_ERR_BAD_REQUEST);
     }
 
-    if(header.conn_id != plc->server_connection_id) {
-        info("Expected connection ID %x but found connection ID %x!", plc->server_connection_id, header.conn_id);
+    conn = session_find_conn(session, header.conn_id);
+    if(!conn) {
+        info("No connection found for connection ID %x!", header.conn_id);
         return slice_make_err(EIP_ERR_BAD_REQUEST);
     }
 
+    /* a class 1 connection carries I/O data over UDP, never explicit messages. */
+    if(conn->io) {
+        info("Connection ID %x is a class 1 I/O connection and does not take explicit messages!", header.conn_id);
+        return slice_make_err(EIP_ERR_BAD_REQUEST);
+    }
+
+    if(session->timers) {
+        conn->last_activity_ms = timer_wheel_now(session->timers);
+    }
+
     if(header.item_data_type != CPF_ITEM_CDI) {
         info("Expected connected data item but found %x!", header.item_data_type);
         return slice_make_err(EIP_ERR_BAD_REQUEST);
@@ -191,23 +202,34 @@ slice_s handle_cpf_connected(slice_s input, slice_s output, plc_s *plc)
         return slice_make_err(EIP_ERR_BAD_REQUEST);
     }
 
+    /* the connection size covers the sequence number and the CIP request. */
+    if(header.item_data_length > conn->client_to_server_max_packet) {
+        info("CPF payload length, %d, is larger than the connection size, %d!", header.item_data_length, conn->client_to_server_max_packet);
+        return slice_make_err(EIP_ERR_BAD_REQUEST);
+    }
+
     /* do we care about the sequence ID?   Should check. */
-    plc->server_connection_seq = header.conn_seq;
+    conn->server_connection_seq = header.conn_seq;
+
+    /* a Forward Close sent over the connection itself frees it. */
+    client_conn_id = conn->client_connection_id;
 
-    /* dispatch and handle the result. */
+    /* dispatch and handle the result.  The response and its sequence number must fit in the size negotiated for this connection. */
     result = cip_dispatch_request(slice_from_slice(input, CPF_CONN_HEADER_SIZE, slice_len(input) - CPF_CONN_HEADER_SIZE),
-                                slice_from_slice(output, CPF_CONN_HEADER_SIZE, slice_len(output) - CPF_CONN_HEADER_SIZE),
-                                plc);
+                                slice_from_slice(output, CPF_CONN_HEADER_SIZE, conn->server_to_client_max_packet - 2),
+                                session);
 
     if(!slice_has_err(result)) {
         /* build outbound header. */
-        slice_set_uint16_le(output, 0, 2); /* two items. */
-        slice_set_uint16_le(output, 2, CPF_ITEM_CAI); /* connected address type. */
-        slice_set_uint16_le(output, 4, 4); /* connection ID is 4 bytes. */
-        slice_set_uint32_le(output, 6, plc->client_connection_id);
-        slice_set_uint16_le(output, 10, CPF_ITEM_CDI); /* connected data type */
-        slice_set_uint16_le(output, 12, slice_len(result) + 2); /* result from CIP processing downstream.  Plus 2 bytes for sequence number. */
-        slice_set_uint16_le(output, 14, plc->client_connection_seq);
+        slice_set_uint32_le(output, 0, header.interface_handle);
+        slice_set_uint16_le(output, 4, header.router_timeout);
+        slice_set_uint16_le(output, 6, 2); /* two items. */
+        slice_set_uint16_le(output, 8, CPF_ITEM_CAI); /* connected address type. */
+        slice_set_uint16_le(output, 10, 4); /* connection ID is 4 bytes. */
+        slice_set_uint32_le(output, 12, client_conn_id);
+        slice_set_uint16_le(output, 16, CPF_ITEM_CDI); /* connected data type */
+        slice_set_uint16_le(output, 18, slice_len(result) + session->tail.len + 2); /* result from CIP processing downstream.  Plus 2 bytes for sequence number. */
+        slice_set_uint16_le(output, 20, header.conn_seq);
 
         /* create a new slice with the CPF header and the response packet in it. */
         result = slice_from_slice(output, 0, slice_len(result) + CPF_CONN_HEADER_SIZE);
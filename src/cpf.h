@@ -20,8 +20,15 @@
 
 #pragma once
 
-#include "plc.h"
+#include "session.h"
 #include "slice.h"
 
-extern slice_s handle_cpf_unconnected(slice_s input, slice_s output, plc_s *plc);
-extern slice_s handle_cpf_connected(slice_s input, slice_s output, plc_s *plc);
+/* CPF header sizes, including the connection sequence number for connected data. */
+#define CPF_UCONN_HEADER_SIZE (16)
+#define CPF_CONN_HEADER_SIZE (22)
+
+/* the largest connection size whose replies, with the CPF header, fit in the 16-bit EIP length. */
+#define CPF_MAX_CONN_SIZE (65535 - CPF_CONN_HEADER_SIZE)
+
+extern slice_s handle_cpf_unconnected(slice_s input, slice_s output, session_s *session);
+extern slice_s handle_cpf_connected(slice_s input, slice_s output, session_s *session);
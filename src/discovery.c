@@ -0,0 +1,336 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/* sendmmsg(), recvmmsg() and struct in_pktinfo. */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "discovery.h"
+#include "eip.h"
+#include "plc.h"
+#include "slice.h"
+#include "socket.h"
+#include "utils.h"
+
+
+/* requests taken and replies sent per system call. */
+#define DISCOVERY_BATCH (32)
+
+/* discovery requests have no payload, anything much longer is not one. */
+#define DISCOVERY_REQUEST_SIZE (EIP_HEADER_SIZE + 64)
+
+/* room for the IP_PKTINFO that says which local address a request came to. */
+#define DISCOVERY_CONTROL_SIZE (CMSG_SPACE(sizeof(struct in_pktinfo)))
+
+/* one UDP socket per PLC. */
+typedef struct {
+    int sock;
+    plc_s *plc;
+    in_port_t port;     /* network byte order, reported in ListIdentity replies. */
+} discovery_port_s;
+
+/* everything for one batch is allocated once, with the thread. */
+typedef struct discovery_s {
+    int wake_fd;        /* written to when the thread must stop. */
+    pthread_t thread;
+    bool running;
+
+    discovery_port_s *ports;
+    size_t num_ports;
+
+    struct mmsghdr requests[DISCOVERY_BATCH];
+    struct mmsghdr replies[DISCOVERY_BATCH];
+    struct iovec request_iovs[DISCOVERY_BATCH];
+    struct iovec reply_iovs[DISCOVERY_BATCH];
+    struct sockaddr_in peers[DISCOVERY_BATCH];
+    uint8_t request_data[DISCOVERY_BATCH][DISCOVERY_REQUEST_SIZE];
+    uint8_t reply_data[DISCOVERY_BATCH][EIP_LIST_REPLY_MAX_SIZE];
+    uint8_t control[DISCOVERY_BATCH][DISCOVERY_CONTROL_SIZE] __attribute__((aligned(8)));
+} discovery_s;
+
+static bool open_port(discovery_port_s *port, plc_s *plc);
+static void *discovery_thread(void *discovery);
+static void answer_requests(discovery_s *discovery, discovery_port_s *port);
+static bool get_local_addr(struct msghdr *msg, in_port_t port, struct sockaddr_in *local_addr);
+
+
+bool discovery_start(plc_s *plcs, size_t num_plcs)
+{
+    discovery_s *discovery = calloc(1, sizeof(*discovery));
+
+    if(!discovery) {
+        error("Unable to allocate memory for the discovery thread!");
+    }
+
+    discovery->ports = calloc(num_plcs, sizeof(*discovery->ports));
+    if(!discovery->ports) {
+        error("Unable to allocate memory for the discovery ports!");
+    }
+
+    for(size_t i=0; i < num_plcs; i++) {
+        if(open_port(&discovery->ports[discovery->num_ports], &plcs[i])) {
+            discovery->num_ports++;
+        }
+    }
+
+    if(discovery->num_ports == 0) {
+        free(discovery->ports);
+        free(discovery);
+        return false;
+    }
+
+    discovery->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if(discovery->wake_fd < 0) {
+        error("Unable to set up the discovery thread!");
+    }
+
+    discovery->running = true;
+
+    for(size_t i=0; i < discovery->num_ports; i++) {
+        discovery->ports[i].plc->discovery = discovery;
+    }
+
+    if(pthread_create(&discovery->thread, NULL, discovery_thread, discovery) != 0) {
+        error("Unable to start the discovery thread!");
+    }
+
+    return true;
+}
+
+
+void discovery_stop(plc_s *plcs, size_t num_plcs)
+{
+    discovery_s *discovery = NULL;
+    uint64_t count = 1;
+
+    for(size_t i=0; i < num_plcs && !discovery; i++) {
+        discovery = plcs[i].discovery;
+    }
+
+    if(!discovery) {
+        return;
+    }
+
+    __atomic_store_n(&discovery->running, false, __ATOMIC_RELAXED);
+    if(write(discovery->wake_fd, &count, sizeof(count)) < 0) {
+        warning("unable to wake the discovery thread, errno=%d!", errno);
+    }
+
+    pthread_join(discovery->thread, NULL);
+
+    for(size_t i=0; i < discovery->num_ports; i++) {
+        socket_close(discovery->ports[i].sock);
+    }
+
+    close(discovery->wake_fd);
+    free(discovery->ports);
+    free(discovery);
+
+    for(size_t i=0; i < num_plcs; i++) {
+        plcs[i].discovery = NULL;
+    }
+}
+
+
+/* open the UDP port on the PLC's listen address. */
+bool open_port(discovery_port_s *port, plc_s *plc)
+{
+    struct sockaddr_in bound_addr;
+    socklen_t addr_len = sizeof(bound_addr);
+    int sock_opt = 1;
+
+    port->sock = socket_open_udp(plc->listen_host, plc->listen_port);
+    if(port->sock < 0) {
+        fprintf(stderr, "Unable to open UDP port %s:%s, discovery is only answered over TCP there.\n",
+                plc->listen_host, plc->listen_port);
+        return false;
+    }
+
+    /* replies say, and come from, the address each request was sent to. */
+    if(setsockopt(port->sock, IPPROTO_IP, IP_PKTINFO, &sock_opt, sizeof(sock_opt)) != 0 ||
+       getsockname(port->sock, (struct sockaddr *)&bound_addr, &addr_len) != 0) {
+        fprintf(stderr, "Unable to set up UDP port %s:%s (errno=%d), discovery is only answered over TCP there.\n",
+                plc->listen_host, plc->listen_port, errno);
+        socket_close(port->sock);
+        port->sock = -1;
+        return false;
+    }
+
+    port->port = bound_addr.sin_port;
+    port->plc = plc;
+
+    return true;
+}
+
+
+void *discovery_thread(void *discovery_arg)
+{
+    discovery_s *discovery = (discovery_s *)discovery_arg;
+    size_t num_fds = discovery->num_ports + 1;
+    struct pollfd *fds = calloc(num_fds, sizeof(*fds));
+
+    if(!fds) {
+        error("Unable to allocate memory for the discovery thread!");
+    }
+
+    for(size_t i=0; i < discovery->num_ports; i++) {
+        fds[i].fd = discovery->ports[i].sock;
+        fds[i].events = POLLIN;
+    }
+
+    fds[discovery->num_ports].fd = discovery->wake_fd;
+    fds[discovery->num_ports].events = POLLIN;
+
+    while(__atomic_load_n(&discovery->running, __ATOMIC_RELAXED)) {
+        if(poll(fds, (nfds_t)num_fds, -1) <= 0) {
+            continue;
+        }
+
+        for(size_t i=0; i < discovery->num_ports; i++) {
+            if(fds[i].revents & POLLIN) {
+                answer_requests(discovery, &discovery->ports[i]);
+            }
+        }
+    }
+
+    free(fds);
+
+    return NULL;
+}
+
+
+/*
+ * Take a batch of requests and send the replies to them in one go.  Each
+ * reply goes out with the request's IP_PKTINFO as its own, so it comes
+ * from the address the request was sent to.
+ */
+void answer_requests(discovery_s *discovery, discovery_port_s *port)
+{
+    int rc = 0;
+
+    do {
+        int num_replies = 0;
+        int sent = 0;
+
+        for(int i=0; i < DISCOVERY_BATCH; i++) {
+            struct msghdr *msg = &discovery->requests[i].msg_hdr;
+
+            discovery->request_iovs[i].iov_base = discovery->request_data[i];
+            discovery->request_iovs[i].iov_len = DISCOVERY_REQUEST_SIZE;
+
+            memset(msg, 0, sizeof(*msg));
+            msg->msg_name = &discovery->peers[i];
+            msg->msg_namelen = sizeof(discovery->peers[i]);
+            msg->msg_iov = &discovery->request_iovs[i];
+            msg->msg_iovlen = 1;
+            msg->msg_control = discovery->control[i];
+            msg->msg_controllen = DISCOVERY_CONTROL_SIZE;
+        }
+
+        rc = recvmmsg(port->sock, discovery->requests, DISCOVERY_BATCH, MSG_DONTWAIT, NULL);
+        if(rc <= 0) {
+            break;
+        }
+
+        for(int i=0; i < rc; i++) {
+            struct msghdr *msg = &discovery->requests[i].msg_hdr;
+            struct msghdr *reply_msg = &discovery->replies[num_replies].msg_hdr;
+            struct sockaddr_in local_addr;
+            slice_s request = slice_make(discovery->request_data[i], (ssize_t)discovery->requests[i].msg_len);
+            slice_s reply;
+
+            if((msg->msg_flags & MSG_TRUNC) || !eip_is_list_request(request)) {
+                info("Dropping a UDP packet that is not a discovery request.");
+                continue;
+            }
+
+            reply = eip_dispatch_list_request(request, slice_make(discovery->reply_data[num_replies], EIP_LIST_REPLY_MAX_SIZE),
+                                              port->plc, (get_local_addr(msg, port->port, &local_addr) ? &local_addr : NULL));
+            if(slice_has_err(reply)) {
+                continue;
+            }
+
+            discovery->reply_iovs[num_replies].iov_base = reply.data;
+            discovery->reply_iovs[num_replies].iov_len = (size_t)slice_len(reply);
+
+            memset(reply_msg, 0, sizeof(*reply_msg));
+            reply_msg->msg_name = msg->msg_name;
+            reply_msg->msg_namelen = msg->msg_namelen;
+            reply_msg->msg_iov = &discovery->reply_iovs[num_replies];
+            reply_msg->msg_iovlen = 1;
+            reply_msg->msg_control = msg->msg_control;
+            reply_msg->msg_controllen = msg->msg_controllen;
+
+            num_replies++;
+        }
+
+        while(sent < num_replies) {
+            int sent_now = sendmmsg(port->sock, discovery->replies + sent, (unsigned int)(num_replies - sent), 0);
+
+            if(sent_now < 0) {
+                if(errno == EINTR) {
+                    continue;
+                }
+
+                /* like a busy device, drop what does not fit. */
+                warning("dropped %d discovery replies, errno=%d!", num_replies - sent, errno);
+                break;
+            }
+
+            sent += sent_now;
+        }
+    } while(rc == DISCOVERY_BATCH);
+}
+
+
+/* the local address from the request's IP_PKTINFO, which is then set up to be the source of the reply. */
+bool get_local_addr(struct msghdr *msg, in_port_t port, struct sockaddr_in *local_addr)
+{
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if(cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO) {
+            struct in_pktinfo *pktinfo = (struct in_pktinfo *)CMSG_DATA(cmsg);
+
+            memset(local_addr, 0, sizeof(*local_addr));
+            local_addr->sin_family = AF_INET;
+            local_addr->sin_port = port;
+            local_addr->sin_addr = pktinfo->ipi_spec_dst;
+
+            /* route the reply by its source address rather than the interface it came in on. */
+            pktinfo->ipi_ifindex = 0;
+
+            return true;
+        }
+    }
+
+    /* without it, let the kernel pick the source. */
+    msg->msg_controllen = 0;
+
+    return false;
+}
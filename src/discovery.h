@@ -0,0 +1,40 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "plc.h"
+
+/*
+ * EtherNet/IP discovery over UDP.  Scanners send ListIdentity, often as
+ * a broadcast, and ListServices or ListInterfaces to UDP port 44818.  One
+ * thread answers them for all the PLCs, in batches from the replies eip.c
+ * encoded at startup, so a sweep costs no allocations and a few system
+ * calls per batch.  Other commands are dropped, as on a real device.
+ */
+
+/*
+ * Open a UDP port on each PLC's listen address and start answering.  A
+ * PLC whose port cannot be bound only answers discovery over TCP.
+ */
+extern bool discovery_start(plc_s *plcs, size_t num_plcs);
+extern void discovery_stop(plc_s *plcs, size_t num_plcs);
@@ -18,9 +18,13 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
 #include "cpf.h"
 #include "eip.h"
+#include "plc.h"
 #include "slice.h"
 #include "tcp_server.h"
 #include "utils.h"
@@ -32,11 +36,46 @@
 #define EIP_UNCONNECTED_SEND     ((uint16_t)0x006F)
 #define EIP_CONNECTED_SEND       ((uint16_t)0x0070)
 
+/* discovery, answered without a session. */
+#define EIP_LIST_SERVICES        ((uint16_t)0x0004)
+#define EIP_LIST_IDENTITY        ((uint16_t)0x0063)
+#define EIP_LIST_INTERFACES      ((uint16_t)0x0064)
+
+/* the identity item, and where each reply puts the big-endian port and address it was asked on. */
+#define EIP_ITEM_IDENTITY        ((uint16_t)0x000C)
+#define EIP_IDENTITY_PORT_OFFSET (10)
+#define EIP_IDENTITY_ADDR_OFFSET (12)
+#define EIP_IDENTITY_STATUS      ((uint16_t)0x0030)    /* no I/O connections yet, not faulted. */
+#define EIP_IDENTITY_STATE       ((uint8_t)0x03)       /* operational. */
+
 /* supported EIP version */
 #define EIP_VERSION     ((uint16_t)1)
 
 
 
+/* typical values of the controllers we simulate. */
+typedef struct {
+    uint16_t vendor_id;
+    uint16_t device_type;
+    uint16_t product_code;
+    uint8_t major_revision;
+    uint8_t minor_revision;
+    const char *product_name;
+} identity_s;
+
+static const identity_s CONTROL_LOGIX_IDENTITY = { 0x0001, 0x000E, 0x00A6, 32, 11, "1756-L83E/B" };
+static const identity_s MICRO800_IDENTITY = { 0x0001, 0x000E, 0x00BE, 12, 11, "2080-LC30-48QWB" };
+
+/* one communications item: CIP over TCP and class 0/1 over UDP. */
+static const uint8_t LIST_SERVICES_REPLY[] = {
+    0x01, 0x00, 0x00, 0x01, 0x14, 0x00, 0x01, 0x00, 0x20, 0x01,
+    'C', 'o', 'm', 'm', 'u', 'n', 'i', 'c', 'a', 't', 'i', 'o', 'n', 's', 0x00, 0x00
+};
+
+/* no items, we have no interfaces beyond the ones above. */
+static const uint8_t LIST_INTERFACES_REPLY[] = { 0x00, 0x00 };
+
+
 typedef struct {
     uint16_t command;
     uint16_t length;
@@ -47,13 +86,12 @@ typedef struct {
 } eip_header_s;
 
 
-static slice_s register_session(slice_s input, slice_s output, plc_s *plc, eip_header_s *header);
-static slice_s unregister_session(slice_s input, slice_s output, plc_s *plc, eip_header_s *header);
+static slice_s register_session(slice_s input, slice_s output, session_s *session, eip_header_s *header);
+static slice_s unregister_session(slice_s input, slice_s output, session_s *session, eip_header_s *header);
 
 
-slice_s eip_dispatch_request(slice_s input, slice_s raw_output, plc_s *plc)
+slice_s eip_dispatch_request(slice_s input, slice_s output, session_s *session)
 {
-    slice_s output = slice_from_slice(raw_output, 0, plc->server_to_client_max_packet);
     slice_s response = slice_from_slice(output, EIP_HEADER_SIZE, slice_len(output) - EIP_HEADER_SIZE);
 
     eip_header_s header;
@@ -75,40 +113,64 @@ slice_s eip_dispatch_request(slice_s input, slice_s raw_output, plc_s *plc)
         return slice_make_err(TCP_SERVER_BAD_REQUEST);
     }
 
-    /* dispatch the request */
-    switch(header.command) {
-        case EIP_REGISTER_SESSION:
-            response = register_session(slice_from_slice(input, EIP_HEADER_SIZE, EIP_REGISTER_SESSION_SIZE), response, plc, &header);
-            break;
+    if(session->timers) {
+        session->last_activity_ms = timer_wheel_now(session->timers);
+    }
 
-        case EIP_UNREGISTER_SESSION:
-            response = unregister_session(slice_from_slice(input, EIP_HEADER_SIZE, EIP_REGISTER_SESSION_SIZE), response, plc, &header);
-            break;
+    /* discovery needs no session and is answered the same way over UDP. */
+    if(eip_is_list_request(input)) {
+        struct sockaddr_in local_addr;
 
-        case EIP_UNCONNECTED_SEND:
-            response = handle_cpf_unconnected(slice_from_slice(input, EIP_HEADER_SIZE, slice_len(input) - EIP_HEADER_SIZE), 
-                                              slice_from_slice(output, EIP_HEADER_SIZE, slice_len(output) - EIP_HEADER_SIZE), 
-                                              plc);
-            break;
+        return eip_dispatch_list_request(input, output, session->plc,
+                                         ((session->tcp_conn && tcp_conn_get_local(session->tcp_conn, &local_addr)) ? &local_addr : NULL));
+    }
 
-        case EIP_CONNECTED_SEND:
-            response = handle_cpf_connected(slice_from_slice(input, EIP_HEADER_SIZE, slice_len(input) - EIP_HEADER_SIZE), 
-                                            slice_from_slice(output, EIP_HEADER_SIZE, slice_len(output) - EIP_HEADER_SIZE), 
-                                            plc);
-            break;
+    /* everything but registration must use the handle this session was given. */
+    if(header.command != EIP_REGISTER_SESSION && (session->session_handle == 0 || header.session_handle != session->session_handle)) {
+        info("Request session handle %x does not match the session handle %x!", header.session_handle, session->session_handle);
+        response = slice_make_err(EIP_ERR_INVALID_SESSION);
+    } else {
+        /* dispatch the request */
+        switch(header.command) {
+            case EIP_REGISTER_SESSION:
+                response = register_session(slice_from_slice(input, EIP_HEADER_SIZE, EIP_REGISTER_SESSION_SIZE), response, session, &header);
+                break;
+
+            case EIP_UNREGISTER_SESSION:
+                response = unregister_session(slice_from_slice(input, EIP_HEADER_SIZE, EIP_REGISTER_SESSION_SIZE), response, session, &header);
+                break;
+
+            case EIP_UNCONNECTED_SEND:
+                response = handle_cpf_unconnected(slice_from_slice(input, EIP_HEADER_SIZE, slice_len(input) - EIP_HEADER_SIZE), 
+                                                  slice_from_slice(output, EIP_HEADER_SIZE, slice_len(output) - EIP_HEADER_SIZE), 
+                                                  session);
+                break;
+
+            case EIP_CONNECTED_SEND:
+                response = handle_cpf_connected(slice_from_slice(input, EIP_HEADER_SIZE, slice_len(input) - EIP_HEADER_SIZE), 
+                                                slice_from_slice(output, EIP_HEADER_SIZE, slice_len(output) - EIP_HEADER_SIZE), 
+                                                session);
+                break;
+
+            default:
+                response = slice_make_err(TCP_SERVER_UNSUPPORTED);
+                break;
+        }
+    }
 
-        default:
-            response = slice_make_err(TCP_SERVER_UNSUPPORTED);
-            break;
+    /* connection sizes are capped so that this cannot happen, but a length that wrapped would desync the client. */
+    if(!slice_has_err(response) && (size_t)slice_len(response) + session->tail.len > UINT16_MAX) {
+        warning("Response payload of %d bytes does not fit in the EIP length!", (int)((size_t)slice_len(response) + session->tail.len));
+        return slice_make_err(TCP_SERVER_BAD_REQUEST);
     }
 
     if(!slice_has_err(response)) {
         /* build response */
         slice_set_uint16_le(output, 0, header.command);
-        slice_set_uint16_le(output, 2, (uint16_t)slice_len(response));
-        slice_set_uint32_le(output, 4, plc->session_handle);
+        slice_set_uint16_le(output, 2, (uint16_t)(slice_len(response) + session->tail.len)); /* tag data sent in place counts too. */
+        slice_set_uint32_le(output, 4, session->session_handle);
         slice_set_uint32_le(output, 8, (uint32_t)0); /* status == 0 -> no error */
-        slice_set_uin64_le(output, 12, plc->sender_context);
+        slice_set_uint64_le(output, 12, header.sender_context);
         slice_set_uint32_le(output, 20, header.options);
 
         /* The payload is already in place. */
@@ -122,9 +184,9 @@ slice_s eip_dispatch_request(slice_s input, slice_s raw_output, plc_s *plc)
         /* error condition. */
         slice_set_uint16_le(output, 0, header.command);
         slice_set_uint16_le(output, 2, (uint16_t)0);  /* no payload. */
-        slice_set_uint32_le(output, 4, plc->session_handle);
+        slice_set_uint32_le(output, 4, header.session_handle);
         slice_set_uint32_le(output, 8, slice_get_err(response)); /* status */
-        slice_set_uin64_le(output, 12, plc->sender_context);
+        slice_set_uint64_le(output, 12, header.sender_context);
         slice_set_uint32_le(output, 20, header.options);
 
         return slice_from_slice(output, 0, EIP_HEADER_SIZE);
@@ -132,7 +194,7 @@ slice_s eip_dispatch_request(slice_s input, slice_s raw_output, plc_s *plc)
 }
 
 
-slice_s register_session(slice_s input, slice_s output, plc_s *plc, eip_header_s *header)
+slice_s register_session(slice_s input, slice_s output, session_s *session, eip_header_s *header)
 {
     struct {
         uint16_t eip_version;
@@ -186,8 +248,17 @@ slice_s register_session(slice_s input, slice_s output, plc_s *plc, eip_header_s
         return slice_make_err(EIP_ERR_BAD_REQUEST);    
     }
 
+    /* only one registration per TCP connection. */
+    if(session->session_handle != (uint32_t)0) {
+        info("Request failed sanity check: session is already registered with handle %x.", session->session_handle);
+
+        return slice_make_err(EIP_ERR_BAD_REQUEST);
+    }
+
     /* all good, generate a session handle. */
-    plc->session_handle = header->session_handle = (uint32_t)rand();
+    do {
+        session->session_handle = header->session_handle = (uint32_t)rand();
+    } while(session->session_handle == 0);
     
     /* build the response. */
     slice_set_uint16_le(output, 0, register_request.eip_version);
@@ -197,9 +268,9 @@ slice_s register_session(slice_s input, slice_s output, plc_s *plc, eip_header_s
 }
 
 
-slice_s unregister_session(slice_s input, slice_s output, plc_s *plc, eip_header_s *header)
+slice_s unregister_session(slice_s input, slice_s output, session_s *session, eip_header_s *header)
 {
-    if(header->session_handle == plc->session_handle) {
+    if(header->session_handle == session->session_handle) {
         return slice_make_err(TCP_SERVER_DONE);
     } else {
         return slice_make_err(EIP_ERR_BAD_REQUEST);
@@ -207,3 +278,106 @@ slice_s unregister_session(slice_s input, slice_s output, plc_s *plc, eip_header
 }
 
 
+
+/*
+ * Encode the identity item of the ListIdentity reply.  The serial number
+ * is random unless it was set, so that simulated devices can be told apart.
+ */
+void eip_identity_build(plc_s *plc)
+{
+    const identity_s *identity = (plc->plc_type == PLC_MICRO800 ? &MICRO800_IDENTITY : &CONTROL_LOGIX_IDENTITY);
+    slice_s output = slice_make(plc->identity, (ssize_t)sizeof(plc->identity));
+    size_t name_len = strlen(identity->product_name);
+    size_t offset = 0;
+
+    while(plc->serial_number == 0) {
+        plc->serial_number = (uint32_t)rand();
+    }
+
+    memset(plc->identity, 0, sizeof(plc->identity));
+
+    slice_set_uint16_le(output, offset, 1); offset += 2;  /* one item. */
+    slice_set_uint16_le(output, offset, EIP_ITEM_IDENTITY); offset += 2;
+    offset += 2;  /* the item length is filled in at the end. */
+    slice_set_uint16_le(output, offset, EIP_VERSION); offset += 2;
+
+    /* a big-endian sockaddr_in.  The port and address are filled in for each reply. */
+    slice_set_uint8(output, offset, 0); offset++;
+    slice_set_uint8(output, offset, AF_INET); offset++;
+    offset += 2 + 4 + 8;
+
+    slice_set_uint16_le(output, offset, identity->vendor_id); offset += 2;
+    slice_set_uint16_le(output, offset, identity->device_type); offset += 2;
+    slice_set_uint16_le(output, offset, identity->product_code); offset += 2;
+    slice_set_uint8(output, offset, identity->major_revision); offset++;
+    slice_set_uint8(output, offset, identity->minor_revision); offset++;
+    slice_set_uint16_le(output, offset, EIP_IDENTITY_STATUS); offset += 2;
+    slice_set_uint32_le(output, offset, plc->serial_number); offset += 4;
+    slice_set_uint8(output, offset, (uint8_t)name_len); offset++;
+    slice_set_bytes(output, offset, (const uint8_t *)identity->product_name, name_len); offset += name_len;
+    slice_set_uint8(output, offset, EIP_IDENTITY_STATE); offset++;
+
+    slice_set_uint16_le(output, 4, (uint16_t)(offset - 6));
+    plc->identity_size = offset;
+}
+
+
+bool eip_is_list_request(slice_s input)
+{
+    uint16_t command = slice_get_uint16_le(input, 0);
+
+    return (command == EIP_LIST_IDENTITY || command == EIP_LIST_SERVICES || command == EIP_LIST_INTERFACES);
+}
+
+
+/*
+ * The header goes back as it came with the payload length and no error.
+ * The payload is copied from the pre-encoded replies.  Without local_addr,
+ * the identity reports address 0.0.0.0 and port 0.
+ */
+slice_s eip_dispatch_list_request(slice_s input, slice_s output, plc_s *plc, const struct sockaddr_in *local_addr)
+{
+    const uint8_t *payload = NULL;
+    size_t payload_size = 0;
+    uint16_t command = slice_get_uint16_le(input, 0);
+
+    if(slice_len(input) < EIP_HEADER_SIZE || slice_len(input) != EIP_HEADER_SIZE + slice_get_uint16_le(input, 2)) {
+        info("Illegal EIP discovery packet of %d bytes!", slice_len(input));
+        return slice_make_err(TCP_SERVER_BAD_REQUEST);
+    }
+
+    switch(command) {
+        case EIP_LIST_IDENTITY:
+            payload = plc->identity;
+            payload_size = plc->identity_size;
+            break;
+
+        case EIP_LIST_SERVICES:
+            payload = LIST_SERVICES_REPLY;
+            payload_size = sizeof(LIST_SERVICES_REPLY);
+            break;
+
+        case EIP_LIST_INTERFACES:
+            payload = LIST_INTERFACES_REPLY;
+            payload_size = sizeof(LIST_INTERFACES_REPLY);
+            break;
+
+        default:
+            return slice_make_err(TCP_SERVER_UNSUPPORTED);
+    }
+
+    if(!slice_set_bytes(output, 0, input.data, EIP_HEADER_SIZE) || !slice_set_bytes(output, EIP_HEADER_SIZE, payload, payload_size)) {
+        warning("no room for a %d byte discovery reply!", (int)(EIP_HEADER_SIZE + payload_size));
+        return slice_make_err(TCP_SERVER_BAD_REQUEST);
+    }
+
+    slice_set_uint16_le(output, 2, (uint16_t)payload_size);
+    slice_set_uint32_le(output, 8, (uint32_t)0);
+
+    if(command == EIP_LIST_IDENTITY && local_addr) {
+        slice_set_bytes(output, EIP_HEADER_SIZE + EIP_IDENTITY_PORT_OFFSET, (const uint8_t *)&local_addr->sin_port, 2);
+        slice_set_bytes(output, EIP_HEADER_SIZE + EIP_IDENTITY_ADDR_OFFSET, (const uint8_t *)&local_addr->sin_addr.s_addr, 4);
+    }
+
+    return slice_from_slice(output, 0, EIP_HEADER_SIZE + payload_size);
+}
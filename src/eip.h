@@ -20,7 +20,10 @@
 
 #pragma once
 
+#include <netinet/in.h>
+#include <stdbool.h>
 #include "plc.h"
+#include "session.h"
 #include "slice.h"
 
 /* EIP header size is 24 bytes. */
@@ -28,6 +31,24 @@
 
 /* EIP errors. */
 #define EIP_ERR_BAD_REQUEST     ((uint32_t)1) /* FIXME */
+#define EIP_ERR_INVALID_SESSION ((uint32_t)0x64)
 
 
-extern slice_s eip_dispatch_request(slice_s input, slice_s output, plc_s *context);
+extern slice_s eip_dispatch_request(slice_s input, slice_s output, session_s *session);
+
+/* discovery is also answered on this UDP port. */
+#define EIP_UDP_PORT "44818"
+
+/* the longest reply to a discovery request, header included. */
+#define EIP_LIST_REPLY_MAX_SIZE (EIP_HEADER_SIZE + PLC_IDENTITY_MAX_SIZE)
+
+/*
+ * ListIdentity, ListServices and ListInterfaces need no session.  The
+ * identity is encoded once by eip_identity_build() and each reply copies
+ * it, filling in the address the request came to, so answering allocates
+ * nothing.  eip_dispatch_list_request() takes and returns whole packets,
+ * header included, from TCP or UDP.
+ */
+extern void eip_identity_build(plc_s *plc);
+extern bool eip_is_list_request(slice_s input);
+extern slice_s eip_dispatch_list_request(slice_s input, slice_s output, plc_s *plc, const struct sockaddr_in *local_addr);
@@ -0,0 +1,735 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/* sendmmsg() and recvmmsg(). */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "io_conn.h"
+#include "plc.h"
+#include "slice.h"
+#include "socket.h"
+#include "tag.h"
+#include "utils.h"
+
+
+/* connections by O->T connection ID.  Must be a power of two. */
+#define IO_CONN_BUCKETS (256)
+
+/* packets sent or received per system call. */
+#define IO_SEND_BATCH (64)
+#define IO_RECV_BATCH (16)
+
+/* how long the thread sleeps when no connection is due. */
+#define IO_IDLE_WAIT_NS (100000000)
+
+/* only wake up this late on a deadline instead of the default 50 us. */
+#define IO_TIMER_SLACK_NS (1000)
+
+/* item count, sequenced address item and the connected data item header, then the sequence count. */
+#define IO_ITEM_SEQ_ADDRESS     ((uint16_t)0x8002)
+#define IO_ITEM_CONNECTED_DATA  ((uint16_t)0x00B1)
+#define IO_PACKET_HEADER_SIZE   (2 + 4 + 8 + 4)
+
+struct io_conn_s {
+    struct io_conn_s *next_in_bucket;
+    uint32_t o_to_t_conn_id;
+    uint32_t t_to_o_conn_id;
+    struct sockaddr_in dest;
+    struct in_addr originator;  /* O->T data is only taken from the host that opened the connection. */
+
+    /* consuming. */
+    tag_def_s *o_to_t_tag;
+    size_t o_to_t_data_size;
+    int64_t o_to_t_rpi_ns;
+    uint16_t o_to_t_seq;
+    bool consumed_any;
+    int64_t last_consumed_ns;
+    int64_t last_activity_ms;   /* read by the session's thread for the connection timeout. */
+
+    /* producing.  The packet is built in place and sent from here. */
+    tag_def_s *t_to_o_tag;
+    size_t t_to_o_data_size;
+    int64_t t_to_o_rpi_ns;
+    int64_t next_due_ns;
+    size_t heap_index;
+    uint32_t encap_seq;
+    uint16_t t_to_o_seq;
+    uint8_t *packet;
+    size_t packet_size;
+
+    /* an IP_PKTINFO that sends from the address the originator connected to. */
+    uint8_t control[CMSG_SPACE(sizeof(struct in_pktinfo))] __attribute__((aligned(8)));
+    size_t control_len;     /* 0 to let the kernel pick. */
+
+    /* timing. */
+    uint64_t num_produced;
+    uint64_t num_overruns;      /* RPIs skipped because the thread fell a whole RPI behind. */
+    int64_t total_late_ns;
+    int64_t max_late_ns;
+    uint64_t num_consumed;
+    int64_t max_consume_jitter_ns;
+};
+
+typedef struct io_engine_s {
+    int sock;
+    int wake_fd;        /* written to when the schedule changes or the thread must stop. */
+    pthread_t thread;
+    bool running;
+
+    /* held by the thread while it works and by server threads to add or remove connections. */
+    pthread_mutex_t lock;
+    io_conn_s *buckets[IO_CONN_BUCKETS];
+
+    /* producing connections, a binary min-heap on next_due_ns. */
+    io_conn_s **heap;
+    size_t heap_len;
+    size_t heap_capacity;
+
+    uint8_t *recv_data;
+    size_t recv_packet_size;
+} io_engine_s;
+
+static inline size_t io_bucket(uint32_t conn_id);
+static void *io_thread(void *engine);
+static int64_t produce_due(io_engine_s *engine);
+static void build_packet(io_conn_s *io);
+static void send_batch(io_engine_s *engine, struct mmsghdr *msgs, int num_msgs);
+static void consume_packets(io_engine_s *engine);
+static void consume_packet(io_engine_s *engine, slice_s packet, const struct sockaddr_in *from, int64_t now_ns);
+static io_conn_s *find_conn(io_engine_s *engine, uint32_t o_to_t_conn_id);
+static void wake_thread(io_engine_s *engine);
+static bool heap_push(io_engine_s *engine, io_conn_s *io);
+static void heap_remove(io_engine_s *engine, io_conn_s *io);
+static void heap_sift_up(io_engine_s *engine, size_t index);
+static void heap_sift_down(io_engine_s *engine, size_t index);
+static void heap_set(io_engine_s *engine, size_t index, io_conn_s *io);
+
+
+bool io_start(plc_s *plcs, size_t num_plcs, const char *host, const char *port)
+{
+    io_engine_s *engine = calloc(1, sizeof(*engine));
+    uint32_t max_packet = 0;
+
+    if(!engine) {
+        error("Unable to allocate memory for the I/O thread!");
+    }
+
+    /* packets for all the PLCs come in on the one socket. */
+    for(size_t i=0; i < num_plcs; i++) {
+        if(plcs[i].conn_max_packet > max_packet) {
+            max_packet = plcs[i].conn_max_packet;
+        }
+    }
+
+    engine->sock = socket_open_udp(host, port);
+    if(engine->sock < 0) {
+        fprintf(stderr, "Unable to open UDP port %s, class 1 I/O connections are disabled.\n", port);
+        free(engine);
+        return false;
+    }
+
+    engine->wake_fd = eventfd(0, EFD_NONBLOCK);
+    engine->recv_packet_size = IO_PACKET_HEADER_SIZE + (size_t)max_packet;
+    engine->recv_data = malloc(IO_RECV_BATCH * engine->recv_packet_size);
+    if(engine->wake_fd < 0 || !engine->recv_data) {
+        error("Unable to set up the I/O thread!");
+    }
+
+    pthread_mutex_init(&engine->lock, NULL);
+    engine->running = true;
+
+    for(size_t i=0; i < num_plcs; i++) {
+        plcs[i].io_engine = engine;
+    }
+
+    if(pthread_create(&engine->thread, NULL, io_thread, engine) != 0) {
+        error("Unable to start the I/O thread!");
+    }
+
+    return true;
+}
+
+
+void io_stop(plc_s *plcs, size_t num_plcs)
+{
+    io_engine_s *engine = (num_plcs > 0 ? plcs[0].io_engine : NULL);
+
+    if(!engine) {
+        return;
+    }
+
+    __atomic_store_n(&engine->running, false, __ATOMIC_RELAXED);
+    wake_thread(engine);
+    pthread_join(engine->thread, NULL);
+
+    /* the sessions close their connections first, anything left is freed here. */
+    for(size_t i=0; i < engine->heap_len; i++) {
+        free(engine->heap[i]->packet);
+        free(engine->heap[i]);
+    }
+
+    socket_close(engine->sock);
+    close(engine->wake_fd);
+    pthread_mutex_destroy(&engine->lock);
+    free(engine->heap);
+    free(engine->recv_data);
+    free(engine);
+
+    for(size_t i=0; i < num_plcs; i++) {
+        plcs[i].io_engine = NULL;
+    }
+}
+
+
+io_conn_s *io_conn_open(plc_s *plc, uint32_t o_to_t_conn_id, uint32_t t_to_o_conn_id, const struct sockaddr_in *dest, const struct sockaddr_in *src,
+                        tag_def_s *o_to_t_tag, uint32_t o_to_t_size, uint32_t o_to_t_rpi_us,
+                        tag_def_s *t_to_o_tag, uint32_t t_to_o_size, uint32_t t_to_o_rpi_us)
+{
+    io_engine_s *engine = plc->io_engine;
+    io_conn_s *io = NULL;
+    size_t bucket = io_bucket(o_to_t_conn_id);
+
+    if(!engine) {
+        info("Class 1 I/O is not running!");
+        return NULL;
+    }
+
+    io = calloc(1, sizeof(*io));
+    if(!io) {
+        warning("Unable to allocate new I/O connection!");
+        return NULL;
+    }
+
+    io->o_to_t_conn_id = o_to_t_conn_id;
+    io->t_to_o_conn_id = t_to_o_conn_id;
+    io->dest = *dest;
+    io->originator = dest->sin_addr;
+
+    if(src && src->sin_addr.s_addr != htonl(INADDR_ANY)) {
+        struct msghdr msg;
+        struct cmsghdr *cmsg = NULL;
+        struct in_pktinfo pktinfo;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = io->control;
+        msg.msg_controllen = sizeof(io->control);
+
+        memset(&pktinfo, 0, sizeof(pktinfo));
+        pktinfo.ipi_spec_dst = src->sin_addr;
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = IPPROTO_IP;
+        cmsg->cmsg_type = IP_PKTINFO;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(pktinfo));
+        memcpy(CMSG_DATA(cmsg), &pktinfo, sizeof(pktinfo));
+
+        io->control_len = CMSG_SPACE(sizeof(pktinfo));
+    }
+
+    io->o_to_t_tag = o_to_t_tag;
+    io->o_to_t_data_size = (o_to_t_size > IO_O_TO_T_HEADER_SIZE ? o_to_t_size - IO_O_TO_T_HEADER_SIZE : 0);
+    io->o_to_t_rpi_ns = (int64_t)o_to_t_rpi_us * 1000;
+    io->last_activity_ms = util_time_ns() / 1000000;
+
+    io->t_to_o_tag = t_to_o_tag;
+    io->t_to_o_data_size = (t_to_o_size > IO_T_TO_O_HEADER_SIZE ? t_to_o_size - IO_T_TO_O_HEADER_SIZE : 0);
+    io->t_to_o_rpi_ns = (int64_t)t_to_o_rpi_us * 1000;
+
+    io->packet_size = IO_PACKET_HEADER_SIZE + IO_T_TO_O_HEADER_SIZE + io->t_to_o_data_size;
+    io->packet = malloc(io->packet_size);
+    if(!io->packet) {
+        warning("Unable to allocate new I/O connection!");
+        free(io);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+
+    if(find_conn(engine, o_to_t_conn_id)) {
+        pthread_mutex_unlock(&engine->lock);
+        warning("I/O connection ID %x is already in use!", o_to_t_conn_id);
+        free(io->packet);
+        free(io);
+        return NULL;
+    }
+
+    /* the first packet goes out right away. */
+    io->next_due_ns = util_time_ns();
+    if(!heap_push(engine, io)) {
+        pthread_mutex_unlock(&engine->lock);
+        free(io->packet);
+        free(io);
+        return NULL;
+    }
+
+    io->next_in_bucket = engine->buckets[bucket];
+    engine->buckets[bucket] = io;
+
+    pthread_mutex_unlock(&engine->lock);
+
+    wake_thread(engine);
+
+    if(log_enabled(LOG_INFO)) {
+        char addr_str[INET_ADDRSTRLEN] = "";
+
+        inet_ntop(AF_INET, &dest->sin_addr, addr_str, sizeof(addr_str));
+        info("Opened I/O connection %x producing %d bytes every %d us to %s.", o_to_t_conn_id, (int)io->t_to_o_data_size, (int)t_to_o_rpi_us, addr_str);
+    }
+
+    return io;
+}
+
+
+void io_conn_close(plc_s *plc, io_conn_s *io)
+{
+    io_engine_s *engine = plc->io_engine;
+    io_conn_s **walker = NULL;
+
+    if(!engine || !io) {
+        return;
+    }
+
+    pthread_mutex_lock(&engine->lock);
+
+    walker = &engine->buckets[io_bucket(io->o_to_t_conn_id)];
+    while(*walker && *walker != io) {
+        walker = &((*walker)->next_in_bucket);
+    }
+
+    if(*walker) {
+        *walker = io->next_in_bucket;
+    }
+
+    heap_remove(engine, io);
+
+    pthread_mutex_unlock(&engine->lock);
+
+    info("Closed I/O connection %x.  Produced %llu packets, late by %lld us on average and %lld us at most, %llu RPIs missed.  Consumed %llu packets, at most %lld us off the RPI.",
+         io->o_to_t_conn_id,
+         (unsigned long long)io->num_produced,
+         (long long)(io->num_produced ? io->total_late_ns / (int64_t)io->num_produced / 1000 : 0),
+         (long long)(io->max_late_ns / 1000),
+         (unsigned long long)io->num_overruns,
+         (unsigned long long)io->num_consumed,
+         (long long)(io->max_consume_jitter_ns / 1000));
+
+    free(io->packet);
+    free(io);
+}
+
+
+/* the I/O thread stores this, the session's thread reads it. */
+int64_t io_conn_last_activity_ms(io_conn_s *io)
+{
+    return __atomic_load_n(&io->last_activity_ms, __ATOMIC_RELAXED);
+}
+
+
+size_t io_bucket(uint32_t conn_id)
+{
+    return (size_t)((conn_id * (uint32_t)0x9E3779B1) >> 24) & (IO_CONN_BUCKETS - 1);
+}
+
+
+void *io_thread(void *engine_arg)
+{
+    io_engine_s *engine = (io_engine_s *)engine_arg;
+    struct pollfd fds[2];
+
+#ifdef PR_SET_TIMERSLACK
+    prctl(PR_SET_TIMERSLACK, (unsigned long)IO_TIMER_SLACK_NS, 0, 0, 0);
+#endif
+
+    fds[0].fd = engine->sock;
+    fds[0].events = POLLIN;
+    fds[1].fd = engine->wake_fd;
+    fds[1].events = POLLIN;
+
+    while(__atomic_load_n(&engine->running, __ATOMIC_RELAXED)) {
+        struct timespec timeout;
+        int64_t wait_ns = 0;
+
+        pthread_mutex_lock(&engine->lock);
+        wait_ns = produce_due(engine);
+        pthread_mutex_unlock(&engine->lock);
+
+        timeout.tv_sec = (time_t)(wait_ns / 1000000000);
+        timeout.tv_nsec = (long)(wait_ns % 1000000000);
+
+        if(ppoll(fds, 2, &timeout, NULL) <= 0) {
+            continue;
+        }
+
+        if(fds[0].revents & POLLIN) {
+            consume_packets(engine);
+        }
+
+        if(fds[1].revents & POLLIN) {
+            uint64_t count = 0;
+
+            if(read(engine->wake_fd, &count, sizeof(count)) < 0) {
+                warning("unable to read the I/O wake up event, errno=%d!", errno);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Send everything that is due, in batches.  Each connection's next packet
+ * is due one RPI after this one was due, not after it went out.  Returns
+ * how long to wait for the next one.
+ */
+int64_t produce_due(io_engine_s *engine)
+{
+    struct mmsghdr msgs[IO_SEND_BATCH];
+    struct iovec iovs[IO_SEND_BATCH];
+    int num_msgs = 0;
+    int64_t now_ns = util_time_ns();
+
+    while(engine->heap_len > 0 && engine->heap[0]->next_due_ns <= now_ns) {
+        io_conn_s *io = engine->heap[0];
+        int64_t late_ns = now_ns - io->next_due_ns;
+
+        build_packet(io);
+
+        iovs[num_msgs].iov_base = io->packet;
+        iovs[num_msgs].iov_len = io->packet_size;
+        memset(&msgs[num_msgs], 0, sizeof(msgs[num_msgs]));
+        msgs[num_msgs].msg_hdr.msg_name = &io->dest;
+        msgs[num_msgs].msg_hdr.msg_namelen = sizeof(io->dest);
+        msgs[num_msgs].msg_hdr.msg_iov = &iovs[num_msgs];
+        msgs[num_msgs].msg_hdr.msg_iovlen = 1;
+        msgs[num_msgs].msg_hdr.msg_control = (io->control_len > 0 ? io->control : NULL);
+        msgs[num_msgs].msg_hdr.msg_controllen = io->control_len;
+        num_msgs++;
+
+        io->num_produced++;
+        io->total_late_ns += late_ns;
+        if(late_ns > io->max_late_ns) {
+            io->max_late_ns = late_ns;
+        }
+
+        io->next_due_ns += io->t_to_o_rpi_ns;
+        if(io->next_due_ns <= now_ns) {
+            int64_t missed = (now_ns - io->next_due_ns) / io->t_to_o_rpi_ns + 1;
+
+            io->num_overruns += (uint64_t)missed;
+            io->next_due_ns += missed * io->t_to_o_rpi_ns;
+        }
+
+        heap_sift_down(engine, 0);
+
+        /* the packet buffers stay put until the batch is sent, no connection is in a batch twice. */
+        if(num_msgs == IO_SEND_BATCH) {
+            send_batch(engine, msgs, num_msgs);
+            num_msgs = 0;
+            now_ns = util_time_ns();
+        }
+    }
+
+    if(num_msgs > 0) {
+        send_batch(engine, msgs, num_msgs);
+    }
+
+    if(engine->heap_len == 0) {
+        return IO_IDLE_WAIT_NS;
+    }
+
+    now_ns = util_time_ns();
+
+    return (engine->heap[0]->next_due_ns > now_ns ? engine->heap[0]->next_due_ns - now_ns : 0);
+}
+
+
+void build_packet(io_conn_s *io)
+{
+    slice_s packet = slice_make(io->packet, (ssize_t)io->packet_size);
+    size_t offset = 0;
+
+    io->encap_seq++;
+    io->t_to_o_seq++;
+
+    slice_set_uint16_le(packet, offset, 2); offset += 2; /* item count. */
+    slice_set_uint16_le(packet, offset, IO_ITEM_SEQ_ADDRESS); offset += 2;
+    slice_set_uint16_le(packet, offset, 8); offset += 2;
+    slice_set_uint32_le(packet, offset, io->t_to_o_conn_id); offset += 4;
+    slice_set_uint32_le(packet, offset, io->encap_seq); offset += 4;
+    slice_set_uint16_le(packet, offset, IO_ITEM_CONNECTED_DATA); offset += 2;
+    slice_set_uint16_le(packet, offset, (uint16_t)(IO_T_TO_O_HEADER_SIZE + io->t_to_o_data_size)); offset += 2;
+    slice_set_uint16_le(packet, offset, io->t_to_o_seq); offset += 2;
+
+    if(io->t_to_o_data_size > 0) {
+        tag_read_data(io->t_to_o_tag, 0, io->packet + offset, io->t_to_o_data_size);
+    }
+}
+
+
+void send_batch(io_engine_s *engine, struct mmsghdr *msgs, int num_msgs)
+{
+    int sent = 0;
+
+    while(sent < num_msgs) {
+        int rc = sendmmsg(engine->sock, msgs + sent, (unsigned int)(num_msgs - sent), 0);
+
+        if(rc < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+
+            /* a full socket buffer drops the rest, as a busy network would. */
+            warning("dropped %d I/O packets, errno=%d!", num_msgs - sent, errno);
+            break;
+        }
+
+        sent += rc;
+    }
+}
+
+
+void consume_packets(io_engine_s *engine)
+{
+    struct mmsghdr msgs[IO_RECV_BATCH];
+    struct iovec iovs[IO_RECV_BATCH];
+    struct sockaddr_in froms[IO_RECV_BATCH];
+    int rc = 0;
+
+    do {
+        int64_t now_ns = 0;
+
+        for(int i=0; i < IO_RECV_BATCH; i++) {
+            iovs[i].iov_base = engine->recv_data + ((size_t)i * engine->recv_packet_size);
+            iovs[i].iov_len = engine->recv_packet_size;
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &froms[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(froms[i]);
+        }
+
+        rc = recvmmsg(engine->sock, msgs, IO_RECV_BATCH, MSG_DONTWAIT, NULL);
+        if(rc <= 0) {
+            break;
+        }
+
+        now_ns = util_time_ns();
+
+        pthread_mutex_lock(&engine->lock);
+
+        for(int i=0; i < rc; i++) {
+            consume_packet(engine, slice_make((uint8_t *)iovs[i].iov_base, (ssize_t)msgs[i].msg_len), &froms[i], now_ns);
+        }
+
+        pthread_mutex_unlock(&engine->lock);
+    } while(rc == IO_RECV_BATCH);
+}
+
+
+/* O->T data only reaches the tag when it comes from the originator, the sequence count moves and the run bit is set. */
+void consume_packet(io_engine_s *engine, slice_s packet, const struct sockaddr_in *from, int64_t now_ns)
+{
+    io_conn_s *io = NULL;
+    uint16_t data_len = 0;
+    uint16_t seq = 0;
+
+    if(slice_len(packet) < IO_PACKET_HEADER_SIZE + IO_T_TO_O_HEADER_SIZE ||
+       slice_get_uint16_le(packet, 0) < 2 ||
+       slice_get_uint16_le(packet, 2) != IO_ITEM_SEQ_ADDRESS ||
+       slice_get_uint16_le(packet, 4) != 8 ||
+       slice_get_uint16_le(packet, 14) != IO_ITEM_CONNECTED_DATA) {
+        info("Dropping malformed I/O packet.");
+        slice_dump(packet);
+        return;
+    }
+
+    data_len = slice_get_uint16_le(packet, 16);
+    if(data_len < IO_T_TO_O_HEADER_SIZE || (size_t)slice_len(packet) < IO_PACKET_HEADER_SIZE + (size_t)data_len) {
+        info("Dropping truncated I/O packet.");
+        return;
+    }
+
+    io = find_conn(engine, slice_get_uint32_le(packet, 6));
+    if(!io) {
+        info("No I/O connection found for connection ID %x!", slice_get_uint32_le(packet, 6));
+        return;
+    }
+
+    /* a guessed or sniffed connection ID is not enough to write the tag. */
+    if(from->sin_family != AF_INET || from->sin_addr.s_addr != io->originator.s_addr) {
+        info("Dropping I/O packet for connection ID %x from a host other than its originator.", io->o_to_t_conn_id);
+        return;
+    }
+
+    if(io->consumed_any) {
+        int64_t jitter_ns = (now_ns - io->last_consumed_ns) - io->o_to_t_rpi_ns;
+
+        jitter_ns = (jitter_ns < 0 ? -jitter_ns : jitter_ns);
+        if(jitter_ns > io->max_consume_jitter_ns) {
+            io->max_consume_jitter_ns = jitter_ns;
+        }
+    }
+
+    io->num_consumed++;
+    io->last_consumed_ns = now_ns;
+    __atomic_store_n(&io->last_activity_ms, now_ns / 1000000, __ATOMIC_RELAXED);
+
+    seq = slice_get_uint16_le(packet, IO_PACKET_HEADER_SIZE);
+    if(io->consumed_any && seq == io->o_to_t_seq) {
+        return;
+    }
+
+    io->consumed_any = true;
+    io->o_to_t_seq = seq;
+
+    if(io->o_to_t_data_size > 0 && data_len >= IO_O_TO_T_HEADER_SIZE + io->o_to_t_data_size &&
+       (slice_get_uint32_le(packet, IO_PACKET_HEADER_SIZE + 2) & 0x01)) {
+        tag_write_data(io->o_to_t_tag, 0, packet.data + IO_PACKET_HEADER_SIZE + IO_O_TO_T_HEADER_SIZE, io->o_to_t_data_size);
+    }
+}
+
+
+io_conn_s *find_conn(io_engine_s *engine, uint32_t o_to_t_conn_id)
+{
+    io_conn_s *io = engine->buckets[io_bucket(o_to_t_conn_id)];
+
+    while(io && io->o_to_t_conn_id != o_to_t_conn_id) {
+        io = io->next_in_bucket;
+    }
+
+    return io;
+}
+
+
+void wake_thread(io_engine_s *engine)
+{
+    uint64_t count = 1;
+
+    if(write(engine->wake_fd, &count, sizeof(count)) < 0) {
+        warning("unable to wake the I/O thread, errno=%d!", errno);
+    }
+}
+
+
+bool heap_push(io_engine_s *engine, io_conn_s *io)
+{
+    if(engine->heap_len == engine->heap_capacity) {
+        size_t new_capacity = (engine->heap_capacity ? engine->heap_capacity * 2 : 64);
+        io_conn_s **new_heap = realloc(engine->heap, new_capacity * sizeof(*new_heap));
+
+        if(!new_heap) {
+            warning("Unable to grow the I/O schedule!");
+            return false;
+        }
+
+        engine->heap = new_heap;
+        engine->heap_capacity = new_capacity;
+    }
+
+    heap_set(engine, engine->heap_len, io);
+    engine->heap_len++;
+    heap_sift_up(engine, io->heap_index);
+
+    return true;
+}
+
+
+void heap_remove(io_engine_s *engine, io_conn_s *io)
+{
+    size_t index = io->heap_index;
+
+    if(index >= engine->heap_len || engine->heap[index] != io) {
+        return;
+    }
+
+    engine->heap_len--;
+
+    if(index < engine->heap_len) {
+        heap_set(engine, index, engine->heap[engine->heap_len]);
+        heap_sift_up(engine, index);
+        heap_sift_down(engine, engine->heap[index]->heap_index);
+    }
+}
+
+
+void heap_sift_up(io_engine_s *engine, size_t index)
+{
+    io_conn_s *io = engine->heap[index];
+
+    while(index > 0) {
+        size_t parent = (index - 1) / 2;
+
+        if(engine->heap[parent]->next_due_ns <= io->next_due_ns) {
+            break;
+        }
+
+        heap_set(engine, index, engine->heap[parent]);
+        index = parent;
+    }
+
+    heap_set(engine, index, io);
+}
+
+
+void heap_sift_down(io_engine_s *engine, size_t index)
+{
+    io_conn_s *io = engine->heap[index];
+
+    for(;;) {
+        size_t child = (index * 2) + 1;
+
+        if(child >= engine->heap_len) {
+            break;
+        }
+
+        if(child + 1 < engine->heap_len && engine->heap[child + 1]->next_due_ns < engine->heap[child]->next_due_ns) {
+            child++;
+        }
+
+        if(io->next_due_ns <= engine->heap[child]->next_due_ns) {
+            break;
+        }
+
+        heap_set(engine, index, engine->heap[child]);
+        index = child;
+    }
+
+    heap_set(engine, index, io);
+}
+
+
+void heap_set(io_engine_s *engine, size_t index, io_conn_s *io)
+{
+    engine->heap[index] = io;
+    io->heap_index = index;
+}
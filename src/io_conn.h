@@ -0,0 +1,80 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#pragma once
+
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "plc.h"
+
+/*
+ * Class 1 (implicit, UDP) I/O connections.
+ *
+ * A Forward Open with transport class 1 names up to two connection
+ * points: the tag the originator writes (O->T) and the tag we produce
+ * (T->O).  One thread, shared by all the PLCs, sends the T->O data from
+ * UDP port 2222 to the originator at the T->O RPI and writes the O->T
+ * data it receives into the O->T tag.  Packets go out from the address
+ * the originator connected to, so PLCs on IP aliases share the socket.
+ *
+ * The thread sleeps on a nanosecond poll timeout until the earliest
+ * connection is due, sends every connection that is due in one batch and
+ * schedules the next packet one RPI after the last one was due, so
+ * lateness does not add up.  How late each packet went out and how far
+ * the O->T packets stray from their RPI is kept per connection and
+ * logged when it closes.
+ */
+
+#define IO_UDP_PORT "2222"
+
+/* the fastest RPI a connection may ask for, in microseconds. */
+#define IO_MIN_RPI_US (1000)
+
+/* T->O data has a 16-bit sequence count in front, O->T data also a 32-bit run/idle header. */
+#define IO_T_TO_O_HEADER_SIZE (2)
+#define IO_O_TO_T_HEADER_SIZE (6)
+
+typedef struct io_conn_s io_conn_s;
+
+/*
+ * Open the UDP socket and start the I/O thread for the PLCs.  If the
+ * port cannot be bound, class 1 Forward Opens are refused and the rest
+ * of the server carries on.
+ */
+extern bool io_start(plc_s *plcs, size_t num_plcs, const char *host, const char *port);
+extern void io_stop(plc_s *plcs, size_t num_plcs);
+
+/*
+ * Start producing to dest, from src unless it is NULL or the wildcard
+ * address, and consuming from the originator.  dest is the originator's
+ * TCP peer address, and O->T packets from any other address are dropped.  The sizes
+ * are the connection sizes from the Forward Open, headers included.  The
+ * tags may be NULL for connections that carry no data.  Returns NULL if
+ * I/O is not running or the connection ID is taken.
+ */
+extern io_conn_s *io_conn_open(plc_s *plc, uint32_t o_to_t_conn_id, uint32_t t_to_o_conn_id, const struct sockaddr_in *dest, const struct sockaddr_in *src,
+                               tag_def_s *o_to_t_tag, uint32_t o_to_t_size, uint32_t o_to_t_rpi_us,
+                               tag_def_s *t_to_o_tag, uint32_t t_to_o_size, uint32_t t_to_o_rpi_us);
+extern void io_conn_close(plc_s *plc, io_conn_s *io);
+
+/* when the last O->T packet came in, or the connection opened, on the timer_now_ms() clock. */
+extern int64_t io_conn_last_activity_ms(io_conn_s *io);
@@ -18,6 +18,7 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -25,42 +26,145 @@
 #include <string.h>
 #include <strings.h>
 #include <time.h>
+#include "cpf.h"
+#include "discovery.h"
 #include "eip.h"
+#include "io_conn.h"
 #include "plc.h"
+#include "session.h"
+#include "sim.h"
 #include "slice.h"
+#include "tag.h"
+#include "tag_file.h"
+#include "tag_store.h"
 #include "tcp_server.h"
+#include "udt.h"
 #include "utils.h"
 
 
 static void usage(void);
-static void process_args(int argc, const char **argv, plc_s *plc);
+static void process_args(int argc, const char **argv, plc_s **plcs, size_t *num_plcs, int *num_threads, int *sync_interval_s);
+static void load_config(const char *config_file, plc_s **plcs, size_t *num_plcs);
+static plc_s *add_plc(plc_s **plcs, size_t *num_plcs);
+static void parse_plc_args(int argc, const char **argv, plc_s *plc, bool tags_optional);
+static void parse_listen(const char *listen_str, plc_s *plc);
 static void parse_path(const char *path, plc_s *plc);
 static void parse_tag(const char *tag, plc_s *plc);
-static slice_s request_handler(slice_s input, slice_s output, void *plc);
+static void *conn_open(tcp_conn_p tcp_conn, void *plc);
+static slice_s request_handler(slice_s input, slice_s output, size_t *used, void *session);
+static void conn_close(void *session);
+static void *server_thread(void *server);
+
+/* initial per-client buffer size.  Sessions grow their buffers to fit the connections they negotiate. */
+#define CLIENT_BUFFER_SIZE (600)
+
+#define MAX_SERVER_THREADS (256)
+
+/* how long a session without connections may go without a request, like a controller's encapsulation inactivity timeout. */
+#define PLC_DEFAULT_SESSION_TIMEOUT_S (120)
+
+#define PLC_DEFAULT_LISTEN_HOST "0.0.0.0"
+#define PLC_DEFAULT_LISTEN_PORT EIP_UDP_PORT
+
+/* the most options on one line of a config file. */
+#define CONFIG_MAX_ARGS (1024)
 
 int main(int argc, const char **argv)
 {
-    tcp_server_p server = NULL;
-    uint8_t buf[4200];  /* CIP only allows 4002 for the CIP request, but there is overhead. */
-    slice_s server_buf = slice_make(buf, sizeof(buf));
-    plc_s plc;
+    tcp_server_p *servers = NULL;
+    pthread_t *threads = NULL;
+    int num_threads = 1;
+    int sync_interval_s = 10;
+    plc_s *plcs = NULL;
+    size_t num_plcs = 0;
 
     debug_off();
 
-    /* clear out context to make sure we do not get gremlins */
-    memset(&plc, 0, sizeof(plc));
-
     /* set the random seed. */
     srand(time(NULL));
 
-    process_args(argc, argv, &plc);
+    process_args(argc, argv, &plcs, &num_plcs, &num_threads, &sync_interval_s);
 
-    /* open a server connection and listen on the right port. */
-    server = tcp_server_create("0.0.0.0", "44818", server_buf, request_handler, &plc);
+    for(size_t i=0; i < num_plcs; i++) {
+        plc_s *plc = &plcs[i];
 
-    tcp_server_start(server);
+        if(!udt_build_templates(plc)) {
+            exit(1);
+        }
+
+        if(!tag_index_build(plc)) {
+            fprintf(stderr, "Tag names must be unique, ignoring case.\n");
+            usage();
+        }
 
-    tcp_server_destroy(server);
+        if(!tag_store_open(plc, plc->data_file, sync_interval_s)) {
+            exit(1);
+        }
+
+        eip_identity_build(plc);
+    }
+
+    /* one thread runs the generators of all the PLCs. */
+    if(!sim_start(plcs, num_plcs)) {
+        exit(1);
+    }
+
+    /* the server still runs without class 1 I/O or UDP discovery if the UDP ports are taken. */
+    io_start(plcs, num_plcs, "0.0.0.0", IO_UDP_PORT);
+    discovery_start(plcs, num_plcs);
+
+    servers = calloc((size_t)num_threads, sizeof(*servers));
+    threads = calloc((size_t)num_threads, sizeof(*threads));
+    if(!servers || !threads) {
+        error("Unable to allocate memory for %d server threads!", num_threads);
+    }
+
+    /*
+     * open a server connection per thread and listen on each PLC's port.  With more
+     * than one thread, the kernel spreads new clients across the listeners.
+     */
+    for(int i=0; i < num_threads; i++) {
+        servers[i] = tcp_server_create(plcs[0].listen_host, plcs[0].listen_port, (num_threads > 1), CLIENT_BUFFER_SIZE,
+                                       conn_open, request_handler, conn_close, &plcs[0]);
+
+        for(size_t j=1; j < num_plcs; j++) {
+            if(!tcp_server_listen(servers[i], plcs[j].listen_host, plcs[j].listen_port, &plcs[j])) {
+                error("Unable to listen on %s:%s!", plcs[j].listen_host, plcs[j].listen_port);
+            }
+        }
+    }
+
+    /* the main thread runs the first server. */
+    for(int i=1; i < num_threads; i++) {
+        if(pthread_create(&threads[i], NULL, server_thread, servers[i])) {
+            error("Unable to start server thread %d!", i);
+        }
+    }
+
+    tcp_server_start(servers[0]);
+
+    for(int i=1; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    for(int i=0; i < num_threads; i++) {
+        tcp_server_destroy(servers[i]);
+    }
+
+    free(servers);
+    free(threads);
+
+    discovery_stop(plcs, num_plcs);
+    io_stop(plcs, num_plcs);
+    sim_stop(plcs, num_plcs);
+
+    for(size_t i=0; i < num_plcs; i++) {
+        tag_store_close(&plcs[i]);
+        tag_index_destroy(&plcs[i]);
+        udt_destroy(&plcs[i]);
+    }
+
+    free(plcs);
 
     return 0;
 }
@@ -68,18 +172,59 @@ int main(int argc, const char **argv)
 
 void usage(void)
 {
-    fprintf(stderr, "Usage: ab_server --plc=<plc_type> [--path=<path>] --tag=<tag>\n"
+    fprintf(stderr, "Usage: ab_server [--threads=<n>] [--sync-interval=<secs>] [--debug] [--debug-packets] <plc options>\n"
+                    "       ab_server [--threads=<n>] [--sync-interval=<secs>] [--debug] [--debug-packets] --config=<file>\n"
+                    "   <plc options> = --plc=<plc_type> [--path=<path>] [--max-packet=<bytes>] [--listen=<host>[:<port>]]\n"
+                    "                   [--data-file=<file>] [--session-timeout=<secs>]\n"
+                    "                   [--udt=<type>] ... (--tag=<tag> | --tags-file=<file>) ... [--sim=<generator>] ...\n"
+                    "   --config=<file> serves several PLCs, one per line of <file> with its <plc options>\n"
+                    "     separated by spaces.  Each PLC needs its own --listen address.  Text after # is\n"
+                    "     ignored.  All the PLCs share the server threads.\n"
                     "   <plc type> = one of \"ControlLogix\" or \"Micro800\".\n"
                     "   <path> = (required for ControlLogix) internal path to CPU in PLC.  E.g. \"1,0\".\n"
+                    "   --debug turns on debugging output.  --debug-packets also dumps every packet.\n"
+                    "   --max-packet=<bytes> sets the largest connection size a Forward Open may request,\n"
+                    "     up to 65513.  The default is 4002 for ControlLogix and 508 for Micro800.\n"
+                    "   --threads=<n> runs <n> server threads that share the ports.  The default is 1.\n"
+                    "   --listen=<host>[:<port>] serves the PLC on that address over TCP and UDP.  The\n"
+                    "     default is 0.0.0.0:44818.\n"
+                    "   --tags-file=<file> loads tags from a CSV file, one per line, either as\n"
+                    "     <name>,<type>[,<sizes>] or as TAG rows from a Logix Designer tag export.\n"
+                    "     Tags without sizes are scalars.  This may be combined with --tag.\n"
+                    "     UDT,<type>,<member>,<type>[<size>] rows add members to a structure type.\n"
+                    "     SIM,<tag>,<generator>,<ms>[,<value>]... rows are the same as --sim.\n"
+                    "   --udt=<type>:<member>:<type>[,<member>:<type>]... defines a structure type.\n"
+                    "     Member types may have one array size, as in REAL[4].  Define a type before\n"
+                    "     the tags and types that use it.\n"
+                    "   --sim=<tag>:<generator>:<ms>[:<value>]... updates a tag every <ms> milliseconds.\n"
+                    "     The generators and their optional values are ramp (min, max, step), sine\n"
+                    "     (min, max, wave ms), random (min, max, step), counter (step) and toggle.\n"
+                    "     Every element of an array is updated.  Structures cannot be simulated.\n"
+                    "   --data-file=<file> keeps tag values in <file> so that they survive a restart.\n"
+                    "     The file is reset if the tags change.\n"
+                    "   --sync-interval=<secs> flushes the data file to disk this often.  The default\n"
+                    "     is 10, 0 leaves it to the kernel.\n"
+                    "   --session-timeout=<secs> closes sessions without connections that send nothing\n"
+                    "     for this long.  The default is 120, 0 never closes them.  Connections time\n"
+                    "     out after RPI x 4 x 2^multiplier, from the Forward Open's RPI and timeout\n"
+                    "     multiplier.\n"
+                    "   Class 1 I/O connections are served on UDP port 2222.  Their connection points\n"
+                    "     are tags, by symbol instance or by name.\n"
+                    "   ListIdentity, ListServices and ListInterfaces are answered over TCP and on UDP,\n"
+                    "     on the listen port.\n"
                     "\n"
                     "    Tags are in the format: <name>:<type>[<sizes>] where:\n"
                     "        <name> is alphanumeric, starting with an alpha character.\n"
                     "        <type> is one of:\n"
+                    "            BOOL - boolean.  Arrays are kept as 32-bit words.  Requires array size(s).\n"
+                    "            SINT - 1-byte signed integer.  Requires array size(s).\n"
                     "            INT - 2-byte signed integer.  Requires array size(s).\n"
                     "            DINT - 4-byte signed integer.  Requires array size(s).\n"
                     "            LINT - 8-byte signed integer.  Requires array size(s).\n"
                     "            REAL - 4-byte floating point number.  Requires array size(s).\n"
                     "            LREAL - 8-byte floating point number.  Requires array size(s).\n"
+                    "            STRING - Logix string of up to 82 characters.  Requires array size(s).\n"
+                    "            or the name of a type defined with --udt.\n"
                     "\n"
                     "        <sizes>> field is one or more (up to 3) numbers separated by commas.\n"
                     "\n"
@@ -89,12 +234,193 @@ void usage(void)
 }
 
 
-void process_args(int argc, const char **argv, plc_s *plc)
+/*
+ * Options that apply to the whole server are taken here.  The rest
+ * define one PLC, unless the PLCs come from a config file.
+ */
+void process_args(int argc, const char **argv, plc_s **plcs, size_t *num_plcs, int *num_threads, int *sync_interval_s)
+{
+    const char *config_file = NULL;
+    bool has_debug = false;
+    bool has_plc = false;
+
+    for(int i=0; i < argc; i++) {
+        if(strncmp(argv[i],"--threads=",10) == 0) {
+            *num_threads = atoi(&(argv[i][10]));
+
+            if(*num_threads < 1 || *num_threads > MAX_SERVER_THREADS) {
+                fprintf(stderr, "The number of threads must be between 1 and %d!\n", MAX_SERVER_THREADS);
+                usage();
+            }
+        }
+
+        if(strncmp(argv[i],"--sync-interval=",16) == 0) {
+            *sync_interval_s = atoi(&(argv[i][16]));
+
+            if(*sync_interval_s < 0 || *sync_interval_s > 86400) {
+                fprintf(stderr, "The sync interval must be between 0 and 86400 seconds!\n");
+                usage();
+            }
+        }
+
+        if(strncmp(argv[i],"--config=",9) == 0) {
+            config_file = &(argv[i][9]);
+        }
+
+        if(strncmp(argv[i],"--plc=",6) == 0) {
+            has_plc = true;
+        }
+
+        if(strcmp(argv[i],"--debug") == 0) {
+            debug_on();
+            has_debug = true;
+        }
+
+        if(strcmp(argv[i],"--debug-packets") == 0) {
+            debug_packets_on();
+        }
+    }
+
+    if(config_file) {
+        if(has_plc) {
+            fprintf(stderr, "PLCs are defined either on the command line or in the config file, not both!\n");
+            usage();
+        }
+
+        load_config(config_file, plcs, num_plcs);
+    } else {
+        parse_plc_args(argc, argv, add_plc(plcs, num_plcs), has_debug);
+    }
+
+    /* each PLC is told apart by the address clients connect to. */
+    for(size_t i=0; i < *num_plcs; i++) {
+        for(size_t j=0; j < i; j++) {
+            if(strcmp((*plcs)[i].listen_host, (*plcs)[j].listen_host) == 0 &&
+               strcmp((*plcs)[i].listen_port, (*plcs)[j].listen_port) == 0) {
+                fprintf(stderr, "PLCs %zu and %zu both listen on %s:%s!\n", j + 1, i + 1, (*plcs)[i].listen_host, (*plcs)[i].listen_port);
+                usage();
+            }
+        }
+    }
+}
+
+
+/*
+ * Each line that is not blank or a comment defines a PLC with the same
+ * options as the command line, separated by spaces.  The text is kept
+ * because the PLCs point to their data file names in it.
+ */
+void load_config(const char *config_file, plc_s **plcs, size_t *num_plcs)
+{
+    FILE *file = fopen(config_file, "r");
+    const char **args = calloc(CONFIG_MAX_ARGS, sizeof(*args));
+    char *text = NULL;
+    long text_size = 0;
+    int line_num = 0;
+
+    if(!file) {
+        fprintf(stderr, "Unable to open config file \"%s\"!\n", config_file);
+        usage();
+    }
+
+    if(!args) {
+        error("Unable to allocate memory for the config file!");
+    }
+
+    if(fseek(file, 0, SEEK_END) != 0 || (text_size = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Unable to read config file \"%s\"!\n", config_file);
+        usage();
+    }
+
+    text = calloc((size_t)text_size + 1, 1);
+    if(!text) {
+        error("Unable to allocate memory for the config file!");
+    }
+
+    if(fread(text, 1, (size_t)text_size, file) != (size_t)text_size) {
+        fprintf(stderr, "Unable to read config file \"%s\"!\n", config_file);
+        usage();
+    }
+
+    fclose(file);
+
+    for(char *line = text, *next = NULL; line; line = next) {
+        char *comment = NULL;
+        char *save = NULL;
+        int num_args = 0;
+
+        next = strchr(line, '\n');
+        if(next) {
+            *next++ = 0;
+        }
+
+        line_num++;
+
+        comment = strchr(line, '#');
+        if(comment) {
+            *comment = 0;
+        }
+
+        for(char *arg = strtok_r(line, " \t\r", &save); arg; arg = strtok_r(NULL, " \t\r", &save)) {
+            if(num_args >= CONFIG_MAX_ARGS) {
+                fprintf(stderr, "Line %d of config file \"%s\" has more than %d options!\n", line_num, config_file, CONFIG_MAX_ARGS);
+                usage();
+            }
+
+            args[num_args++] = arg;
+        }
+
+        if(num_args > 0) {
+            info("Processing the PLC on line %d of config file %s.", line_num, config_file);
+            parse_plc_args(num_args, args, add_plc(plcs, num_plcs), false);
+        }
+    }
+
+    free(args);
+
+    if(*num_plcs == 0) {
+        fprintf(stderr, "Config file \"%s\" does not define any PLCs!\n", config_file);
+        usage();
+    }
+}
+
+
+/* a new PLC with the defaults and the built-in types. */
+plc_s *add_plc(plc_s **plcs, size_t *num_plcs)
+{
+    plc_s *new_plcs = realloc(*plcs, (*num_plcs + 1) * sizeof(*new_plcs));
+    plc_s *plc = NULL;
+
+    if(!new_plcs) {
+        error("Unable to allocate memory for PLC %zu!", *num_plcs + 1);
+    }
+
+    *plcs = new_plcs;
+    plc = &new_plcs[(*num_plcs)++];
+
+    /* clear out context to make sure we do not get gremlins */
+    memset(plc, 0, sizeof(*plc));
+    plc->session_timeout_ms = (int64_t)PLC_DEFAULT_SESSION_TIMEOUT_S * 1000;
+    snprintf(plc->listen_host, sizeof(plc->listen_host), "%s", PLC_DEFAULT_LISTEN_HOST);
+    snprintf(plc->listen_port, sizeof(plc->listen_port), "%s", PLC_DEFAULT_LISTEN_PORT);
+
+    /* the built-in types come before any that are defined on the command line. */
+    if(!udt_init(plc)) {
+        error("Unable to define the built-in types!");
+    }
+
+    return plc;
+}
+
+
+/* the options for one PLC, from the command line or a line of the config file. */
+void parse_plc_args(int argc, const char **argv, plc_s *plc, bool tags_optional)
 {
     bool has_path = false;
     bool needs_path = false;
     bool has_plc = false;
-    bool has_tag = false;
+    bool has_tag = tags_optional;   /* --debug runs without tags. */
+    bool has_max_packet = false;
 
     for(int i=0; i < argc; i++) {
         if(strncmp(argv[i],"--plc=",6) == 0) {
@@ -115,6 +441,9 @@ void process_args(int argc, const char **argv, plc_s *plc)
                 plc->path_len = 6;
                 plc->client_to_server_max_packet = 508;
                 plc->server_to_client_max_packet = 508;
+                if(!has_max_packet) {
+                    plc->conn_max_packet = 4002;
+                }
                 needs_path = true;
                 has_plc = true;
             } else if(strcasecmp(&(argv[i][6]), "Micro800") == 0) {
@@ -127,6 +456,9 @@ void process_args(int argc, const char **argv, plc_s *plc)
                 plc->path_len = 4;
                 plc->client_to_server_max_packet = 508;
                 plc->server_to_client_max_packet = 508;
+                if(!has_max_packet) {
+                    plc->conn_max_packet = 508;
+                }
                 needs_path = false;
                 has_plc = true;
             } else {
@@ -140,14 +472,59 @@ void process_args(int argc, const char **argv, plc_s *plc)
             has_path = true;
         }
 
+        if(strncmp(argv[i],"--max-packet=",13) == 0) {
+            int max_packet = atoi(&(argv[i][13]));
+
+            if(max_packet < 100 || max_packet > CPF_MAX_CONN_SIZE) {
+                fprintf(stderr, "The maximum connection packet size must be between 100 and %d bytes!\n", CPF_MAX_CONN_SIZE);
+                usage();
+            }
+
+            plc->conn_max_packet = (uint32_t)max_packet;
+            has_max_packet = true;
+        }
+
+        if(strncmp(argv[i],"--udt=",6) == 0) {
+            if(!udt_parse(plc, &(argv[i][6]))) {
+                usage();
+            }
+        }
+
         if(strncmp(argv[i],"--tag=",6) == 0) {
             parse_tag(&(argv[i][6]), plc);
             has_tag = true;
         }
 
-        if(strcmp(argv[i],"--debug") == 0) {
-            debug_on();
-            has_tag = true;
+        if(strncmp(argv[i],"--tags-file=",12) == 0) {
+            if(!tag_file_load(plc, &(argv[i][12]))) {
+                usage();
+            }
+            has_tag = (plc->tags != NULL);
+        }
+
+        if(strncmp(argv[i],"--sim=",6) == 0) {
+            if(!sim_parse(plc, &(argv[i][6]))) {
+                usage();
+            }
+        }
+
+        if(strncmp(argv[i],"--data-file=",12) == 0) {
+            plc->data_file = &(argv[i][12]);
+        }
+
+        if(strncmp(argv[i],"--listen=",9) == 0) {
+            parse_listen(&(argv[i][9]), plc);
+        }
+
+        if(strncmp(argv[i],"--session-timeout=",18) == 0) {
+            int session_timeout_s = atoi(&(argv[i][18]));
+
+            if(session_timeout_s < 0 || session_timeout_s > 86400) {
+                fprintf(stderr, "The session timeout must be between 0 and 86400 seconds!\n");
+                usage();
+            }
+
+            plc->session_timeout_ms = (int64_t)session_timeout_s * 1000;
         }
     }
 
@@ -167,11 +544,6 @@ void process_args(int argc, const char **argv, plc_s *plc)
     }
 }
 
-void parse_plc(const char *plc_str, plc_s *plc)
-{
-
-}
-
 void parse_path(const char *path_str, plc_s *plc)
 {
     int tmp_path[2];
@@ -187,6 +559,33 @@ void parse_path(const char *path_str, plc_s *plc)
 }
 
 
+/* <host>[:<port>], the port defaults to 44818. */
+void parse_listen(const char *listen_str, plc_s *plc)
+{
+    const char *colon = strchr(listen_str, ':');
+    size_t host_len = (colon ? (size_t)(colon - listen_str) : strlen(listen_str));
+
+    if(host_len == 0 || host_len >= sizeof(plc->listen_host)) {
+        fprintf(stderr, "Error processing listen address \"%s\"!  It must be <host>[:<port>].\n", listen_str);
+        usage();
+    }
+
+    memcpy(plc->listen_host, listen_str, host_len);
+    plc->listen_host[host_len] = 0;
+
+    if(colon) {
+        int port = atoi(colon + 1);
+
+        if(port < 1 || port > 65535) {
+            fprintf(stderr, "The listen port in \"%s\" must be between 1 and 65535!\n", listen_str);
+            usage();
+        }
+
+        snprintf(plc->listen_port, sizeof(plc->listen_port), "%d", port);
+    }
+}
+
+
 /*
  * Tags are in the format:
  *    <name>:<type>[<sizes>]
@@ -194,30 +593,36 @@ void parse_path(const char *path_str, plc_s *plc)
  * Where name is alphanumeric, starting with an alpha character.
  * 
  * Type is one of:
+ *     BOOL - boolean.  Arrays are kept as 32-bit words.  Requires array size(s).
+ *     SINT - 1-byte signed integer.  Requires array size(s).
  *     INT - 2-byte signed integer.  Requires array size(s).
  *     DINT - 4-byte signed integer.  Requires array size(s).
  *     LINT - 8-byte signed integer.  Requires array size(s).
  *     REAL - 4-byte floating point number.  Requires array size(s).
  *     LREAL - 8-byte floating point number.  Requires array size(s).
+ *     STRING - Logix string of up to 82 characters.  Requires array size(s).
+ *     or the name of a type defined with --udt.
  *  
  * Array size field is one or more (up to 3) numbers separated by commas.
  */
 
 void parse_tag(const char *tag_str, plc_s *plc)
 {
-    tag_def_s *tag = calloc(1, sizeof(*tag));
+    tag_def_s *tag = arena_alloc(&plc->tag_arena, sizeof(*tag), sizeof(uint64_t));
+    char *name_str = NULL;
     char *type_str = NULL;
     char *dim_str = NULL;
+    int dims[3] = { 0, 0, 0 };
     int num_dims = 0;
 
     if(!tag) {
         error("Unable to allocate memory for new tag!");
     }
 
-    if(sscanf(tag_str,"%m[a-zA-Z0-9_]:%m[A-Z][%m[0-9,]]", &(tag->name), &type_str, &dim_str) != 3) {
+    if(sscanf(tag_str,"%m[a-zA-Z0-9_]:%m[a-zA-Z0-9_][%m[0-9,]]", &name_str, &type_str, &dim_str) != 3) {
         fprintf(stderr, "Tag format is incorrect in \"%s\"!\n", tag_str);
-        if(tag->name) {
-            info("Tag name: %s\n", tag->name);
+        if(name_str) {
+            info("Tag name: %s\n", name_str);
         }
 
         if(type_str) {
@@ -232,25 +637,7 @@ void parse_tag(const char *tag_str, plc_s *plc)
     }
 
     /* match the type. */
-    if(strcasecmp(type_str, "SINT") == 0) {
-        tag->tag_type = TAG_TYPE_SINT;
-        tag->elem_size = 1;
-    } else if(strcasecmp(type_str, "INT") == 0) {
-        tag->tag_type = TAG_TYPE_INT;
-        tag->elem_size = 2;
-    } else if(strcasecmp(type_str, "DINT") == 0) {
-        tag->tag_type = TAG_TYPE_DINT;
-        tag->elem_size = 4;
-    } else if(strcasecmp(type_str, "LINT") == 0) {
-        tag->tag_type = TAG_TYPE_LINT;
-        tag->elem_size = 8;
-    } else if(strcasecmp(type_str, "REAL") == 0) {
-        tag->tag_type = TAG_TYPE_REAL;
-        tag->elem_size = 4;
-    } else if(strcasecmp(type_str, "LREAL") == 0) {
-        tag->tag_type = TAG_TYPE_LREAL;
-        tag->elem_size = 8;
-    } else {
+    if(!tag_type_lookup(plc, type_str, strlen(type_str), &tag->tag_type, &tag->elem_size, &tag->udt)) {
         fprintf(stderr, "Unsupported tag type \"%s\"!", type_str);
         free(type_str);
         free(dim_str);
@@ -259,11 +646,15 @@ void parse_tag(const char *tag_str, plc_s *plc)
 
     free(type_str);
 
+    /* the name is staged with the rest of the definition until the tag table is built. */
+    tag->name = arena_strndup(&plc->tag_arena, name_str, strlen(name_str));
+    free(name_str);
+    if(!tag->name) {
+        error("Unable to allocate memory for tag name!");
+    }
+
     /* match the dimensions. */
-    tag->dimensions[0] = 0;
-    tag->dimensions[1] = 0;
-    tag->dimensions[2] = 0;
-    num_dims = sscanf(dim_str, "%d,%d,%d,%*d", &tag->dimensions[0], &tag->dimensions[1], &tag->dimensions[2]);
+    num_dims = sscanf(dim_str, "%d,%d,%d,%*d", &dims[0], &dims[1], &dims[2]);
 
     free(dim_str);
 
@@ -273,36 +664,20 @@ void parse_tag(const char *tag_str, plc_s *plc)
     }
 
     /* check the dimensions. */
-    if(tag->dimensions[0] <= 0) {
+    if(dims[0] <= 0) {
         fprintf(stderr, "The first tag dimension must be at least 1 and may not be negative!\n");
         usage();
-    } else {
-        tag->elem_count = tag->dimensions[0];
-        tag->num_dimensions = 1;
-    }
-
-    if(tag->dimensions[1] > 0) {
-        tag->elem_count *= tag->dimensions[1];
-        tag->num_dimensions = 2;
-    } else {
-        tag->dimensions[1] = 1;
-    }
-
-    if(tag->dimensions[2] > 0) {
-        tag->elem_count *= tag->dimensions[2];
-        tag->num_dimensions = 3;
-    } else {
-        tag->dimensions[2] = 1;
     }
 
-    /* allocate the tag data array. */
-    info("allocating %d elements of %d bytes each.", tag->elem_count, tag->elem_size);
-    tag->data = calloc(tag->elem_count, (size_t)tag->elem_size);
+    /* trailing zero dimensions are left out. */
+    num_dims = (dims[2] > 0 ? 3 : (dims[1] > 0 ? 2 : 1));
 
-    if(!tag->data) {
-        free(tag->name);
+    if(!tag_set_size(tag, dims, num_dims)) {
+        fprintf(stderr, "Tag %s is too large, or is a BOOL array with more than one dimension!\n", tag->name);
+        usage();
     }
 
+    /* the data is laid out with all the other tags' by tag_store_open(). */
     info("Processed \"%s\" into tag %s of type %x with dimensions (%d, %d, %d).", tag_str, tag->name, tag->tag_type, tag->dimensions[0], tag->dimensions[1], tag->dimensions[2]);
 
     /* add the tag to the list. */
@@ -310,19 +685,51 @@ void parse_tag(const char *tag_str, plc_s *plc)
     plc->tags = tag;
 }
 
+/* each new client gets its own session state. */
+void *conn_open(tcp_conn_p tcp_conn, void *plc)
+{
+    return session_create((plc_s *)plc, tcp_conn);
+}
+
+
+void conn_close(void *session)
+{
+    session_destroy((session_s *)session);
+}
+
+
+void *server_thread(void *server)
+{
+    tcp_server_start((tcp_server_p)server);
+
+    return NULL;
+}
+
+
 /*
  * Process each request.  Dispatch to the correct 
  * request type handler.
+ *
+ * The input may hold more than one pipelined EIP packet.  Only the first
+ * is handled here, the TCP server calls again for the rest.
  */
 
-slice_s request_handler(slice_s input, slice_s output, void *plc)
+slice_s request_handler(slice_s input, slice_s output, size_t *used, void *session)
 {
     /* check to see if we have a full packet. */
     if(slice_len(input) >= EIP_HEADER_SIZE) {
         uint16_t eip_len = slice_get_uint16_le(input, 2);
 
         if(slice_len(input) >= (EIP_HEADER_SIZE + eip_len)) {
-            return eip_dispatch_request(input, output, (plc_s *)plc);
+            slice_s response;
+
+            *used = EIP_HEADER_SIZE + (size_t)eip_len;
+            response = eip_dispatch_request(slice_from_slice(input, 0, *used), output, (session_s *)session);
+
+            /* any tag data referenced by the response goes out right after it. */
+            session_send_tail((session_s *)session);
+
+            return response;
         } 
     } 
     
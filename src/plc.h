@@ -20,11 +20,16 @@
 
 #pragma once
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include "arena.h"
 
 
 typedef uint16_t tag_type_t;
 
+#define TAG_TYPE_BOOL        ((tag_type_t)0x00C1) /* Boolean value, a byte that is 0 or 1 */
 #define TAG_TYPE_SINT        ((tag_type_t)0x00C2) /* Signed 8–bit integer value */
 #define TAG_TYPE_INT         ((tag_type_t)0x00C3) /* Signed 16–bit integer value */
 #define TAG_TYPE_DINT        ((tag_type_t)0x00C4) /* Signed 32–bit integer value */
@@ -35,16 +40,33 @@ typedef uint16_t tag_type_t;
 #define TAG_TYPE_ULINT       ((tag_type_t)0x00C9) /* Unsigned 64–bit integer value */
 #define TAG_TYPE_REAL        ((tag_type_t)0x00CA) /* 32–bit floating point value, IEEE format */
 #define TAG_TYPE_LREAL       ((tag_type_t)0x00CB) /* 64–bit floating point value, IEEE format */
+#define TAG_TYPE_BOOL_ARRAY  ((tag_type_t)0x00D3) /* 32-bit words of a BOOL array */
+#define TAG_TYPE_STRUCT      ((tag_type_t)0x02A0) /* structure, followed by its handle in requests and responses */
+
+struct udt_def_s;
+struct sim_s;
+struct sim_engine_s;
+struct io_engine_s;
+struct discovery_s;
 
 struct tag_def_s {
     struct tag_def_s *next_tag;
     char *name;
+    size_t name_len;
+    uint32_t name_hash;     /* case-insensitive hash of the name, see tag.h. */
+    uint32_t instance_id;   /* symbol object instance, used when listing tags. */
     tag_type_t tag_type;
+    struct udt_def_s *udt;  /* the structure type if tag_type is TAG_TYPE_STRUCT. */
     int elem_size;
-    int elem_count;
+    int elem_count;         /* 32-bit words for BOOL arrays, whose dimensions are in bits. */
     int num_dimensions;
     int dimensions[3];
     uint8_t *data;
+    struct sim_s *sim;      /* the generator updating the value, if any.  See sim.h. */
+
+    /* readers never lock the data, see tag_read_data() in tag.h. */
+    uint32_t data_seq;              /* odd while a write is in progress. */
+    pthread_rwlock_t data_lock;     /* held exclusively by writers, shared while data is sent in place. */
 };
 
 typedef struct tag_def_s tag_def_s;
@@ -54,28 +76,87 @@ typedef enum {
     PLC_MICRO800
 } plc_type_t;
 
-/* Define the context that is passed around. */
+/* how many CIP connections the simulated PLC accepts across all sessions. */
+#define PLC_MAX_CONNS (500)
+
+/* room for the encoded identity item, see eip_identity_build(). */
+#define PLC_IDENTITY_MAX_SIZE (96)
+
+/* Define the PLC-wide context that is shared by all sessions. */
 typedef struct {
     plc_type_t plc_type;
     uint8_t path[16];
     uint8_t path_len;
 
-    /* connection info. */
-    uint32_t session_handle;
-    uint64_t sender_context;
-    uint32_t server_connection_id;
-    uint16_t server_connection_seq;
-    uint32_t server_to_client_rpi;
-    uint32_t client_connection_id;
-    uint16_t client_connection_seq;
-    uint16_t client_connection_serial_number;
-    uint16_t client_vendor_id;
-    uint32_t client_serial_number;
-    uint32_t client_to_server_rpi;
+    /* the address clients connect to, over TCP and UDP.  Each PLC has its own. */
+    char listen_host[64];
+    char listen_port[8];
+
+    /* where the tag values persist, NULL to keep them in memory.  See tag_store.h. */
+    const char *data_file;
 
+    /* packet sizes used for unconnected messaging. */
     uint32_t client_to_server_max_packet;
     uint32_t server_to_client_max_packet;
 
-    /* list of tags served by this "PLC" */
+    /* largest connection size a Forward Open may negotiate. */
+    uint32_t conn_max_packet;
+
+    /* number of CIP connections currently open on this PLC.  Updated atomically. */
+    int num_conns;
+
+    /* a session with no CIP connections is closed after this long without a request, 0 to never close it. */
+    int64_t session_timeout_ms;
+
+    /*
+     * Tags defined on the command line or in a file, newest first.  They
+     * and their names are staged in the arena until tag_index_build()
+     * moves them into tag_defs.
+     */
     struct tag_def_s *tags;
-} plc_s;
\ No newline at end of file
+    arena_s tag_arena;
+
+    /* user-defined structure types, in template instance order.  See udt.h. */
+    struct udt_def_s **udts;
+    size_t num_udts;
+    arena_s udt_arena;
+
+    /* the data of all tags in one region, mapped from a file if it persists.  See tag_store.h. */
+    uint8_t *tag_data;
+    size_t tag_data_size;
+    int tag_data_fd;        /* -1 if the data is not in a file. */
+
+    /* the thread that flushes the data file, if sync_interval_ms is above zero. */
+    int sync_interval_ms;
+    bool sync_running;      /* cleared under sync_lock to stop the thread. */
+    pthread_t sync_thread;
+    pthread_mutex_t sync_lock;
+    pthread_cond_t sync_wake;
+
+    /* open addressing hash index over tag_defs, built once at startup. */
+    struct tag_def_s **tag_index;
+    size_t tag_index_size;  /* always a power of two. */
+
+    /* all tags in one array in instance ID order, their names packed after it. */
+    struct tag_def_s *tag_defs;
+    size_t num_tags;
+
+    /* the symbol listings, encoded once when the index is built. */
+    struct tag_list_cache_s *tag_list_caches;
+
+    /* value generators and the thread, shared by all PLCs, that runs them. */
+    struct sim_s *sims;
+    size_t num_sims;
+    struct sim_engine_s *sim_engine;
+
+    /* class 1 I/O connections for all PLCs, NULL if UDP port 2222 could not be opened.  See io_conn.h. */
+    struct io_engine_s *io_engine;
+
+    /* the identity object, encoded once as the ListIdentity reply.  See eip.h. */
+    uint32_t serial_number;
+    uint8_t identity[PLC_IDENTITY_MAX_SIZE];
+    size_t identity_size;
+
+    /* discovery requests on UDP for all PLCs, NULL if this PLC's port could not be opened.  See discovery.h. */
+    struct discovery_s *discovery;
+} plc_s;
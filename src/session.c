@@ -0,0 +1,293 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include "cpf.h"
+#include "eip.h"
+#include "io_conn.h"
+#include "plc.h"
+#include "session.h"
+#include "tag.h"
+#include "tcp_server.h"
+#include "timer.h"
+#include "utils.h"
+
+
+static void release_tail(void *session);
+static void session_idle_timeout(void *session);
+static void conn_timeout(void *conn);
+
+
+static inline size_t conn_bucket(uint32_t conn_id)
+{
+    /* connection IDs are random, but mix them anyway in case a client picks its own. */
+    return (size_t)((conn_id * (uint32_t)0x9E3779B1) >> 26) & (SESSION_CONN_BUCKETS - 1);
+}
+
+
+session_s *session_create(plc_s *plc, tcp_conn_p tcp_conn)
+{
+    session_s *session = calloc(1, sizeof(*session));
+
+    if(!session) {
+        warning("Unable to allocate new session!");
+        return NULL;
+    }
+
+    session->plc = plc;
+    session->tcp_conn = tcp_conn;
+
+    timer_init(&session->idle_timer, session_idle_timeout, session);
+    if(tcp_conn) {
+        session->timers = tcp_conn_get_timers(tcp_conn);
+        session->last_activity_ms = timer_wheel_now(session->timers);
+
+        if(plc->session_timeout_ms > 0) {
+            timer_start(session->timers, &session->idle_timer, session->last_activity_ms + plc->session_timeout_ms);
+        }
+    }
+
+    /* start out with enough room for unconnected messages. */
+    session_fit_buffers(session, (plc->client_to_server_max_packet > plc->server_to_client_max_packet ?
+                                  plc->client_to_server_max_packet : plc->server_to_client_max_packet));
+
+    return session;
+}
+
+
+void session_destroy(session_s *session)
+{
+    if(!session) {
+        return;
+    }
+
+    for(size_t i=0; i < SESSION_CONN_BUCKETS; i++) {
+        while(session->conns[i]) {
+            session_remove_conn(session, session->conns[i]);
+        }
+    }
+
+    if(session->timers) {
+        timer_stop(session->timers, &session->idle_timer);
+    }
+
+    free(session->frag_write.data);
+    free(session);
+}
+
+
+/*
+ * Allocate a new connection with a server connection ID that is not
+ * already in use.  Returns NULL if the PLC is out of connections.
+ */
+conn_s *session_add_conn(session_s *session)
+{
+    conn_s *conn = NULL;
+    uint32_t conn_id = 0;
+    size_t bucket = 0;
+
+    /* sessions on other threads share the PLC's connection count. */
+    if(__atomic_add_fetch(&session->plc->num_conns, 1, __ATOMIC_RELAXED) > PLC_MAX_CONNS) {
+        __atomic_sub_fetch(&session->plc->num_conns, 1, __ATOMIC_RELAXED);
+        info("PLC is out of connections, %d are in use.", PLC_MAX_CONNS);
+        return NULL;
+    }
+
+    conn = calloc(1, sizeof(*conn));
+    if(!conn) {
+        __atomic_sub_fetch(&session->plc->num_conns, 1, __ATOMIC_RELAXED);
+        warning("Unable to allocate new connection!");
+        return NULL;
+    }
+
+    do {
+        conn_id = (uint32_t)rand();
+    } while(conn_id == 0 || session_find_conn(session, conn_id));
+
+    conn->server_connection_id = conn_id;
+    conn->session = session;
+    timer_init(&conn->timeout_timer, conn_timeout, conn);
+
+    bucket = conn_bucket(conn_id);
+    conn->next_conn = session->conns[bucket];
+    session->conns[bucket] = conn;
+
+    session->num_conns++;
+
+    return conn;
+}
+
+
+conn_s *session_find_conn(session_s *session, uint32_t server_connection_id)
+{
+    conn_s *conn = session->conns[conn_bucket(server_connection_id)];
+
+    while(conn && conn->server_connection_id != server_connection_id) {
+        conn = conn->next_conn;
+    }
+
+    return conn;
+}
+
+
+/* Forward Close identifies the connection by the connection triad, not the ID. */
+conn_s *session_find_conn_by_serial(session_s *session, uint16_t conn_serial_number, uint16_t vendor_id, uint32_t orig_serial_number)
+{
+    for(size_t i=0; i < SESSION_CONN_BUCKETS; i++) {
+        for(conn_s *conn = session->conns[i]; conn; conn = conn->next_conn) {
+            if(conn->client_connection_serial_number == conn_serial_number &&
+               conn->client_vendor_id == vendor_id &&
+               conn->client_serial_number == orig_serial_number) {
+                return conn;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+void session_remove_conn(session_s *session, conn_s *conn)
+{
+    conn_s **walker = &session->conns[conn_bucket(conn->server_connection_id)];
+
+    while(*walker && *walker != conn) {
+        walker = &((*walker)->next_conn);
+    }
+
+    if(*walker) {
+        *walker = conn->next_conn;
+        session->num_conns--;
+        __atomic_sub_fetch(&session->plc->num_conns, 1, __ATOMIC_RELAXED);
+    }
+
+    if(session->timers) {
+        timer_stop(session->timers, &conn->timeout_timer);
+    }
+
+    if(conn->io) {
+        io_conn_close(session->plc, conn->io);
+    }
+
+    free(conn);
+}
+
+
+/*
+ * Start the connection's inactivity timeout.  Like a real controller's,
+ * it is the O->T RPI times 4 << the Forward Open's timeout multiplier.
+ * An RPI of 0 means the connection never times out.
+ */
+void session_set_conn_timeout(session_s *session, conn_s *conn, uint32_t rpi_us, uint8_t timeout_multiplier)
+{
+    int64_t timeout_us = (int64_t)rpi_us * ((int64_t)4 << (timeout_multiplier & 0x07));
+
+    if(!session->timers || rpi_us == 0) {
+        return;
+    }
+
+    conn->timeout_ms = (timeout_us + 999) / 1000;
+    conn->last_activity_ms = timer_wheel_now(session->timers);
+
+    timer_start(session->timers, &conn->timeout_timer, conn->last_activity_ms + conn->timeout_ms);
+}
+
+
+
+/*
+ * Make sure the client's buffers can hold a CIP packet of the given size
+ * plus the EIP and CPF headers.  Buffers only grow, a client that
+ * negotiated a large connection once is likely to do so again.
+ */
+void session_fit_buffers(session_s *session, uint32_t packet_size)
+{
+    if(packet_size > session->buffer_packet_size) {
+        session->buffer_packet_size = packet_size;
+
+        if(session->tcp_conn) {
+            tcp_conn_set_buffer_size(session->tcp_conn, EIP_HEADER_SIZE + CPF_CONN_HEADER_SIZE + (size_t)packet_size);
+        }
+    }
+}
+
+
+
+/* hand the pinned tag data of the current response to the TCP connection to send after the buffer. */
+void session_send_tail(session_s *session)
+{
+    response_tail_s *tail = &session->tail;
+
+    if(!tail->tag) {
+        return;
+    }
+
+    tcp_conn_set_tail(session->tcp_conn, slice_make(tail->tag->data + tail->offset, (ssize_t)tail->len), release_tail, session);
+}
+
+
+void release_tail(void *session_arg)
+{
+    session_s *session = (session_s *)session_arg;
+
+    if(session->tail.tag) {
+        tag_unpin_data(session->tail.tag);
+        session->tail.tag = NULL;
+        session->tail.len = 0;
+    }
+}
+
+
+/* only a session with no CIP connections is idle, the connections have their own timeouts. */
+void session_idle_timeout(void *session_arg)
+{
+    session_s *session = (session_s *)session_arg;
+    int64_t now_ms = timer_wheel_now(session->timers);
+    int64_t idle_until_ms = session->last_activity_ms + session->plc->session_timeout_ms;
+
+    if(session->num_conns == 0 && now_ms >= idle_until_ms) {
+        info("Closing session %x, it has been idle for %lld ms.", session->session_handle, (long long)(now_ms - session->last_activity_ms));
+        tcp_conn_close(session->tcp_conn);
+        return;
+    }
+
+    timer_start(session->timers, &session->idle_timer, (now_ms >= idle_until_ms ? now_ms + session->plc->session_timeout_ms : idle_until_ms));
+}
+
+
+/*
+ * Requests do not move the timer, they only note the time.  When the timer
+ * fires, it either finds the connection idle for the whole timeout or
+ * starts again for the rest of it.
+ */
+void conn_timeout(void *conn_arg)
+{
+    conn_s *conn = (conn_s *)conn_arg;
+    session_s *session = conn->session;
+    int64_t now_ms = timer_wheel_now(session->timers);
+    int64_t last_activity_ms = (conn->io ? io_conn_last_activity_ms(conn->io) : conn->last_activity_ms);
+
+    if(now_ms - last_activity_ms >= conn->timeout_ms) {
+        info("Connection %x timed out after %lld ms without data.", conn->server_connection_id, (long long)(now_ms - last_activity_ms));
+        session_remove_conn(session, conn);
+        return;
+    }
+
+    timer_start(session->timers, &conn->timeout_timer, last_activity_ms + conn->timeout_ms);
+}
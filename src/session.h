@@ -0,0 +1,115 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include "plc.h"
+#include "tcp_server.h"
+#include "timer.h"
+
+/* number of buckets in the per-session connection table.  Must be a power of two. */
+#define SESSION_CONN_BUCKETS (64)
+
+struct io_conn_s;
+struct session_s;
+
+/* one CIP connection created by a Forward Open. */
+typedef struct conn_s {
+    struct conn_s *next_conn;   /* next connection in the same hash bucket. */
+
+    uint32_t server_connection_id;
+    uint16_t server_connection_seq;
+    uint32_t server_to_client_rpi;
+    uint32_t client_connection_id;
+    uint16_t client_connection_seq;
+    uint16_t client_connection_serial_number;
+    uint16_t client_vendor_id;
+    uint32_t client_serial_number;
+    uint32_t client_to_server_rpi;
+
+    uint32_t client_to_server_max_packet;
+    uint32_t server_to_client_max_packet;
+
+    struct io_conn_s *io;       /* the UDP side of a class 1 connection, NULL for class 3. */
+
+    /* the connection is dropped when nothing comes in for its timeout, the O->T RPI times the multiplier. */
+    struct session_s *session;
+    timer_s timeout_timer;
+    int64_t timeout_ms;         /* 0 if the connection does not time out. */
+    int64_t last_activity_ms;
+} conn_s;
+
+/*
+ * A fragmented write in progress.  The fragments are gathered here and
+ * written to the tag in one go with the last one, so readers never see
+ * a partly written range.
+ */
+typedef struct {
+    tag_def_s *tag;         /* NULL if no write is in progress. */
+    size_t start_offset;    /* byte offset in the tag of the first element. */
+    size_t total_size;      /* bytes in the whole write. */
+    size_t received;        /* bytes gathered so far. */
+    uint8_t *data;
+    size_t capacity;
+} frag_write_s;
+
+/*
+ * Tag data that follows the response in the output buffer.  It is sent
+ * from the tag without being copied.  The tag is pinned until it is sent.
+ */
+typedef struct {
+    tag_def_s *tag;         /* NULL when the whole response is in the buffer. */
+    size_t offset;
+    size_t len;
+} response_tail_s;
+
+/* one EIP session.  Each TCP client gets its own. */
+typedef struct session_s {
+    plc_s *plc;
+    uint32_t session_handle;
+
+    /* the client's TCP connection and the CIP packet size its buffers are sized for. */
+    tcp_conn_p tcp_conn;
+    uint32_t buffer_packet_size;
+
+    /* CIP connections opened on this session, hashed by server connection ID. */
+    int num_conns;
+    conn_s *conns[SESSION_CONN_BUCKETS];
+
+    frag_write_s frag_write;
+
+    response_tail_s tail;
+
+    /* a session without CIP connections is closed after the PLC's session timeout without requests. */
+    timer_wheel_s *timers;
+    timer_s idle_timer;
+    int64_t last_activity_ms;
+} session_s;
+
+extern session_s *session_create(plc_s *plc, tcp_conn_p tcp_conn);
+extern void session_destroy(session_s *session);
+extern conn_s *session_add_conn(session_s *session);
+extern conn_s *session_find_conn(session_s *session, uint32_t server_connection_id);
+extern conn_s *session_find_conn_by_serial(session_s *session, uint16_t conn_serial_number, uint16_t vendor_id, uint32_t orig_serial_number);
+extern void session_remove_conn(session_s *session, conn_s *conn);
+extern void session_set_conn_timeout(session_s *session, conn_s *conn, uint32_t rpi_us, uint8_t timeout_multiplier);
+extern void session_fit_buffers(session_s *session, uint32_t packet_size);
+extern void session_send_tail(session_s *session);
@@ -0,0 +1,585 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "plc.h"
+#include "sim.h"
+#include "slice.h"
+#include "tag.h"
+#include "timer.h"
+#include "utils.h"
+
+
+/* after a stall, drop the backlog instead of running it all at once. */
+#define SIM_MAX_CATCH_UP_TICKS (50)
+
+#define SIM_MAX_PARAMS (4)
+
+typedef struct sim_engine_s {
+    pthread_t thread;
+    bool running;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    /* sim_stop() wakes the thread early to stop. */
+    timer_wheel_s timers;
+    uint64_t rng_state;
+
+    /* the tag's data and the same values as doubles, grown to the largest tag. */
+    uint8_t *data;
+    double *values;
+    size_t capacity;
+} sim_engine_s;
+
+static const struct {
+    const char *name;
+    sim_kind_t kind;
+    int max_params;
+    double defaults[3];
+} sim_kinds[] = {
+    { "ramp", SIM_RAMP, 3, { 0.0, 100.0, 1.0 } },
+    { "sine", SIM_SINE, 3, { -100.0, 100.0, 10000.0 } },
+    { "random", SIM_RANDOM, 3, { -100.0, 100.0, 1.0 } },
+    { "counter", SIM_COUNTER, 1, { 1.0, 0.0, 0.0 } },
+    { "toggle", SIM_TOGGLE, 0, { 0.0, 0.0, 0.0 } }
+};
+
+static bool parse_number(slice_s field, double *value);
+static bool attach_sims(sim_engine_s *engine, plc_s *plc);
+static void *sim_thread(void *engine);
+static void sim_fire(void *sim);
+static void run_sim(sim_engine_s *engine, sim_s *sim, int64_t now_ms);
+static bool type_range(tag_type_t tag_type, double *low, double *high);
+static void load_values(tag_type_t tag_type, const uint8_t *data, double *values, size_t count);
+static void store_values(tag_type_t tag_type, const double *values, uint8_t *data, size_t count, bool wrap);
+static double next_random(sim_engine_s *engine);
+
+
+bool sim_add(plc_s *plc, slice_s tag_name, slice_s generator, const slice_s *params, int num_params)
+{
+    sim_s *sims = NULL;
+    sim_s *sim = NULL;
+    double values[SIM_MAX_PARAMS] = { 0 };
+    double period_ms = 0;
+    int kind_index = -1;
+
+    for(size_t i=0; i < sizeof(sim_kinds)/sizeof(sim_kinds[0]); i++) {
+        if(strlen(sim_kinds[i].name) == (size_t)slice_len(generator) && strncasecmp(sim_kinds[i].name, (const char *)generator.data, (size_t)slice_len(generator)) == 0) {
+            kind_index = (int)i;
+            break;
+        }
+    }
+
+    if(kind_index < 0) {
+        fprintf(stderr, "Unknown generator \"%.*s\" for tag %.*s!\n", (int)slice_len(generator), (const char *)generator.data, (int)slice_len(tag_name), (const char *)tag_name.data);
+        return false;
+    }
+
+    if(num_params < 1 || num_params > 1 + sim_kinds[kind_index].max_params) {
+        fprintf(stderr, "The %s generator takes a period and at most %d more values!\n", sim_kinds[kind_index].name, sim_kinds[kind_index].max_params);
+        return false;
+    }
+
+    for(int i=0; i < num_params; i++) {
+        if(!parse_number(params[i], &values[i])) {
+            fprintf(stderr, "Generator value \"%.*s\" for tag %.*s is not a number!\n", (int)slice_len(params[i]), (const char *)params[i].data, (int)slice_len(tag_name), (const char *)tag_name.data);
+            return false;
+        }
+    }
+
+    period_ms = values[0];
+    if(period_ms < SIM_TICK_MS || period_ms > 86400000.0) {
+        fprintf(stderr, "The period for tag %.*s must be between %d ms and a day!\n", (int)slice_len(tag_name), (const char *)tag_name.data, SIM_TICK_MS);
+        return false;
+    }
+
+    sims = realloc(plc->sims, (plc->num_sims + 1) * sizeof(*plc->sims));
+    if(!sims) {
+        error("Unable to allocate memory for the generator of tag %.*s!", (int)slice_len(tag_name), (const char *)tag_name.data);
+    }
+
+    plc->sims = sims;
+    sim = &plc->sims[plc->num_sims];
+    memset(sim, 0, sizeof(*sim));
+
+    sim->tag_name = strndup((const char *)tag_name.data, (size_t)slice_len(tag_name));
+    if(!sim->tag_name) {
+        error("Unable to allocate memory for the generator of tag %.*s!", (int)slice_len(tag_name), (const char *)tag_name.data);
+    }
+
+    sim->kind = sim_kinds[kind_index].kind;
+    sim->period_ticks = (uint32_t)((period_ms + SIM_TICK_MS - 1) / SIM_TICK_MS);
+
+    /* the values after the period, or the defaults. */
+    for(int i=1; i < 1 + sim_kinds[kind_index].max_params; i++) {
+        if(i >= num_params) {
+            values[i] = sim_kinds[kind_index].defaults[i - 1];
+        }
+    }
+
+    if(sim->kind == SIM_COUNTER) {
+        sim->step = values[1];
+    } else {
+        sim->min = values[1];
+        sim->max = values[2];
+        sim->step = values[3];
+    }
+
+    if(sim->min > sim->max || (sim->kind == SIM_SINE && sim->step <= 0)) {
+        fprintf(stderr, "The minimum for tag %s must not be above the maximum, and a wave period must be positive!\n", sim->tag_name);
+        free(sim->tag_name);
+        return false;
+    }
+
+    plc->num_sims++;
+
+    return true;
+}
+
+
+bool sim_parse(plc_s *plc, const char *sim_str)
+{
+    slice_s fields[2 + 1 + SIM_MAX_PARAMS];
+    int num_fields = 0;
+    const char *pos = sim_str;
+
+    while(num_fields < (int)(sizeof(fields)/sizeof(fields[0]))) {
+        const char *end = strchr(pos, ':');
+
+        if(!end) {
+            end = pos + strlen(pos);
+        }
+
+        fields[num_fields] = slice_make((uint8_t *)pos, (ssize_t)(end - pos));
+        num_fields++;
+
+        if(!*end) {
+            break;
+        }
+
+        pos = end + 1;
+    }
+
+    if(num_fields < 3 || strchr(pos, ':')) {
+        fprintf(stderr, "Generator format is incorrect in \"%s\"!\n", sim_str);
+        return false;
+    }
+
+    return sim_add(plc, fields[0], fields[1], &fields[2], num_fields - 2);
+}
+
+
+bool sim_start(plc_s *plcs, size_t num_plcs)
+{
+    sim_engine_s *engine = NULL;
+    pthread_condattr_t cond_attr;
+    size_t num_sims = 0;
+
+    for(size_t i=0; i < num_plcs; i++) {
+        num_sims += plcs[i].num_sims;
+    }
+
+    if(num_sims == 0) {
+        return true;
+    }
+
+    engine = calloc(1, sizeof(*engine));
+    if(!engine) {
+        error("Unable to allocate memory for the simulation engine!");
+    }
+
+    engine->rng_state = (uint64_t)util_time_ms() | 1;
+    timer_wheel_init(&engine->timers);
+
+    for(size_t i=0; i < num_plcs; i++) {
+        if(!attach_sims(engine, &plcs[i])) {
+            free(engine);
+            return false;
+        }
+    }
+
+    engine->data = malloc(engine->capacity * sizeof(uint64_t));
+    engine->values = malloc(engine->capacity * sizeof(double));
+    if(!engine->data || !engine->values) {
+        error("Unable to allocate memory for the simulation engine!");
+    }
+
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&engine->wake, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    pthread_mutex_init(&engine->lock, NULL);
+
+    engine->running = true;
+
+    if(pthread_create(&engine->thread, NULL, sim_thread, engine) != 0) {
+        fprintf(stderr, "Unable to start the simulation thread!\n");
+        pthread_cond_destroy(&engine->wake);
+        pthread_mutex_destroy(&engine->lock);
+        free(engine->data);
+        free(engine->values);
+        free(engine);
+        return false;
+    }
+
+    for(size_t i=0; i < num_plcs; i++) {
+        plcs[i].sim_engine = engine;
+    }
+
+    fprintf(stderr, "Simulating %d tags.\n", (int)num_sims);
+
+    return true;
+}
+
+
+void sim_stop(plc_s *plcs, size_t num_plcs)
+{
+    sim_engine_s *engine = (num_plcs > 0 ? plcs[0].sim_engine : NULL);
+
+    if(engine) {
+        pthread_mutex_lock(&engine->lock);
+        engine->running = false;
+        pthread_cond_signal(&engine->wake);
+        pthread_mutex_unlock(&engine->lock);
+
+        pthread_join(engine->thread, NULL);
+
+        pthread_cond_destroy(&engine->wake);
+        pthread_mutex_destroy(&engine->lock);
+
+        free(engine->data);
+        free(engine->values);
+        free(engine);
+    }
+
+    for(size_t p=0; p < num_plcs; p++) {
+        plc_s *plc = &plcs[p];
+
+        plc->sim_engine = NULL;
+
+        for(size_t i=0; i < plc->num_sims; i++) {
+            if(plc->sims[i].tag) {
+                plc->sims[i].tag->sim = NULL;
+            }
+
+            free(plc->sims[i].tag_name);
+        }
+
+        free(plc->sims);
+        plc->sims = NULL;
+        plc->num_sims = 0;
+    }
+}
+
+
+/* find the PLC's simulated tags and put their generators on the wheel. */
+bool attach_sims(sim_engine_s *engine, plc_s *plc)
+{
+    for(size_t i=0; i < plc->num_sims; i++) {
+        sim_s *sim = &plc->sims[i];
+        tag_def_s *tag = tag_find(plc, slice_make((uint8_t *)sim->tag_name, (ssize_t)strlen(sim->tag_name)));
+        size_t count = 0;
+
+        if(!tag) {
+            fprintf(stderr, "There is no tag %s to simulate!\n", sim->tag_name);
+            return false;
+        }
+
+        if(tag->udt) {
+            fprintf(stderr, "Tag %s is a structure, which cannot be simulated!\n", tag->name);
+            return false;
+        }
+
+        if(tag->sim) {
+            fprintf(stderr, "Tag %s has more than one generator!\n", tag->name);
+            return false;
+        }
+
+        tag->sim = sim;
+        sim->tag = tag;
+
+        count = (size_t)tag->elem_count;
+        if(count > engine->capacity) {
+            engine->capacity = count;
+        }
+
+        sim->engine = engine;
+        timer_init(&sim->timer, sim_fire, sim);
+
+        /* spread the first updates over a period so that tags with the same period do not all land on one tick. */
+        timer_start(&engine->timers, &sim->timer, timer_wheel_now(&engine->timers) + (int64_t)(1 + i % sim->period_ticks) * SIM_TICK_MS);
+    }
+
+    return true;
+}
+
+
+bool parse_number(slice_s field, double *value)
+{
+    char buf[64];
+    char *end = NULL;
+
+    if(slice_len(field) == 0 || (size_t)slice_len(field) >= sizeof(buf)) {
+        return false;
+    }
+
+    memcpy(buf, field.data, (size_t)slice_len(field));
+    buf[slice_len(field)] = 0;
+
+    *value = strtod(buf, &end);
+
+    return (*end == 0 && isfinite(*value));
+}
+
+
+void *sim_thread(void *engine_arg)
+{
+    sim_engine_s *engine = (sim_engine_s *)engine_arg;
+    struct timespec wake_at;
+
+    pthread_mutex_lock(&engine->lock);
+
+    while(engine->running) {
+        int wait_ms = 0;
+
+        pthread_mutex_unlock(&engine->lock);
+
+        timer_wheel_set_now(&engine->timers, timer_now_ms());
+        timer_wheel_run(&engine->timers);
+        wait_ms = timer_wheel_wait_ms(&engine->timers);
+
+        pthread_mutex_lock(&engine->lock);
+
+        /* generators always start their timer again, so there is always one to sleep until. */
+        if(engine->running && wait_ms > 0) {
+            clock_gettime(CLOCK_MONOTONIC, &wake_at);
+            wake_at.tv_sec += wait_ms / 1000;
+            wake_at.tv_nsec += (long)(wait_ms % 1000) * 1000000;
+
+            if(wake_at.tv_nsec >= 1000000000) {
+                wake_at.tv_sec++;
+                wake_at.tv_nsec -= 1000000000;
+            }
+
+            pthread_cond_timedwait(&engine->wake, &engine->lock, &wake_at);
+        }
+    }
+
+    pthread_mutex_unlock(&engine->lock);
+
+    return NULL;
+}
+
+
+/* run the generator and start its timer again for the next period. */
+void sim_fire(void *sim_arg)
+{
+    sim_s *sim = (sim_s *)sim_arg;
+    sim_engine_s *engine = sim->engine;
+    int64_t now_ms = timer_wheel_now(&engine->timers);
+    int64_t period_ms = (int64_t)sim->period_ticks * SIM_TICK_MS;
+    int64_t expires_ms = sim->timer.expires_ms + period_ms;
+
+    run_sim(engine, sim, util_time_ms());
+
+    /* after a stall, drop the backlog instead of running it all at once. */
+    if(now_ms - sim->timer.expires_ms > SIM_MAX_CATCH_UP_TICKS * SIM_TICK_MS) {
+        warning("simulation of tag %s fell %d ms behind, skipping ahead.", sim->tag->name, (int)(now_ms - sim->timer.expires_ms));
+        expires_ms = now_ms + period_ms;
+    }
+
+    timer_start(&engine->timers, &sim->timer, expires_ms);
+}
+
+
+/*
+ * The values are worked on as doubles, one simple loop per step, so
+ * that the compiler can vectorize each one.  Generators that start from
+ * the current values keep other writers off the tag from the read to the
+ * store, so a client write in between is not lost.  Readers only wait
+ * for the store.
+ */
+void run_sim(sim_engine_s *engine, sim_s *sim, int64_t now_ms)
+{
+    tag_def_s *tag = sim->tag;
+    size_t count = (size_t)tag->elem_count;
+    size_t len = count * (size_t)tag->elem_size;
+    double *values = engine->values;
+    double low = 0;
+    double high = 0;
+
+    if(!type_range(tag->tag_type, &low, &high)) {
+        return;
+    }
+
+    /* a sine wave does not depend on the old values, so it only needs the tag for the store. */
+    if(sim->kind != SIM_SINE) {
+        tag_lock_data(tag);
+        memcpy(engine->data, tag->data, len);
+        load_values(tag->tag_type, engine->data, values, count);
+    }
+
+    switch(sim->kind) {
+        case SIM_RAMP:
+            for(size_t i=0; i < count; i++) {
+                values[i] += sim->step;
+                values[i] = (values[i] > sim->max || values[i] < sim->min ? sim->min : values[i]);
+            }
+            break;
+
+        case SIM_SINE: {
+                double mid = (sim->max + sim->min) / 2.0;
+                double amplitude = (sim->max - sim->min) / 2.0;
+                double phase = fmod((double)now_ms, sim->step) / sim->step;
+
+                for(size_t i=0; i < count; i++) {
+                    values[i] = mid + amplitude * sin(2.0 * M_PI * (phase + (double)i / (double)count));
+                }
+            }
+            break;
+
+        case SIM_RANDOM:
+            for(size_t i=0; i < count; i++) {
+                values[i] += sim->step * next_random(engine);
+                values[i] = (values[i] > sim->max ? sim->max : (values[i] < sim->min ? sim->min : values[i]));
+            }
+            break;
+
+        case SIM_COUNTER:
+            for(size_t i=0; i < count; i++) {
+                values[i] += sim->step;
+            }
+            break;
+
+        case SIM_TOGGLE:
+            for(size_t i=0; i < count; i++) {
+                values[i] = (values[i] == 0.0 ? (tag->tag_type == TAG_TYPE_BOOL_ARRAY ? high : 1.0) : 0.0);
+            }
+            break;
+    }
+
+    store_values(tag->tag_type, values, engine->data, count, (sim->kind == SIM_COUNTER));
+
+    if(sim->kind != SIM_SINE) {
+        tag_replace_data(tag, 0, engine->data, len);
+        tag_unlock_data(tag);
+    } else {
+        tag_write_data(tag, 0, engine->data, len);
+    }
+}
+
+
+/* the values an element can hold.  The top of LINT is the largest double below 2^63. */
+bool type_range(tag_type_t tag_type, double *low, double *high)
+{
+    switch(tag_type) {
+        case TAG_TYPE_BOOL: *low = 0.0; *high = 1.0; break;
+        case TAG_TYPE_SINT: *low = -128.0; *high = 127.0; break;
+        case TAG_TYPE_INT: *low = -32768.0; *high = 32767.0; break;
+        case TAG_TYPE_DINT: *low = -2147483648.0; *high = 2147483647.0; break;
+        case TAG_TYPE_LINT: *low = -9223372036854775808.0; *high = 9223372036854774784.0; break;
+        case TAG_TYPE_BOOL_ARRAY: *low = 0.0; *high = 4294967295.0; break;
+        case TAG_TYPE_REAL: *low = -3.4e38; *high = 3.4e38; break;
+        case TAG_TYPE_LREAL: *low = -1.0e308; *high = 1.0e308; break;
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+
+void load_values(tag_type_t tag_type, const uint8_t *data, double *values, size_t count)
+{
+    switch(tag_type) {
+        case TAG_TYPE_BOOL: for(size_t i=0; i < count; i++) { values[i] = (data[i] ? 1.0 : 0.0); } break;
+        case TAG_TYPE_SINT: for(size_t i=0; i < count; i++) { values[i] = (double)((const int8_t *)data)[i]; } break;
+        case TAG_TYPE_INT: for(size_t i=0; i < count; i++) { values[i] = (double)((const int16_t *)data)[i]; } break;
+        case TAG_TYPE_DINT: for(size_t i=0; i < count; i++) { values[i] = (double)((const int32_t *)data)[i]; } break;
+        case TAG_TYPE_LINT: for(size_t i=0; i < count; i++) { values[i] = (double)((const int64_t *)data)[i]; } break;
+        case TAG_TYPE_BOOL_ARRAY: for(size_t i=0; i < count; i++) { values[i] = (double)((const uint32_t *)data)[i]; } break;
+        case TAG_TYPE_REAL: for(size_t i=0; i < count; i++) { values[i] = (double)((const float *)data)[i]; } break;
+        case TAG_TYPE_LREAL: for(size_t i=0; i < count; i++) { values[i] = ((const double *)data)[i]; } break;
+        default: break;
+    }
+}
+
+
+/* integers are rounded and either wrap like the type or stop at its limits. */
+void store_values(tag_type_t tag_type, const double *values, uint8_t *data, size_t count, bool wrap)
+{
+    double low = 0;
+    double high = 0;
+
+    type_range(tag_type, &low, &high);
+
+    if(tag_type == TAG_TYPE_REAL) {
+        for(size_t i=0; i < count; i++) {
+            ((float *)data)[i] = (float)(values[i] > high ? high : (values[i] < low ? low : values[i]));
+        }
+    } else if(tag_type == TAG_TYPE_LREAL) {
+        for(size_t i=0; i < count; i++) {
+            ((double *)data)[i] = values[i];
+        }
+    } else {
+        double range = high - low + 1.0;
+
+        for(size_t i=0; i < count; i++) {
+            double value = nearbyint(values[i]);
+            int64_t result = 0;
+
+            if(wrap && (value > high || value < low)) {
+                value = fmod(value - low, range);
+                value = (value < 0 ? value + range : value) + low;
+            }
+
+            value = (value > high ? high : (value < low ? low : value));
+            result = (int64_t)value;
+
+            switch(tag_type) {
+                case TAG_TYPE_BOOL: data[i] = (uint8_t)result; break;
+                case TAG_TYPE_SINT: ((int8_t *)data)[i] = (int8_t)result; break;
+                case TAG_TYPE_INT: ((int16_t *)data)[i] = (int16_t)result; break;
+                case TAG_TYPE_DINT: ((int32_t *)data)[i] = (int32_t)result; break;
+                case TAG_TYPE_LINT: ((int64_t *)data)[i] = result; break;
+                case TAG_TYPE_BOOL_ARRAY: ((uint32_t *)data)[i] = (uint32_t)result; break;
+                default: break;
+            }
+        }
+    }
+}
+
+
+/* xorshift64*, scaled to -1.0 .. 1.0. */
+double next_random(sim_engine_s *engine)
+{
+    uint64_t x = engine->rng_state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    engine->rng_state = x;
+
+    return ((double)((x * (uint64_t)2685821657736338717u) >> 11) / 4503599627370496.0) - 1.0;
+}
@@ -0,0 +1,78 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "plc.h"
+#include "slice.h"
+#include "timer.h"
+
+/*
+ * Tag value simulation.  A tag may have one generator that changes every
+ * element of it on a fixed period:
+ *
+ *    ramp:<ms>[:<min>[:<max>[:<step>]]]     adds step, back to min past max.
+ *    sine:<ms>[:<min>[:<max>[:<wave ms>]]]  a sine wave, each element a little later in the wave.
+ *    random:<ms>[:<min>[:<max>[:<step>]]]   a random walk of up to step each way.
+ *    counter:<ms>[:<step>]                  adds step, wrapping as the type does.
+ *    toggle:<ms>                            flips between 0 and 1, or every bit of a BOOL array.
+ *
+ * Ramps, walks, counters and toggles start from the current value, so
+ * they carry on from whatever a client wrote.  Structures and strings
+ * are not simulated.
+ *
+ * One thread runs the generators of all PLCs off its own timer wheel, so
+ * it only wakes when a generator is due.  Each tag's new values are
+ * worked out from a copy of its data and stored in one write.
+ */
+
+#define SIM_TICK_MS (TIMER_TICK_MS)
+
+typedef enum {
+    SIM_RAMP,
+    SIM_SINE,
+    SIM_RANDOM,
+    SIM_COUNTER,
+    SIM_TOGGLE
+} sim_kind_t;
+
+typedef struct sim_s {
+    timer_s timer;
+    struct sim_engine_s *engine;
+    char *tag_name;
+    tag_def_s *tag;
+    sim_kind_t kind;
+    uint32_t period_ticks;
+    double min;
+    double max;
+    double step;            /* the wave period in ms for sine. */
+} sim_s;
+
+/* define a generator for a tag by name, before the tags are indexed.  Prints what is wrong and returns false. */
+extern bool sim_add(plc_s *plc, slice_s tag_name, slice_s generator, const slice_s *params, int num_params);
+
+/* <tag>:<generator>:<ms>[:<param>]... from the command line. */
+extern bool sim_parse(plc_s *plc, const char *sim_str);
+
+/* attach the generators of all the PLCs to their tags and start updating them.  Call after tag_store_open(). */
+extern bool sim_start(plc_s *plcs, size_t num_plcs);
+extern void sim_stop(plc_s *plcs, size_t num_plcs);
@@ -26,8 +26,6 @@
 #include <string.h>
 #include <sys/types.h> /* for ssize_t */
 
-#include <stdio.h>
-
 typedef struct {
     ssize_t len;
     uint8_t *data;
@@ -40,20 +38,15 @@ inline static bool slice_in_bounds(slice_s s, size_t index) { if(index < (size_t
 inline static uint16_t slice_get_uint8(slice_s s, size_t index) { if(slice_in_bounds(s, index)) { return s.data[index]; } else { return UINT16_MAX; } }
 inline static bool slice_set_uint8(slice_s s, size_t index, uint8_t val) { if(slice_in_bounds(s, index)) { s.data[index] = val; return true; } else { return false; } }
 inline static uint8_t *slice_get_bytes(slice_s s, size_t index) {  if(slice_in_bounds(s, index)) { return &s.data[index];} else { return NULL;} }
+inline static bool slice_range_in_bounds(slice_s s, size_t index, size_t len) { return (s.len >= 0 && index <= (size_t)s.len && len <= ((size_t)s.len - index)); }
 inline static bool slice_has_err(slice_s s) { if(s.data == NULL) { return true; } else { return false; } }
 inline static int slice_get_err(slice_s s) { return slice_len(s); }
 inline static bool slice_match_bytes(slice_s s, const uint8_t *data, size_t data_len) { 
     if((ssize_t)data_len > slice_len(s)) { 
-        fprintf(stderr, "lengths do not match! Slice has length %d and bytes have length %d!\n", (int)slice_len(s), (int)data_len);
         return false; 
     }
-    for(size_t i=0; i < data_len; i++) { 
-        fprintf(stderr,"Comparing element %d, %x and %x\n", (int)i, (int)slice_get_uint8(s, (ssize_t)i), data[i]);
-        if(slice_get_uint8(s, (ssize_t)i) != data[i]) { 
-            return false;
-        }
-    } 
-    return true; 
+
+    return (memcmp(s.data, data, data_len) == 0);
 }
 inline static bool slice_match_string(slice_s s, const char *data) { return slice_match_bytes(s, (const uint8_t*)data, strlen(data)); }
 
@@ -78,13 +71,59 @@ inline static slice_s slice_from_slice(slice_s src, size_t start, size_t len) {
 }
 
 
+/*
+ * Unaligned little endian loads and stores.  On little endian targets
+ * these are a single memcpy() that the compiler turns into one move.
+ */
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+    inline static uint16_t load_uint16_le(const uint8_t *p) { uint16_t v; memcpy(&v, p, sizeof(v)); return v; }
+    inline static uint32_t load_uint32_le(const uint8_t *p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; }
+    inline static uint64_t load_uint64_le(const uint8_t *p) { uint64_t v; memcpy(&v, p, sizeof(v)); return v; }
+    inline static void store_uint16_le(uint8_t *p, uint16_t v) { memcpy(p, &v, sizeof(v)); }
+    inline static void store_uint32_le(uint8_t *p, uint32_t v) { memcpy(p, &v, sizeof(v)); }
+    inline static void store_uint64_le(uint8_t *p, uint64_t v) { memcpy(p, &v, sizeof(v)); }
+#else
+    inline static uint16_t load_uint16_le(const uint8_t *p) { return (uint16_t)(p[0] | (p[1] << 8)); }
+    inline static uint32_t load_uint32_le(const uint8_t *p) { return (uint32_t)load_uint16_le(p) | ((uint32_t)load_uint16_le(p + 2) << 16); }
+    inline static uint64_t load_uint64_le(const uint8_t *p) { return (uint64_t)load_uint32_le(p) | ((uint64_t)load_uint32_le(p + 4) << 32); }
+    inline static void store_uint16_le(uint8_t *p, uint16_t v) { p[0] = (uint8_t)(v & 0xFF); p[1] = (uint8_t)(v >> 8); }
+    inline static void store_uint32_le(uint8_t *p, uint32_t v) { store_uint16_le(p, (uint16_t)(v & 0xFFFF)); store_uint16_le(p + 2, (uint16_t)(v >> 16)); }
+    inline static void store_uint64_le(uint8_t *p, uint64_t v) { store_uint32_le(p, (uint32_t)(v & 0xFFFFFFFF)); store_uint32_le(p + 4, (uint32_t)(v >> 32)); }
+#endif
+
+
+/* bulk copies in and out of a slice.  The whole range is checked once. */
+
+inline static bool slice_set_bytes(slice_s output_buf, size_t offset, const uint8_t *src, size_t len) {
+    if(!slice_range_in_bounds(output_buf, offset, len)) {
+        return false;
+    }
+
+    memcpy(&output_buf.data[offset], src, len);
+
+    return true;
+}
+
+
+inline static bool slice_copy_bytes(slice_s input_buf, size_t offset, uint8_t *dest, size_t len) {
+    if(!slice_range_in_bounds(input_buf, offset, len)) {
+        return false;
+    }
+
+    memcpy(dest, &input_buf.data[offset], len);
+
+    return true;
+}
+
+
 /* helper functions to get and set data in a slice. */
 
 inline static uint16_t slice_get_uint16_le(slice_s input_buf, int offset) {
     uint16_t res = 0;
 
-    if(offset >= 0 && slice_in_bounds(input_buf, (offset + 1))) {
-        res = ((uint16_t)slice_get_uint8(input_buf, offset) + (uint16_t)(slice_get_uint8(input_buf, offset + 1) << 8));
+    if(offset >= 0 && slice_range_in_bounds(input_buf, (size_t)offset, 2)) {
+        res = load_uint16_le(&input_buf.data[offset]);
     }
 
     return res;
@@ -94,11 +133,8 @@ inline static uint16_t slice_get_uint16_le(slice_s input_buf, int offset) {
 inline static uint32_t slice_get_uint32_le(slice_s input_buf, int offset) {
     uint32_t res = 0;
 
-    if(offset >= 0 && slice_in_bounds(input_buf, (offset + 3))) {
-        res =  (uint32_t)(slice_get_uint8(input_buf, offset))
-             + (uint32_t)(slice_get_uint8(input_buf, offset + 1) << 8)
-             + (uint32_t)(slice_get_uint8(input_buf, offset + 2) << 16)
-             + (uint32_t)(slice_get_uint8(input_buf, offset + 3) << 24);
+    if(offset >= 0 && slice_range_in_bounds(input_buf, (size_t)offset, 4)) {
+        res = load_uint32_le(&input_buf.data[offset]);
     }
 
     return res;
@@ -108,15 +144,8 @@ inline static uint32_t slice_get_uint32_le(slice_s input_buf, int offset) {
 inline static uint64_t slice_get_uint64_le(slice_s input_buf, int offset) {
     uint64_t res = 0;
 
-    if(offset >= 0 && slice_in_bounds(input_buf, (offset + 7))) {
-        res =  ((uint64_t)slice_get_uint8(input_buf, offset))
-             + ((uint64_t)slice_get_uint8(input_buf, offset + 1) << 8)
-             + ((uint64_t)slice_get_uint8(input_buf, offset + 2) << 16)
-             + ((uint64_t)slice_get_uint8(input_buf, offset + 3) << 24)
-             + ((uint64_t)slice_get_uint8(input_buf, offset + 4) << 32)
-             + ((uint64_t)slice_get_uint8(input_buf, offset + 5) << 40)
-             + ((uint64_t)slice_get_uint8(input_buf, offset + 6) << 48)
-             + ((uint64_t)slice_get_uint8(input_buf, offset + 7) << 56);
+    if(offset >= 0 && slice_range_in_bounds(input_buf, (size_t)offset, 8)) {
+        res = load_uint64_le(&input_buf.data[offset]);
     }
 
     return res;
@@ -126,33 +155,21 @@ inline static uint64_t slice_get_uint64_le(slice_s input_buf, int offset) {
 /* FIXME - these probably should not just fail silently.  They are safe though. */
 
 inline static void slice_set_uint16_le(slice_s output_buf, int offset, uint16_t val) {
-    if(offset >= 0 && slice_in_bounds(output_buf, (offset + 1))) {
-        slice_set_uint8(output_buf, offset + 0, (uint8_t)(val & 0xFF));
-        slice_set_uint8(output_buf, offset + 1, (uint8_t)((val >> 8) & 0xFF));
+    if(offset >= 0 && slice_range_in_bounds(output_buf, (size_t)offset, 2)) {
+        store_uint16_le(&output_buf.data[offset], val);
     }
 }
 
 
 inline static void slice_set_uint32_le(slice_s output_buf, int offset, uint32_t val) {
-    if(offset >= 0 && slice_in_bounds(output_buf, (offset + 3))) {
-        slice_set_uint8(output_buf, offset + 0, (uint8_t)(val & 0xFF));
-        slice_set_uint8(output_buf, offset + 1, (uint8_t)((val >> 8) & 0xFF));
-        slice_set_uint8(output_buf, offset + 2, (uint8_t)((val >> 16) & 0xFF));
-        slice_set_uint8(output_buf, offset + 3, (uint8_t)((val >> 24) & 0xFF));
+    if(offset >= 0 && slice_range_in_bounds(output_buf, (size_t)offset, 4)) {
+        store_uint32_le(&output_buf.data[offset], val);
     }
 }
 
 
-inline static void slice_set_uin64_le(slice_s output_buf, int offset, uint64_t val) {
-    if(offset >= 0 && slice_in_bounds(output_buf, (offset + 7))) {
-        slice_set_uint8(output_buf, offset + 0, (uint8_t)(val & 0xFF));
-        slice_set_uint8(output_buf, offset + 1, (uint8_t)((val >> 8) & 0xFF));
-        slice_set_uint8(output_buf, offset + 2, (uint8_t)((val >> 16) & 0xFF));
-        slice_set_uint8(output_buf, offset + 3, (uint8_t)((val >> 24) & 0xFF));
-        slice_set_uint8(output_buf, offset + 4, (uint8_t)((val >> 32) & 0xFF));
-        slice_set_uint8(output_buf, offset + 5, (uint8_t)((val >> 40) & 0xFF));
-        slice_set_uint8(output_buf, offset + 6, (uint8_t)((val >> 48) & 0xFF));
-        slice_set_uint8(output_buf, offset + 7, (uint8_t)((val >> 56) & 0xFF));
+inline static void slice_set_uint64_le(slice_s output_buf, int offset, uint64_t val) {
+    if(offset >= 0 && slice_range_in_bounds(output_buf, (size_t)offset, 8)) {
+        store_uint64_le(&output_buf.data[offset], val);
     }
 }
-
@@ -24,13 +24,16 @@
 #else
     #include <arpa/inet.h>
     #include <errno.h>
+    #include <fcntl.h>
     #include <netdb.h>
     #include <netinet/in.h>
     #include <sys/socket.h>
     #include <sys/time.h>
     #include <sys/types.h>
+    #include <sys/uio.h>
     #include <unistd.h>
 #endif
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,9 +42,41 @@
 #include "utils.h"
 
 
-#define LISTEN_QUEUE (10)
+#define LISTEN_QUEUE (128)
 
+/* not all platforms can suppress SIGPIPE per call. */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL (0)
+#endif
+
+static int open_socket(const char *host, const char *port, bool server, bool share_port);
+
+
+/* a listening socket if the host is 0.0.0.0, otherwise a client connected to the host. */
 int socket_open(const char *host, const char *port)
+{
+    return open_socket(host, port, (strcmp(host,"0.0.0.0") == 0), false);
+}
+
+
+/* a listening socket on the host's address, which may be a specific one. */
+int socket_open_server(const char *host, const char *port)
+{
+    return open_socket(host, port, true, false);
+}
+
+
+/*
+ * Open a listening socket that other sockets in this process can also
+ * bind to the same port.  The kernel spreads new connections across them.
+ */
+int socket_open_shared(const char *host, const char *port)
+{
+    return open_socket(host, port, true, true);
+}
+
+
+int open_socket(const char *host, const char *port, bool server, bool share_port)
 {
 	//int status;
 	struct addrinfo addr_hints;
@@ -99,7 +134,7 @@ int socket_open(const char *host, const char *port)
     /* Get the address info about the local system, to be used later. */
     rc = getaddrinfo(host, port, &addr_hints, &addr_info);
     if (rc != 0) {
-        info("ERROR: getaddrinfo() failed: %s\n", gai_strerror(rc));
+        warning("getaddrinfo() failed: %s\n", gai_strerror(rc));
         return SOCKET_ERR_OPEN;
     }
 
@@ -107,34 +142,51 @@ int socket_open(const char *host, const char *port)
     sock = socket(addr_info->ai_family, addr_info->ai_socktype, addr_info->ai_protocol);
 
     if (sock < 0) {
-        info("ERROR: socket() failed: %s\n", gai_strerror(sock));
+        warning("socket() failed: %s\n", gai_strerror(sock));
         return SOCKET_ERR_CREATE;
     }
 
     /* if this is going to be a server socket, bind it. */
-    if(strcmp(host,"0.0.0.0") == 0) {
-        info("socket_open() setting up server socket.   Binding to address 0.0.0.0.");
+    if(server) {
+        info("socket_open() setting up server socket.   Binding to address %s.", host);
+
+        /* set up our socket to allow reuse if we crash suddenly.  This only works before bind(). */
+        sock_opt = 1;
+        rc = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char*)&sock_opt, sizeof(sock_opt));
+        if(rc) {
+            socket_close(sock);
+            warning("Setting SO_REUSEADDR on socket failed: %s\n", gai_strerror(rc));
+            return SOCKET_ERR_SETOPT;
+        }
+
+        if(share_port) {
+#ifdef SO_REUSEPORT
+            rc = setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (char*)&sock_opt, sizeof(sock_opt));
+            if(rc) {
+                socket_close(sock);
+                warning("Setting SO_REUSEPORT on socket failed, errno=%d!", errno);
+                return SOCKET_ERR_SETOPT;
+            }
+#else
+            socket_close(sock);
+            warning("This platform does not support SO_REUSEPORT!");
+            return SOCKET_ERR_SETOPT;
+#endif
+        }
 
         rc = bind(sock, addr_info->ai_addr, addr_info->ai_addrlen);
         if (rc < 0)	{
-            printf("ERROR: Unable to bind() socket: %s\n", gai_strerror(rc));
+            socket_close(sock);
+            freeaddrinfo(addr_info);
+            warning("Unable to bind() socket to %s:%s, errno=%d!", host, port, errno);
             return SOCKET_ERR_BIND;
         }
 
         rc = listen(sock, LISTEN_QUEUE);
         if(rc < 0) {
-            info("ERROR: Unable to call listen() on socket: %s\n", gai_strerror(rc));
+            warning("Unable to call listen() on socket: %s\n", gai_strerror(rc));
             return SOCKET_ERR_LISTEN;
         }
-
-        /* set up our socket to allow reuse if we crash suddenly. */
-        sock_opt = 1;
-        rc = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char*)&sock_opt, sizeof(sock_opt));
-        if(rc) {
-            socket_close(sock);
-            info("ERROR: Setting SO_REUSEADDR on socket failed: %s\n", gai_strerror(rc));
-            return SOCKET_ERR_SETOPT;
-        }
     } else {
         struct timeval timeout; /* used for timing out connections etc. */
         struct linger so_linger; /* used to set up short/no lingering after connections are close()ed. */
@@ -155,14 +207,14 @@ int socket_open(const char *host, const char *port)
         rc = setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
         if(rc) {
             socket_close(sock);
-            info("ERROR: Setting SO_RCVTIMEO on socket failed: %s\n", gai_strerror(rc));
+            warning("Setting SO_RCVTIMEO on socket failed: %s\n", gai_strerror(rc));
             return SOCKET_ERR_SETOPT;
         }
 
         rc = setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout));
         if(rc) {
             socket_close(sock);
-            info("ERROR: Setting SO_SNDTIMEO on socket failed: %s\n", gai_strerror(rc));
+            warning("Setting SO_SNDTIMEO on socket failed: %s\n", gai_strerror(rc));
             return SOCKET_ERR_SETOPT;
         }
 
@@ -173,9 +225,18 @@ int socket_open(const char *host, const char *port)
         rc = setsockopt(sock, SOL_SOCKET, SO_LINGER,(char*)&so_linger,sizeof(so_linger));
         if(rc) {
             socket_close(sock);
-            info("ERROR: Setting SO_LINGER on socket failed: %s\n", gai_strerror(rc));
+            warning("Setting SO_LINGER on socket failed: %s\n", gai_strerror(rc));
             return SOCKET_ERR_SETOPT;
         }
+
+        /* clients connect to the host and port. */
+        rc = connect(sock, addr_info->ai_addr, addr_info->ai_addrlen);
+        if(rc < 0) {
+            socket_close(sock);
+            freeaddrinfo(addr_info);
+            warning("Unable to connect() socket, errno=%d!", errno);
+            return SOCKET_ERR_OPEN;
+        }
     }
 
     /* free the memory for the address info struct. */
@@ -186,6 +247,62 @@ int socket_open(const char *host, const char *port)
 
 
 
+/*
+ * Open a non-blocking UDP socket bound to the host and port.  The same
+ * socket both receives and sends, so packets go out from that port.
+ */
+int socket_open_udp(const char *host, const char *port)
+{
+    struct addrinfo addr_hints;
+    struct addrinfo *addr_info = NULL;
+    int sock;
+    int sock_opt = 1;
+    int rc;
+
+    memset(&addr_hints, 0, sizeof addr_hints);
+    addr_hints.ai_flags = AI_PASSIVE;
+    addr_hints.ai_family = AF_INET;     /* EtherNet/IP I/O is IPv4 only. */
+    addr_hints.ai_socktype = SOCK_DGRAM;
+
+    rc = getaddrinfo(host, port, &addr_hints, &addr_info);
+    if (rc != 0) {
+        warning("getaddrinfo() failed: %s\n", gai_strerror(rc));
+        return SOCKET_ERR_OPEN;
+    }
+
+    sock = socket(addr_info->ai_family, addr_info->ai_socktype, addr_info->ai_protocol);
+    if (sock < 0) {
+        freeaddrinfo(addr_info);
+        warning("socket() failed, errno=%d!", errno);
+        return SOCKET_ERR_CREATE;
+    }
+
+    rc = setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char*)&sock_opt, sizeof(sock_opt));
+    if(rc) {
+        socket_close(sock);
+        freeaddrinfo(addr_info);
+        warning("Setting SO_REUSEADDR on socket failed, errno=%d!", errno);
+        return SOCKET_ERR_SETOPT;
+    }
+
+    rc = bind(sock, addr_info->ai_addr, addr_info->ai_addrlen);
+    freeaddrinfo(addr_info);
+    if (rc < 0) {
+        socket_close(sock);
+        warning("Unable to bind() UDP socket to %s:%s, errno=%d!", host, port, errno);
+        return SOCKET_ERR_BIND;
+    }
+
+    if(socket_set_nonblocking(sock) < 0) {
+        socket_close(sock);
+        return SOCKET_ERR_SETOPT;
+    }
+
+    return sock;
+}
+
+
+
 void socket_close(int sock)
 {
     if(sock >= 0) {
@@ -200,21 +317,67 @@ void socket_close(int sock)
 
 int socket_accept(int sock)
 {
-    return accept(sock, NULL, NULL);
+    int rc = accept(sock, NULL, NULL);
+
+    if(rc < 0) {
+#ifdef WIN32
+        if(WSAGetLastError() == WSAEWOULDBLOCK) {
+#else
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+#endif
+            return SOCKET_ERR_AGAIN;
+        }
+
+        info("Socket accept error rc=%d.\n", rc);
+        return SOCKET_ERR_ACCEPT;
+    }
+
+    return rc;
+}
+
+
+/* put the socket into non-blocking mode so that one slow client cannot stall the others. */
+int socket_set_nonblocking(int sock)
+{
+#ifdef WIN32
+    u_long non_blocking = 1;
+
+    if(ioctlsocket(sock, FIONBIO, &non_blocking) != NO_ERROR) {
+        return SOCKET_ERR_SETOPT;
+    }
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+
+    if(flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) < 0) {
+        warning("Unable to set socket non-blocking, errno=%d!", errno);
+        return SOCKET_ERR_SETOPT;
+    }
+#endif
+
+    return 0;
 }
 
 
+/*
+ * Read whatever data is available.  Returns an empty slice if nothing
+ * is available yet and an error slice if the socket is closed or broken.
+ */
 slice_s socket_read(int sock, slice_s in_buf)
 {
     int rc = (int)recv(sock, (char *)in_buf.data, (size_t)in_buf.len, 0);
 
+    if(rc == 0 && in_buf.len > 0) {
+        /* orderly shutdown by the peer. */
+        return slice_make_err(SOCKET_ERR_CLOSED);
+    }
+
     if(rc < 0) {
 #ifdef WIN32
         rc = WSAGetLastError();
         if(rc == WSAEWOULDBLOCK) {
 #else
         rc = errno;
-        if(rc == EAGAIN || rc == EWOULDBLOCK) {
+        if(rc == EAGAIN || rc == EWOULDBLOCK || rc == EINTR) {
 #endif
             rc = 0;
         } else {
@@ -227,7 +390,11 @@ slice_s socket_read(int sock, slice_s in_buf)
 }
 
 
-/* this blocks until all the data is written or there is an error. */
+/*
+ * This writes as much of the data as the socket will take without blocking.
+ * Returns the number of bytes written, which may be less than the slice length,
+ * or an error.
+ */
 int socket_write(int sock, slice_s out_buf)
 {
     int total_bytes_written = 0;
@@ -237,21 +404,28 @@ int socket_write(int sock, slice_s out_buf)
     info("socket_write(): writing packet:");
     slice_dump(out_buf);
 
-    do {
-        rc = (int)send(sock, (char *)tmp_out_buf.data, (size_t)tmp_out_buf.len, 0);
+    while(total_bytes_written < out_buf.len) {
+        rc = (int)send(sock, (char *)tmp_out_buf.data, (size_t)tmp_out_buf.len, MSG_NOSIGNAL);
 
         /* was there an error? */
         if(rc < 0) {
             /*
              * check the return value.  If it is an interrupted system call
-             * or would block, just keep looping.
+             * just try again.  If it would block, let the caller wait for
+             * the socket to drain.
              */
 #ifdef WIN32
             rc = WSAGetLastError();
-            if(rc != WSAEWOULDBLOCK) {
+            if(rc == WSAEWOULDBLOCK) {
+                break;
+            } else {
 #else
             rc = errno;
-            if(rc != EAGAIN && rc != EWOULDBLOCK) {
+            if(rc == EINTR) {
+                continue;
+            } else if(rc == EAGAIN || rc == EWOULDBLOCK) {
+                break;
+            } else {
 #endif
                 info("Socket write error rc=%d.\n", rc);
                 return SOCKET_ERR_WRITE;
@@ -260,8 +434,92 @@ int socket_write(int sock, slice_s out_buf)
             total_bytes_written += rc;
             tmp_out_buf = slice_from_slice(out_buf, total_bytes_written, slice_len(out_buf) - total_bytes_written);
         }
-    } while(total_bytes_written < out_buf.len);
+    }
 
     return total_bytes_written;
 }
 
+
+
+/*
+ * Write several slices with one system call, as far as the socket takes
+ * them without blocking.  Returns the total number of bytes written or an
+ * error, like socket_write().
+ */
+#define SOCKET_MAX_PARTS (8)
+
+int socket_write_parts(int sock, slice_s *parts, int num_parts)
+{
+#ifdef WIN32
+    int total_bytes_written = 0;
+
+    for(int i=0; i < num_parts; i++) {
+        int rc = socket_write(sock, parts[i]);
+
+        if(rc < 0) {
+            return rc;
+        }
+
+        total_bytes_written += rc;
+
+        if(rc < slice_len(parts[i])) {
+            break;
+        }
+    }
+
+    return total_bytes_written;
+#else
+    struct iovec iov[SOCKET_MAX_PARTS];
+    struct msghdr msg;
+    int num_iov = 0;
+    int first = 0;
+    int total_bytes_written = 0;
+    ssize_t rc = 0;
+
+    if(num_parts > SOCKET_MAX_PARTS) {
+        return SOCKET_ERR_WRITE;
+    }
+
+    for(int i=0; i < num_parts; i++) {
+        if(slice_len(parts[i]) > 0) {
+            iov[num_iov].iov_base = parts[i].data;
+            iov[num_iov].iov_len = (size_t)slice_len(parts[i]);
+            num_iov++;
+        }
+    }
+
+    while(first < num_iov) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov[first];
+        msg.msg_iovlen = (size_t)(num_iov - first);
+
+        rc = sendmsg(sock, &msg, MSG_NOSIGNAL);
+
+        if(rc < 0) {
+            if(errno == EINTR) {
+                continue;
+            } else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+
+            info("Socket write error rc=%d.\n", errno);
+            return SOCKET_ERR_WRITE;
+        }
+
+        total_bytes_written += (int)rc;
+
+        /* step past what went out. */
+        while(first < num_iov && (size_t)rc >= iov[first].iov_len) {
+            rc -= (ssize_t)iov[first].iov_len;
+            first++;
+        }
+
+        if(first < num_iov) {
+            iov[first].iov_base = (uint8_t *)iov[first].iov_base + rc;
+            iov[first].iov_len -= (size_t)rc;
+        }
+    }
+
+    return total_bytes_written;
+#endif
+}
@@ -30,12 +30,20 @@ typedef enum {
     SOCKET_ERR_LISTEN = -5,
     SOCKET_ERR_SETOPT = -6,
     SOCKET_ERR_READ = -7,
-    SOCKET_ERR_WRITE = -8
+    SOCKET_ERR_WRITE = -8,
+    SOCKET_ERR_ACCEPT = -9,
+    SOCKET_ERR_AGAIN = -10,
+    SOCKET_ERR_CLOSED = -11
 } socket_err_t;
 
 extern int socket_open(const char *host, const char *port);
+extern int socket_open_server(const char *host, const char *port);
+extern int socket_open_shared(const char *host, const char *port);
+extern int socket_open_udp(const char *host, const char *port);
 extern void socket_close(int sock);
 extern int socket_accept(int sock);
+extern int socket_set_nonblocking(int sock);
 extern slice_s socket_read(int sock, slice_s in_buf);
 extern int socket_write(int sock, slice_s out_buf);
+extern int socket_write_parts(int sock, slice_s *parts, int num_parts);
 
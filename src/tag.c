@@ -0,0 +1,572 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <ctype.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "arena.h"
+#include "plc.h"
+#include "slice.h"
+#include "tag.h"
+#include "udt.h"
+#include "utils.h"
+
+
+static void copy_from_shared(uint8_t *dest, const uint8_t *src, size_t len);
+static void copy_to_shared(uint8_t *dest, const uint8_t *src, size_t len);
+static tag_list_cache_s *build_list_cache(plc_s *plc, const uint16_t *attribs, int num_attribs);
+
+
+static const struct {
+    const char *name;
+    tag_type_t tag_type;
+    int elem_size;
+} tag_types[] = {
+    { "BOOL", TAG_TYPE_BOOL, 1 },
+    { "SINT", TAG_TYPE_SINT, 1 },
+    { "INT", TAG_TYPE_INT, 2 },
+    { "DINT", TAG_TYPE_DINT, 4 },
+    { "LINT", TAG_TYPE_LINT, 8 },
+    { "REAL", TAG_TYPE_REAL, 4 },
+    { "LREAL", TAG_TYPE_LREAL, 8 }
+};
+
+/*
+ * The attribute lists that get a listing, encoded when the index is
+ * built.  Requests for any other list are refused rather than encoded on
+ * demand, so a client cannot make the server build listings without end.
+ */
+static const struct {
+    int num_attribs;
+    uint16_t attribs[TAG_LIST_MAX_ATTRIBS];
+} tag_list_sets[] = {
+    { 4, { 2, 7, 8, 1 } },  /* type, element size, dimensions and name, as libplctag asks. */
+    { 4, { 1, 2, 7, 8 } },
+    { 3, { 1, 2, 8 } },
+    { 2, { 1, 2 } },
+    { 1, { 1 } }
+};
+
+
+/* FNV-1a over the ASCII lower case name. */
+uint32_t tag_name_hash(const uint8_t *name, size_t name_len)
+{
+    uint32_t hash = (uint32_t)2166136261u;
+
+    for(size_t i=0; i < name_len; i++) {
+        hash ^= (uint32_t)tolower(name[i]);
+        hash *= (uint32_t)16777619u;
+    }
+
+    return hash;
+}
+
+
+/*
+ * Move the tag definitions into one dense array in instance order, with
+ * all the names packed in a pool right after it, and build the index
+ * over them.  The table is kept at most half full so that probe
+ * sequences stay short.  Returns false if two tags have the same name.
+ */
+bool tag_index_build(plc_s *plc)
+{
+    size_t num_tags = 0;
+    size_t names_size = 0;
+    size_t mask = 0;
+    size_t instance = 0;
+    char *name_pool = NULL;
+
+    for(tag_def_s *tag = plc->tags; tag; tag = tag->next_tag) {
+        num_tags++;
+        names_size += strlen(tag->name) + 1;
+    }
+
+    plc->num_tags = num_tags;
+    plc->tag_defs = calloc(1, (num_tags * sizeof(*plc->tag_defs)) + names_size);
+    if(!plc->tag_defs) {
+        error("Unable to allocate tag table for %d tags!", (int)num_tags);
+    }
+
+    /* the tag list is in reverse order of definition, number instances in definition order. */
+    instance = num_tags;
+    for(tag_def_s *tag = plc->tags; tag; tag = tag->next_tag) {
+        plc->tag_defs[instance - 1] = *tag;
+        instance--;
+    }
+
+    name_pool = (char *)(plc->tag_defs + num_tags);
+
+    for(size_t i=0; i < num_tags; i++) {
+        tag_def_s *tag = &plc->tag_defs[i];
+
+        tag->name_len = strlen(tag->name);
+        memcpy(name_pool, tag->name, tag->name_len + 1);
+        tag->name = name_pool;
+        name_pool += tag->name_len + 1;
+
+        tag->next_tag = NULL;
+        tag->instance_id = (uint32_t)(i + 1);
+        tag->data_seq = 0;
+        pthread_rwlock_init(&tag->data_lock, NULL);
+    }
+
+    /* the definitions were only staged there. */
+    arena_free(&plc->tag_arena);
+    plc->tags = NULL;
+
+    plc->tag_index_size = 16;
+    while(plc->tag_index_size < (num_tags * 2)) {
+        plc->tag_index_size *= 2;
+    }
+
+    plc->tag_index = calloc(plc->tag_index_size, sizeof(*plc->tag_index));
+    if(!plc->tag_index) {
+        error("Unable to allocate tag index for %d tags!", (int)num_tags);
+    }
+
+    mask = plc->tag_index_size - 1;
+
+    for(size_t i=0; i < num_tags; i++) {
+        tag_def_s *tag = &plc->tag_defs[i];
+        size_t slot;
+
+        tag->name_hash = tag_name_hash((const uint8_t *)tag->name, tag->name_len);
+
+        slot = tag->name_hash & mask;
+        while(plc->tag_index[slot]) {
+            tag_def_s *other = plc->tag_index[slot];
+
+            if(other->name_hash == tag->name_hash && other->name_len == tag->name_len && strncasecmp(other->name, tag->name, tag->name_len) == 0) {
+                fprintf(stderr, "Tag %s is defined more than once!\n", tag->name);
+                return false;
+            }
+
+            slot = (slot + 1) & mask;
+        }
+
+        plc->tag_index[slot] = tag;
+    }
+
+    info("Built tag index with %d slots for %d tags.", (int)plc->tag_index_size, (int)num_tags);
+
+    for(size_t i=0; i < sizeof(tag_list_sets)/sizeof(tag_list_sets[0]); i++) {
+        tag_list_cache_s *cache = build_list_cache(plc, tag_list_sets[i].attribs, tag_list_sets[i].num_attribs);
+
+        if(!cache) {
+            error("Unable to encode the tag listing!");
+        }
+
+        cache->next = plc->tag_list_caches;
+        plc->tag_list_caches = cache;
+    }
+
+    return true;
+}
+
+
+/* the tags, their names and the listings.  The data belongs to the tag store. */
+void tag_index_destroy(plc_s *plc)
+{
+    tag_list_cache_s *cache = plc->tag_list_caches;
+
+    while(cache) {
+        tag_list_cache_s *next = cache->next;
+
+        free(cache->entries);
+        free(cache->entry_offsets);
+        free(cache);
+        cache = next;
+    }
+
+    plc->tag_list_caches = NULL;
+
+    for(size_t i=0; i < plc->num_tags; i++) {
+        pthread_rwlock_destroy(&plc->tag_defs[i].data_lock);
+    }
+
+    free(plc->tag_index);
+    plc->tag_index = NULL;
+    plc->tag_index_size = 0;
+
+    free(plc->tag_defs);
+    plc->tag_defs = NULL;
+    plc->num_tags = 0;
+}
+
+
+bool tag_type_lookup(plc_s *plc, const char *type_name, size_t type_name_len, tag_type_t *tag_type, int *elem_size, struct udt_def_s **udt)
+{
+    udt_def_s *found = NULL;
+
+    for(size_t i=0; i < sizeof(tag_types)/sizeof(tag_types[0]); i++) {
+        if(strlen(tag_types[i].name) == type_name_len && strncasecmp(tag_types[i].name, type_name, type_name_len) == 0) {
+            *tag_type = tag_types[i].tag_type;
+            *elem_size = tag_types[i].elem_size;
+            *udt = NULL;
+            return true;
+        }
+    }
+
+    found = udt_find(plc, type_name, type_name_len);
+    if(!found) {
+        return false;
+    }
+
+    /* the layout is fixed from now on. */
+    found->in_use = true;
+
+    *tag_type = TAG_TYPE_STRUCT;
+    *elem_size = (int)found->size;
+    *udt = found;
+
+    return true;
+}
+
+
+bool tag_set_size(tag_def_s *tag, const int *dims, int num_dims)
+{
+    size_t elem_count = 1;
+
+    tag->num_dimensions = num_dims;
+
+    for(int i=0; i < 3; i++) {
+        tag->dimensions[i] = (i < num_dims ? dims[i] : 1);
+
+        if(tag->dimensions[i] < 1 || elem_count > (size_t)INT_MAX / (size_t)tag->dimensions[i]) {
+            return false;
+        }
+
+        elem_count *= (size_t)tag->dimensions[i];
+    }
+
+    if(tag->tag_type == TAG_TYPE_BOOL && num_dims > 0) {
+        if(num_dims > 1) {
+            return false;
+        }
+
+        elem_count = (elem_count + 31) / 32;
+
+        tag->tag_type = TAG_TYPE_BOOL_ARRAY;
+        tag->elem_size = 4;
+        tag->dimensions[0] = (int)elem_count * 32;
+    }
+
+    if(elem_count > (size_t)INT_MAX / (size_t)tag->elem_size) {
+        return false;
+    }
+
+    tag->elem_count = (int)elem_count;
+
+    return true;
+}
+
+
+tag_def_s *tag_find(plc_s *plc, slice_s name)
+{
+    size_t name_len = (size_t)slice_len(name);
+    uint32_t hash;
+    size_t mask;
+    size_t slot;
+
+    if(!plc->tag_index || slice_has_err(name)) {
+        return NULL;
+    }
+
+    hash = tag_name_hash(name.data, name_len);
+    mask = plc->tag_index_size - 1;
+
+    for(slot = hash & mask; plc->tag_index[slot]; slot = (slot + 1) & mask) {
+        tag_def_s *tag = plc->tag_index[slot];
+
+        if(tag->name_hash == hash && tag->name_len == name_len && strncasecmp(tag->name, (const char *)name.data, name_len) == 0) {
+            return tag;
+        }
+    }
+
+    return NULL;
+}
+
+
+
+void tag_read_data(tag_def_s *tag, size_t offset, uint8_t *dest, size_t len)
+{
+    uint32_t start_seq = 0;
+    uint32_t end_seq = 0;
+
+    do {
+        /* wait out a write in progress. */
+        while((start_seq = __atomic_load_n(&tag->data_seq, __ATOMIC_ACQUIRE)) & 1) {
+            sched_yield();
+        }
+
+        copy_from_shared(dest, tag->data + offset, len);
+
+        /* the copy must be done before the sequence is checked again. */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        end_seq = __atomic_load_n(&tag->data_seq, __ATOMIC_RELAXED);
+    } while(start_seq != end_seq);
+}
+
+
+void tag_write_data(tag_def_s *tag, size_t offset, const uint8_t *src, size_t len)
+{
+    tag_write_begin(tag);
+    tag_store_data(tag, offset, src, len);
+    tag_write_end(tag);
+}
+
+
+/* only between tag_write_begin() and tag_write_end(). */
+void tag_store_data(tag_def_s *tag, size_t offset, const uint8_t *src, size_t len)
+{
+    copy_to_shared(tag->data + offset, src, len);
+}
+
+
+void tag_write_begin(tag_def_s *tag)
+{
+    tag_lock_data(tag);
+
+    /* make the sequence odd before any data changes. */
+    __atomic_store_n(&tag->data_seq, tag->data_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+
+void tag_write_end(tag_def_s *tag)
+{
+    __atomic_store_n(&tag->data_seq, tag->data_seq + 1, __ATOMIC_RELEASE);
+
+    tag_unlock_data(tag);
+}
+
+
+/* writers wait, but the sequence stays even, so readers do not. */
+void tag_lock_data(tag_def_s *tag)
+{
+    pthread_rwlock_wrlock(&tag->data_lock);
+}
+
+
+/* only between tag_lock_data() and tag_unlock_data(). */
+void tag_replace_data(tag_def_s *tag, size_t offset, const uint8_t *src, size_t len)
+{
+    __atomic_store_n(&tag->data_seq, tag->data_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    copy_to_shared(tag->data + offset, src, len);
+
+    __atomic_store_n(&tag->data_seq, tag->data_seq + 1, __ATOMIC_RELEASE);
+}
+
+
+void tag_unlock_data(tag_def_s *tag)
+{
+    pthread_rwlock_unlock(&tag->data_lock);
+}
+
+
+void tag_pin_data(tag_def_s *tag)
+{
+    pthread_rwlock_rdlock(&tag->data_lock);
+}
+
+
+void tag_unpin_data(tag_def_s *tag)
+{
+    pthread_rwlock_unlock(&tag->data_lock);
+}
+
+
+/*
+ * Readers copy while a writer may be storing, so both sides use relaxed
+ * atomic accesses.  These compile to plain loads and stores, a word at a
+ * time once the tag data is aligned.
+ */
+void copy_from_shared(uint8_t *dest, const uint8_t *src, size_t len)
+{
+    while(len > 0 && ((uintptr_t)src & (sizeof(uint64_t) - 1))) {
+        *dest++ = __atomic_load_n(src++, __ATOMIC_RELAXED);
+        len--;
+    }
+
+    while(len >= sizeof(uint64_t)) {
+        uint64_t word = __atomic_load_n((const uint64_t *)(const void *)src, __ATOMIC_RELAXED);
+
+        memcpy(dest, &word, sizeof(word));
+        dest += sizeof(word);
+        src += sizeof(word);
+        len -= sizeof(word);
+    }
+
+    while(len > 0) {
+        *dest++ = __atomic_load_n(src++, __ATOMIC_RELAXED);
+        len--;
+    }
+}
+
+
+void copy_to_shared(uint8_t *dest, const uint8_t *src, size_t len)
+{
+    while(len > 0 && ((uintptr_t)dest & (sizeof(uint64_t) - 1))) {
+        __atomic_store_n(dest++, *src++, __ATOMIC_RELAXED);
+        len--;
+    }
+
+    while(len >= sizeof(uint64_t)) {
+        uint64_t word;
+
+        memcpy(&word, src, sizeof(word));
+        __atomic_store_n((uint64_t *)(void *)dest, word, __ATOMIC_RELAXED);
+        dest += sizeof(word);
+        src += sizeof(word);
+        len -= sizeof(word);
+    }
+
+    while(len > 0) {
+        __atomic_store_n(dest++, *src++, __ATOMIC_RELAXED);
+        len--;
+    }
+}
+
+
+
+/*
+ * Symbol object attributes we know how to encode:
+ *   1 - symbol name, a UINT length and then the name bytes.
+ *   2 - symbol type, the type code plus the number of dimensions in bits 13-14.
+ *   7 - element size in bytes as a UINT.
+ *   8 - array dimensions, three UDINTs.
+ * Returns the encoded size, or zero if an attribute is not supported.  If
+ * buf is NULL, nothing is written.
+ */
+static size_t encode_list_entry(tag_def_s *tag, const uint16_t *attribs, int num_attribs, uint8_t *buf)
+{
+    size_t offset = 0;
+
+    if(buf) {
+        store_uint32_le(buf, tag->instance_id);
+    }
+    offset += 4;
+
+    for(int i=0; i < num_attribs; i++) {
+        switch(attribs[i]) {
+            case 1:
+                if(buf) {
+                    store_uint16_le(buf + offset, (uint16_t)tag->name_len);
+                    memcpy(buf + offset + 2, tag->name, tag->name_len);
+                }
+                offset += 2 + tag->name_len;
+                break;
+
+            case 2:
+                /* structures show their template instance instead of a type code. */
+                if(buf) {
+                    uint16_t symbol_type = (tag->udt ? (uint16_t)(0x8000 | (tag->udt->instance_id & 0x0FFF)) : tag->tag_type);
+
+                    store_uint16_le(buf + offset, (uint16_t)(symbol_type | (uint16_t)(tag->num_dimensions << 13)));
+                }
+                offset += 2;
+                break;
+
+            case 7:
+                if(buf) {
+                    store_uint16_le(buf + offset, (uint16_t)tag->elem_size);
+                }
+                offset += 2;
+                break;
+
+            case 8:
+                if(buf) {
+                    for(int dim=0; dim < 3; dim++) {
+                        store_uint32_le(buf + offset + (4 * (size_t)dim), (uint32_t)(dim < tag->num_dimensions ? tag->dimensions[dim] : 0));
+                    }
+                }
+                offset += 12;
+                break;
+
+            default:
+                info("Unsupported symbol attribute %u!", attribs[i]);
+                return 0;
+        }
+    }
+
+    return offset;
+}
+
+
+/* the listing for this attribute list, or NULL if it is not one of the lists encoded up front. */
+tag_list_cache_s *tag_list_cache_get(plc_s *plc, const uint16_t *attribs, int num_attribs)
+{
+    for(tag_list_cache_s *cache = plc->tag_list_caches; cache; cache = cache->next) {
+        if(cache->num_attribs == num_attribs && memcmp(cache->attribs, attribs, sizeof(*attribs) * (size_t)num_attribs) == 0) {
+            return cache;
+        }
+    }
+
+    return NULL;
+}
+
+
+tag_list_cache_s *build_list_cache(plc_s *plc, const uint16_t *attribs, int num_attribs)
+{
+    tag_list_cache_s *cache = NULL;
+    size_t total_size = 0;
+
+    cache = calloc(1, sizeof(*cache));
+    if(!cache) {
+        return NULL;
+    }
+
+    memcpy(cache->attribs, attribs, sizeof(*attribs) * (size_t)num_attribs);
+    cache->num_attribs = num_attribs;
+
+    cache->entry_offsets = calloc(plc->num_tags + 1, sizeof(*cache->entry_offsets));
+    if(!cache->entry_offsets) {
+        free(cache);
+        return NULL;
+    }
+
+    for(size_t i=0; i < plc->num_tags; i++) {
+        cache->entry_offsets[i] = total_size;
+        total_size += encode_list_entry(&plc->tag_defs[i], attribs, num_attribs, NULL);
+    }
+
+    cache->entry_offsets[plc->num_tags] = total_size;
+
+    cache->entries = malloc(total_size ? total_size : 1);
+    if(!cache->entries) {
+        free(cache->entry_offsets);
+        free(cache);
+        return NULL;
+    }
+
+    for(size_t i=0; i < plc->num_tags; i++) {
+        encode_list_entry(&plc->tag_defs[i], attribs, num_attribs, cache->entries + cache->entry_offsets[i]);
+    }
+
+    info("Encoded symbol listing of %d tags in %d bytes.", (int)plc->num_tags, (int)total_size);
+
+    return cache;
+}
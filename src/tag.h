@@ -0,0 +1,109 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "plc.h"
+#include "slice.h"
+
+/* Logix tag names are case insensitive, so the hash and comparison are too. */
+extern uint32_t tag_name_hash(const uint8_t *name, size_t name_len);
+extern bool tag_index_build(plc_s *plc);
+extern void tag_index_destroy(plc_s *plc);
+extern tag_def_s *tag_find(plc_s *plc, slice_s name);
+
+/*
+ * What a request path names: a whole tag, an element of it, or a member
+ * of a structure in it.  length is the number of bytes from offset to the
+ * end of that part of the tag, which bounds how much a request may touch.
+ */
+typedef struct {
+    tag_def_s *tag;
+    size_t offset;
+    size_t length;
+    tag_type_t tag_type;
+    struct udt_def_s *udt;  /* the structure type if tag_type is TAG_TYPE_STRUCT. */
+    int elem_size;
+    int bit;                /* BOOL members are one bit of a byte, otherwise -1. */
+} tag_ref_s;
+
+/*
+ * Look up a type by name, ignoring case.  udt is set for structure types
+ * and NULL for atomic ones.  Returns false if it is not one we serve.
+ */
+extern bool tag_type_lookup(plc_s *plc, const char *type_name, size_t type_name_len, tag_type_t *tag_type, int *elem_size, struct udt_def_s **udt);
+
+/*
+ * Set the dimensions and element count of a tag once its type is set.  A
+ * BOOL array has one dimension in bits, rounded up to whole 32-bit words
+ * as Logix does.  Returns false if a dimension is not positive, a BOOL
+ * array has more than one or the tag is too large.
+ */
+extern bool tag_set_size(tag_def_s *tag, const int *dims, int num_dims);
+
+/*
+ * Tag data is shared by all server threads.  Each tag has a sequence lock:
+ * readers copy without locking and retry if a write overlapped the copy,
+ * writers take the tag's lock and bump the sequence around the change.
+ * A reader therefore sees all of a write or none of it, whatever its size.
+ *
+ * Anything that reads and then writes, like read-modify-write, must do
+ * both between tag_write_begin() and tag_write_end() and store with
+ * tag_store_data().
+ *
+ * A longer step from read to write, like a generator's, holds off other
+ * writers with tag_lock_data() instead and stores with tag_replace_data().
+ * Readers then only retry during the store itself.
+ */
+extern void tag_read_data(tag_def_s *tag, size_t offset, uint8_t *dest, size_t len);
+extern void tag_write_data(tag_def_s *tag, size_t offset, const uint8_t *src, size_t len);
+extern void tag_write_begin(tag_def_s *tag);
+extern void tag_store_data(tag_def_s *tag, size_t offset, const uint8_t *src, size_t len);
+extern void tag_write_end(tag_def_s *tag);
+extern void tag_lock_data(tag_def_s *tag);
+extern void tag_replace_data(tag_def_s *tag, size_t offset, const uint8_t *src, size_t len);
+extern void tag_unlock_data(tag_def_s *tag);
+
+/*
+ * Large responses are sent straight from the tag data.  The data is
+ * pinned while the socket copies it, which holds off writers but not
+ * other readers.
+ */
+extern void tag_pin_data(tag_def_s *tag);
+extern void tag_unpin_data(tag_def_s *tag);
+
+/*
+ * Symbol listings are encoded when the index is built, one for each of a
+ * fixed set of attribute lists.  All entries sit back to back in one
+ * buffer, in instance order, so a page of the listing is a single copy.
+ */
+#define TAG_LIST_MAX_ATTRIBS (8)
+
+typedef struct tag_list_cache_s {
+    struct tag_list_cache_s *next;
+    uint16_t attribs[TAG_LIST_MAX_ATTRIBS];
+    int num_attribs;
+    uint8_t *entries;
+    size_t *entry_offsets;   /* num_tags + 1 offsets into entries. */
+} tag_list_cache_s;
+
+extern tag_list_cache_s *tag_list_cache_get(plc_s *plc, const uint16_t *attribs, int num_attribs);
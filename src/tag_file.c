@@ -0,0 +1,499 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "arena.h"
+#include "plc.h"
+#include "sim.h"
+#include "slice.h"
+#include "tag.h"
+#include "tag_file.h"
+#include "udt.h"
+#include "utils.h"
+
+
+/* enough for a Logix export row, we only look at the first five fields. */
+#define MAX_FIELDS (8)
+
+/* the name goes in a symbolic segment with a one byte length. */
+#define MAX_TAG_NAME_LEN (255)
+
+typedef enum {
+    LINE_SKIPPED,
+    LINE_TAG,
+    LINE_UDT,
+    LINE_SIM,
+    LINE_UNSUPPORTED,
+    LINE_ERROR
+} line_result_t;
+
+static char *read_file(const char *path, size_t *file_len);
+static line_result_t parse_line(plc_s *plc, char *line, size_t line_len, int line_num);
+static int split_fields(char *line, size_t line_len, slice_s *fields);
+static slice_s trim_field(slice_s field);
+static bool field_is(slice_s field, const char *str);
+static bool valid_name(slice_s name);
+static line_result_t parse_udt_line(plc_s *plc, slice_s *fields, int num_fields);
+static line_result_t parse_sim_line(plc_s *plc, slice_s *fields, int num_fields);
+static bool parse_data_type(plc_s *plc, slice_s data_type, tag_type_t *tag_type, int *elem_size, udt_def_s **udt, int *dims, int *num_dims);
+static bool parse_dim(slice_s field, int *dim);
+static bool add_tag(plc_s *plc, slice_s name, tag_type_t tag_type, int elem_size, udt_def_s *udt, int *dims, int num_dims);
+
+
+bool tag_file_load(plc_s *plc, const char *path)
+{
+    int64_t start_ms = util_time_ms();
+    size_t file_len = 0;
+    char *file_data = read_file(path, &file_len);
+    char *line = file_data;
+    char *end = file_data + file_len;
+    int line_num = 0;
+    int num_tags = 0;
+    int num_unsupported = 0;
+    int num_udts = 0;
+    int num_sims = 0;
+
+    if(!file_data) {
+        return false;
+    }
+
+    /* one pass over the file, a line at a time, without copying it. */
+    while(line < end) {
+        char *eol = memchr(line, '\n', (size_t)(end - line));
+        size_t line_len = (eol ? (size_t)(eol - line) : (size_t)(end - line));
+
+        line_num++;
+
+        if(line_len > 0 && line[line_len - 1] == '\r') {
+            line_len--;
+        }
+
+        switch(parse_line(plc, line, line_len, line_num)) {
+            case LINE_TAG:
+                num_tags++;
+                break;
+
+            case LINE_UDT:
+                num_udts++;
+                break;
+
+            case LINE_SIM:
+                num_sims++;
+                break;
+
+            case LINE_UNSUPPORTED:
+                num_unsupported++;
+                break;
+
+            case LINE_ERROR:
+                fprintf(stderr, "Error in tag file %s on line %d!\n", path, line_num);
+                free(file_data);
+                return false;
+
+            default:
+                break;
+        }
+
+        line = (eol ? eol + 1 : end);
+    }
+
+    free(file_data);
+
+    fprintf(stderr, "Loaded %d tags", num_tags);
+    if(num_udts > 0) {
+        fprintf(stderr, " and %d structure members", num_udts);
+    }
+    if(num_sims > 0) {
+        fprintf(stderr, " and %d generators", num_sims);
+    }
+    fprintf(stderr, " from %s in %d ms", path, (int)(util_time_ms() - start_ms));
+    if(num_unsupported > 0) {
+        fprintf(stderr, ", skipped %d program scoped or unsupported tags", num_unsupported);
+    }
+    fprintf(stderr, ".\n");
+
+    return true;
+}
+
+
+/* the whole file in one buffer. */
+char *read_file(const char *path, size_t *file_len)
+{
+    FILE *file = fopen(path, "rb");
+    char *data = NULL;
+    long len = 0;
+
+    if(!file) {
+        fprintf(stderr, "Unable to open tag file %s!\n", path);
+        return NULL;
+    }
+
+    if(fseek(file, 0, SEEK_END) != 0 || (len = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Unable to get the size of tag file %s!\n", path);
+        fclose(file);
+        return NULL;
+    }
+
+    data = malloc((size_t)len + 1);
+    if(!data) {
+        fprintf(stderr, "Unable to allocate %ld bytes for tag file %s!\n", len, path);
+        fclose(file);
+        return NULL;
+    }
+
+    if(fread(data, 1, (size_t)len, file) != (size_t)len) {
+        fprintf(stderr, "Unable to read tag file %s!\n", path);
+        free(data);
+        fclose(file);
+        return NULL;
+    }
+
+    fclose(file);
+
+    data[len] = 0;
+    *file_len = (size_t)len;
+
+    return data;
+}
+
+
+line_result_t parse_line(plc_s *plc, char *line, size_t line_len, int line_num)
+{
+    slice_s fields[MAX_FIELDS];
+    int num_fields = split_fields(line, line_len, fields);
+    slice_s name;
+    slice_s data_type;
+    tag_type_t tag_type = 0;
+    int elem_size = 0;
+    udt_def_s *udt = NULL;
+    int dims[3] = { 0, 0, 0 };
+    int num_dims = 0;
+
+    if(num_fields == 0 || slice_len(fields[0]) == 0 || fields[0].data[0] == '#') {
+        return LINE_SKIPPED;
+    }
+
+    if(field_is(fields[0], "TAG")) {
+        /* Logix export: TYPE,SCOPE,NAME,DESCRIPTION,DATATYPE,... */
+        if(num_fields < 5) {
+            fprintf(stderr, "Tag export rows need at least five fields.\n");
+            return LINE_ERROR;
+        }
+
+        name = fields[2];
+        data_type = fields[4];
+
+        if(slice_len(fields[1]) > 0 || !parse_data_type(plc, data_type, &tag_type, &elem_size, &udt, dims, &num_dims)) {
+            info("Skipping tag %.*s on line %d.", (int)slice_len(name), (const char *)name.data, line_num);
+            return LINE_UNSUPPORTED;
+        }
+    } else if(field_is(fields[0], "UDT")) {
+        return parse_udt_line(plc, fields, num_fields);
+    } else if(field_is(fields[0], "SIM")) {
+        return parse_sim_line(plc, fields, num_fields);
+    } else if(isdigit(fields[0].data[0]) || field_is(fields[0], "REMARK") || field_is(fields[0], "TYPE")
+              || field_is(fields[0], "ALIAS") || field_is(fields[0], "COMMENT") || field_is(fields[0], "RCOMMENT")) {
+        /* the version line, column headers and other export records. */
+        return LINE_SKIPPED;
+    } else {
+        name = fields[0];
+        data_type = (num_fields > 1 ? fields[1] : slice_make(NULL, 0));
+
+        if(!parse_data_type(plc, data_type, &tag_type, &elem_size, &udt, dims, &num_dims)) {
+            fprintf(stderr, "Unsupported tag type \"%.*s\".\n", (int)slice_len(data_type), (const char *)data_type.data);
+            return LINE_ERROR;
+        }
+
+        /* dimensions in their own fields. */
+        if(num_fields > 2) {
+            if(num_dims > 0 || num_fields > 5) {
+                fprintf(stderr, "Tags have at most three dimensions, given either with the type or after it.\n");
+                return LINE_ERROR;
+            }
+
+            for(int i=2; i < num_fields; i++) {
+                if(!parse_dim(fields[i], &dims[num_dims])) {
+                    fprintf(stderr, "Tag dimensions must be positive numbers.\n");
+                    return LINE_ERROR;
+                }
+
+                num_dims++;
+            }
+        }
+    }
+
+    if(!valid_name(name)) {
+        fprintf(stderr, "Tag name \"%.*s\" is not valid.\n", (int)slice_len(name), (const char *)name.data);
+        return LINE_ERROR;
+    }
+
+    if(!add_tag(plc, name, tag_type, elem_size, udt, dims, num_dims)) {
+        return LINE_ERROR;
+    }
+
+    return LINE_TAG;
+}
+
+
+/* UDT,<type>,<member>,<member type>.  The first row for a type creates it. */
+line_result_t parse_udt_line(plc_s *plc, slice_s *fields, int num_fields)
+{
+    udt_def_s *udt = NULL;
+
+    if(num_fields != 4) {
+        fprintf(stderr, "Structure rows need a type name, a member name and a member type.\n");
+        return LINE_ERROR;
+    }
+
+    udt = udt_find(plc, (const char *)fields[1].data, (size_t)slice_len(fields[1]));
+    if(!udt) {
+        udt = udt_create(plc, (const char *)fields[1].data, (size_t)slice_len(fields[1]));
+        if(!udt) {
+            return LINE_ERROR;
+        }
+    }
+
+    if(!udt_add_member(plc, udt, fields[2], fields[3])) {
+        return LINE_ERROR;
+    }
+
+    return LINE_UDT;
+}
+
+
+/* SIM,<tag>,<generator>,<period ms>[,<value>]...  The tag may come later in the file. */
+line_result_t parse_sim_line(plc_s *plc, slice_s *fields, int num_fields)
+{
+    if(num_fields < 4) {
+        fprintf(stderr, "Generator rows need a tag name, a generator and a period.\n");
+        return LINE_ERROR;
+    }
+
+    if(!sim_add(plc, fields[1], fields[2], &fields[3], num_fields - 3)) {
+        return LINE_ERROR;
+    }
+
+    return LINE_SIM;
+}
+
+
+/*
+ * Split a CSV line in place.  Quoted fields may contain commas.  Fields
+ * past MAX_FIELDS are ignored.  Returns the number of fields.
+ */
+int split_fields(char *line, size_t line_len, slice_s *fields)
+{
+    size_t pos = 0;
+    int num_fields = 0;
+
+    if(line_len == 0) {
+        return 0;
+    }
+
+    while(num_fields < MAX_FIELDS) {
+        size_t start = pos;
+        bool quoted = false;
+
+        while(pos < line_len && (line[pos] != ',' || quoted)) {
+            if(line[pos] == '"') {
+                quoted = !quoted;
+            }
+            pos++;
+        }
+
+        fields[num_fields] = trim_field(slice_make((uint8_t *)line + start, (ssize_t)(pos - start)));
+        num_fields++;
+
+        if(pos >= line_len) {
+            break;
+        }
+
+        /* skip the comma. */
+        pos++;
+    }
+
+    return num_fields;
+}
+
+
+/* drop surrounding white space and quotes. */
+slice_s trim_field(slice_s field)
+{
+    uint8_t *start = field.data;
+    uint8_t *end = field.data + slice_len(field);
+
+    while(start < end && isspace(*start)) {
+        start++;
+    }
+
+    while(end > start && isspace(*(end - 1))) {
+        end--;
+    }
+
+    if(end - start >= 2 && *start == '"' && *(end - 1) == '"') {
+        start++;
+        end--;
+    }
+
+    return slice_make(start, (ssize_t)(end - start));
+}
+
+
+bool field_is(slice_s field, const char *str)
+{
+    size_t len = strlen(str);
+
+    return (size_t)slice_len(field) == len && strncasecmp((const char *)field.data, str, len) == 0;
+}
+
+
+bool valid_name(slice_s name)
+{
+    if(slice_len(name) == 0 || slice_len(name) > MAX_TAG_NAME_LEN) {
+        return false;
+    }
+
+    if(!isalpha(name.data[0]) && name.data[0] != '_') {
+        return false;
+    }
+
+    for(ssize_t i=1; i < slice_len(name); i++) {
+        if(!isalnum(name.data[i]) && name.data[i] != '_') {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/* <type> or <type>[<d1>[,<d2>[,<d3>]]]. */
+bool parse_data_type(plc_s *plc, slice_s data_type, tag_type_t *tag_type, int *elem_size, udt_def_s **udt, int *dims, int *num_dims)
+{
+    size_t len = (size_t)slice_len(data_type);
+    size_t type_len = 0;
+
+    while(type_len < len && data_type.data[type_len] != '[') {
+        type_len++;
+    }
+
+    if(!tag_type_lookup(plc, (const char *)data_type.data, type_len, tag_type, elem_size, udt)) {
+        return false;
+    }
+
+    *num_dims = 0;
+
+    if(type_len < len) {
+        size_t pos = type_len + 1;
+
+        if(data_type.data[len - 1] != ']') {
+            return false;
+        }
+
+        while(pos < len - 1) {
+            size_t start = pos;
+
+            while(pos < len - 1 && data_type.data[pos] != ',') {
+                pos++;
+            }
+
+            if(*num_dims >= 3 || !parse_dim(slice_make(data_type.data + start, (ssize_t)(pos - start)), &dims[*num_dims])) {
+                return false;
+            }
+
+            (*num_dims)++;
+            pos++;
+        }
+
+        if(*num_dims == 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool parse_dim(slice_s field, int *dim)
+{
+    long value = 0;
+
+    field = trim_field(field);
+
+    if(slice_len(field) == 0) {
+        return false;
+    }
+
+    for(ssize_t i=0; i < slice_len(field); i++) {
+        if(!isdigit(field.data[i])) {
+            return false;
+        }
+
+        value = (value * 10) + (field.data[i] - '0');
+        if(value > INT_MAX) {
+            return false;
+        }
+    }
+
+    if(value < 1) {
+        return false;
+    }
+
+    *dim = (int)value;
+
+    return true;
+}
+
+
+/* the tag and its name come from the arena.  A tag without dimensions is a scalar. */
+bool add_tag(plc_s *plc, slice_s name, tag_type_t tag_type, int elem_size, udt_def_s *udt, int *dims, int num_dims)
+{
+    tag_def_s *tag = arena_alloc(&plc->tag_arena, sizeof(*tag), sizeof(uint64_t));
+
+    if(!tag) {
+        fprintf(stderr, "Unable to allocate memory for new tag!\n");
+        return false;
+    }
+
+    tag->name = arena_strndup(&plc->tag_arena, (const char *)name.data, (size_t)slice_len(name));
+    if(!tag->name) {
+        fprintf(stderr, "Unable to allocate memory for tag %.*s!\n", (int)slice_len(name), (const char *)name.data);
+        return false;
+    }
+
+    tag->tag_type = tag_type;
+    tag->udt = udt;
+    tag->elem_size = elem_size;
+
+    if(!tag_set_size(tag, dims, num_dims)) {
+        fprintf(stderr, "Tag %s is too large, or is a BOOL array with more than one dimension!\n", tag->name);
+        return false;
+    }
+
+    tag->next_tag = plc->tags;
+    plc->tags = tag;
+
+    return true;
+}
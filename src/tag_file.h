@@ -0,0 +1,49 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include "plc.h"
+
+/*
+ * Load tag definitions from a file.  Each line is either
+ *
+ *    <name>,<type>[,<dim1>[,<dim2>[,<dim3>]]]
+ *
+ * where the type may also carry the dimensions as in <type>[<sizes>], or
+ * a TAG row from a Logix Designer tag export (TYPE,SCOPE,NAME,DESCRIPTION,
+ * DATATYPE,...).  Blank lines and lines starting with # are ignored, as
+ * are the other export records, program scoped tags and tags of types we
+ * do not serve.
+ *
+ *    UDT,<type>,<member>,<member type>
+ *
+ * adds a member to a structure type, creating it on its first row.  See
+ * udt.h.  The rows of a type must come before any tag that uses it.
+ *
+ *    SIM,<tag>,<generator>,<period ms>[,<value>]...
+ *
+ * updates a tag's value while the server runs.  See sim.h.
+ *
+ * The tags and their names come from the PLC's tag arena.  Returns false
+ * after printing the line at fault if the file cannot be used.
+ */
+extern bool tag_file_load(plc_s *plc, const char *path);
@@ -0,0 +1,342 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "plc.h"
+#include "tag.h"
+#include "tag_store.h"
+#include "udt.h"
+#include "utils.h"
+
+
+#define TAG_STORE_MAGIC "ABSRVTAG"
+#define TAG_STORE_VERSION (2)
+
+/* the data starts on its own page. */
+#define TAG_STORE_HEADER_SIZE (4096)
+
+/*
+ * Small tags are word aligned so that bulk copies can use whole words and
+ * several share a cache line.  Anything a line or bigger starts on its own
+ * line so that it does not share one with its neighbours.
+ */
+#define TAG_DATA_ALIGN (sizeof(uint64_t))
+#define TAG_DATA_LINE_SIZE (64)
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_tags;
+    uint64_t layout_hash;   /* names, types and sizes of the tags, in order. */
+    uint64_t data_size;
+    uint64_t sync_count;    /* flushes since the file was created. */
+} tag_store_header_s;
+
+static size_t layout_tags(plc_s *plc, uint64_t *layout_hash);
+static size_t place_tag(tag_def_s *tag, size_t offset);
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t len);
+static bool map_data_file(plc_s *plc, const char *data_file, size_t data_size, uint64_t layout_hash);
+static void *sync_thread(void *plc);
+
+
+bool tag_store_open(plc_s *plc, const char *data_file, int sync_interval_s)
+{
+    uint64_t layout_hash = 0;
+    size_t data_size = layout_tags(plc, &layout_hash);
+    size_t offset = 0;
+
+    plc->tag_data_fd = -1;
+
+    if(data_file) {
+        if(!map_data_file(plc, data_file, data_size, layout_hash)) {
+            return false;
+        }
+    } else {
+        void *slab = NULL;
+
+        if(posix_memalign(&slab, TAG_DATA_LINE_SIZE, (data_size > 0 ? data_size : 1)) != 0) {
+            fprintf(stderr, "Unable to allocate %zu bytes of tag data!\n", data_size);
+            return false;
+        }
+
+        memset(slab, 0, data_size);
+        plc->tag_data = slab;
+        plc->tag_data_size = data_size;
+    }
+
+    /* point each tag at its part of the region. */
+    for(size_t i=0; i < plc->num_tags; i++) {
+        tag_def_s *tag = &plc->tag_defs[i];
+
+        offset = place_tag(tag, offset);
+        tag->data = plc->tag_data + offset;
+        offset += (size_t)tag->elem_count * (size_t)tag->elem_size;
+    }
+
+    if(data_file && sync_interval_s > 0) {
+        pthread_condattr_t cond_attr;
+
+        /* the thread waits on the monotonic clock so that changes to the time of day do not stall it. */
+        pthread_condattr_init(&cond_attr);
+        pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&plc->sync_wake, &cond_attr);
+        pthread_condattr_destroy(&cond_attr);
+        pthread_mutex_init(&plc->sync_lock, NULL);
+
+        plc->sync_interval_ms = sync_interval_s * 1000;
+        plc->sync_running = true;
+
+        if(pthread_create(&plc->sync_thread, NULL, sync_thread, plc) != 0) {
+            fprintf(stderr, "Unable to start the tag data sync thread!\n");
+            plc->sync_interval_ms = 0;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/* flush changed pages of the data file to disk. */
+void tag_store_sync(plc_s *plc)
+{
+    tag_store_header_s *header = NULL;
+
+    if(plc->tag_data_fd < 0) {
+        return;
+    }
+
+    if(msync(plc->tag_data, plc->tag_data_size, MS_SYNC) != 0) {
+        warning("unable to flush tag data, errno %d!", errno);
+        return;
+    }
+
+    /* the header is only written here, by one thread at a time. */
+    header = (tag_store_header_s *)(plc->tag_data - TAG_STORE_HEADER_SIZE);
+    header->sync_count++;
+    msync(header, TAG_STORE_HEADER_SIZE, MS_ASYNC);
+}
+
+
+void tag_store_close(plc_s *plc)
+{
+    /* the thread must be done with the region before the last flush and the unmap. */
+    if(plc->sync_interval_ms > 0) {
+        pthread_mutex_lock(&plc->sync_lock);
+        plc->sync_running = false;
+        pthread_cond_signal(&plc->sync_wake);
+        pthread_mutex_unlock(&plc->sync_lock);
+
+        pthread_join(plc->sync_thread, NULL);
+
+        pthread_cond_destroy(&plc->sync_wake);
+        pthread_mutex_destroy(&plc->sync_lock);
+        plc->sync_interval_ms = 0;
+    }
+
+    if(plc->tag_data_fd >= 0) {
+        tag_store_sync(plc);
+        munmap(plc->tag_data - TAG_STORE_HEADER_SIZE, TAG_STORE_HEADER_SIZE + plc->tag_data_size);
+        close(plc->tag_data_fd);
+        plc->tag_data_fd = -1;
+    } else {
+        free(plc->tag_data);
+    }
+
+    plc->tag_data = NULL;
+    plc->tag_data_size = 0;
+}
+
+
+/* total size of the region, and a hash of what is in it so that a file from other tags is not reused. */
+size_t layout_tags(plc_s *plc, uint64_t *layout_hash)
+{
+    uint64_t hash = (uint64_t)14695981039346656037u;
+    size_t data_size = 0;
+
+    for(size_t i=0; i < plc->num_tags; i++) {
+        tag_def_s *tag = &plc->tag_defs[i];
+        uint32_t sizes[2] = { (uint32_t)tag->elem_size, (uint32_t)tag->elem_count };
+
+        hash = hash_bytes(hash, tag->name, tag->name_len + 1);
+        hash = hash_bytes(hash, &tag->tag_type, sizeof(tag->tag_type));
+        if(tag->udt) {
+            hash = hash_bytes(hash, &tag->udt->handle, sizeof(tag->udt->handle));
+        }
+        hash = hash_bytes(hash, sizes, sizeof(sizes));
+
+        data_size = place_tag(tag, data_size) + (size_t)tag->elem_count * (size_t)tag->elem_size;
+    }
+
+    *layout_hash = hash;
+
+    /* whole lines, so that the last tag does not share one with anything else. */
+    return (data_size + TAG_DATA_LINE_SIZE - 1) & ~((size_t)TAG_DATA_LINE_SIZE - 1);
+}
+
+
+/* where the tag's data starts, at or after offset. */
+size_t place_tag(tag_def_s *tag, size_t offset)
+{
+    size_t align = TAG_DATA_ALIGN;
+
+    if((size_t)tag->elem_count * (size_t)tag->elem_size >= TAG_DATA_LINE_SIZE) {
+        align = TAG_DATA_LINE_SIZE;
+    }
+
+    return (offset + align - 1) & ~(align - 1);
+}
+
+
+/* FNV-1a, 64 bit. */
+uint64_t hash_bytes(uint64_t hash, const void *data, size_t len)
+{
+    const uint8_t *bytes = data;
+
+    for(size_t i=0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= (uint64_t)1099511628211u;
+    }
+
+    return hash;
+}
+
+
+bool map_data_file(plc_s *plc, const char *data_file, size_t data_size, uint64_t layout_hash)
+{
+    size_t file_size = TAG_STORE_HEADER_SIZE + data_size;
+    tag_store_header_s *header = NULL;
+    struct stat file_stat;
+    uint8_t *base = NULL;
+    bool reuse = false;
+    int fd;
+
+    fd = open(data_file, O_RDWR | O_CREAT, 0644);
+    if(fd < 0) {
+        fprintf(stderr, "Unable to open tag data file %s, errno %d!\n", data_file, errno);
+        return false;
+    }
+
+    /* two servers writing the same file would corrupt each other's tags. */
+    if(flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        fprintf(stderr, "Tag data file %s is in use by another server!\n", data_file);
+        close(fd);
+        return false;
+    }
+
+    if(fstat(fd, &file_stat) != 0) {
+        fprintf(stderr, "Unable to get the size of tag data file %s, errno %d!\n", data_file, errno);
+        close(fd);
+        return false;
+    }
+
+    if((size_t)file_stat.st_size == file_size) {
+        tag_store_header_s existing;
+
+        reuse = (pread(fd, &existing, sizeof(existing), 0) == (ssize_t)sizeof(existing)
+                 && memcmp(existing.magic, TAG_STORE_MAGIC, sizeof(existing.magic)) == 0
+                 && existing.version == TAG_STORE_VERSION
+                 && existing.num_tags == (uint32_t)plc->num_tags
+                 && existing.layout_hash == layout_hash
+                 && existing.data_size == (uint64_t)data_size);
+    }
+
+    if(!reuse) {
+        if(file_stat.st_size > 0) {
+            fprintf(stderr, "Tag data file %s does not match the tags, starting with zeros.\n", data_file);
+        }
+
+        /* truncating first is the cheapest way to zero the old contents. */
+        if(ftruncate(fd, 0) != 0 || ftruncate(fd, (off_t)file_size) != 0) {
+            fprintf(stderr, "Unable to size tag data file %s to %zu bytes, errno %d!\n", data_file, file_size, errno);
+            close(fd);
+            return false;
+        }
+    }
+
+    base = mmap(NULL, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(base == MAP_FAILED) {
+        fprintf(stderr, "Unable to map tag data file %s, errno %d!\n", data_file, errno);
+        close(fd);
+        return false;
+    }
+
+    header = (tag_store_header_s *)base;
+
+    if(reuse) {
+        fprintf(stderr, "Using tag values in %s (%llu flushes).\n", data_file, (unsigned long long)header->sync_count);
+    } else {
+        memcpy(header->magic, TAG_STORE_MAGIC, sizeof(header->magic));
+        header->version = TAG_STORE_VERSION;
+        header->num_tags = (uint32_t)plc->num_tags;
+        header->layout_hash = layout_hash;
+        header->data_size = (uint64_t)data_size;
+        header->sync_count = 0;
+        msync(base, TAG_STORE_HEADER_SIZE, MS_SYNC);
+    }
+
+    plc->tag_data = base + TAG_STORE_HEADER_SIZE;
+    plc->tag_data_size = data_size;
+    plc->tag_data_fd = fd;
+
+    return true;
+}
+
+
+void *sync_thread(void *plc_arg)
+{
+    plc_s *plc = (plc_s *)plc_arg;
+    struct timespec wake_at;
+
+    clock_gettime(CLOCK_MONOTONIC, &wake_at);
+
+    pthread_mutex_lock(&plc->sync_lock);
+
+    while(plc->sync_running) {
+        wake_at.tv_sec += plc->sync_interval_ms / 1000;
+
+        /* tag_store_close() wakes it early to stop. */
+        while(plc->sync_running) {
+            if(pthread_cond_timedwait(&plc->sync_wake, &plc->sync_lock, &wake_at) == ETIMEDOUT) {
+                break;
+            }
+        }
+
+        if(plc->sync_running) {
+            pthread_mutex_unlock(&plc->sync_lock);
+            tag_store_sync(plc);
+            pthread_mutex_lock(&plc->sync_lock);
+        }
+    }
+
+    pthread_mutex_unlock(&plc->sync_lock);
+
+    return NULL;
+}
@@ -0,0 +1,42 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include "plc.h"
+
+/*
+ * Lay out the data of every tag back to back, in instance order, in one
+ * region.  With a data file the region is the file, mapped shared, so
+ * values survive a restart: if the file was written for the same tags,
+ * it is used as is and nothing is loaded or cleared.  Otherwise the file
+ * is reset to zeros for the current tags.
+ *
+ * The kernel writes changed pages back on its own.  With sync_interval_s
+ * above zero, a background thread also flushes them that often, so at
+ * most that many seconds of writes are lost if the machine goes down.
+ *
+ * Call after tag_index_build().  Returns false if the file cannot be
+ * used, for instance because another server has it open.
+ */
+extern bool tag_store_open(plc_s *plc, const char *data_file, int sync_interval_s);
+extern void tag_store_sync(plc_s *plc);
+extern void tag_store_close(plc_s *plc);
@@ -18,130 +18,722 @@
  *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
  ***************************************************************************/
 
+#include <errno.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
 #include "slice.h"
 #include "socket.h"
 #include "tcp_server.h"
+#include "tcp_server_int.h"
 #include "utils.h"
 
-struct tcp_server {
-    int sock_fd;
-    slice_s buffer;
-    slice_s (*handler)(slice_s input, slice_s output, void *context);
-    void *context;
-};
 
+/* how many ready sockets we pick up per call to epoll_wait(). */
+#define MAX_EVENTS (64)
 
-tcp_server_p tcp_server_create(const char *host, const char *port, slice_s buffer, slice_s (*handler)(slice_s input, slice_s output, void *context), void *context)
+/* listening sockets are registered by index with the low bit set, clients by pointer. */
+#define LISTENER_EVENT(index) ((((uint64_t)(index)) << 1) | 1)
+#define IS_LISTENER_EVENT(data) (((data) & 1) != 0)
+#define LISTENER_INDEX(data) ((size_t)((data) >> 1))
+
+
+static bool add_listener(tcp_server_p server, const char *host, const char *port, void *context);
+static bool setup_epoll(tcp_server_p server);
+static bool watch_listener(tcp_server_p server, size_t index);
+static void accept_clients(tcp_server_p server, tcp_listener_s *listener);
+static void handle_conn_event(tcp_server_p server, tcp_conn_s *conn, uint32_t events);
+static bool read_and_process(tcp_server_p server, tcp_conn_s *conn);
+static bool send_output(tcp_server_p server, tcp_conn_s *conn);
+static bool flush_pending(tcp_server_p server, tcp_conn_s *conn);
+static void send_with_tail(tcp_conn_s *conn);
+static void close_conn(tcp_server_p server, tcp_conn_s *conn);
+static bool resize_buffers(tcp_conn_s *conn);
+static void free_conn(tcp_conn_s *conn);
+
+
+tcp_server_p tcp_server_create(const char *host, const char *port, bool share_port, size_t buffer_size,
+                               void *(*conn_open)(tcp_conn_p conn, void *context),
+                               slice_s (*handler)(slice_s input, slice_s output, size_t *used, void *conn_context),
+                               void (*conn_close)(void *conn_context),
+                               void *context)
 {
     tcp_server_p server = calloc(1, sizeof(*server));
 
     if(server) {
-        int rc;
-        server->sock_fd = socket_open(host, port);
+        server->epoll_fd = -1;
+        server->share_port = share_port;
+        server->buffer_size = buffer_size;
+        server->conn_open = conn_open;
+        server->handler = handler;
+        server->conn_close = conn_close;
+        timer_wheel_init(&server->timers);
 
-        if(server->sock_fd < 0) {
-            error("ERROR: Unable to open TCP socket, error code %d!", server->sock_fd);
+        if(!add_listener(server, host, port, context)) {
+            error("Unable to listen on %s:%s!", host, port);
         }
 
-        server->buffer = buffer;
-        server->handler = handler;
-        server->context = context;
+#ifdef TCP_SERVER_IO_URING
+        /* older kernels do not have everything we need, so fall back to epoll. */
+        server->uring = tcp_uring_create(server);
+        if(server->uring) {
+            return server;
+        }
+
+        warning("io_uring is not usable, using epoll instead.");
+#endif
+
+        if(!setup_epoll(server)) {
+            error("Unable to set up epoll for the listening socket!");
+        }
     }
 
     return server;
 }
 
+
+bool tcp_server_listen(tcp_server_p server, const char *host, const char *port, void *context)
+{
+    if(!add_listener(server, host, port, context)) {
+        return false;
+    }
+
+    /* io_uring arms all the listeners when it starts. */
+    if(server->epoll_fd >= 0 && !watch_listener(server, server->num_listeners - 1)) {
+        warning("Unable to add listening socket to epoll set!");
+        return false;
+    }
+
+    return true;
+}
+
+
 void tcp_server_start(tcp_server_p server)
 {
-    slice_s response;
-    int client_fd;
+    struct epoll_event events[MAX_EVENTS];
     bool done = false;
 
+    info("Waiting for client connections.");
+
+#ifdef TCP_SERVER_IO_URING
+    if(server->uring) {
+        tcp_uring_run(server);
+        return;
+    }
+#endif
+
     do {
-        info("Waiting for new client connection.");
-        client_fd = socket_accept(server->sock_fd);
+        int num_events = epoll_wait(server->epoll_fd, events, MAX_EVENTS, timer_wheel_wait_ms(&server->timers));
+
+        timer_wheel_set_now(&server->timers, timer_now_ms());
+
+        if(num_events < 0) {
+            if(errno != EINTR) {
+                warning("epoll_wait() failed with errno %d!", errno);
+                done = true;
+            }
+
+            continue;
+        }
+
+        for(int i=0; i < num_events; i++) {
+            if(IS_LISTENER_EVENT(events[i].data.u64)) {
+                accept_clients(server, &server->listeners[LISTENER_INDEX(events[i].data.u64)]);
+            } else {
+                handle_conn_event(server, (tcp_conn_s *)events[i].data.ptr, events[i].events);
+            }
+        }
+
+        /* after the events, so that a client a timer closes is not in this batch. */
+        timer_wheel_run(&server->timers);
+    } while(!done);
+}
+
 
-        if(client_fd >= 0) {
-            slice_s tmp_input = server->buffer;
+
+void tcp_server_destroy(tcp_server_p server)
+{
+    if(server) {
+#ifdef TCP_SERVER_IO_URING
+        /* this cancels anything still in flight on the clients' sockets. */
+        if(server->uring) {
+            tcp_uring_destroy(server->uring);
+            server->uring = NULL;
+        }
+#endif
+
+        while(server->conns) {
+            close_conn(server, server->conns);
+        }
+
+        if(server->epoll_fd >= 0) {
+            close(server->epoll_fd);
+            server->epoll_fd = -1;
+        }
+
+        for(size_t i=0; i < server->num_listeners; i++) {
+            socket_close(server->listeners[i].sock_fd);
+        }
+
+        free(server->listeners);
+        free(server);
+    }
+}
+
+
+/* each thread's server has its own listener on the same port when sharing. */
+bool add_listener(tcp_server_p server, const char *host, const char *port, void *context)
+{
+    tcp_listener_s *listeners = realloc(server->listeners, (server->num_listeners + 1) * sizeof(*listeners));
+    int sock_fd = -1;
+
+    if(!listeners) {
+        warning("Unable to allocate memory for another listener!");
+        return false;
+    }
+
+    server->listeners = listeners;
+
+    sock_fd = (server->share_port ? socket_open_shared(host, port) : socket_open_server(host, port));
+    if(sock_fd < 0) {
+        warning("Unable to open TCP socket on %s:%s, error code %d!", host, port, sock_fd);
+        return false;
+    }
+
+    if(socket_set_nonblocking(sock_fd) < 0) {
+        warning("Unable to set listening socket non-blocking!");
+        socket_close(sock_fd);
+        return false;
+    }
+
+    listeners[server->num_listeners].sock_fd = sock_fd;
+    listeners[server->num_listeners].context = context;
+    server->num_listeners++;
+
+    return true;
+}
+
+
+bool setup_epoll(tcp_server_p server)
+{
+    server->epoll_fd = epoll_create1(0);
+    if(server->epoll_fd < 0) {
+        warning("Unable to create epoll instance!");
+        return false;
+    }
+
+    for(size_t i=0; i < server->num_listeners; i++) {
+        if(!watch_listener(server, i)) {
+            warning("Unable to add listening socket to epoll set!");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool watch_listener(tcp_server_p server, size_t index)
+{
+    struct epoll_event ev = {0};
+
+    ev.events = EPOLLIN;
+    ev.data.u64 = LISTENER_EVENT(index);
+
+    return (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listeners[index].sock_fd, &ev) == 0);
+}
+
+
+/* take all the waiting connections off the listen queue. */
+void accept_clients(tcp_server_p server, tcp_listener_s *listener)
+{
+    int client_fd;
+
+    while((client_fd = socket_accept(listener->sock_fd)) >= 0) {
+        tcp_conn_s *conn = NULL;
+        struct epoll_event ev = {0};
+
+        if(socket_set_nonblocking(client_fd) < 0) {
+            warning("unable to set client socket non-blocking!");
+            socket_close(client_fd);
+            continue;
+        }
+
+        conn = tcp_conn_add(server, listener, client_fd);
+        if(!conn) {
+            continue;
+        }
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = conn;
+        if(epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            warning("unable to add client socket to epoll set!");
+            tcp_conn_remove(server, conn);
+            continue;
+        }
+    }
+
+    if(client_fd != SOCKET_ERR_AGAIN) {
+        warning("Error while trying to open the client socket.");
+    }
+}
+
+
+/*
+ * Set up a new client on an accepted socket and link it in.  On failure
+ * the socket is closed and NULL returned.
+ */
+tcp_conn_s *tcp_conn_add(tcp_server_p server, tcp_listener_s *listener, int fd)
+{
+    tcp_conn_s *conn = calloc(1, sizeof(*conn));
+
+    if(conn) {
+        conn->wanted_buffer_size = server->buffer_size;
+    }
+
+    if(!conn || !resize_buffers(conn)) {
+        warning("unable to set up client connection!");
+        free_conn(conn);
+        socket_close(fd);
+        return NULL;
+    }
+
+    conn->fd = fd;
+    conn->server = server;
+
+    conn->context = (server->conn_open ? server->conn_open(conn, listener->context) : listener->context);
+    if(!conn->context) {
+        warning("unable to create client context!");
+        free_conn(conn);
+        socket_close(fd);
+        return NULL;
+    }
+
+    /* link it in. */
+    conn->next = server->conns;
+    if(server->conns) {
+        server->conns->prev = conn;
+    }
+    server->conns = conn;
+    server->num_conns++;
+
+    info("New client connection on socket %d, %d clients connected.", fd, server->num_conns);
+
+    return conn;
+}
+
+
+void handle_conn_event(tcp_server_p server, tcp_conn_s *conn, uint32_t events)
+{
+    bool keep = true;
+
+    if(slice_len(conn->pending) > 0) {
+        /* only drain the response while one is outstanding.  New requests wait. */
+        if(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+            keep = flush_pending(server, conn);
+
+            /* requests that came in behind the response may already be buffered. */
+            if(keep && slice_len(conn->pending) == 0 && conn->in_len > 0) {
+                keep = tcp_conn_process_input(server, conn);
+            }
+        }
+    } else if(events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        keep = read_and_process(server, conn);
+    }
+
+    if(!keep) {
+        close_conn(server, conn);
+    }
+}
+
+
+/* returns false if the connection should be closed. */
+bool read_and_process(tcp_server_p server, tcp_conn_s *conn)
+{
+    slice_s tmp_input;
+
+    /* the previous response is out, so it is safe to move the buffers now. */
+    if(conn->wanted_buffer_size != conn->buffer_size && !resize_buffers(conn)) {
+        return false;
+    }
+
+    /* get more data after whatever is already buffered. */
+    tmp_input = socket_read(conn->fd, slice_make(conn->in_data + conn->in_len, (ssize_t)(conn->in_capacity - conn->in_len)));
+
+    if(slice_has_err(tmp_input)) {
+        info("Client on socket %d disconnected or had an error %d.", conn->fd, slice_get_err(tmp_input));
+        return false;
+    }
+
+    if(slice_len(tmp_input) == 0) {
+        /* spurious wake up. */
+        return true;
+    }
+
+    conn->in_len += (size_t)slice_len(tmp_input);
+
+    return tcp_conn_process_input(server, conn);
+}
+
+
+/*
+ * Handle every complete request in the input buffer and send the
+ * responses with one write.  A partial request is kept for the next
+ * read.  This stops early if the output buffer cannot hold another
+ * full-sized response or a response has a tail that must follow it
+ * directly.  The rest is handled once that output is sent.
+ *
+ * Returns false if the connection should be closed.
+ */
+bool tcp_conn_process_input(tcp_server_p server, tcp_conn_s *conn)
+{
+    size_t in_used = 0;
+    size_t out_len = 0;
+    bool more = false;
+    bool keep = true;
+
+    do {
+        in_used = 0;
+        out_len = 0;
+        more = false;
+
+        /* nothing is pending, so a resize asked for by an earlier request is safe now. */
+        if(conn->wanted_buffer_size != conn->buffer_size && !resize_buffers(conn)) {
+            return false;
+        }
+
+        while(in_used < conn->in_len) {
+            slice_s input = slice_make(conn->in_data + in_used, (ssize_t)(conn->in_len - in_used));
             slice_s tmp_output;
-            int rc;
+            size_t used = 0;
 
-            do {
-                rc = TCP_SERVER_PROCESSED;
+            if(out_len > 0 && (conn->buffer_size + TCP_SERVER_COALESCE_SIZE - out_len) < conn->buffer_size) {
+                more = true;
+                break;
+            }
 
-                /* get an incoming packet or a partial packet. */
-                tmp_input = socket_read(client_fd, tmp_input);
+            tmp_output = server->handler(input, slice_make(conn->out_data + out_len, (ssize_t)(conn->buffer_size + TCP_SERVER_COALESCE_SIZE - out_len)), &used, conn->context);
 
-                if((rc = slice_has_err(tmp_input))) {
-                    info("WARN: error response reading socket! error %d", rc);
-                    rc = TCP_SERVER_DONE;
+            if(!slice_has_err(tmp_output)) {
+                in_used += used;
+                out_len += (size_t)slice_len(tmp_output);
+
+                if(slice_len(conn->tail) > 0) {
+                    more = (in_used < conn->in_len);
                     break;
                 }
 
-                /* try to process the packet. */
-                tmp_output = server->handler(tmp_input, server->buffer, server->context);
-
-                /* check the response. */
-                if(!slice_has_err(tmp_output)) {
-                    /* FIXME - this should be in a loop to make sure all data is pushed. */
-                    rc = socket_write(client_fd, tmp_output);
-
-                    /* error writing? */
-                    if(rc < 0) {
-                        info("ERROR: error writing output packet! Error: %d", rc);
-                        rc = TCP_SERVER_DONE;
-                        break;
-                    } else {
-                        /* all good. Reset the buffers etc. */
-                        tmp_input = server->buffer;
-                        rc = TCP_SERVER_PROCESSED;
-                    }
-                } else {
-                    /* there was some sort of error or exceptional condition. */
-                    switch((rc = slice_get_err(tmp_input))) {
-                        case TCP_SERVER_DONE:
-                            done = true;
-                            break;
-
-                        case TCP_SERVER_INCOMPLETE:
-                            tmp_input = slice_from_slice(server->buffer, slice_len(tmp_input), slice_len(server->buffer) - slice_len(tmp_input));
-                            break;
-
-                        case TCP_SERVER_PROCESSED:
-                            break;
-
-                        case TCP_SERVER_UNSUPPORTED:
-                            info("WARN: Unsupported packet!");
-                            slice_dump(tmp_input);
-                            break;
-
-                        default:
-                            info("WARN: Unsupported return code %d!", rc);
-                            break;
-                    }
+                continue;
+            }
+
+            /* no response to go with any tail. */
+            tcp_conn_release_tail(conn);
+
+            if(slice_get_err(tmp_output) == TCP_SERVER_INCOMPLETE) {
+                if(in_used == 0 && conn->in_len >= conn->buffer_size) {
+                    warning("request is larger than the buffer, %d bytes!", (int)conn->buffer_size);
+                    keep = false;
                 }
-            } while(rc == TCP_SERVER_INCOMPLETE || rc == TCP_SERVER_PROCESSED);
-        } else {
-            /* could not open the client socket! */
-            info("WARN: error while trying to open the client socket.");
+                break;
+            } else if(slice_get_err(tmp_output) == TCP_SERVER_PROCESSED) {
+                in_used += used;
+                continue;
+            } else if(slice_get_err(tmp_output) == TCP_SERVER_DONE) {
+                keep = false;
+                break;
+            } else if(slice_get_err(tmp_output) == TCP_SERVER_UNSUPPORTED) {
+                warning("Unsupported packet!");
+                slice_dump(input);
+                keep = false;
+                break;
+            } else {
+                warning("Unsupported return code %d!", slice_get_err(tmp_output));
+                keep = false;
+                break;
+            }
+        }
+
+        /* keep any partial request at the front of the buffer. */
+        if(in_used > 0) {
+            memmove(conn->in_data, conn->in_data + in_used, conn->in_len - in_used);
+            conn->in_len -= in_used;
         }
 
-        socket_close(client_fd);
+        if(out_len > 0) {
+            conn->pending = slice_make(conn->out_data, (ssize_t)out_len);
 
-    } while(!done);
+            /* send what we have even if the client is going away. */
+            if(!send_output(server, conn)) {
+                return false;
+            }
+        }
+
+        /* carry on with buffered requests if everything went out. */
+    } while(keep && more && slice_len(conn->pending) == 0);
+
+    return keep;
 }
 
 
+/* hand the pending response, and any tail, to whichever back end is running. */
+bool send_output(tcp_server_p server, tcp_conn_s *conn)
+{
+#ifdef TCP_SERVER_IO_URING
+    if(server->uring) {
+        return tcp_uring_send(server, conn);
+    }
+#endif
 
-void tcp_server_destroy(tcp_server_p server)
+    if(slice_len(conn->tail) > 0) {
+        send_with_tail(conn);
+    }
+
+    return flush_pending(server, conn);
+}
+
+
+/*
+ * Push out as much of the pending response as the socket takes.  If it
+ * does not all fit, wait for the socket to become writable before
+ * reading anything else from this client.
+ */
+bool flush_pending(tcp_server_p server, tcp_conn_s *conn)
 {
-    if(server) {
-        if(server->sock_fd >= 0) {
-            socket_close(server->sock_fd);
-            server->sock_fd = -1;
+    bool need_write = false;
+    int rc;
+
+    rc = socket_write(conn->fd, conn->pending);
+    if(rc < 0) {
+        warning("Error writing output packet, error %d!", rc);
+        return false;
+    }
+
+    conn->pending = slice_from_slice(conn->pending, (size_t)rc, (size_t)(slice_len(conn->pending) - rc));
+    need_write = (slice_len(conn->pending) > 0);
+
+    /* only touch the epoll set when we change what we are waiting for. */
+    if(need_write != conn->waiting_for_write) {
+        struct epoll_event ev = {0};
+
+        ev.events = (need_write ? EPOLLOUT : EPOLLIN);
+        ev.data.ptr = conn;
+        if(epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+            warning("unable to change epoll events for socket %d!", conn->fd);
+            return false;
         }
-        free(server);
+
+        conn->waiting_for_write = need_write;
+    }
+
+    return true;
+}
+
+
+/* send the response and the tail together. */
+void send_with_tail(tcp_conn_s *conn)
+{
+    slice_s parts[2] = { conn->pending, conn->tail };
+    int rc;
+
+    rc = socket_write_parts(conn->fd, parts, 2);
+
+    tcp_conn_keep_unsent(conn, (rc > 0 ? (size_t)rc : 0));
+}
+
+
+/*
+ * After sending the pending response and the tail together, copy
+ * whatever the socket did not take in behind the response so the tail
+ * can be released now.  The output buffer always has room, since the
+ * response was sized as if the tail had been copied.
+ */
+void tcp_conn_keep_unsent(tcp_conn_s *conn, size_t sent)
+{
+    size_t head_len = (size_t)slice_len(conn->pending);
+    size_t tail_len = (size_t)slice_len(conn->tail);
+
+    if(sent >= head_len + tail_len) {
+        conn->pending = slice_make(conn->out_data, 0);
+    } else if(sent >= head_len) {
+        size_t tail_sent = sent - head_len;
+
+        memcpy(conn->pending.data + sent, conn->tail.data + tail_sent, tail_len - tail_sent);
+        conn->pending = slice_make(conn->pending.data + sent, (ssize_t)(tail_len - tail_sent));
+    } else {
+        memcpy(conn->pending.data + head_len, conn->tail.data, tail_len);
+        conn->pending = slice_make(conn->pending.data + sent, (ssize_t)(head_len + tail_len - sent));
+    }
+
+    tcp_conn_release_tail(conn);
+}
+
+
+void tcp_conn_release_tail(tcp_conn_s *conn)
+{
+    if(conn->tail_release) {
+        conn->tail_release(conn->tail_arg);
+    }
+
+    conn->tail = slice_make(NULL, 0);
+    conn->tail_release = NULL;
+    conn->tail_arg = NULL;
+}
+
+
+void close_conn(tcp_server_p server, tcp_conn_s *conn)
+{
+    if(server->epoll_fd >= 0) {
+        epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+
+    tcp_conn_remove(server, conn);
+}
+
+
+/* close the client's socket, unlink it and free it. */
+void tcp_conn_remove(tcp_server_p server, tcp_conn_s *conn)
+{
+    info("Closing client connection on socket %d.", conn->fd);
+
+    socket_close(conn->fd);
+
+    tcp_conn_release_tail(conn);
+
+    if(server->conn_close) {
+        server->conn_close(conn->context);
+    }
+
+    if(conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        server->conns = conn->next;
+    }
+
+    if(conn->next) {
+        conn->next->prev = conn->prev;
+    }
+
+    server->num_conns--;
+
+    free_conn(conn);
+}
+
+
+/*
+ * Ask for different buffer sizes for a client, for instance after it
+ * negotiates a larger connection size.  This takes effect before the
+ * next read, so the current request and response are not disturbed.
+ */
+void tcp_conn_set_buffer_size(tcp_conn_p conn, size_t buffer_size)
+{
+    if(buffer_size > TCP_SERVER_MAX_BUFFER_SIZE) {
+        buffer_size = TCP_SERVER_MAX_BUFFER_SIZE;
+    }
+
+    /* never shrink below what is already buffered. */
+    if(buffer_size < conn->in_len) {
+        buffer_size = conn->in_len;
+    }
+
+    conn->wanted_buffer_size = buffer_size;
+}
+
+
+timer_wheel_s *tcp_conn_get_timers(tcp_conn_p conn)
+{
+    return &conn->server->timers;
+}
+
+
+void tcp_conn_close(tcp_conn_p conn)
+{
+#ifdef TCP_SERVER_IO_URING
+    if(conn->server->uring) {
+        tcp_uring_close(conn->server, conn);
+        return;
+    }
+#endif
+
+    close_conn(conn->server, conn);
+}
+
+
+/* the client's address, for replies that do not go over the TCP connection. */
+bool tcp_conn_get_peer(tcp_conn_p conn, struct sockaddr_in *addr)
+{
+    socklen_t addr_len = sizeof(*addr);
+
+    if(getpeername(conn->fd, (struct sockaddr *)addr, &addr_len) != 0 || addr->sin_family != AF_INET) {
+        warning("unable to get the IPv4 address of the client on socket %d!", conn->fd);
+        return false;
+    }
+
+    return true;
+}
+
+
+/* the address the client connected to, which a ListIdentity reply reports. */
+bool tcp_conn_get_local(tcp_conn_p conn, struct sockaddr_in *addr)
+{
+    socklen_t addr_len = sizeof(*addr);
+
+    if(getsockname(conn->fd, (struct sockaddr *)addr, &addr_len) != 0 || addr->sin_family != AF_INET) {
+        warning("unable to get the local IPv4 address of socket %d!", conn->fd);
+        return false;
+    }
+
+    return true;
+}
+
+
+bool resize_buffers(tcp_conn_s *conn)
+{
+    size_t in_capacity = (conn->wanted_buffer_size > conn->in_len ? conn->wanted_buffer_size : conn->in_len);
+    uint8_t *new_in = realloc(conn->in_data, in_capacity);
+    uint8_t *new_out = NULL;
+
+    if(!new_in) {
+        warning("unable to resize input buffer to %d bytes!", (int)in_capacity);
+        return false;
     }
+
+    conn->in_data = new_in;
+    conn->in_capacity = in_capacity;
+
+    /* the output buffer holds nothing we need to keep. */
+    new_out = malloc(conn->wanted_buffer_size + TCP_SERVER_COALESCE_SIZE);
+    if(!new_out) {
+        warning("unable to resize output buffer to %d bytes!", (int)conn->wanted_buffer_size);
+        return false;
+    }
+
+    free(conn->out_data);
+    conn->out_data = new_out;
+    conn->buffer_size = conn->wanted_buffer_size;
+
+    return true;
+}
+
+
+void free_conn(tcp_conn_s *conn)
+{
+    if(conn) {
+        free(conn->in_data);
+        free(conn->out_data);
+        free(conn);
+    }
+}
+
+
+
+void tcp_conn_set_tail(tcp_conn_p conn, slice_s tail, void (*release)(void *arg), void *arg)
+{
+    tcp_conn_release_tail(conn);
+
+    conn->tail = tail;
+    conn->tail_release = release;
+    conn->tail_arg = arg;
 }
@@ -20,8 +20,11 @@
 
 #pragma once
 
+#include <netinet/in.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include "slice.h"
+#include "timer.h"
 
 typedef enum {
     TCP_SERVER_INCOMPLETE = 100001,
@@ -31,9 +34,56 @@ typedef enum {
     TCP_SERVER_UNSUPPORTED = 100005
 } tcp_server_status_t;
 
+/* the largest per-client buffer, enough for a 65535-byte connection plus headers. */
+#define TCP_SERVER_MAX_BUFFER_SIZE (65535 + 128)
+
 typedef struct tcp_server *tcp_server_p;
+typedef struct tcp_conn *tcp_conn_p;
+
+/* room for several small responses to go out in one write. */
+#define TCP_SERVER_COALESCE_SIZE (16384)
 
-extern tcp_server_p tcp_server_create(const char *host, const char *port, slice_s buffer, slice_s (*handler)(slice_s input, slice_s output, void *context), void *context);
+/*
+ * conn_open() is called for each new client with the server context and returns
+ * the per-client context passed to handler().  conn_close() releases it.
+ * buffer_size is the initial size of each client's buffers.  With share_port,
+ * several servers, each run by its own thread, can listen on the same port.
+ *
+ * handler() gets all the buffered input and handles the first request in it.
+ * It sets used to the size of that request, or returns TCP_SERVER_INCOMPLETE
+ * if the request is not all there yet.  The server calls it again for any
+ * requests that follow and sends the responses together.
+ */
+extern tcp_server_p tcp_server_create(const char *host, const char *port, bool share_port, size_t buffer_size,
+                                      void *(*conn_open)(tcp_conn_p conn, void *context),
+                                      slice_s (*handler)(slice_s input, slice_s output, size_t *used, void *conn_context),
+                                      void (*conn_close)(void *conn_context),
+                                      void *context);
+/*
+ * Listen on another address as well, so that one loop serves several
+ * devices.  Clients accepted there are opened with this context instead.
+ * Call before tcp_server_start().
+ */
+extern bool tcp_server_listen(tcp_server_p server, const char *host, const char *port, void *context);
 extern void tcp_server_start(tcp_server_p server);
 extern void tcp_server_destroy(tcp_server_p server);
+extern void tcp_conn_set_buffer_size(tcp_conn_p conn, size_t buffer_size);
+extern bool tcp_conn_get_peer(tcp_conn_p conn, struct sockaddr_in *addr);
+extern bool tcp_conn_get_local(tcp_conn_p conn, struct sockaddr_in *addr);
+
+/*
+ * The timer wheel of the thread that serves the client.  Timers on it
+ * fire on that thread between requests, so they can use the client's
+ * state freely.  tcp_conn_close() may be called from them to drop the
+ * client, which closes its context.
+ */
+extern timer_wheel_s *tcp_conn_get_timers(tcp_conn_p conn);
+extern void tcp_conn_close(tcp_conn_p conn);
+
+/*
+ * Send data from outside the output buffer after the next response,
+ * without copying it.  release() is called once the data has been sent
+ * or copied, or if the response is dropped.
+ */
+extern void tcp_conn_set_tail(tcp_conn_p conn, slice_s tail, void (*release)(void *arg), void *arg);
 
@@ -0,0 +1,105 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#pragma once
+
+/*
+ * Internals shared by the epoll and io_uring back ends of the TCP server.
+ * Nothing outside tcp_server.c and tcp_server_uring.c should include this.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "slice.h"
+#include "tcp_server.h"
+#include "timer.h"
+
+/* each client gets its own buffers so that one client's partial packet cannot corrupt another's. */
+struct tcp_conn {
+    struct tcp_conn *next;
+    struct tcp_conn *prev;
+    struct tcp_server *server;
+    int fd;
+    size_t buffer_size;
+    size_t wanted_buffer_size;  /* applied once the current response is sent. */
+    uint8_t *in_data;
+    size_t in_capacity; /* at least buffer_size, more if pipelined requests piled up. */
+    size_t in_len;      /* bytes of requests not handled yet. */
+    uint8_t *out_data;  /* buffer_size plus TCP_SERVER_COALESCE_SIZE bytes. */
+    slice_s pending;    /* response bytes the socket has not taken yet. */
+    slice_s tail;       /* data sent in place after the response, see tcp_conn_set_tail(). */
+    void (*tail_release)(void *arg);
+    void *tail_arg;
+    bool waiting_for_write;
+    void *context;      /* per-client context from conn_open(). */
+
+#ifdef TCP_SERVER_IO_URING
+    /* io_uring state.  The connection is freed once nothing is in flight. */
+    int ops_in_flight;
+    bool recv_armed;
+    bool recv_cancelling;
+    bool send_in_flight;
+    bool closing;
+#endif
+};
+
+typedef struct tcp_conn tcp_conn_s;
+
+typedef struct tcp_uring *tcp_uring_p;
+
+/* a listening socket and the context its clients are opened with. */
+typedef struct {
+    int sock_fd;
+    void *context;
+} tcp_listener_s;
+
+struct tcp_server {
+    tcp_listener_s *listeners;
+    size_t num_listeners;
+    bool share_port;
+    int epoll_fd;
+    tcp_uring_p uring;  /* NULL when using epoll. */
+    size_t buffer_size;
+    tcp_conn_s *conns;
+    int num_conns;
+    void *(*conn_open)(tcp_conn_p conn, void *context);
+    slice_s (*handler)(slice_s input, slice_s output, size_t *used, void *conn_context);
+    void (*conn_close)(void *conn_context);
+
+    /* timeouts of this thread's clients, run between passes of the event loop. */
+    timer_wheel_s timers;
+};
+
+/* in tcp_server.c */
+extern tcp_conn_s *tcp_conn_add(tcp_server_p server, tcp_listener_s *listener, int fd);
+extern void tcp_conn_remove(tcp_server_p server, tcp_conn_s *conn);
+extern bool tcp_conn_process_input(tcp_server_p server, tcp_conn_s *conn);
+extern void tcp_conn_keep_unsent(tcp_conn_s *conn, size_t sent);
+extern void tcp_conn_release_tail(tcp_conn_s *conn);
+
+#ifdef TCP_SERVER_IO_URING
+/* in tcp_server_uring.c */
+extern tcp_uring_p tcp_uring_create(tcp_server_p server);
+extern void tcp_uring_run(tcp_server_p server);
+extern bool tcp_uring_send(tcp_server_p server, tcp_conn_s *conn);
+extern void tcp_uring_destroy(tcp_uring_p uring);
+extern void tcp_uring_close(tcp_server_p server, tcp_conn_s *conn);
+#endif
@@ -0,0 +1,756 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+/*
+ * io_uring back end for the TCP server.  Each listener has one multishot
+ * accept and each client one multishot receive that fills buffers from
+ * a ring shared by all the clients.  Responses go out as send requests
+ * that are submitted together once per pass through the event loop.
+ *
+ * liburing is not required; the few system calls are made directly.
+ */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "slice.h"
+#include "socket.h"
+#include "tcp_server.h"
+#include "tcp_server_int.h"
+#include "utils.h"
+
+
+#define URING_ENTRIES (1024)
+
+/* received data lands in these before it is copied to the client's input buffer. */
+#define URING_BUF_COUNT (512)   /* must be a power of two. */
+#define URING_BUF_SIZE (4096)
+#define URING_BUF_GROUP (0)
+
+/*
+ * Hard limit on buffered input for a client that sends faster than it
+ * reads.  Receiving is cancelled well before this, but whatever is in
+ * the socket's receive buffer can still arrive first.
+ */
+#define URING_MAX_INPUT (16 * 1024 * 1024)
+
+/* the low bits of the user data say what completed, the rest point at the client. */
+#define URING_OP_ACCEPT (0)
+#define URING_OP_RECV (1)
+#define URING_OP_SEND (2)
+#define URING_OP_CANCEL (3)
+#define URING_OP_MASK ((uint64_t)3)
+
+/* accepts carry the listener's index above the op bits instead. */
+#define URING_LISTENER_SHIFT (2)
+
+struct tcp_uring {
+    int ring_fd;
+
+    /* submission queue. */
+    void *sq_ring;
+    size_t sq_ring_size;
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t sq_mask;
+    uint32_t sq_entries;
+    uint32_t *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    uint32_t sq_local_tail;
+    uint32_t to_submit;
+
+    /* completion queue, may share the mapping with the submission queue. */
+    void *cq_ring;
+    size_t cq_ring_size;
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* provided receive buffers. */
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_size;
+    uint8_t *bufs;
+    uint16_t buf_tail;
+};
+
+
+static int uring_setup(unsigned entries, struct io_uring_params *params);
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags, int wait_ms);
+static int uring_register(int ring_fd, unsigned opcode, void *arg, unsigned nr_args);
+static bool map_rings(tcp_uring_p uring, struct io_uring_params *params);
+static bool setup_buf_ring(tcp_uring_p uring);
+static void return_buf(tcp_uring_p uring, uint16_t bid);
+static struct io_uring_sqe *get_sqe(tcp_uring_p uring);
+static int submit(tcp_uring_p uring, unsigned min_complete, int wait_ms);
+static void arm_accept(tcp_server_p server, size_t listener);
+static void arm_recv(tcp_server_p server, tcp_conn_s *conn);
+static void cancel_recv(tcp_server_p server, tcp_conn_s *conn);
+static void handle_cqe(tcp_server_p server, struct io_uring_cqe *cqe);
+static void handle_accept(tcp_server_p server, size_t listener, struct io_uring_cqe *cqe);
+static void handle_recv(tcp_server_p server, tcp_conn_s *conn, struct io_uring_cqe *cqe);
+static void handle_send(tcp_server_p server, tcp_conn_s *conn, struct io_uring_cqe *cqe);
+static bool append_input(tcp_conn_s *conn, const uint8_t *data, size_t len);
+static void resume_conn(tcp_server_p server, tcp_conn_s *conn);
+static void start_close(tcp_server_p server, tcp_conn_s *conn);
+
+
+/*
+ * Set up a ring for the server.  Returns NULL if the kernel is missing
+ * anything we use, so that the caller can fall back to epoll.
+ */
+tcp_uring_p tcp_uring_create(tcp_server_p server)
+{
+    struct io_uring_params params;
+    tcp_uring_p uring = calloc(1, sizeof(*uring));
+
+    (void)server;
+
+    if(!uring) {
+        return NULL;
+    }
+
+    memset(&params, 0, sizeof(params));
+
+    uring->ring_fd = uring_setup(URING_ENTRIES, &params);
+    if(uring->ring_fd < 0) {
+        warning("io_uring_setup() failed with errno %d.", errno);
+        free(uring);
+        return NULL;
+    }
+
+    /* without NODROP, a burst of multishot completions could be lost.  EXT_ARG gives waits a timeout. */
+    if(!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_EXT_ARG) || !map_rings(uring, &params) || !setup_buf_ring(uring)) {
+        warning("io_uring is missing features we need.");
+        tcp_uring_destroy(uring);
+        return NULL;
+    }
+
+    info("Using io_uring for client connections.");
+
+    return uring;
+}
+
+
+void tcp_uring_destroy(tcp_uring_p uring)
+{
+    if(uring) {
+        /* closing the ring cancels everything still in flight. */
+        if(uring->ring_fd >= 0) {
+            close(uring->ring_fd);
+        }
+
+        if(uring->buf_ring) {
+            munmap(uring->buf_ring, uring->buf_ring_size);
+        }
+
+        free(uring->bufs);
+
+        if(uring->sqes) {
+            munmap(uring->sqes, uring->sqes_size);
+        }
+
+        if(uring->cq_ring && uring->cq_ring != uring->sq_ring) {
+            munmap(uring->cq_ring, uring->cq_ring_size);
+        }
+
+        if(uring->sq_ring) {
+            munmap(uring->sq_ring, uring->sq_ring_size);
+        }
+
+        free(uring);
+    }
+}
+
+
+void tcp_uring_run(tcp_server_p server)
+{
+    tcp_uring_p uring = server->uring;
+    bool done = false;
+
+    for(size_t i=0; i < server->num_listeners; i++) {
+        arm_accept(server, i);
+    }
+
+    do {
+        uint32_t head;
+        uint32_t tail;
+        uint16_t buf_tail = uring->buf_tail;
+
+        /* submit everything queued since the last pass and wait for at least one completion or the next timer tick. */
+        if(submit(uring, 1, timer_wheel_wait_ms(&server->timers)) < 0) {
+            warning("io_uring_enter() failed with errno %d!", errno);
+            done = true;
+            continue;
+        }
+
+        timer_wheel_set_now(&server->timers, timer_now_ms());
+
+        head = *uring->cq_head;
+        tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+
+        while(head != tail) {
+            handle_cqe(server, &uring->cqes[head & uring->cq_mask]);
+            head++;
+
+            /* free the slot now, handling a completion can queue more work. */
+            __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        /* give back the receive buffers we are done with. */
+        if(buf_tail != uring->buf_tail) {
+            __atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+        }
+
+        timer_wheel_run(&server->timers);
+    } while(!done);
+}
+
+
+/*
+ * Queue a send of the pending response.  A tail is pinned data that
+ * another client's write on this thread could be waiting for, so it is
+ * sent right away without blocking.  Whatever the socket does not take
+ * is copied and queued with the rest of the response.
+ */
+bool tcp_uring_send(tcp_server_p server, tcp_conn_s *conn)
+{
+    struct io_uring_sqe *sqe = NULL;
+
+    if(slice_len(conn->tail) > 0) {
+        struct iovec iov[2];
+        struct msghdr msg;
+        ssize_t rc;
+
+        iov[0].iov_base = conn->pending.data;
+        iov[0].iov_len = (size_t)slice_len(conn->pending);
+        iov[1].iov_base = conn->tail.data;
+        iov[1].iov_len = (size_t)slice_len(conn->tail);
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+
+        /* a response is never queued while another is in flight, so this cannot reorder data. */
+        rc = sendmsg(conn->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if(rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            warning("Error writing output packet, error %d!", errno);
+            return false;
+        }
+
+        tcp_conn_keep_unsent(conn, (rc > 0 ? (size_t)rc : 0));
+    }
+
+    if(conn->send_in_flight || slice_len(conn->pending) == 0) {
+        return true;
+    }
+
+    sqe = get_sqe(server->uring);
+    if(!sqe) {
+        return false;
+    }
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = conn->fd;
+    sqe->addr = (uint64_t)(uintptr_t)conn->pending.data;
+    sqe->len = (uint32_t)slice_len(conn->pending);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | URING_OP_SEND;
+
+    conn->send_in_flight = true;
+    conn->ops_in_flight++;
+
+    return true;
+}
+
+
+int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+
+/* with wait_ms of 0 or more, waiting for completions gives up after that long. */
+int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags, int wait_ms)
+{
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+
+    if(wait_ms < 0 || !(flags & IORING_ENTER_GETEVENTS)) {
+        return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+    }
+
+    ts.tv_sec = wait_ms / 1000;
+    ts.tv_nsec = (long long)(wait_ms % 1000) * 1000000;
+
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+
+int uring_register(int ring_fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+
+bool map_rings(tcp_uring_p uring, struct io_uring_params *params)
+{
+    uint8_t *sq_ring = NULL;
+    uint8_t *cq_ring = NULL;
+
+    uring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(uint32_t);
+    uring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+
+    if(params->features & IORING_FEAT_SINGLE_MMAP) {
+        if(uring->cq_ring_size > uring->sq_ring_size) {
+            uring->sq_ring_size = uring->cq_ring_size;
+        }
+        uring->cq_ring_size = uring->sq_ring_size;
+    }
+
+    uring->sq_ring = mmap(NULL, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQ_RING);
+    if(uring->sq_ring == MAP_FAILED) {
+        uring->sq_ring = NULL;
+        return false;
+    }
+
+    if(params->features & IORING_FEAT_SINGLE_MMAP) {
+        uring->cq_ring = uring->sq_ring;
+    } else {
+        uring->cq_ring = mmap(NULL, uring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_CQ_RING);
+        if(uring->cq_ring == MAP_FAILED) {
+            uring->cq_ring = NULL;
+            return false;
+        }
+    }
+
+    uring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+    uring->sqes = mmap(NULL, uring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->ring_fd, IORING_OFF_SQES);
+    if(uring->sqes == MAP_FAILED) {
+        uring->sqes = NULL;
+        return false;
+    }
+
+    sq_ring = uring->sq_ring;
+    cq_ring = uring->cq_ring;
+
+    uring->sq_head = (uint32_t *)(sq_ring + params->sq_off.head);
+    uring->sq_tail = (uint32_t *)(sq_ring + params->sq_off.tail);
+    uring->sq_mask = *(uint32_t *)(sq_ring + params->sq_off.ring_mask);
+    uring->sq_entries = params->sq_entries;
+    uring->sq_array = (uint32_t *)(sq_ring + params->sq_off.array);
+    uring->sq_local_tail = *uring->sq_tail;
+
+    uring->cq_head = (uint32_t *)(cq_ring + params->cq_off.head);
+    uring->cq_tail = (uint32_t *)(cq_ring + params->cq_off.tail);
+    uring->cq_mask = *(uint32_t *)(cq_ring + params->cq_off.ring_mask);
+    uring->cqes = (struct io_uring_cqe *)(cq_ring + params->cq_off.cqes);
+
+    return true;
+}
+
+
+/* needs a 5.19 or later kernel. */
+bool setup_buf_ring(tcp_uring_p uring)
+{
+    struct io_uring_buf_reg reg;
+
+    uring->buf_ring_size = URING_BUF_COUNT * sizeof(struct io_uring_buf);
+    uring->buf_ring = mmap(NULL, uring->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(uring->buf_ring == MAP_FAILED) {
+        uring->buf_ring = NULL;
+        return false;
+    }
+
+    uring->bufs = malloc((size_t)URING_BUF_COUNT * URING_BUF_SIZE);
+    if(!uring->bufs) {
+        return false;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)uring->buf_ring;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+
+    if(uring_register(uring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        warning("unable to register receive buffer ring, errno %d.", errno);
+        return false;
+    }
+
+    for(uint16_t bid = 0; bid < URING_BUF_COUNT; bid++) {
+        return_buf(uring, bid);
+    }
+
+    __atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+
+/* the kernel sees returned buffers once the tail is published. */
+void return_buf(tcp_uring_p uring, uint16_t bid)
+{
+    struct io_uring_buf *buf = &uring->buf_ring->bufs[uring->buf_tail & (URING_BUF_COUNT - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(uring->bufs + (size_t)bid * URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+
+    uring->buf_tail++;
+}
+
+
+/* returns NULL only if the queue is full and cannot be submitted. */
+struct io_uring_sqe *get_sqe(tcp_uring_p uring)
+{
+    struct io_uring_sqe *sqe = NULL;
+    uint32_t index;
+
+    if(uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+        if(submit(uring, 0, -1) < 0 || uring->sq_local_tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+            warning("io_uring submission queue is full!");
+            return NULL;
+        }
+    }
+
+    index = uring->sq_local_tail & uring->sq_mask;
+    sqe = &uring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    uring->sq_array[index] = index;
+
+    uring->sq_local_tail++;
+    uring->to_submit++;
+
+    return sqe;
+}
+
+
+/* one system call for everything queued, optionally waiting for completions. */
+int submit(tcp_uring_p uring, unsigned min_complete, int wait_ms)
+{
+    int rc;
+
+    __atomic_store_n(uring->sq_tail, uring->sq_local_tail, __ATOMIC_RELEASE);
+
+    do {
+        rc = uring_enter(uring->ring_fd, uring->to_submit, min_complete, (min_complete > 0 ? IORING_ENTER_GETEVENTS : 0), wait_ms);
+    } while(rc < 0 && errno == EINTR);
+
+    /* the submissions went in even if the wait timed out. */
+    if(rc < 0 && errno == ETIME) {
+        uring->to_submit = 0;
+        return 0;
+    }
+
+    if(rc < 0 && errno != EAGAIN && errno != EBUSY) {
+        return rc;
+    }
+
+    if(rc > 0) {
+        uring->to_submit -= ((unsigned)rc < uring->to_submit ? (unsigned)rc : uring->to_submit);
+    }
+
+    return 0;
+}
+
+
+void arm_accept(tcp_server_p server, size_t listener)
+{
+    struct io_uring_sqe *sqe = get_sqe(server->uring);
+
+    if(!sqe) {
+        error("Unable to queue accept on the listening socket!");
+    }
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = server->listeners[listener].sock_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = ((uint64_t)listener << URING_LISTENER_SHIFT) | URING_OP_ACCEPT;
+}
+
+
+void arm_recv(tcp_server_p server, tcp_conn_s *conn)
+{
+    struct io_uring_sqe *sqe = get_sqe(server->uring);
+
+    if(!sqe) {
+        start_close(server, conn);
+        return;
+    }
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | URING_OP_RECV;
+
+    conn->recv_armed = true;
+    conn->ops_in_flight++;
+}
+
+
+/* stop receiving from a client that has sent more than we can hold until it reads its responses. */
+void cancel_recv(tcp_server_p server, tcp_conn_s *conn)
+{
+    struct io_uring_sqe *sqe = NULL;
+
+    if(!conn->recv_armed || conn->recv_cancelling) {
+        return;
+    }
+
+    sqe = get_sqe(server->uring);
+    if(!sqe) {
+        return;
+    }
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = (uint64_t)(uintptr_t)conn | URING_OP_RECV;
+    sqe->user_data = (uint64_t)(uintptr_t)conn | URING_OP_CANCEL;
+
+    conn->recv_cancelling = true;
+    conn->ops_in_flight++;
+
+    /* do not wait for the end of the pass, the client may still be sending. */
+    submit(server->uring, 0, -1);
+}
+
+
+void handle_cqe(tcp_server_p server, struct io_uring_cqe *cqe)
+{
+    tcp_conn_s *conn = (tcp_conn_s *)(uintptr_t)(cqe->user_data & ~URING_OP_MASK);
+
+    switch(cqe->user_data & URING_OP_MASK) {
+        case URING_OP_ACCEPT:
+            handle_accept(server, (size_t)(cqe->user_data >> URING_LISTENER_SHIFT), cqe);
+            return;
+
+        case URING_OP_RECV:
+            handle_recv(server, conn, cqe);
+            break;
+
+        case URING_OP_SEND:
+            handle_send(server, conn, cqe);
+            break;
+
+        case URING_OP_CANCEL:
+            conn->ops_in_flight--;
+            break;
+    }
+
+    /* the client goes once nothing refers to it any more. */
+    if(conn->closing) {
+        if(conn->ops_in_flight == 0) {
+            tcp_conn_remove(server, conn);
+        }
+    } else {
+        resume_conn(server, conn);
+    }
+}
+
+
+void handle_accept(tcp_server_p server, size_t listener, struct io_uring_cqe *cqe)
+{
+    if(cqe->res >= 0) {
+        tcp_conn_s *conn = tcp_conn_add(server, &server->listeners[listener], cqe->res);
+
+        if(conn) {
+            arm_recv(server, conn);
+
+            if(conn->closing && conn->ops_in_flight == 0) {
+                tcp_conn_remove(server, conn);
+            }
+        }
+    } else {
+        warning("Error %d while trying to accept a client.", -cqe->res);
+    }
+
+    /* the kernel stops a multishot accept on errors. */
+    if(!(cqe->flags & IORING_CQE_F_MORE)) {
+        arm_accept(server, listener);
+    }
+}
+
+
+void handle_recv(tcp_server_p server, tcp_conn_s *conn, struct io_uring_cqe *cqe)
+{
+    if(!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->recv_armed = false;
+        conn->recv_cancelling = false;
+        conn->ops_in_flight--;
+    }
+
+    if(cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+        if(cqe->res > 0 && !conn->closing && !append_input(conn, server->uring->bufs + (size_t)bid * URING_BUF_SIZE, (size_t)cqe->res)) {
+            start_close(server, conn);
+        }
+
+        return_buf(server->uring, bid);
+    }
+
+    if(cqe->res == 0) {
+        info("Client on socket %d disconnected.", conn->fd);
+        start_close(server, conn);
+    } else if(cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED) {
+        info("Client on socket %d had an error %d.", conn->fd, -cqe->res);
+        start_close(server, conn);
+    }
+}
+
+
+void handle_send(tcp_server_p server, tcp_conn_s *conn, struct io_uring_cqe *cqe)
+{
+    conn->send_in_flight = false;
+    conn->ops_in_flight--;
+
+    if(cqe->res < 0) {
+        conn->pending = slice_make(conn->out_data, 0);
+
+        if(!conn->closing) {
+            warning("Error writing output packet, error %d!", -cqe->res);
+            start_close(server, conn);
+            return;
+        }
+    } else {
+        conn->pending = slice_from_slice(conn->pending, (size_t)cqe->res, (size_t)(slice_len(conn->pending) - cqe->res));
+    }
+
+    /* a closing client still gets what is left of its last response. */
+    if(conn->closing && (slice_len(conn->pending) == 0 || !tcp_uring_send(server, conn))) {
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+}
+
+
+/* copy received data behind anything already buffered, growing the buffer if requests piled up. */
+bool append_input(tcp_conn_s *conn, const uint8_t *data, size_t len)
+{
+    if(conn->in_len + len > conn->in_capacity) {
+        size_t new_capacity = conn->in_len + len + URING_BUF_SIZE;
+        uint8_t *new_in = NULL;
+
+        if(new_capacity > URING_MAX_INPUT) {
+            warning("client on socket %d sent too much without reading the responses!", conn->fd);
+            return false;
+        }
+
+        new_in = realloc(conn->in_data, new_capacity);
+        if(!new_in) {
+            warning("unable to grow input buffer to %d bytes!", (int)new_capacity);
+            return false;
+        }
+
+        conn->in_data = new_in;
+        conn->in_capacity = new_capacity;
+    }
+
+    memcpy(conn->in_data + conn->in_len, data, len);
+    conn->in_len += len;
+
+    return true;
+}
+
+
+/*
+ * Handle buffered requests once the last response is out, send whatever
+ * is left, and keep input flowing only while there is room for it.
+ */
+void resume_conn(tcp_server_p server, tcp_conn_s *conn)
+{
+    if(!conn->send_in_flight) {
+        if(slice_len(conn->pending) > 0) {
+            if(!tcp_uring_send(server, conn)) {
+                start_close(server, conn);
+                return;
+            }
+        } else if(conn->in_len > 0 && !tcp_conn_process_input(server, conn)) {
+            start_close(server, conn);
+            return;
+        }
+    }
+
+    /* give back the memory from a burst of pipelined requests. */
+    if(conn->in_capacity > conn->buffer_size && conn->in_len <= conn->buffer_size) {
+        uint8_t *new_in = realloc(conn->in_data, conn->buffer_size);
+
+        if(new_in) {
+            conn->in_data = new_in;
+            conn->in_capacity = conn->buffer_size;
+        }
+    }
+
+    if(conn->in_len >= conn->buffer_size) {
+        cancel_recv(server, conn);
+    } else if(!conn->recv_armed) {
+        arm_recv(server, conn);
+    }
+}
+
+
+/*
+ * Shut the socket down so that the multishot receive ends.  Any response
+ * still being sent goes out first.  The client is freed when its last
+ * request in flight completes.
+ */
+void start_close(tcp_server_p server, tcp_conn_s *conn)
+{
+    if(conn->closing) {
+        return;
+    }
+
+    conn->closing = true;
+
+    if(conn->send_in_flight || slice_len(conn->pending) > 0) {
+        shutdown(conn->fd, SHUT_RD);
+
+        /* make sure the rest of the response is on its way. */
+        if(!conn->send_in_flight && !tcp_uring_send(server, conn)) {
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    } else {
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+}
+
+
+/* drop a client from outside its completions, for instance when it times out. */
+void tcp_uring_close(tcp_server_p server, tcp_conn_s *conn)
+{
+    start_close(server, conn);
+
+    /* with nothing in flight, no completion would come to free it. */
+    if(conn->ops_in_flight == 0) {
+        tcp_conn_remove(server, conn);
+    }
+}
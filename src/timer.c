@@ -0,0 +1,291 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <limits.h>
+#include <stdlib.h>
+#include "timer.h"
+#include "utils.h"
+
+
+static void place_timer(timer_wheel_s *wheel, timer_s *timer);
+static void remove_timer(timer_wheel_s *wheel, timer_s *timer);
+static void run_tick(timer_wheel_s *wheel, int64_t tick);
+static int64_t next_busy_tick(timer_wheel_s *wheel);
+static int first_occupied(uint64_t occupied, int start);
+static void link_timer(timer_s *head, timer_s *timer);
+static void unlink_timer(timer_s *timer);
+
+
+/* a monotonic clock, so that setting the time of day does not fire or hold back timeouts. */
+int64_t timer_now_ms(void)
+{
+    return util_time_ns() / 1000000;
+}
+
+
+void timer_wheel_init(timer_wheel_s *wheel)
+{
+    for(size_t i=0; i < TIMER_LEVELS * TIMER_LEVEL_SLOTS; i++) {
+        wheel->slots[i].next = &wheel->slots[i];
+        wheel->slots[i].prev = &wheel->slots[i];
+    }
+
+    for(size_t i=0; i < TIMER_LEVELS; i++) {
+        wheel->occupied[i] = 0;
+    }
+
+    wheel->expired.next = &wheel->expired;
+    wheel->expired.prev = &wheel->expired;
+
+    wheel->now_ms = timer_now_ms();
+    wheel->last_tick = wheel->now_ms / TIMER_TICK_MS;
+    wheel->num_timers = 0;
+}
+
+
+void timer_wheel_set_now(timer_wheel_s *wheel, int64_t now_ms)
+{
+    wheel->now_ms = now_ms;
+}
+
+
+/* fire everything that expired since the last run, going straight to the ticks that have something to do. */
+void timer_wheel_run(timer_wheel_s *wheel)
+{
+    int64_t tick = wheel->now_ms / TIMER_TICK_MS;
+
+    while(wheel->last_tick < tick) {
+        int64_t busy_tick = next_busy_tick(wheel);
+
+        if(busy_tick > tick) {
+            wheel->last_tick = tick;
+            break;
+        }
+
+        /* timers moving down are placed from the tick being run. */
+        wheel->last_tick = busy_tick - 1;
+        run_tick(wheel, busy_tick);
+        wheel->last_tick = busy_tick;
+    }
+
+    /* callbacks may stop timers that are still on the expired list, so take them one at a time. */
+    while(wheel->expired.next != &wheel->expired) {
+        timer_s *timer = wheel->expired.next;
+
+        unlink_timer(timer);
+        wheel->num_timers--;
+
+        timer->fire(timer->arg);
+    }
+}
+
+
+int timer_wheel_wait_ms(timer_wheel_s *wheel)
+{
+    int64_t busy_tick = 0;
+    int64_t wait_ms = 0;
+
+    if(wheel->num_timers == 0) {
+        return -1;
+    }
+
+    busy_tick = next_busy_tick(wheel);
+    if(busy_tick == INT64_MAX) {
+        return -1;
+    }
+
+    wait_ms = busy_tick * TIMER_TICK_MS - timer_now_ms();
+
+    if(wait_ms < 0) {
+        return 0;
+    }
+
+    return (wait_ms > INT_MAX ? INT_MAX : (int)wait_ms);
+}
+
+
+void timer_init(timer_s *timer, void (*fire)(void *arg), void *arg)
+{
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires_ms = 0;
+    timer->slot = -1;
+    timer->fire = fire;
+    timer->arg = arg;
+}
+
+
+/* start the timer, or move it if it is already running. */
+void timer_start(timer_wheel_s *wheel, timer_s *timer, int64_t expires_ms)
+{
+    if(timer_is_running(timer)) {
+        remove_timer(wheel, timer);
+    } else {
+        wheel->num_timers++;
+    }
+
+    timer->expires_ms = expires_ms;
+    place_timer(wheel, timer);
+}
+
+
+void timer_stop(timer_wheel_s *wheel, timer_s *timer)
+{
+    if(timer_is_running(timer)) {
+        remove_timer(wheel, timer);
+        wheel->num_timers--;
+    }
+}
+
+
+/*
+ * Put the timer in the lowest level that reaches the first tick at or
+ * after its expiry.  Ticks are counted from the next one to be run, and
+ * one that is already due goes in that.  A timer past the top level
+ * waits in the top level's furthest slot and is placed again from there.
+ */
+void place_timer(timer_wheel_s *wheel, timer_s *timer)
+{
+    int64_t base = wheel->last_tick + 1;
+    int64_t tick = (timer->expires_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    int64_t span = (int64_t)1 << (TIMER_LEVEL_BITS * TIMER_LEVELS);
+    int level = 0;
+    int index = 0;
+
+    if(tick < base) {
+        tick = base;
+    }
+
+    if(tick - base >= span) {
+        tick = base + span - 1;
+    }
+
+    while(level < TIMER_LEVELS - 1 && tick - base >= ((int64_t)1 << (TIMER_LEVEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    index = (int)((tick >> (TIMER_LEVEL_BITS * level)) & (TIMER_LEVEL_SLOTS - 1));
+
+    timer->slot = level * TIMER_LEVEL_SLOTS + index;
+    link_timer(&wheel->slots[timer->slot], timer);
+    wheel->occupied[level] |= (uint64_t)1 << index;
+}
+
+
+void remove_timer(timer_wheel_s *wheel, timer_s *timer)
+{
+    int slot = timer->slot;
+
+    unlink_timer(timer);
+
+    if(slot >= 0 && wheel->slots[slot].next == &wheel->slots[slot]) {
+        wheel->occupied[slot / TIMER_LEVEL_SLOTS] &= ~((uint64_t)1 << (slot % TIMER_LEVEL_SLOTS));
+    }
+}
+
+
+/* move down the higher level slots that start at this tick, then expire the bottom slot. */
+void run_tick(timer_wheel_s *wheel, int64_t tick)
+{
+    timer_s *head = NULL;
+
+    for(int level = 1; level < TIMER_LEVELS; level++) {
+        int shift = TIMER_LEVEL_BITS * level;
+        int index = (int)((tick >> shift) & (TIMER_LEVEL_SLOTS - 1));
+
+        if(tick & (((int64_t)1 << shift) - 1)) {
+            break;
+        }
+
+        head = &wheel->slots[level * TIMER_LEVEL_SLOTS + index];
+        wheel->occupied[level] &= ~((uint64_t)1 << index);
+
+        /* they all land in lower levels, never back in this slot. */
+        while(head->next != head) {
+            timer_s *timer = head->next;
+
+            unlink_timer(timer);
+            place_timer(wheel, timer);
+        }
+    }
+
+    head = &wheel->slots[tick & (TIMER_LEVEL_SLOTS - 1)];
+    wheel->occupied[0] &= ~((uint64_t)1 << (tick & (TIMER_LEVEL_SLOTS - 1)));
+
+    while(head->next != head) {
+        timer_s *timer = head->next;
+
+        unlink_timer(timer);
+        timer->slot = -1;
+        link_timer(&wheel->expired, timer);
+    }
+}
+
+
+/* the first tick after the last one run that expires a bottom slot or moves down a higher one, or INT64_MAX if there is none. */
+int64_t next_busy_tick(timer_wheel_s *wheel)
+{
+    int64_t busy_tick = INT64_MAX;
+
+    for(int level = 0; level < TIMER_LEVELS; level++) {
+        int shift = TIMER_LEVEL_BITS * level;
+        int64_t first = (wheel->last_tick >> shift) + 1;
+        int64_t tick = 0;
+
+        if(!wheel->occupied[level]) {
+            continue;
+        }
+
+        tick = (first + first_occupied(wheel->occupied[level], (int)(first & (TIMER_LEVEL_SLOTS - 1)))) << shift;
+
+        if(tick < busy_tick) {
+            busy_tick = tick;
+        }
+    }
+
+    return busy_tick;
+}
+
+
+/* how many slots on from start the first occupied one is, wrapping around. */
+int first_occupied(uint64_t occupied, int start)
+{
+    uint64_t rotated = (start == 0 ? occupied : (occupied >> start) | (occupied << (TIMER_LEVEL_SLOTS - start)));
+
+    return __builtin_ctzll(rotated);
+}
+
+
+void link_timer(timer_s *head, timer_s *timer)
+{
+    timer->next = head->next;
+    timer->prev = head;
+    head->next->prev = timer;
+    head->next = timer;
+}
+
+
+void unlink_timer(timer_s *timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
@@ -0,0 +1,86 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A hierarchical timer wheel for one event loop.  The bottom level has a
+ * slot for each of the next TIMER_LEVEL_SLOTS ticks, and each level above
+ * has slots as long as a whole turn of the level below it.  A timer goes
+ * in the lowest level that reaches its expiry.  When the wheel comes to a
+ * slot in a higher level, its timers move down to where they now fit, so
+ * a timer is moved at most once per level and a tick only touches the
+ * timers that are due in it.
+ *
+ * Each level keeps a bit for every slot with timers in it, so the loop
+ * can sleep until the next tick that has something to do.
+ *
+ * Timeouts on activity should not move their timer on every packet.
+ * Record the time of the activity instead, and when the timer fires,
+ * start it again for the rest of the timeout if there was any.  Busy
+ * clients then cost one check per timeout and only idle ones expire.
+ *
+ * The loop sets the time once per pass with timer_wheel_set_now(), which
+ * is also the activity time its handlers should use, and calls
+ * timer_wheel_run() when nothing else is in progress.  A timer's
+ * callback may start or stop any timer, including its own.
+ */
+
+#define TIMER_TICK_MS (10)
+#define TIMER_LEVEL_BITS (6)
+#define TIMER_LEVEL_SLOTS (1 << TIMER_LEVEL_BITS)  /* one bit each in a uint64_t. */
+#define TIMER_LEVELS (4)                            /* 2^24 ticks, about 46 hours. */
+
+typedef struct timer_s {
+    struct timer_s *next;       /* NULL while the timer is stopped. */
+    struct timer_s *prev;
+    int64_t expires_ms;
+    int slot;                   /* in the wheel's slots, or -1 once it has expired. */
+    void (*fire)(void *arg);
+    void *arg;
+} timer_s;
+
+typedef struct {
+    timer_s slots[TIMER_LEVELS * TIMER_LEVEL_SLOTS];   /* list heads, bottom level first. */
+    uint64_t occupied[TIMER_LEVELS];                    /* a bit for each slot with timers in it. */
+    timer_s expired;                                    /* timers waiting for their callback. */
+    int64_t now_ms;
+    int64_t last_tick;
+    size_t num_timers;
+} timer_wheel_s;
+
+extern int64_t timer_now_ms(void);
+extern void timer_wheel_init(timer_wheel_s *wheel);
+extern void timer_wheel_set_now(timer_wheel_s *wheel, int64_t now_ms);
+extern void timer_wheel_run(timer_wheel_s *wheel);
+
+/* how long the loop may wait before a tick has anything to do, or -1 if no timer is running. */
+extern int timer_wheel_wait_ms(timer_wheel_s *wheel);
+
+extern void timer_init(timer_s *timer, void (*fire)(void *arg), void *arg);
+extern void timer_start(timer_wheel_s *wheel, timer_s *timer, int64_t expires_ms);
+extern void timer_stop(timer_wheel_s *wheel, timer_s *timer);
+
+static inline int64_t timer_wheel_now(timer_wheel_s *wheel) { return wheel->now_ms; }
+static inline bool timer_is_running(timer_s *timer) { return timer->next != NULL; }
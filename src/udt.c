@@ -0,0 +1,531 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "arena.h"
+#include "plc.h"
+#include "slice.h"
+#include "tag.h"
+#include "udt.h"
+#include "utils.h"
+
+
+/* Logix names the hidden hosts of BOOL members like this. */
+#define UDT_HIDDEN_PREFIX "ZZZZZZZZZZ"
+
+/* the name goes in a symbolic segment with a one byte length. */
+#define UDT_MAX_NAME_LEN (255)
+
+static bool valid_name(const char *name, size_t name_len);
+static udt_member_s *new_member(udt_def_s *udt);
+static bool add_bool_member(plc_s *plc, udt_def_s *udt, udt_member_s *member);
+static uint32_t member_end(udt_def_s *udt);
+static void update_layout(udt_def_s *udt, uint32_t align);
+static bool build_template(plc_s *plc, udt_def_s *udt);
+static uint16_t member_symbol_type(udt_member_s *member);
+
+
+bool udt_init(plc_s *plc)
+{
+    udt_def_s *string_udt = udt_create(plc, "STRING", strlen("STRING"));
+    char data_type[16];
+
+    if(!string_udt) {
+        return false;
+    }
+
+    snprintf(data_type, sizeof(data_type), "SINT[%d]", UDT_STRING_DATA_LEN);
+
+    if(!udt_add_member(plc, string_udt, slice_make((uint8_t *)"LEN", 3), slice_make((uint8_t *)"DINT", 4))
+       || !udt_add_member(plc, string_udt, slice_make((uint8_t *)"DATA", 4), slice_make((uint8_t *)data_type, (ssize_t)strlen(data_type)))) {
+        return false;
+    }
+
+    /* clients recognize strings by this handle. */
+    string_udt->handle = UDT_STRING_HANDLE;
+
+    return true;
+}
+
+
+void udt_destroy(plc_s *plc)
+{
+    for(size_t i=0; i < plc->num_udts; i++) {
+        free(plc->udts[i]->members);
+    }
+
+    free(plc->udts);
+    plc->udts = NULL;
+    plc->num_udts = 0;
+
+    arena_free(&plc->udt_arena);
+}
+
+
+udt_def_s *udt_find(plc_s *plc, const char *name, size_t name_len)
+{
+    for(size_t i=0; i < plc->num_udts; i++) {
+        udt_def_s *udt = plc->udts[i];
+
+        if(udt->name_len == name_len && strncasecmp(udt->name, name, name_len) == 0) {
+            return udt;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* template instances are numbered from 1 in the order the types were defined. */
+udt_def_s *udt_find_instance(plc_s *plc, uint32_t instance_id)
+{
+    if(instance_id == 0 || instance_id > plc->num_udts) {
+        return NULL;
+    }
+
+    return plc->udts[instance_id - 1];
+}
+
+
+udt_member_s *udt_find_member(udt_def_s *udt, slice_s name)
+{
+    for(int i=0; i < udt->num_members; i++) {
+        udt_member_s *member = &udt->members[i];
+
+        if(member->name_len == (size_t)slice_len(name) && strncasecmp(member->name, (const char *)name.data, member->name_len) == 0) {
+            return member;
+        }
+    }
+
+    return NULL;
+}
+
+
+udt_def_s *udt_create(plc_s *plc, const char *name, size_t name_len)
+{
+    udt_def_s *udt = NULL;
+    udt_def_s **new_udts = NULL;
+    tag_type_t tag_type = 0;
+    int elem_size = 0;
+    udt_def_s *existing = NULL;
+
+    if(!valid_name(name, name_len)) {
+        fprintf(stderr, "Type name \"%.*s\" is not valid.\n", (int)name_len, name);
+        return NULL;
+    }
+
+    if(tag_type_lookup(plc, name, name_len, &tag_type, &elem_size, &existing)) {
+        fprintf(stderr, "Type %.*s is already defined.\n", (int)name_len, name);
+        return NULL;
+    }
+
+    /* template instance IDs are 12 bits in the symbol type. */
+    if(plc->num_udts >= 0x0FFF) {
+        fprintf(stderr, "Too many structure types!\n");
+        return NULL;
+    }
+
+    new_udts = realloc(plc->udts, (plc->num_udts + 1) * sizeof(*plc->udts));
+    udt = arena_alloc(&plc->udt_arena, sizeof(*udt), sizeof(uint64_t));
+    if(!new_udts || !udt) {
+        error("Unable to allocate memory for type %.*s!", (int)name_len, name);
+    }
+
+    udt->name = arena_strndup(&plc->udt_arena, name, name_len);
+    if(!udt->name) {
+        error("Unable to allocate memory for type %.*s!", (int)name_len, name);
+    }
+
+    udt->name_len = name_len;
+    udt->instance_id = (uint16_t)(plc->num_udts + 1);
+    udt->align = 4;
+
+    plc->udts = new_udts;
+    plc->udts[plc->num_udts] = udt;
+    plc->num_udts++;
+
+    return udt;
+}
+
+
+bool udt_add_member(plc_s *plc, udt_def_s *udt, slice_s name, slice_s type)
+{
+    size_t type_len = 0;
+    int array_size = 0;
+    udt_member_s member = {0};
+    udt_member_s *new_member_p = NULL;
+    uint32_t align = 0;
+    size_t member_size = 0;
+
+    if(udt->in_use) {
+        fprintf(stderr, "Type %s is already in use, so members cannot be added to it.\n", udt->name);
+        return false;
+    }
+
+    if(!valid_name((const char *)name.data, (size_t)slice_len(name))) {
+        fprintf(stderr, "Member name \"%.*s\" is not valid.\n", (int)slice_len(name), (const char *)name.data);
+        return false;
+    }
+
+    if(udt_find_member(udt, name)) {
+        fprintf(stderr, "Type %s already has a member %.*s.\n", udt->name, (int)slice_len(name), (const char *)name.data);
+        return false;
+    }
+
+    /* <type> or <type>[<size>]. */
+    while(type_len < (size_t)slice_len(type) && type.data[type_len] != '[') {
+        type_len++;
+    }
+
+    if(type_len < (size_t)slice_len(type)) {
+        long value = 0;
+
+        if(type.data[slice_len(type) - 1] != ']' || (size_t)slice_len(type) - type_len < 3) {
+            fprintf(stderr, "Member %.*s must have one array size, as in DINT[4].\n", (int)slice_len(name), (const char *)name.data);
+            return false;
+        }
+
+        for(size_t i=type_len + 1; i < (size_t)slice_len(type) - 1; i++) {
+            if(!isdigit(type.data[i]) || (value = (value * 10) + (type.data[i] - '0')) > 0xFFFF) {
+                fprintf(stderr, "Member %.*s must have an array size from 1 to 65535.\n", (int)slice_len(name), (const char *)name.data);
+                return false;
+            }
+        }
+
+        if(value < 1) {
+            fprintf(stderr, "Member %.*s must have an array size from 1 to 65535.\n", (int)slice_len(name), (const char *)name.data);
+            return false;
+        }
+
+        array_size = (int)value;
+    }
+
+    if(type_len == udt->name_len && strncasecmp((const char *)type.data, udt->name, type_len) == 0) {
+        fprintf(stderr, "Type %s cannot contain itself.\n", udt->name);
+        return false;
+    }
+
+    if(!tag_type_lookup(plc, (const char *)type.data, type_len, &member.tag_type, &member.elem_size, &member.udt)) {
+        fprintf(stderr, "Unsupported member type \"%.*s\".\n", (int)type_len, (const char *)type.data);
+        return false;
+    }
+
+    member.name = arena_strndup(&plc->udt_arena, (const char *)name.data, (size_t)slice_len(name));
+    if(!member.name) {
+        error("Unable to allocate memory for member %.*s!", (int)slice_len(name), (const char *)name.data);
+    }
+
+    member.name_len = (size_t)slice_len(name);
+    member.elem_count = 1;
+    member.array_size = array_size;
+    member.bit = -1;
+
+    if(member.tag_type == TAG_TYPE_BOOL) {
+        if(array_size == 0) {
+            return add_bool_member(plc, udt, &member);
+        }
+
+        /* BOOL arrays are whole 32-bit words. */
+        member.tag_type = TAG_TYPE_BOOL_ARRAY;
+        member.elem_size = 4;
+        member.elem_count = (array_size + 31) / 32;
+        member.array_size = member.elem_count * 32;
+    } else if(array_size > 0) {
+        member.elem_count = array_size;
+    }
+
+    align = (member.udt ? member.udt->align : (uint32_t)member.elem_size);
+    member.offset = (member_end(udt) + align - 1) & ~(align - 1);
+
+    member_size = (size_t)member.elem_size * (size_t)member.elem_count;
+    if((size_t)member.offset + member_size > (size_t)INT_MAX) {
+        fprintf(stderr, "Type %s is too large!\n", udt->name);
+        return false;
+    }
+
+    new_member_p = new_member(udt);
+    *new_member_p = member;
+
+    update_layout(udt, align);
+
+    return true;
+}
+
+
+/*
+ * <name>:<member>:<type>[,<member>:<type>]...
+ *
+ * The member types are as in udt_add_member().
+ */
+bool udt_parse(plc_s *plc, const char *udt_str)
+{
+    const char *colon = strchr(udt_str, ':');
+    const char *pos = NULL;
+    udt_def_s *udt = NULL;
+
+    if(!colon) {
+        fprintf(stderr, "Type format is incorrect in \"%s\"!\n", udt_str);
+        return false;
+    }
+
+    udt = udt_create(plc, udt_str, (size_t)(colon - udt_str));
+    if(!udt) {
+        return false;
+    }
+
+    pos = colon + 1;
+
+    while(*pos) {
+        const char *end = strchr(pos, ',');
+        const char *sep = NULL;
+
+        if(!end) {
+            end = pos + strlen(pos);
+        }
+
+        sep = memchr(pos, ':', (size_t)(end - pos));
+        if(!sep) {
+            fprintf(stderr, "Members must be given as <name>:<type> in \"%s\"!\n", udt_str);
+            return false;
+        }
+
+        if(!udt_add_member(plc, udt, slice_make((uint8_t *)pos, (ssize_t)(sep - pos)), slice_make((uint8_t *)sep + 1, (ssize_t)(end - sep - 1)))) {
+            return false;
+        }
+
+        pos = (*end ? end + 1 : end);
+    }
+
+    if(udt->num_members == 0) {
+        fprintf(stderr, "Type %s has no members!\n", udt->name);
+        return false;
+    }
+
+    info("Processed \"%s\" into type %s with %d members in %u bytes and handle %04x.", udt_str, udt->name, udt->num_members, udt->size, udt->handle);
+
+    return true;
+}
+
+
+bool udt_build_templates(plc_s *plc)
+{
+    for(size_t i=0; i < plc->num_udts; i++) {
+        if(!build_template(plc, plc->udts[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+bool valid_name(const char *name, size_t name_len)
+{
+    if(name_len == 0 || name_len > UDT_MAX_NAME_LEN) {
+        return false;
+    }
+
+    if(!isalpha(name[0]) && name[0] != '_') {
+        return false;
+    }
+
+    for(size_t i=1; i < name_len; i++) {
+        if(!isalnum(name[i]) && name[i] != '_') {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/* grow the member table by one. */
+udt_member_s *new_member(udt_def_s *udt)
+{
+    udt_member_s *members = realloc(udt->members, ((size_t)udt->num_members + 1) * sizeof(*members));
+
+    if(!members) {
+        error("Unable to allocate memory for the members of type %s!", udt->name);
+    }
+
+    udt->members = members;
+    udt->num_members++;
+
+    memset(&members[udt->num_members - 1], 0, sizeof(*members));
+
+    return &members[udt->num_members - 1];
+}
+
+
+/* BOOLs share a hidden SINT, eight to a byte, as long as they follow each other. */
+bool add_bool_member(plc_s *plc, udt_def_s *udt, udt_member_s *member)
+{
+    udt_member_s *last = (udt->num_members > 0 ? &udt->members[udt->num_members - 1] : NULL);
+    udt_member_s *new_member_p = NULL;
+
+    if(last && last->tag_type == TAG_TYPE_BOOL && last->bit < 7) {
+        member->offset = last->offset;
+        member->bit = last->bit + 1;
+    } else {
+        char host_name[UDT_MAX_NAME_LEN + 1];
+        int host_name_len = snprintf(host_name, sizeof(host_name), UDT_HIDDEN_PREFIX "%.200s%d", udt->name, udt->num_members);
+        uint32_t offset = member_end(udt);
+        udt_member_s *host = new_member(udt);
+
+        host->name = arena_strndup(&plc->udt_arena, host_name, (size_t)host_name_len);
+        if(!host->name) {
+            error("Unable to allocate memory for a member of type %s!", udt->name);
+        }
+
+        host->name_len = (size_t)host_name_len;
+        host->tag_type = TAG_TYPE_SINT;
+        host->elem_size = 1;
+        host->elem_count = 1;
+        host->bit = -1;
+        host->hidden = true;
+        host->offset = offset;
+
+        member->offset = host->offset;
+        member->bit = 0;
+    }
+
+    new_member_p = new_member(udt);
+    *new_member_p = *member;
+
+    update_layout(udt, 1);
+
+    return true;
+}
+
+
+/* the first byte after the last member. */
+uint32_t member_end(udt_def_s *udt)
+{
+    udt_member_s *last = NULL;
+
+    if(udt->num_members == 0) {
+        return 0;
+    }
+
+    last = &udt->members[udt->num_members - 1];
+
+    /* BOOL members take no space of their own. */
+    if(last->tag_type == TAG_TYPE_BOOL) {
+        return last->offset + 1;
+    }
+
+    return last->offset + (uint32_t)(last->elem_size * last->elem_count);
+}
+
+
+/* the size is a multiple of the largest alignment, and the handle changes with the layout. */
+void update_layout(udt_def_s *udt, uint32_t align)
+{
+    uint32_t hash = (uint32_t)2166136261u;
+
+    if(align > udt->align) {
+        udt->align = align;
+    }
+
+    udt->size = (member_end(udt) + udt->align - 1) & ~(udt->align - 1);
+
+    for(int i=0; i < udt->num_members; i++) {
+        udt_member_s *member = &udt->members[i];
+        uint32_t fields[3] = { (uint32_t)member->tag_type, member->offset, (uint32_t)member->array_size };
+
+        hash = tag_name_hash((const uint8_t *)member->name, member->name_len) ^ (hash * (uint32_t)16777619u);
+
+        for(size_t j=0; j < sizeof(fields); j++) {
+            hash ^= ((const uint8_t *)fields)[j];
+            hash *= (uint32_t)16777619u;
+        }
+    }
+
+    udt->handle = (uint16_t)((hash >> 16) ^ (hash & 0xFFFF));
+
+    /* only strings may look like strings. */
+    if(udt->handle == UDT_STRING_HANDLE) {
+        udt->handle++;
+    }
+}
+
+
+bool build_template(plc_s *plc, udt_def_s *udt)
+{
+    size_t size = (size_t)udt->num_members * 8;
+    size_t offset = 0;
+    uint8_t *data = NULL;
+
+    size += udt->name_len + strlen(";n") + 1;
+    for(int i=0; i < udt->num_members; i++) {
+        size += udt->members[i].name_len + 1;
+    }
+
+    data = arena_alloc(&plc->udt_arena, size, sizeof(uint32_t));
+    if(!data) {
+        fprintf(stderr, "Unable to allocate memory for the template of type %s!\n", udt->name);
+        return false;
+    }
+
+    for(int i=0; i < udt->num_members; i++) {
+        udt_member_s *member = &udt->members[i];
+
+        store_uint16_le(data + offset, (uint16_t)(member->bit >= 0 ? member->bit : member->array_size));
+        store_uint16_le(data + offset + 2, member_symbol_type(member));
+        store_uint32_le(data + offset + 4, member->offset);
+        offset += 8;
+    }
+
+    memcpy(data + offset, udt->name, udt->name_len);
+    offset += udt->name_len;
+    memcpy(data + offset, ";n", 3);
+    offset += 3;
+
+    for(int i=0; i < udt->num_members; i++) {
+        memcpy(data + offset, udt->members[i].name, udt->members[i].name_len + 1);
+        offset += udt->members[i].name_len + 1;
+    }
+
+    udt->template_data = data;
+    udt->template_size = (uint32_t)size;
+    udt->template_words = (uint32_t)((size + 23 + 3) / 4);
+
+    info("Encoded template of type %s in %u bytes.", udt->name, udt->template_size);
+
+    return true;
+}
+
+
+/* as in a symbol listing: the template instance for structures, with the array flag. */
+uint16_t member_symbol_type(udt_member_s *member)
+{
+    uint16_t symbol_type = (member->udt ? (uint16_t)(0x8000 | (member->udt->instance_id & 0x0FFF)) : member->tag_type);
+
+    if(member->array_size > 0) {
+        symbol_type |= 0x2000;
+    }
+
+    return symbol_type;
+}
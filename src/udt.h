@@ -0,0 +1,101 @@
+/***************************************************************************
+ *   Copyright (C) 2020 by Kyle Hayes                                      *
+ *   Author Kyle Hayes  kyle.hayes@gmail.com                               *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "plc.h"
+#include "slice.h"
+
+/*
+ * User-defined structure types (UDTs).  Each one has a template instance
+ * ID, which tags of the type show in their symbol type, and a structure
+ * handle that goes with the data in read and write requests.  Members are
+ * laid out the way Logix does it: each on its natural alignment, BOOLs
+ * packed into hidden SINT members, and the size rounded up to the
+ * largest alignment.
+ *
+ * STRING is predefined with the handle clients expect for it.
+ */
+
+/* the built-in Logix STRING: a DINT length and 82 characters. */
+#define UDT_STRING_HANDLE ((uint16_t)0x0FCE)
+#define UDT_STRING_DATA_LEN (82)
+
+typedef struct {
+    char *name;
+    size_t name_len;
+    tag_type_t tag_type;
+    struct udt_def_s *udt;  /* the member's structure type, or NULL. */
+    int elem_size;
+    int elem_count;         /* 1 for scalars, 32-bit words for BOOL arrays. */
+    int array_size;         /* 0 for scalars, in bits for BOOL arrays. */
+    int bit;                /* bit in the host SINT for BOOL members, otherwise -1. */
+    uint32_t offset;
+    bool hidden;            /* a host for BOOL members. */
+} udt_member_s;
+
+typedef struct udt_def_s {
+    char *name;
+    size_t name_len;
+    uint16_t instance_id;   /* template instance. */
+    uint16_t handle;        /* structure handle, a hash of the layout. */
+    uint32_t size;
+    uint32_t align;
+    bool in_use;            /* no more members once a tag or another type uses it. */
+    int num_members;
+    udt_member_s *members;
+
+    /* the template object's definition of the type, see udt_build_templates(). */
+    uint8_t *template_data;
+    uint32_t template_size;
+    uint32_t template_words;    /* the definition size that attribute 4 reports. */
+} udt_def_s;
+
+/* call before any types or tags are defined.  Sets up STRING. */
+extern bool udt_init(plc_s *plc);
+extern void udt_destroy(plc_s *plc);
+
+extern udt_def_s *udt_find(plc_s *plc, const char *name, size_t name_len);
+extern udt_def_s *udt_find_instance(plc_s *plc, uint32_t instance_id);
+extern udt_member_s *udt_find_member(udt_def_s *udt, slice_s name);
+
+/*
+ * Types are built a member at a time.  The member type is an atomic type
+ * or an earlier structure, with [<size>] for an array.  These print what
+ * is wrong and return NULL or false.
+ */
+extern udt_def_s *udt_create(plc_s *plc, const char *name, size_t name_len);
+extern bool udt_add_member(plc_s *plc, udt_def_s *udt, slice_s name, slice_s type);
+
+/* a whole type from the command line: <name>:<member>:<type>[,<member>:<type>]... */
+extern bool udt_parse(plc_s *plc, const char *udt_str);
+
+/*
+ * Encode each type's template once all types are defined.  Clients read
+ * it through the template object, class 0x6C, to decode structures:
+ * an 8-byte entry per member with its array size or bit number, symbol
+ * type and offset, then "<type name>;n" and the member names, each
+ * NUL terminated.  By Logix convention the definition size in 32-bit
+ * words is 23 bytes more than the template, rounded up.
+ */
+extern bool udt_build_templates(plc_s *plc);
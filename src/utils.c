@@ -20,6 +20,8 @@
 
 
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
@@ -27,6 +29,7 @@
 #include <string.h>
 #include <sys/time.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -68,22 +71,73 @@ int64_t util_time_ms(void)
 }
 
 
+/*
+ * time_ns
+ *
+ * Return a monotonic time in nanoseconds, for timing that must not jump
+ * when the clock is set.
+ */
+int64_t util_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((int64_t)ts.tv_sec * 1000000000) + (int64_t)ts.tv_nsec;
+}
+
+
 
 /*
  * Logging routines.
+ *
+ * Callers format their message into a slot in a ring buffer and a
+ * background thread writes the slots out to stderr.  Request processing
+ * never waits on the terminal.  If the ring fills up, messages are
+ * dropped and counted rather than blocking the caller.
  */
 
-static bool debug_is_on = false;
+#define LOG_RING_SLOTS (1024)  /* must be a power of two. */
+#define LOG_SLOT_SIZE (256)
+
+int log_level = LOG_NONE;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t has_data;
+    pthread_cond_t drained;
+    pthread_t writer;
+    bool writer_started;
+    uint64_t head;          /* next slot to fill. */
+    uint64_t tail;          /* next slot to write out. */
+    uint64_t dropped;
+    char slots[LOG_RING_SLOTS][LOG_SLOT_SIZE];
+} log_ring = { .lock = PTHREAD_MUTEX_INITIALIZER, .has_data = PTHREAD_COND_INITIALIZER, .drained = PTHREAD_COND_INITIALIZER };
+
+
+static void *log_writer(void *arg);
+static void log_start_writer(void);
+static void log_push(const char *prefix, const char *func, int line, const char *templ, va_list va);
+static void log_push_line(const char *templ, ...);
 
 
 void debug_on(void)
 {
-    debug_is_on = true;
+    log_level = LOG_INFO;
+    log_start_writer();
 }
 
+/* warnings are still shown. */
 void debug_off(void)
 {
-    debug_is_on = false;
+    log_level = LOG_ERROR;
+    log_start_writer();
+}
+
+void debug_packets_on(void)
+{
+    log_level = LOG_PACKET;
+    log_start_writer();
 }
 
 
@@ -92,7 +146,10 @@ void error_impl(const char *func, int line, const char *templ, ...)
 {
     va_list va;
 
-    /* print it out. */
+    /* get everything logged so far out first so the error is last. */
+    log_flush();
+
+    /* print it out directly, we are about to exit. */
     fprintf(stderr, "ERROR %s:%d ", func, line);
     va_start(va,templ);
     vfprintf(stderr,templ,va);
@@ -104,29 +161,146 @@ void error_impl(const char *func, int line, const char *templ, ...)
 
 
 
+void warning_impl(const char *func, int line, const char *templ, ...)
+{
+    va_list va;
+
+    va_start(va,templ);
+    log_push("WARN", func, line, templ, va);
+    va_end(va);
+}
+
+
+
 void info_impl(const char *func, int line, const char *templ, ...)
 {
     va_list va;
 
-    if(!debug_is_on) {
+    va_start(va,templ);
+    log_push("INFO", func, line, templ, va);
+    va_end(va);
+}
+
+
+/* wait until the writer thread has written out everything queued so far. */
+void log_flush(void)
+{
+    pthread_mutex_lock(&log_ring.lock);
+
+    while(log_ring.writer_started && log_ring.tail != log_ring.head) {
+        pthread_cond_wait(&log_ring.drained, &log_ring.lock);
+    }
+
+    pthread_mutex_unlock(&log_ring.lock);
+}
+
+
+void log_start_writer(void)
+{
+    pthread_mutex_lock(&log_ring.lock);
+
+    if(!log_ring.writer_started) {
+        if(pthread_create(&log_ring.writer, NULL, log_writer, NULL) == 0) {
+            pthread_detach(log_ring.writer);
+            log_ring.writer_started = true;
+        } else {
+            fprintf(stderr, "WARN: unable to start log writer thread, logging is disabled!\n");
+            log_level = LOG_NONE;
+        }
+    }
+
+    pthread_mutex_unlock(&log_ring.lock);
+}
+
+
+void log_push(const char *prefix, const char *func, int line, const char *templ, va_list va)
+{
+    char *slot;
+    int len;
+
+    pthread_mutex_lock(&log_ring.lock);
+
+    if(!log_ring.writer_started || (log_ring.head - log_ring.tail) >= LOG_RING_SLOTS) {
+        log_ring.dropped++;
+        pthread_mutex_unlock(&log_ring.lock);
         return;
     }
 
-    /* print it out. */
-    fprintf(stderr, "INFO %s:%d ", func, line);
-    va_start(va,templ);
-    vfprintf(stderr,templ,va);
+    slot = log_ring.slots[log_ring.head & (LOG_RING_SLOTS - 1)];
+
+    if(prefix) {
+        len = snprintf(slot, LOG_SLOT_SIZE, "%s %s:%d ", prefix, func, line);
+    } else {
+        len = 0;
+    }
+
+    if(len >= 0 && len < LOG_SLOT_SIZE) {
+        vsnprintf(slot + len, (size_t)(LOG_SLOT_SIZE - len), templ, va);
+    }
+
+    log_ring.head++;
+
+    pthread_cond_signal(&log_ring.has_data);
+    pthread_mutex_unlock(&log_ring.lock);
+}
+
+
+/* this pushes a preformatted line without a prefix. */
+void log_push_line(const char *templ, ...)
+{
+    va_list va;
+
+    va_start(va, templ);
+    log_push(NULL, NULL, 0, templ, va);
     va_end(va);
-    fprintf(stderr,"\n");
+}
+
+
+void *log_writer(void *arg)
+{
+    char line[LOG_SLOT_SIZE];
+    uint64_t dropped = 0;
+
+    (void)arg;
+
+    pthread_mutex_lock(&log_ring.lock);
+
+    while(true) {
+        while(log_ring.tail == log_ring.head) {
+            pthread_cond_broadcast(&log_ring.drained);
+            pthread_cond_wait(&log_ring.has_data, &log_ring.lock);
+        }
+
+        /* copy the slot out so that we do not hold the lock during I/O. */
+        memcpy(line, log_ring.slots[log_ring.tail & (LOG_RING_SLOTS - 1)], sizeof(line));
+        line[sizeof(line) - 1] = 0;
+        dropped = log_ring.dropped;
+        log_ring.dropped = 0;
+
+        pthread_mutex_unlock(&log_ring.lock);
+
+        if(dropped) {
+            fprintf(stderr, "WARN: log ring overflowed, %" PRIu64 " messages dropped.\n", dropped);
+        }
+
+        fputs(line, stderr);
+        fputc('\n', stderr);
+
+        pthread_mutex_lock(&log_ring.lock);
+
+        log_ring.tail++;
+    }
+
+    return NULL;
 }
 
 
 #define COLUMNS (10)
 
-void slice_dump(slice_s s)
+void slice_dump_impl(slice_s s)
 {
     int max_row, row, column;
-    char row_buf[300]; /* MAGIC */
+    char row_buf[LOG_SLOT_SIZE];
 
     /* determine the number of rows we will need to print. */
     max_row = (s.len  + (COLUMNS - 1))/COLUMNS;
@@ -152,8 +326,6 @@ void slice_dump(slice_s s)
         }
 
         /* output it, finally */
-        fprintf(stderr,"%s\n", row_buf);
+        log_push_line("%s", row_buf);
     }
 }
-
-
@@ -25,12 +25,36 @@
 
 extern int util_sleep_ms(int ms);
 extern int64_t util_time_ms(void);
+extern int64_t util_time_ns(void);
+
+/*
+ * Logging levels.  Anything above LOG_LEVEL_MAX is compiled out entirely,
+ * anything above the runtime level costs one compare.
+ */
+#define LOG_NONE    (0)
+#define LOG_ERROR   (1)
+#define LOG_INFO    (2)
+#define LOG_PACKET  (3)     /* hex dumps of every packet. */
+
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_PACKET
+#endif
+
+extern int log_level;
+
+#define log_enabled(level) ((level) <= LOG_LEVEL_MAX && (level) <= log_level)
 
 /* debug helpers */
 void debug_on(void);
 void debug_off(void);
+void debug_packets_on(void);
+extern void log_flush(void);
 #define error(...) error_impl(__func__, __LINE__, __VA_ARGS__)
 extern void error_impl(const char *func, int line, const char *templ, ...);
-#define info(...) info_impl(__func__, __LINE__, __VA_ARGS__)
+/* problems the server carries on from, shown unless logging is compiled out. */
+#define warning(...) do { if(log_enabled(LOG_ERROR)) { warning_impl(__func__, __LINE__, __VA_ARGS__); } } while(0)
+extern void warning_impl(const char *func, int line, const char *templ, ...);
+#define info(...) do { if(log_enabled(LOG_INFO)) { info_impl(__func__, __LINE__, __VA_ARGS__); } } while(0)
 extern void info_impl(const char *func, int line, const char *templ, ...);
-extern void slice_dump(slice_s s);
+#define slice_dump(s) do { if(log_enabled(LOG_PACKET)) { slice_dump_impl(s); } } while(0)
+extern void slice_dump_impl(slice_s s);